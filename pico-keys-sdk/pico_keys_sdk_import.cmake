@@ -37,6 +37,20 @@ if(ENABLE_DELAYED_BOOT)
 else()
 message(STATUS "Delayed boot:\t\t disabled")
 endif(ENABLE_DELAYED_BOOT)
+option(ENABLE_TELEMETRY "Enable/disable per-command telemetry" OFF)
+if(ENABLE_TELEMETRY)
+    add_definitions(-DENABLE_TELEMETRY=1)
+    message(STATUS "Telemetry:\t\t\t enabled")
+else()
+    message(STATUS "Telemetry:\t\t\t disabled")
+endif(ENABLE_TELEMETRY)
+option(ENABLE_CRYPTO_BACKEND_PICO "Use the Pico crypto backend instead of the mbedTLS block functions" OFF)
+if(ENABLE_CRYPTO_BACKEND_PICO)
+    add_definitions(-DPICO_KEYS_CRYPTO_BACKEND_PICO=1)
+    message(STATUS "Crypto backend:\t\t pico")
+else()
+    message(STATUS "Crypto backend:\t\t mbedtls")
+endif(ENABLE_CRYPTO_BACKEND_PICO)
 if(USB_ITF_HID)
     add_definitions(-DUSB_ITF_HID=1)
     message(STATUS "USB HID Interface:\t\t enabled")
@@ -47,6 +61,8 @@ if(USB_ITF_CCID)
 endif(USB_ITF_CCID)
 add_definitions(-DDEBUG_APDU=${DEBUG_APDU})
 add_definitions(-DMBEDTLS_CONFIG_FILE="${CMAKE_CURRENT_LIST_DIR}/config/mbedtls_config.h")
+# Crypto jobs run on core0 while core1 is in a command, both allocating from the heap
+add_definitions(-DPICO_USE_MALLOC_MUTEX=1)
 
 message(STATUS "USB VID/PID: ${USB_VID}:${USB_PID}")
 
@@ -56,12 +72,17 @@ ${CMAKE_CURRENT_LIST_DIR}/src/usb/usb.c
 ${CMAKE_CURRENT_LIST_DIR}/src/fs/file.c
 ${CMAKE_CURRENT_LIST_DIR}/src/fs/flash.c
 ${CMAKE_CURRENT_LIST_DIR}/src/fs/low_flash.c
+${CMAKE_CURRENT_LIST_DIR}/src/fs/asset.c
 ${CMAKE_CURRENT_LIST_DIR}/src/rng/random.c
 ${CMAKE_CURRENT_LIST_DIR}/src/rng/hwrng.c
 ${CMAKE_CURRENT_LIST_DIR}/src/eac.c
 ${CMAKE_CURRENT_LIST_DIR}/src/crypto_utils.c
+${CMAKE_CURRENT_LIST_DIR}/src/crypto_backend.c
+${CMAKE_CURRENT_LIST_DIR}/src/crypto_jobs.c
 ${CMAKE_CURRENT_LIST_DIR}/src/asn1.c
 ${CMAKE_CURRENT_LIST_DIR}/src/apdu.c
+${CMAKE_CURRENT_LIST_DIR}/src/telemetry.c
+${CMAKE_CURRENT_LIST_DIR}/src/arena.c
 
 ${CMAKE_CURRENT_LIST_DIR}/mbedtls/library/aes.c
 ${CMAKE_CURRENT_LIST_DIR}/mbedtls/library/asn1parse.c
@@ -18,17 +18,59 @@
 #include "apdu.h"
 #include "pico_keys.h"
 #include "usb.h"
+#include "telemetry.h"
 #include <stdio.h>
 
 uint8_t *rdata_gr = NULL;
 uint16_t rdata_bk = 0x0;
 extern uint32_t timeout;
 
+#ifndef MAX_RESP_APDU
+#define MAX_RESP_APDU (USB_BUFFER_SIZE - 2) // Smallest transport buffer, without the status word
+#endif
+
+const cmd_t *cmd_find(cmd_table_t *table, uint8_t code) {
+    if (!table->indexed) {
+        memset(table->index, 0, sizeof(table->index));
+        for (uint8_t i = 0; table->cmds[i].cmd_handler && i < 0xFF; i++) {
+            if (table->index[table->cmds[i].ins] == 0) {
+                table->index[table->cmds[i].ins] = i + 1;
+            }
+        }
+        table->indexed = true;
+    }
+    if (table->index[code] == 0) {
+        return NULL;
+    }
+    return &table->cmds[table->index[code] - 1];
+}
+
+int apdu_dispatch(cmd_table_t *table) {
+    const cmd_t *cmd = cmd_find(table, INS(apdu));
+    if (!cmd) {
+        return SW_INS_NOT_SUPPORTED();
+    }
+    if (cmd->max_resp > (table->resp_size ? table->resp_size : MAX_RESP_APDU)) {
+        return SW_WRONG_LENGTH();
+    }
+    if ((cmd->flags & (CMD_UP | CMD_PIN)) && table->check) {
+        int r = table->check(cmd);
+        if (r != 0) {
+            return r;
+        }
+    }
+    int r = cmd->cmd_handler();
+    if (cmd->flags & CMD_FLASH) {
+        low_flash_available();
+    }
+    return r;
+}
+
 int process_apdu() {
     led_set_blink(BLINK_PROCESSING);
     if (INS(apdu) == 0xA4 && P1(apdu) == 0x04 && (P2(apdu) == 0x00 || P2(apdu) == 0x4)) { //select by AID
-        for (int a = 0; a < num_apps; a++) {
-            if (!memcmp(apps[a].aid + 1, apdu.data, MIN(apdu.nc, apps[a].aid[0]))) {
+        for (app_t *a = apps; a; a = a->next) {
+            if (!memcmp(a->aid + 1, apdu.data, MIN(apdu.nc, a->aid[0]))) {
                 if (current_app) {
                     if (current_app->aid && !memcmp(current_app->aid + 1, apdu.data, apdu.nc)) {
                         current_app->select_aid(current_app);
@@ -38,7 +80,7 @@ int process_apdu() {
                         current_app->unload();
                     }
                 }
-                current_app = &apps[a];
+                current_app = a;
                 if (current_app->select_aid(current_app) == CCID_OK) {
                     return set_res_sw(0x90, 0x00);
                 }
@@ -184,12 +226,16 @@ void apdu_thread() {
             break;
         }
 
+        TELEMETRY_BEGIN(TELEMETRY_TYPE_APDU, INS(apdu));
         process_apdu();
+        TELEMETRY_END();
+        flash_wear_task();
 
 done:   ;
 
         apdu_finish();
         finished_data_size = apdu_next();
+        arena_reset();
         uint32_t flag = EV_EXEC_FINISHED;
         queue_add_blocking(&card_to_usb_q, &flag);
     }
@@ -24,21 +24,44 @@
 #endif
 #include <stdio.h>
 #include <inttypes.h>
+#include <stdbool.h>
 
 typedef struct app {
     const uint8_t *aid;
     int (*process_apdu)();
     int (*select_aid)(struct app *);
     int (*unload)();
+    struct app *next;
 } app_t;
 
 extern int register_app(int (*)(app_t *), const uint8_t *);
 
+#define CMD_UP              0x01 // Asks for user presence
+#define CMD_PIN             0x02 // Needs a verified PIN or PIN/UV auth token
+#define CMD_FLASH           0x04 // Writes to flash
+
 typedef struct cmd {
     uint8_t ins;
     int (*cmd_handler)();
+    uint8_t flags;
+    uint16_t max_resp; // Largest response in bytes, 0 if not known
 } cmd_t;
 
+/* Handlers of an applet, terminated by a NULL handler and indexed by INS or command byte on the
+ * first lookup. Before invoking a handler, apdu_dispatch() checks that its response fits
+ * resp_size (0 takes the transport buffer) and asks check(), which returns 0 or the status word
+ * to answer, when it has CMD_UP or CMD_PIN. After a CMD_FLASH handler, writes are committed. */
+typedef struct cmd_table {
+    const cmd_t *cmds;
+    uint16_t resp_size;
+    int (*check)(const cmd_t *);
+    uint8_t index[256]; // Position + 1 of the handler of each code, 0 if none
+    bool indexed;
+} cmd_table_t;
+
+extern const cmd_t *cmd_find(cmd_table_t *table, uint8_t code);
+extern int apdu_dispatch(cmd_table_t *table);
+
 
 #if defined(DEBUG_APDU) && DEBUG_APDU == 1
 #define DEBUG_PAYLOAD(_p, _s) { \
@@ -75,8 +98,7 @@ typedef struct cmd {
 #define DEBUG_DATA(_p, _s)
 #endif
 
-extern uint8_t num_apps;
-extern app_t apps[4];
+extern app_t *apps;
 extern app_t *current_app;
 
 struct apdu {
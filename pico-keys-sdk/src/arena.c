@@ -0,0 +1,99 @@
+/*
+ * This file is part of the Pico Keys SDK distribution (https://github.com/polhenarejos/pico-keys-sdk).
+ * Copyright (c) 2022 Pol Henarejos.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, version 3.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "arena.h"
+#include <stdlib.h>
+#include <string.h>
+#include "mbedtls/platform_util.h"
+#ifndef ENABLE_EMULATION
+#include "pico/stdlib.h"
+#include "pico/platform.h"
+#endif
+
+#define ARENA_ALIGN     8
+
+static uint8_t arena[ARENA_SIZE] __attribute__((aligned(ARENA_ALIGN)));
+static size_t arena_used = 0;
+static arena_stats_t stats = { .size = ARENA_SIZE };
+
+// Heap fallbacks keep their size in a header so arena_free() can wipe them
+typedef union heap_hdr {
+    size_t size;
+    uint8_t pad[ARENA_ALIGN];
+} heap_hdr_t;
+
+// Only the card thread owns the arena. Core 0 allocates from the heap.
+static bool arena_core() {
+#ifndef ENABLE_EMULATION
+    return get_core_num() == 1;
+#else
+    return true;
+#endif
+}
+
+void *arena_alloc(size_t size) {
+    size_t len = (size + ARENA_ALIGN - 1) & ~(ARENA_ALIGN - 1);
+    if (len == 0) {
+        len = ARENA_ALIGN;
+    }
+    if (!arena_core() || len > ARENA_SIZE - arena_used) {
+        stats.fallbacks++;
+        heap_hdr_t *hdr = (heap_hdr_t *) calloc(1, sizeof(heap_hdr_t) + size);
+        if (!hdr) {
+            return NULL;
+        }
+        hdr->size = size;
+        return hdr + 1;
+    }
+    void *ptr = arena + arena_used;
+    arena_used += len;
+    if (arena_used > stats.high_water) {
+        stats.high_water = arena_used;
+    }
+    memset(ptr, 0, size);
+    return ptr;
+}
+
+bool arena_owns(const void *ptr) {
+    return (const uint8_t *) ptr >= arena && (const uint8_t *) ptr < arena + ARENA_SIZE;
+}
+
+void arena_free(void *ptr) {
+    if (ptr && !arena_owns(ptr)) {
+        heap_hdr_t *hdr = (heap_hdr_t *) ptr - 1;
+        mbedtls_platform_zeroize(hdr, sizeof(heap_hdr_t) + hdr->size);
+        free(hdr);
+    }
+}
+
+void arena_reset() {
+    if (arena_core()) {
+        // Requests leave plaintexts and PIN material behind
+        mbedtls_platform_zeroize(arena, arena_used);
+        arena_used = 0;
+    }
+}
+
+void arena_get_stats(arena_stats_t *st) {
+    *st = stats;
+    st->used = arena_used;
+}
+
+void arena_reset_stats() {
+    stats.high_water = arena_used;
+    stats.fallbacks = 0;
+}
@@ -0,0 +1,46 @@
+/*
+ * This file is part of the Pico Keys SDK distribution (https://github.com/polhenarejos/pico-keys-sdk).
+ * Copyright (c) 2022 Pol Henarejos.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, version 3.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef _ARENA_H_
+#define _ARENA_H_
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+
+/* Request arena. Buffers that only live while a command is processed are taken from here with
+ * a pointer bump and released all together when the response is finalised. Requests that do
+ * not fit, or that are made outside the card thread, fall back to the heap. */
+#ifndef ARENA_SIZE
+#define ARENA_SIZE      8192
+#endif
+
+typedef struct arena_stats {
+    uint32_t size;
+    uint32_t used;
+    uint32_t high_water;
+    uint32_t fallbacks;
+} arena_stats_t;
+
+extern void *arena_alloc(size_t size);
+extern void arena_free(void *ptr);
+extern bool arena_owns(const void *ptr);
+extern void arena_reset();
+extern void arena_get_stats(arena_stats_t *stats);
+extern void arena_reset_stats();
+
+#endif //_ARENA_H_
@@ -0,0 +1,188 @@
+/*
+ * This file is part of the Pico Keys SDK distribution (https://github.com/polhenarejos/pico-keys-sdk).
+ * Copyright (c) 2022 Pol Henarejos.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, version 3.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef ENABLE_EMULATION
+#include "pico/platform.h"
+#endif
+#include "mbedtls/sha256.h"
+#include "mbedtls/sha512.h"
+#include "mbedtls/platform_util.h"
+#include "crypto_backend.h"
+
+/* The compression functions run from SRAM on the RP2040, so a hash of a long input does not
+ * stall on XIP cache misses. The message schedule is kept as a rolling window of 16 words and
+ * the rounds are unrolled by 8, renaming the working variables instead of shifting them. */
+#ifndef ENABLE_EMULATION
+#define CRYPTO_RAM_FUNC(f) __not_in_flash_func(f)
+#else
+#define CRYPTO_RAM_FUNC(f) f
+#endif
+
+#define ROTR32(x, n) (((x) >> (n)) | ((x) << (32 - (n))))
+#define ROTR64(x, n) (((x) >> (n)) | ((x) << (64 - (n))))
+
+#define W_LOAD(i)    (W[(i) & 15])
+
+#define CH(x, y, z)  ((z) ^ ((x) & ((y) ^ (z))))
+#define MAJ(x, y, z) (((x) & (y)) | ((z) & ((x) | (y))))
+
+static const uint32_t K256[64] = {
+    0x428A2F98, 0x71374491, 0xB5C0FBCF, 0xE9B5DBA5, 0x3956C25B, 0x59F111F1, 0x923F82A4, 0xAB1C5ED5,
+    0xD807AA98, 0x12835B01, 0x243185BE, 0x550C7DC3, 0x72BE5D74, 0x80DEB1FE, 0x9BDC06A7, 0xC19BF174,
+    0xE49B69C1, 0xEFBE4786, 0x0FC19DC6, 0x240CA1CC, 0x2DE92C6F, 0x4A7484AA, 0x5CB0A9DC, 0x76F988DA,
+    0x983E5152, 0xA831C66D, 0xB00327C8, 0xBF597FC7, 0xC6E00BF3, 0xD5A79147, 0x06CA6351, 0x14292967,
+    0x27B70A85, 0x2E1B2138, 0x4D2C6DFC, 0x53380D13, 0x650A7354, 0x766A0ABB, 0x81C2C92E, 0x92722C85,
+    0xA2BFE8A1, 0xA81A664B, 0xC24B8B70, 0xC76C51A3, 0xD192E819, 0xD6990624, 0xF40E3585, 0x106AA070,
+    0x19A4C116, 0x1E376C08, 0x2748774C, 0x34B0BCB5, 0x391C0CB3, 0x4ED8AA4A, 0x5B9CCA4F, 0x682E6FF3,
+    0x748F82EE, 0x78A5636F, 0x84C87814, 0x8CC70208, 0x90BEFFFA, 0xA4506CEB, 0xBEF9A3F7, 0xC67178F2,
+};
+
+#define S256_0(x) (ROTR32(x, 2) ^ ROTR32(x, 13) ^ ROTR32(x, 22))
+#define S256_1(x) (ROTR32(x, 6) ^ ROTR32(x, 11) ^ ROTR32(x, 25))
+#define s256_0(x) (ROTR32(x, 7) ^ ROTR32(x, 18) ^ ((x) >> 3))
+#define s256_1(x) (ROTR32(x, 17) ^ ROTR32(x, 19) ^ ((x) >> 10))
+
+#define SHA256_SCHED(i)                                                                     \
+    (W[(i) & 15] += s256_1(W[((i) - 2) & 15]) + W[((i) - 7) & 15] + s256_0(W[((i) - 15) & 15]))
+
+#define SHA256_ROUND(a, b, c, d, e, f, g, h, i, w)                                          \
+    do {                                                                                    \
+        uint32_t t1 = h + S256_1(e) + CH(e, f, g) + K256[i] + (w);                          \
+        d += t1;                                                                            \
+        h = t1 + S256_0(a) + MAJ(a, b, c);                                                  \
+    } while (0)
+
+#define SHA256_ROUNDS8(i, w)                                                                \
+    do {                                                                                    \
+        SHA256_ROUND(a, b, c, d, e, f, g, h, (i), w((i)));                                  \
+        SHA256_ROUND(h, a, b, c, d, e, f, g, (i) + 1, w((i) + 1));                          \
+        SHA256_ROUND(g, h, a, b, c, d, e, f, (i) + 2, w((i) + 2));                          \
+        SHA256_ROUND(f, g, h, a, b, c, d, e, (i) + 3, w((i) + 3));                          \
+        SHA256_ROUND(e, f, g, h, a, b, c, d, (i) + 4, w((i) + 4));                          \
+        SHA256_ROUND(d, e, f, g, h, a, b, c, (i) + 5, w((i) + 5));                          \
+        SHA256_ROUND(c, d, e, f, g, h, a, b, (i) + 6, w((i) + 6));                          \
+        SHA256_ROUND(b, c, d, e, f, g, h, a, (i) + 7, w((i) + 7));                          \
+    } while (0)
+
+void CRYPTO_RAM_FUNC(crypto_sha256_blocks)(uint32_t state[8], const uint8_t *data, size_t blocks) {
+    uint32_t W[16];
+    for (; blocks > 0; blocks--, data += 64) {
+        for (int i = 0; i < 16; i++) {
+            W[i] = ((uint32_t) data[4 * i] << 24) | ((uint32_t) data[4 * i + 1] << 16) |
+                   ((uint32_t) data[4 * i + 2] << 8) | data[4 * i + 3];
+        }
+        uint32_t a = state[0], b = state[1], c = state[2], d = state[3];
+        uint32_t e = state[4], f = state[5], g = state[6], h = state[7];
+        for (int i = 0; i < 16; i += 8) {
+            SHA256_ROUNDS8(i, W_LOAD);
+        }
+        for (int i = 16; i < 64; i += 8) {
+            SHA256_ROUNDS8(i, SHA256_SCHED);
+        }
+        state[0] += a; state[1] += b; state[2] += c; state[3] += d;
+        state[4] += e; state[5] += f; state[6] += g; state[7] += h;
+    }
+    mbedtls_platform_zeroize(W, sizeof(W));
+}
+
+static const uint64_t K512[80] = {
+    0x428A2F98D728AE22ULL, 0x7137449123EF65CDULL, 0xB5C0FBCFEC4D3B2FULL, 0xE9B5DBA58189DBBCULL,
+    0x3956C25BF348B538ULL, 0x59F111F1B605D019ULL, 0x923F82A4AF194F9BULL, 0xAB1C5ED5DA6D8118ULL,
+    0xD807AA98A3030242ULL, 0x12835B0145706FBEULL, 0x243185BE4EE4B28CULL, 0x550C7DC3D5FFB4E2ULL,
+    0x72BE5D74F27B896FULL, 0x80DEB1FE3B1696B1ULL, 0x9BDC06A725C71235ULL, 0xC19BF174CF692694ULL,
+    0xE49B69C19EF14AD2ULL, 0xEFBE4786384F25E3ULL, 0x0FC19DC68B8CD5B5ULL, 0x240CA1CC77AC9C65ULL,
+    0x2DE92C6F592B0275ULL, 0x4A7484AA6EA6E483ULL, 0x5CB0A9DCBD41FBD4ULL, 0x76F988DA831153B5ULL,
+    0x983E5152EE66DFABULL, 0xA831C66D2DB43210ULL, 0xB00327C898FB213FULL, 0xBF597FC7BEEF0EE4ULL,
+    0xC6E00BF33DA88FC2ULL, 0xD5A79147930AA725ULL, 0x06CA6351E003826FULL, 0x142929670A0E6E70ULL,
+    0x27B70A8546D22FFCULL, 0x2E1B21385C26C926ULL, 0x4D2C6DFC5AC42AEDULL, 0x53380D139D95B3DFULL,
+    0x650A73548BAF63DEULL, 0x766A0ABB3C77B2A8ULL, 0x81C2C92E47EDAEE6ULL, 0x92722C851482353BULL,
+    0xA2BFE8A14CF10364ULL, 0xA81A664BBC423001ULL, 0xC24B8B70D0F89791ULL, 0xC76C51A30654BE30ULL,
+    0xD192E819D6EF5218ULL, 0xD69906245565A910ULL, 0xF40E35855771202AULL, 0x106AA07032BBD1B8ULL,
+    0x19A4C116B8D2D0C8ULL, 0x1E376C085141AB53ULL, 0x2748774CDF8EEB99ULL, 0x34B0BCB5E19B48A8ULL,
+    0x391C0CB3C5C95A63ULL, 0x4ED8AA4AE3418ACBULL, 0x5B9CCA4F7763E373ULL, 0x682E6FF3D6B2B8A3ULL,
+    0x748F82EE5DEFB2FCULL, 0x78A5636F43172F60ULL, 0x84C87814A1F0AB72ULL, 0x8CC702081A6439ECULL,
+    0x90BEFFFA23631E28ULL, 0xA4506CEBDE82BDE9ULL, 0xBEF9A3F7B2C67915ULL, 0xC67178F2E372532BULL,
+    0xCA273ECEEA26619CULL, 0xD186B8C721C0C207ULL, 0xEADA7DD6CDE0EB1EULL, 0xF57D4F7FEE6ED178ULL,
+    0x06F067AA72176FBAULL, 0x0A637DC5A2C898A6ULL, 0x113F9804BEF90DAEULL, 0x1B710B35131C471BULL,
+    0x28DB77F523047D84ULL, 0x32CAAB7B40C72493ULL, 0x3C9EBE0A15C9BEBCULL, 0x431D67C49C100D4CULL,
+    0x4CC5D4BECB3E42B6ULL, 0x597F299CFC657E2AULL, 0x5FCB6FAB3AD6FAECULL, 0x6C44198C4A475817ULL,
+};
+
+#define S512_0(x) (ROTR64(x, 28) ^ ROTR64(x, 34) ^ ROTR64(x, 39))
+#define S512_1(x) (ROTR64(x, 14) ^ ROTR64(x, 18) ^ ROTR64(x, 41))
+#define s512_0(x) (ROTR64(x, 1) ^ ROTR64(x, 8) ^ ((x) >> 7))
+#define s512_1(x) (ROTR64(x, 19) ^ ROTR64(x, 61) ^ ((x) >> 6))
+
+#define SHA512_SCHED(i)                                                                     \
+    (W[(i) & 15] += s512_1(W[((i) - 2) & 15]) + W[((i) - 7) & 15] + s512_0(W[((i) - 15) & 15]))
+
+#define SHA512_ROUND(a, b, c, d, e, f, g, h, i, w)                                          \
+    do {                                                                                    \
+        uint64_t t1 = h + S512_1(e) + CH(e, f, g) + K512[i] + (w);                          \
+        d += t1;                                                                            \
+        h = t1 + S512_0(a) + MAJ(a, b, c);                                                  \
+    } while (0)
+
+#define SHA512_ROUNDS8(i, w)                                                                \
+    do {                                                                                    \
+        SHA512_ROUND(a, b, c, d, e, f, g, h, (i), w((i)));                                  \
+        SHA512_ROUND(h, a, b, c, d, e, f, g, (i) + 1, w((i) + 1));                          \
+        SHA512_ROUND(g, h, a, b, c, d, e, f, (i) + 2, w((i) + 2));                          \
+        SHA512_ROUND(f, g, h, a, b, c, d, e, (i) + 3, w((i) + 3));                          \
+        SHA512_ROUND(e, f, g, h, a, b, c, d, (i) + 4, w((i) + 4));                          \
+        SHA512_ROUND(d, e, f, g, h, a, b, c, (i) + 5, w((i) + 5));                          \
+        SHA512_ROUND(c, d, e, f, g, h, a, b, (i) + 6, w((i) + 6));                          \
+        SHA512_ROUND(b, c, d, e, f, g, h, a, (i) + 7, w((i) + 7));                          \
+    } while (0)
+
+void CRYPTO_RAM_FUNC(crypto_sha512_blocks)(uint64_t state[8], const uint8_t *data, size_t blocks) {
+    uint64_t W[16];
+    for (; blocks > 0; blocks--, data += 128) {
+        for (int i = 0; i < 16; i++) {
+            uint64_t w = 0;
+            for (int j = 0; j < 8; j++) {
+                w = (w << 8) | data[8 * i + j];
+            }
+            W[i] = w;
+        }
+        uint64_t a = state[0], b = state[1], c = state[2], d = state[3];
+        uint64_t e = state[4], f = state[5], g = state[6], h = state[7];
+        for (int i = 0; i < 16; i += 8) {
+            SHA512_ROUNDS8(i, W_LOAD);
+        }
+        for (int i = 16; i < 80; i += 8) {
+            SHA512_ROUNDS8(i, SHA512_SCHED);
+        }
+        state[0] += a; state[1] += b; state[2] += c; state[3] += d;
+        state[4] += e; state[5] += f; state[6] += g; state[7] += h;
+    }
+    mbedtls_platform_zeroize(W, sizeof(W));
+}
+
+#ifdef MBEDTLS_SHA256_PROCESS_ALT
+int mbedtls_internal_sha256_process(mbedtls_sha256_context *ctx, const unsigned char data[64]) {
+    crypto_sha256_blocks(ctx->MBEDTLS_PRIVATE(state), data, 1);
+    return 0;
+}
+#endif
+
+#ifdef MBEDTLS_SHA512_PROCESS_ALT
+int mbedtls_internal_sha512_process(mbedtls_sha512_context *ctx, const unsigned char data[128]) {
+    crypto_sha512_blocks(ctx->MBEDTLS_PRIVATE(state), data, 1);
+    return 0;
+}
+#endif
@@ -0,0 +1,38 @@
+/*
+ * This file is part of the Pico Keys SDK distribution (https://github.com/polhenarejos/pico-keys-sdk).
+ * Copyright (c) 2022 Pol Henarejos.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, version 3.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef _CRYPTO_BACKEND_H_
+#define _CRYPTO_BACKEND_H_
+
+#include <stdint.h>
+#include <stddef.h>
+
+/* Alternative implementations of the mbedTLS primitives. They are always built, so they can be
+ * checked against the reference, and they replace the mbedTLS ones when the build defines
+ * PICO_KEYS_CRYPTO_BACKEND_PICO, which turns on the matching MBEDTLS_*_ALT in mbedtls_config.h.
+ * Everything above (hash_multi, double_hash_pin, HKDF, HMAC...) keeps calling mbedTLS. */
+
+#ifdef PICO_KEYS_CRYPTO_BACKEND_PICO
+#define CRYPTO_BACKEND_NAME "pico"
+#else
+#define CRYPTO_BACKEND_NAME "mbedtls"
+#endif
+
+extern void crypto_sha256_blocks(uint32_t state[8], const uint8_t *data, size_t blocks);
+extern void crypto_sha512_blocks(uint64_t state[8], const uint8_t *data, size_t blocks);
+
+#endif //_CRYPTO_BACKEND_H_
@@ -0,0 +1,220 @@
+/*
+ * This file is part of the Pico Keys SDK distribution (https://github.com/polhenarejos/pico-keys-sdk).
+ * Copyright (c) 2022 Pol Henarejos.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, version 3.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <stddef.h>
+#include <string.h>
+#ifndef ENABLE_EMULATION
+#include "pico/stdlib.h"
+#include "hardware/sync.h"
+#endif
+#include "crypto_jobs.h"
+#include "random.h"
+#include "mbedtls/sha256.h"
+#include "mbedtls/platform_util.h"
+
+static crypto_job_t *jobs[CRYPTO_JOBS_MAX] = { NULL };
+
+#ifndef ENABLE_EMULATION
+static spin_lock_t *jobs_lock = NULL;
+
+static uint32_t jobs_lock_enter() {
+    return spin_lock_blocking(jobs_lock);
+}
+
+static void jobs_lock_exit(uint32_t save) {
+    spin_unlock(jobs_lock, save);
+}
+#else
+static uint32_t jobs_lock_enter() {
+    return 0;
+}
+
+static void jobs_lock_exit(uint32_t save) {
+    (void) save;
+}
+#endif
+
+void crypto_jobs_init() {
+#ifndef ENABLE_EMULATION
+    if (jobs_lock == NULL) {
+        jobs_lock = spin_lock_instance(spin_lock_claim_unused(true));
+    }
+#endif
+    // Only calls with a restart context are cut, the others keep running to the end
+    mbedtls_ecp_set_max_ops(CRYPTO_JOB_ECP_OPS);
+}
+
+/* Called by core0 before resetting core1. Queued jobs belong to the card thread being killed,
+ * so they are dropped, and the lock is released in case core1 died holding it. */
+void crypto_jobs_flush() {
+#ifndef ENABLE_EMULATION
+    spin_unlock_unsafe(jobs_lock);
+#endif
+    for (int i = 0; i < CRYPTO_JOBS_MAX; i++) {
+        jobs[i] = NULL;
+    }
+}
+
+// Puts a claimed job back at the queue. False if the queue is full.
+static bool crypto_job_requeue(crypto_job_t *job) {
+    bool queued = false;
+    uint32_t save = jobs_lock_enter();
+    for (int i = 0; i < CRYPTO_JOBS_MAX && !queued; i++) {
+        if (jobs[i] == NULL) {
+            job->state = CRYPTO_JOB_QUEUED;
+            jobs[i] = job;
+            queued = true;
+        }
+    }
+    jobs_lock_exit(save);
+    return queued;
+}
+
+/* Runs a claimed job. With step, it runs until the job runs out of budget and queues it again,
+ * otherwise until it is done. */
+static void crypto_job_run(crypto_job_t *job, bool step) {
+    int ret = 0;
+    do {
+        ret = job->fn(job->arg);
+        if (ret == CRYPTO_JOB_IN_PROGRESS && step == true && crypto_job_requeue(job) == true) {
+            return;
+        }
+    } while (ret == CRYPTO_JOB_IN_PROGRESS);
+    job->ret = ret;
+#ifndef ENABLE_EMULATION
+    __dmb();
+#endif
+    job->state = CRYPTO_JOB_DONE;
+}
+
+/* Claims a queued job, the given one or any if NULL. */
+static crypto_job_t *crypto_job_claim(crypto_job_t *job) {
+    crypto_job_t *claimed = NULL;
+    uint32_t save = jobs_lock_enter();
+    for (int i = 0; i < CRYPTO_JOBS_MAX && !claimed; i++) {
+        if (jobs[i] && (job == NULL || jobs[i] == job)) {
+            claimed = jobs[i];
+            claimed->state = CRYPTO_JOB_RUNNING;
+            jobs[i] = NULL;
+        }
+    }
+    jobs_lock_exit(save);
+    return claimed;
+}
+
+void crypto_job_submit(crypto_job_t *job, int (*fn)(void *arg), void *arg) {
+    job->fn = fn;
+    job->arg = arg;
+    job->ret = 0;
+    job->state = CRYPTO_JOB_QUEUED;
+    uint32_t save = jobs_lock_enter();
+    for (int i = 0; i < CRYPTO_JOBS_MAX; i++) {
+        if (jobs[i] == NULL) {
+            jobs[i] = job;
+            jobs_lock_exit(save);
+            return;
+        }
+    }
+    jobs_lock_exit(save);
+    // The queue is full, so it runs right away on the caller
+    job->state = CRYPTO_JOB_RUNNING;
+    crypto_job_run(job, false);
+}
+
+int crypto_job_wait(crypto_job_t *job) {
+    if (job->state == CRYPTO_JOB_IDLE) {
+        return 0;
+    }
+    if (crypto_job_claim(job)) {
+        crypto_job_run(job, false);
+    }
+    while (job->state != CRYPTO_JOB_DONE) {
+        // A step runs on the other core. Meanwhile, this core takes any queued job, this one
+        // included once the step is over
+        crypto_job_t *other = crypto_job_claim(NULL);
+        if (other) {
+            crypto_job_run(other, false);
+        }
+#ifndef ENABLE_EMULATION
+        else {
+            tight_loop_contents();
+        }
+#endif
+    }
+#ifndef ENABLE_EMULATION
+    __dmb();
+#endif
+    job->state = CRYPTO_JOB_IDLE;
+    return job->ret;
+}
+
+/* Drops a job whose result is not wanted anymore. A step running on the other core is let finish,
+ * but the job is not resumed. The caller may free the job argument afterwards. */
+void crypto_job_cancel(crypto_job_t *job) {
+    while (job->state == CRYPTO_JOB_QUEUED || job->state == CRYPTO_JOB_RUNNING) {
+        if (crypto_job_claim(job)) {
+            break;
+        }
+#ifndef ENABLE_EMULATION
+        tight_loop_contents();
+#endif
+    }
+#ifndef ENABLE_EMULATION
+    __dmb();
+#endif
+    job->state = CRYPTO_JOB_IDLE;
+}
+
+bool crypto_jobs_task() {
+    crypto_job_t *job = crypto_job_claim(NULL);
+    if (job) {
+        crypto_job_run(job, true);
+        return true;
+    }
+    return false;
+}
+
+void crypto_job_rng_seed(crypto_job_rng_t *rng) {
+    random_gen(NULL, rng->seed, sizeof(rng->seed));
+    rng->counter = 0;
+}
+
+/* Counter mode over sha256(seed | counter). Only meant for blinding inside a job. */
+int crypto_job_rng(void *ctx, unsigned char *out, size_t out_len) {
+    crypto_job_rng_t *rng = (crypto_job_rng_t *) ctx;
+    uint8_t block[32], ctr[4];
+    while (out_len > 0) {
+        ctr[0] = rng->counter >> 24;
+        ctr[1] = rng->counter >> 16;
+        ctr[2] = rng->counter >> 8;
+        ctr[3] = rng->counter;
+        rng->counter++;
+        mbedtls_sha256_context sctx;
+        mbedtls_sha256_init(&sctx);
+        mbedtls_sha256_starts(&sctx, 0);
+        mbedtls_sha256_update(&sctx, rng->seed, sizeof(rng->seed));
+        mbedtls_sha256_update(&sctx, ctr, sizeof(ctr));
+        mbedtls_sha256_finish(&sctx, block);
+        mbedtls_sha256_free(&sctx);
+        size_t n = out_len < sizeof(block) ? out_len : sizeof(block);
+        memcpy(out, block, n);
+        out += n;
+        out_len -= n;
+    }
+    mbedtls_platform_zeroize(block, sizeof(block));
+    return 0;
+}
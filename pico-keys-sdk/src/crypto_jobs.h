@@ -0,0 +1,75 @@
+/*
+ * This file is part of the Pico Keys SDK distribution (https://github.com/polhenarejos/pico-keys-sdk).
+ * Copyright (c) 2022 Pol Henarejos.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, version 3.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef _CRYPTO_JOBS_H_
+#define _CRYPTO_JOBS_H_
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include "mbedtls/ecp.h"
+
+/* Cross-core queue of independent crypto jobs. The card thread submits a job and keeps working;
+ * core0 picks it up from its main loop while a command is in progress, one step per iteration,
+ * so the USB tasks are still serviced between steps. When the card thread waits for a job that
+ * is queued, it runs it to the end itself, so a job never waits for core0.
+ *
+ * A job is restartable: it returns CRYPTO_JOB_IN_PROGRESS when it ran out of budget and it is
+ * called again later with the same argument. Scalar multiplications go through the restartable
+ * ECP API with a restart context kept in the argument, and stop every CRYPTO_JOB_ECP_OPS
+ * operations. A job must not touch the request arena and must only read state that the card
+ * thread does not write until the job is waited for or cancelled. The random pool is not shared
+ * across cores, so a job that needs random bytes (i.e. blinding) takes them from a
+ * crypto_job_rng_t seeded by the card thread before submitting. */
+
+#define CRYPTO_JOB_IDLE     0
+#define CRYPTO_JOB_QUEUED   1
+#define CRYPTO_JOB_RUNNING  2
+#define CRYPTO_JOB_DONE     3
+
+#ifndef CRYPTO_JOBS_MAX
+#define CRYPTO_JOBS_MAX     4
+#endif
+
+#define CRYPTO_JOB_IN_PROGRESS  MBEDTLS_ERR_ECP_IN_PROGRESS
+
+#ifndef CRYPTO_JOB_ECP_OPS
+#define CRYPTO_JOB_ECP_OPS  128 // A P-256 scalar multiplication is about 1200
+#endif
+
+typedef struct crypto_job {
+    int (*fn)(void *arg);
+    void *arg;
+    volatile uint8_t state;
+    int ret;
+} crypto_job_t;
+
+typedef struct crypto_job_rng {
+    uint8_t seed[32];
+    uint32_t counter;
+} crypto_job_rng_t;
+
+extern void crypto_jobs_init();
+extern void crypto_jobs_flush();
+extern void crypto_job_submit(crypto_job_t *job, int (*fn)(void *arg), void *arg);
+extern int crypto_job_wait(crypto_job_t *job);
+extern void crypto_job_cancel(crypto_job_t *job);
+extern bool crypto_jobs_task();
+extern void crypto_job_rng_seed(crypto_job_rng_t *rng);
+extern int crypto_job_rng(void *ctx, unsigned char *out, size_t out_len);
+
+#endif //_CRYPTO_JOBS_H_
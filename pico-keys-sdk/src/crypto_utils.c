@@ -17,10 +17,15 @@
 
 #ifndef ENABLE_EMULATION
 #include <pico/unique_id.h>
+#include "hardware/sync.h"
 #endif
 #include "mbedtls/md.h"
 #include "mbedtls/sha256.h"
 #include "mbedtls/aes.h"
+#include "mbedtls/ecdsa.h"
+#include "mbedtls/asn1write.h"
+#include "mbedtls/platform_util.h"
+#include "random.h"
 #include "crypto_utils.h"
 #include "pico_keys.h"
 
@@ -184,3 +189,188 @@ mbedtls_ecp_group_id ec_get_curve_from_prime(const uint8_t *prime, size_t prime_
     }
     return MBEDTLS_ECP_DP_NONE;
 }
+
+/* Ephemeral pairs (k, r = x(kG) mod n) for P-256, computed by core0 while the card is idle.
+ * The generator multiplication, the costly part of a signature, then leaves the request path.
+ * Each slot is written only by the producer while empty and released only by the consumer,
+ * so no k is ever used twice. */
+typedef struct ecdsa_precomp {
+    volatile uint8_t ready;
+    uint8_t k[32];
+    uint8_t r[32];
+} ecdsa_precomp_t;
+
+static ecdsa_precomp_t ecdsa_precomp[ECDSA_PRECOMP_SLOTS] = { 0 };
+
+static void ecdsa_precomp_barrier() {
+#ifndef ENABLE_EMULATION
+    __dmb();
+#endif
+}
+
+/* The pair in progress. The multiplication is restartable, so each call only advances it by the
+ * ECP budget and the main loop gets back to USB in between. */
+static struct {
+    bool started;
+    mbedtls_ecp_group grp;
+    mbedtls_ecp_point R;
+    mbedtls_mpi k;
+    mbedtls_ecp_restart_ctx rs;
+} ecdsa_precomp_run = { 0 };
+
+void ecdsa_precompute_task() {
+    ecdsa_precomp_t *pc = NULL;
+    for (int i = 0; i < ECDSA_PRECOMP_SLOTS; i++) {
+        if (ecdsa_precomp[i].ready == false) {
+            pc = &ecdsa_precomp[i];
+            break;
+        }
+    }
+    if (pc == NULL) {
+        return;
+    }
+    int ret = 0;
+    uint8_t k[32], r[32];
+    mbedtls_mpi mr;
+    mbedtls_mpi_init(&mr);
+    if (ecdsa_precomp_run.started == false) {
+        if (ecdsa_precomp_run.grp.id == MBEDTLS_ECP_DP_NONE) {
+            mbedtls_ecp_group_init(&ecdsa_precomp_run.grp);
+            mbedtls_ecp_point_init(&ecdsa_precomp_run.R);
+            mbedtls_mpi_init(&ecdsa_precomp_run.k);
+            MBEDTLS_MPI_CHK(mbedtls_ecp_group_load(&ecdsa_precomp_run.grp,
+                                                   MBEDTLS_ECP_DP_SECP256R1));
+        }
+        MBEDTLS_MPI_CHK(mbedtls_ecp_gen_privkey(&ecdsa_precomp_run.grp, &ecdsa_precomp_run.k,
+                                                random_gen, NULL));
+        mbedtls_ecp_restart_init(&ecdsa_precomp_run.rs);
+        ecdsa_precomp_run.started = true;
+    }
+    ret = mbedtls_ecp_mul_restartable(&ecdsa_precomp_run.grp, &ecdsa_precomp_run.R,
+                                      &ecdsa_precomp_run.k, &ecdsa_precomp_run.grp.G,
+                                      random_gen, NULL, &ecdsa_precomp_run.rs);
+    if (ret == MBEDTLS_ERR_ECP_IN_PROGRESS) {
+        return;
+    }
+    mbedtls_ecp_restart_free(&ecdsa_precomp_run.rs);
+    ecdsa_precomp_run.started = false;
+    if (ret != 0) {
+        goto cleanup;
+    }
+    // A zero r is dropped and the next call starts over with another k
+    MBEDTLS_MPI_CHK(mbedtls_mpi_mod_mpi(&mr, &ecdsa_precomp_run.R.MBEDTLS_PRIVATE(X),
+                                        &ecdsa_precomp_run.grp.N));
+    if (mbedtls_mpi_cmp_int(&mr, 0) == 0) {
+        goto cleanup;
+    }
+    MBEDTLS_MPI_CHK(mbedtls_mpi_write_binary(&ecdsa_precomp_run.k, k, sizeof(k)));
+    MBEDTLS_MPI_CHK(mbedtls_mpi_write_binary(&mr, r, sizeof(r)));
+    memcpy(pc->k, k, sizeof(k));
+    memcpy(pc->r, r, sizeof(r));
+    ecdsa_precomp_barrier();
+    pc->ready = true;
+cleanup:
+    if (ecdsa_precomp_run.started == false) {
+        mbedtls_mpi_lset(&ecdsa_precomp_run.k, 0);
+    }
+    mbedtls_platform_zeroize(k, sizeof(k));
+    mbedtls_mpi_free(&mr);
+}
+
+static bool ecdsa_precomp_take(uint8_t k[32], uint8_t r[32]) {
+    for (int i = 0; i < ECDSA_PRECOMP_SLOTS; i++) {
+        ecdsa_precomp_t *pc = &ecdsa_precomp[i];
+        if (pc->ready == true) {
+            ecdsa_precomp_barrier();
+            memcpy(k, pc->k, 32);
+            memcpy(r, pc->r, 32);
+            mbedtls_platform_zeroize(pc->k, sizeof(pc->k));
+            ecdsa_precomp_barrier();
+            pc->ready = false;
+            return true;
+        }
+    }
+    return false;
+}
+
+/* s = k^-1 (e + r d) mod n, blinded with a random t as mbedtls does. */
+static int ecdsa_sign_precomp(mbedtls_ecdsa_context *ctx, const uint8_t *hash, size_t hlen,
+                              const uint8_t k[32], mbedtls_mpi *r, mbedtls_mpi *s,
+                              int (*f_rng)(void *, unsigned char *, size_t), void *p_rng) {
+    int ret = 0;
+    mbedtls_ecp_group *grp = &ctx->MBEDTLS_PRIVATE(grp);
+    mbedtls_mpi e, t, mk;
+    mbedtls_mpi_init(&e);
+    mbedtls_mpi_init(&t);
+    mbedtls_mpi_init(&mk);
+    size_t n_size = (grp->nbits + 7) / 8;
+    size_t use_size = MIN(hlen, n_size);
+    MBEDTLS_MPI_CHK(mbedtls_mpi_read_binary(&e, hash, use_size));
+    if (use_size * 8 > grp->nbits) {
+        MBEDTLS_MPI_CHK(mbedtls_mpi_shift_r(&e, use_size * 8 - grp->nbits));
+    }
+    if (mbedtls_mpi_cmp_mpi(&e, &grp->N) >= 0) {
+        MBEDTLS_MPI_CHK(mbedtls_mpi_sub_mpi(&e, &e, &grp->N));
+    }
+    MBEDTLS_MPI_CHK(mbedtls_mpi_read_binary(&mk, k, 32));
+    MBEDTLS_MPI_CHK(mbedtls_ecp_gen_privkey(grp, &t, f_rng, p_rng));
+    MBEDTLS_MPI_CHK(mbedtls_mpi_mul_mpi(s, r, &ctx->MBEDTLS_PRIVATE(d)));
+    MBEDTLS_MPI_CHK(mbedtls_mpi_add_mpi(&e, &e, s));
+    MBEDTLS_MPI_CHK(mbedtls_mpi_mul_mpi(&e, &e, &t));
+    MBEDTLS_MPI_CHK(mbedtls_mpi_mul_mpi(&mk, &mk, &t));
+    MBEDTLS_MPI_CHK(mbedtls_mpi_mod_mpi(&mk, &mk, &grp->N));
+    MBEDTLS_MPI_CHK(mbedtls_mpi_inv_mod(s, &mk, &grp->N));
+    MBEDTLS_MPI_CHK(mbedtls_mpi_mul_mpi(s, s, &e));
+    MBEDTLS_MPI_CHK(mbedtls_mpi_mod_mpi(s, s, &grp->N));
+    if (mbedtls_mpi_cmp_int(s, 0) == 0) {
+        ret = MBEDTLS_ERR_ECP_RANDOM_FAILED;
+    }
+cleanup:
+    mbedtls_mpi_free(&e);
+    mbedtls_mpi_free(&t);
+    mbedtls_mpi_free(&mk);
+    return ret;
+}
+
+int ecdsa_write_signature(mbedtls_ecdsa_context *ctx,
+                          mbedtls_md_type_t md_alg,
+                          const uint8_t *hash,
+                          size_t hlen,
+                          uint8_t *sig,
+                          size_t sig_size,
+                          size_t *slen,
+                          int (*f_rng)(void *, unsigned char *, size_t),
+                          void *p_rng) {
+    uint8_t k[32], r_bin[32];
+    if (ctx->MBEDTLS_PRIVATE(grp).id != MBEDTLS_ECP_DP_SECP256R1 || ecdsa_precomp_take(k, r_bin) == false) {
+        return mbedtls_ecdsa_write_signature(ctx, md_alg, hash, hlen, sig, sig_size, slen, f_rng, p_rng);
+    }
+    int ret = 0;
+    size_t len = 0;
+    uint8_t buf[MBEDTLS_ECDSA_MAX_LEN], *p = buf + sizeof(buf);
+    mbedtls_mpi r, s;
+    mbedtls_mpi_init(&r);
+    mbedtls_mpi_init(&s);
+    MBEDTLS_MPI_CHK(mbedtls_mpi_read_binary(&r, r_bin, sizeof(r_bin)));
+    if ((ret = ecdsa_sign_precomp(ctx, hash, hlen, k, &r, &s, f_rng, p_rng)) != 0) {
+        goto cleanup;
+    }
+    MBEDTLS_ASN1_CHK_CLEANUP_ADD(len, mbedtls_asn1_write_mpi(&p, buf, &s));
+    MBEDTLS_ASN1_CHK_CLEANUP_ADD(len, mbedtls_asn1_write_mpi(&p, buf, &r));
+    MBEDTLS_ASN1_CHK_CLEANUP_ADD(len, mbedtls_asn1_write_len(&p, buf, len));
+    MBEDTLS_ASN1_CHK_CLEANUP_ADD(len, mbedtls_asn1_write_tag(&p, buf, MBEDTLS_ASN1_CONSTRUCTED | MBEDTLS_ASN1_SEQUENCE));
+    if (len > sig_size) {
+        ret = MBEDTLS_ERR_ECP_BUFFER_TOO_SMALL;
+        goto cleanup;
+    }
+    memcpy(sig, p, len);
+    *slen = len;
+cleanup:
+    mbedtls_platform_zeroize(k, sizeof(k));
+    mbedtls_mpi_free(&r);
+    mbedtls_mpi_free(&s);
+    if (ret != 0 && ret != MBEDTLS_ERR_ECP_BUFFER_TOO_SMALL) {
+        return mbedtls_ecdsa_write_signature(ctx, md_alg, hash, hlen, sig, sig_size, slen, f_rng, p_rng);
+    }
+    return ret;
+}
@@ -23,6 +23,7 @@
 #include "pico/stdlib.h"
 #endif
 #include "mbedtls/ecp.h"
+#include "mbedtls/ecdsa.h"
 #include "mbedtls/md.h"
 
 #define PICO_KEYS_KEY_RSA                 0x000f // It is a mask
@@ -42,6 +43,10 @@
 
 #define IV_SIZE 16
 
+#ifndef ECDSA_PRECOMP_SLOTS
+#define ECDSA_PRECOMP_SLOTS 4 // Ephemeral P-256 pairs computed ahead while idle
+#endif
+
 extern void double_hash_pin(const uint8_t *pin, size_t len, uint8_t output[32]);
 extern void hash_multi(const uint8_t *input, size_t len, uint8_t output[32]);
 extern void hash256(const uint8_t *input, size_t len, uint8_t output[32]);
@@ -61,5 +66,15 @@ extern int aes_decrypt(const uint8_t *key,
 extern int aes_encrypt_cfb_256(const uint8_t *key, const uint8_t *iv, uint8_t *data, int len);
 extern int aes_decrypt_cfb_256(const uint8_t *key, const uint8_t *iv, uint8_t *data, int len);
 extern mbedtls_ecp_group_id ec_get_curve_from_prime(const uint8_t *prime, size_t prime_len);
+extern void ecdsa_precompute_task();
+extern int ecdsa_write_signature(mbedtls_ecdsa_context *ctx,
+                                 mbedtls_md_type_t md_alg,
+                                 const uint8_t *hash,
+                                 size_t hlen,
+                                 uint8_t *sig,
+                                 size_t sig_size,
+                                 size_t *slen,
+                                 int (*f_rng)(void *, unsigned char *, size_t),
+                                 void *p_rng);
 
 #endif
@@ -19,19 +19,28 @@
 #include "crypto_utils.h"
 #include "random.h"
 #include "mbedtls/cmac.h"
+#include "mbedtls/aes.h"
+#include "mbedtls/sha1.h"
+#include "mbedtls/platform_util.h"
 #include "asn1.h"
 #include "apdu.h"
 
 static uint8_t nonce[8];
-static uint8_t sm_kmac[16];
-static uint8_t sm_kenc[16];
 static MSE_protocol sm_protocol = MSE_NONE;
-static mbedtls_mpi sm_mSSC;
 static uint8_t sm_blocksize = 0;
 static uint8_t sm_iv[16];
 size_t sm_session_pin_len = 0;
 uint8_t sm_session_pin[16];
 
+/* Session state. The AES and CMAC key schedules are expanded once when the keys are derived and
+ * kept until the next session, so each APDU only runs the block operations. The send sequence
+ * counter is kept big endian, as it enters the MAC and the IV. */
+static mbedtls_aes_context sm_aes_enc, sm_aes_dec;
+static mbedtls_cipher_context_t sm_cmac;
+static bool sm_keys_ready = false;
+static uint8_t sm_ssc[16];
+static size_t sm_mac_len = 0;
+
 bool is_secured_apdu() {
     return CLA(apdu) & 0xC;
 }
@@ -42,27 +51,45 @@ void sm_derive_key(const uint8_t *input,
                    const uint8_t *nonce,
                    size_t nonce_len,
                    uint8_t *out) {
-    uint8_t *b = (uint8_t *) calloc(1, input_len + nonce_len + 4);
+    const uint8_t c[4] = { 0, 0, 0, counter };
+    uint8_t digest[20];
+    mbedtls_sha1_context ctx;
+    mbedtls_sha1_init(&ctx);
+    mbedtls_sha1_starts(&ctx);
     if (input) {
-        memcpy(b, input, input_len);
+        mbedtls_sha1_update(&ctx, input, input_len);
     }
     if (nonce) {
-        memcpy(b + input_len, nonce, nonce_len);
+        mbedtls_sha1_update(&ctx, nonce, nonce_len);
     }
-    b[input_len + nonce_len + 3] = counter;
-    uint8_t digest[20];
-    generic_hash(MBEDTLS_MD_SHA1, b, input_len + nonce_len + 4, digest);
+    mbedtls_sha1_update(&ctx, c, sizeof(c));
+    mbedtls_sha1_finish(&ctx, digest);
+    mbedtls_sha1_free(&ctx);
     memcpy(out, digest, 16);
-    free(b);
 }
 
 void sm_derive_all_keys(const uint8_t *derived, size_t derived_len) {
+    uint8_t kenc[16], kmac[16];
     memcpy(nonce, random_bytes_get(8), 8);
-    sm_derive_key(derived, derived_len, 1, nonce, sizeof(nonce), sm_kenc);
-    sm_derive_key(derived, derived_len, 2, nonce, sizeof(nonce), sm_kmac);
-    mbedtls_mpi_init(&sm_mSSC);
-    mbedtls_mpi_grow(&sm_mSSC, sm_blocksize);
-    mbedtls_mpi_lset(&sm_mSSC, 0);
+    sm_derive_key(derived, derived_len, 1, nonce, sizeof(nonce), kenc);
+    sm_derive_key(derived, derived_len, 2, nonce, sizeof(nonce), kmac);
+    if (sm_keys_ready) {
+        mbedtls_aes_free(&sm_aes_enc);
+        mbedtls_aes_free(&sm_aes_dec);
+        mbedtls_cipher_free(&sm_cmac);
+    }
+    mbedtls_aes_init(&sm_aes_enc);
+    mbedtls_aes_init(&sm_aes_dec);
+    mbedtls_cipher_init(&sm_cmac);
+    sm_keys_ready = mbedtls_aes_setkey_enc(&sm_aes_enc, kenc, 128) == 0 &&
+                    mbedtls_aes_setkey_dec(&sm_aes_dec, kenc, 128) == 0 &&
+                    mbedtls_cipher_setup(&sm_cmac,
+                                         mbedtls_cipher_info_from_type(MBEDTLS_CIPHER_AES_128_ECB))
+                    == 0 &&
+                    mbedtls_cipher_cmac_starts(&sm_cmac, kmac, 128) == 0;
+    mbedtls_platform_zeroize(kenc, sizeof(kenc));
+    mbedtls_platform_zeroize(kmac, sizeof(kmac));
+    memset(sm_ssc, 0, sizeof(sm_ssc));
     memset(sm_iv, 0, sizeof(sm_iv));
     sm_session_pin_len = 0;
 }
@@ -86,12 +113,49 @@ uint8_t *sm_get_nonce() {
 }
 
 int sm_sign(uint8_t *in, size_t in_len, uint8_t *out) {
-    return mbedtls_cipher_cmac(mbedtls_cipher_info_from_type(MBEDTLS_CIPHER_AES_128_ECB),
-                               sm_kmac,
-                               128,
-                               in,
-                               in_len,
-                               out);
+    if (!sm_keys_ready) {
+        return CCID_EXEC_ERROR;
+    }
+    int r = mbedtls_cipher_cmac_reset(&sm_cmac);
+    if (r == 0) {
+        r = mbedtls_cipher_cmac_update(&sm_cmac, in, in_len);
+    }
+    if (r == 0) {
+        r = mbedtls_cipher_cmac_finish(&sm_cmac, out);
+    }
+    return r;
+}
+
+/* The MAC input is | SSC | [header | padding] | data objects | padding |. It is fed to the CMAC
+ * as it is walked, without building it in a buffer. */
+static int sm_mac_begin() {
+    if (!sm_keys_ready) {
+        return CCID_EXEC_ERROR;
+    }
+    for (int i = sizeof(sm_ssc) - 1; i >= 0 && ++sm_ssc[i] == 0; i--) {
+        ;
+    }
+    sm_mac_len = sm_blocksize;
+    if (mbedtls_cipher_cmac_reset(&sm_cmac) != 0 ||
+        mbedtls_cipher_cmac_update(&sm_cmac, sm_ssc + sizeof(sm_ssc) - sm_blocksize,
+                                   sm_blocksize) != 0) {
+        return CCID_EXEC_ERROR;
+    }
+    return CCID_OK;
+}
+
+static int sm_mac_update(const uint8_t *data, size_t len) {
+    sm_mac_len += len;
+    return mbedtls_cipher_cmac_update(&sm_cmac, data, len) == 0 ? CCID_OK : CCID_EXEC_ERROR;
+}
+
+static int sm_mac_pad() {
+    static const uint8_t pad[16] = { 0x80 };
+    return sm_mac_update(pad, sm_blocksize - (sm_mac_len % sm_blocksize));
+}
+
+static int sm_mac_finish(uint8_t *out) {
+    return mbedtls_cipher_cmac_finish(&sm_cmac, out) == 0 ? CCID_OK : CCID_EXEC_ERROR;
 }
 
 int sm_unwrap() {
@@ -131,9 +195,15 @@ int sm_unwrap() {
         return CCID_WRONG_PADDING;
     }
     sm_update_iv();
-    aes_decrypt(sm_kenc, sm_iv, 128, PICO_KEYS_AES_MODE_CBC, body, body_size);
-    memmove(apdu.data, body, body_size);
-    apdu.nc = sm_remove_padding(apdu.data, body_size);
+    if (mbedtls_aes_crypt_cbc(&sm_aes_dec, MBEDTLS_AES_DECRYPT, body_size, sm_iv, body,
+                              apdu.data) != 0) {
+        return CCID_WRONG_DATA;
+    }
+    int nc = sm_remove_padding(apdu.data, body_size);
+    if (nc < 0) {
+        return CCID_WRONG_PADDING;
+    }
+    apdu.nc = nc;
     DEBUG_PAYLOAD(apdu.data, (int) apdu.nc);
     return CCID_OK;
 }
@@ -143,60 +213,42 @@ int sm_wrap() {
     if (sm_indicator == 0) {
         return CCID_OK;
     }
-    uint8_t input[1024];
-    size_t input_len = 0;
-    memset(input, 0, sizeof(input));
-    mbedtls_mpi ssc;
-    mbedtls_mpi_init(&ssc);
-    mbedtls_mpi_add_int(&ssc, &sm_mSSC, 1);
-    mbedtls_mpi_copy(&sm_mSSC, &ssc);
-    int r = mbedtls_mpi_write_binary(&ssc, input, sm_blocksize);
-    if (r != 0) {
-        return CCID_EXEC_ERROR;
+    int r = sm_mac_begin();
+    if (r != CCID_OK) {
+        return r;
     }
-    input_len += sm_blocksize;
-    mbedtls_mpi_free(&ssc);
     if (res_APDU_size > 0) {
-        res_APDU[res_APDU_size++] = 0x80;
-        memset(res_APDU + res_APDU_size, 0, (sm_blocksize - (res_APDU_size % sm_blocksize)));
-        res_APDU_size += (sm_blocksize - (res_APDU_size % sm_blocksize));
-        DEBUG_PAYLOAD(res_APDU, res_APDU_size);
+        // The cryptogram is | 0x01 | padded data |, so the plaintext is moved once behind the
+        // tag, length and indicator and then padded and encrypted in place
+        size_t enc_len = (res_APDU_size / sm_blocksize + 1) * sm_blocksize;
+        size_t hdr_len = enc_len + 1 < 128 ? 2 : (enc_len + 1 < 256 ? 3 : 4);
+        uint8_t *enc = res_APDU + hdr_len + 1;
+        memmove(enc, res_APDU, res_APDU_size);
+        enc[res_APDU_size] = 0x80;
+        memset(enc + res_APDU_size + 1, 0, enc_len - res_APDU_size - 1);
+        DEBUG_PAYLOAD(enc, enc_len);
         sm_update_iv();
-        aes_encrypt(sm_kenc, sm_iv, 128, PICO_KEYS_AES_MODE_CBC, res_APDU, res_APDU_size);
-        memmove(res_APDU + 1, res_APDU, res_APDU_size);
-        res_APDU[0] = 0x1;
-        res_APDU_size++;
-        if (res_APDU_size < 128) {
-            memmove(res_APDU + 2, res_APDU, res_APDU_size);
-            res_APDU[1] = res_APDU_size;
-            res_APDU_size += 2;
-        }
-        else if (res_APDU_size < 256) {
-            memmove(res_APDU + 3, res_APDU, res_APDU_size);
-            res_APDU[1] = 0x81;
-            res_APDU[2] = res_APDU_size;
-            res_APDU_size += 3;
-        }
-        else {
-            memmove(res_APDU + 4, res_APDU, res_APDU_size);
-            res_APDU[1] = 0x82;
-            res_APDU[2] = res_APDU_size >> 8;
-            res_APDU[3] = res_APDU_size & 0xff;
-            res_APDU_size += 4;
+        if (mbedtls_aes_crypt_cbc(&sm_aes_enc, MBEDTLS_AES_ENCRYPT, enc_len, sm_iv, enc,
+                                  enc) != 0) {
+            return CCID_EXEC_ERROR;
         }
         res_APDU[0] = 0x87;
+        format_tlv_len(enc_len + 1, res_APDU + 1);
+        res_APDU[hdr_len] = 0x1;
+        res_APDU_size = hdr_len + 1 + enc_len;
     }
     res_APDU[res_APDU_size++] = 0x99;
     res_APDU[res_APDU_size++] = 2;
     res_APDU[res_APDU_size++] = apdu.sw >> 8;
     res_APDU[res_APDU_size++] = apdu.sw & 0xff;
-    memcpy(input + input_len, res_APDU, res_APDU_size);
-    input_len += res_APDU_size;
-    input[input_len++] = 0x80;
-    input_len += (sm_blocksize - (input_len % sm_blocksize));
-    r = sm_sign(input, input_len, res_APDU + res_APDU_size + 2);
+    uint8_t mac[16];
+    if (sm_mac_update(res_APDU, res_APDU_size) != CCID_OK || sm_mac_pad() != CCID_OK ||
+        sm_mac_finish(mac) != CCID_OK) {
+        return CCID_EXEC_ERROR;
+    }
     res_APDU[res_APDU_size++] = 0x8E;
     res_APDU[res_APDU_size++] = 8;
+    memcpy(res_APDU + res_APDU_size, mac, 8);
     res_APDU_size += 8;
     if (apdu.ne > 0) {
         apdu.ne = res_APDU_size;
@@ -221,42 +273,22 @@ int sm_get_le() {
 }
 
 void sm_update_iv() {
-    uint8_t tmp_iv[16], sc_counter[16];
-    memset(tmp_iv, 0, sizeof(tmp_iv)); //IV is always 0 for encryption of IV based on counter
-    mbedtls_mpi_write_binary(&sm_mSSC, sc_counter, sizeof(sc_counter));
-    aes_encrypt(sm_kenc, tmp_iv, 128, PICO_KEYS_AES_MODE_CBC, sc_counter, sizeof(sc_counter));
-    memcpy(sm_iv, sc_counter, sizeof(sc_counter));
+    // The IV is the encryption of the counter with a zero IV, which is one ECB block
+    if (sm_keys_ready) {
+        mbedtls_aes_crypt_ecb(&sm_aes_enc, MBEDTLS_AES_ENCRYPT, sm_ssc, sm_iv);
+    }
 }
 
 int sm_verify() {
-    uint8_t input[1024];
-    memset(input, 0, sizeof(input));
-    int input_len = 0, r = 0;
-    bool add_header = (CLA(apdu) & 0xC) == 0xC;
-    int data_len = (int) (apdu.nc / sm_blocksize) * sm_blocksize;
-    if (data_len % sm_blocksize) {
-        data_len += sm_blocksize;
-    }
-    if (data_len + (add_header ? sm_blocksize : 0) > 1024) {
-        return CCID_WRONG_LENGTH;
-    }
-    mbedtls_mpi ssc;
-    mbedtls_mpi_init(&ssc);
-    mbedtls_mpi_add_int(&ssc, &sm_mSSC, 1);
-    mbedtls_mpi_copy(&sm_mSSC, &ssc);
-    r = mbedtls_mpi_write_binary(&ssc, input, sm_blocksize);
-    input_len += sm_blocksize;
-    mbedtls_mpi_free(&ssc);
-    if (r != 0) {
-        return CCID_EXEC_ERROR;
+    int r = sm_mac_begin();
+    if (r != CCID_OK) {
+        return r;
     }
-    if (add_header) {
-        input[input_len++] = CLA(apdu);
-        input[input_len++] = INS(apdu);
-        input[input_len++] = P1(apdu);
-        input[input_len++] = P2(apdu);
-        input[input_len++] = 0x80;
-        input_len += sm_blocksize - 5;
+    if ((CLA(apdu) & 0xC) == 0xC) {
+        uint8_t header[4] = { CLA(apdu), INS(apdu), P1(apdu), P2(apdu) };
+        if (sm_mac_update(header, sizeof(header)) != CCID_OK || sm_mac_pad() != CCID_OK) {
+            return CCID_EXEC_ERROR;
+        }
     }
     bool some_added = false;
     const uint8_t *mac = NULL;
@@ -266,11 +298,13 @@ int sm_verify() {
     size_t tag_len = 0;
     while (walk_tlv(apdu.data, apdu.nc, &p, &tag, &tag_len, &tag_data)) {
         if (tag & 0x1) {
-            input[input_len++] = tag;
-            int tlen = format_tlv_len(tag_len, input + input_len);
-            input_len += tlen;
-            memcpy(input + input_len, tag_data, tag_len);
-            input_len += tag_len;
+            uint8_t tl[4];
+            tl[0] = (uint8_t) tag;
+            int tlen = format_tlv_len(tag_len, tl + 1);
+            if (sm_mac_update(tl, 1 + tlen) != CCID_OK ||
+                sm_mac_update(tag_data, tag_len) != CCID_OK) {
+                return CCID_EXEC_ERROR;
+            }
             some_added = true;
         }
         if (tag == 0x8E) {
@@ -278,16 +312,14 @@ int sm_verify() {
             mac_len = tag_len;
         }
     }
-    if (!mac) {
+    if (!mac || mac_len > 16) {
         return CCID_WRONG_DATA;
     }
-    if (some_added) {
-        input[input_len++] = 0x80;
-        input_len += (sm_blocksize - (input_len % sm_blocksize));
+    if (some_added && sm_mac_pad() != CCID_OK) {
+        return CCID_EXEC_ERROR;
     }
     uint8_t signature[16];
-    r = sm_sign(input, input_len, signature);
-    if (r != 0) {
+    if (sm_mac_finish(signature) != CCID_OK) {
         return CCID_EXEC_ERROR;
     }
     if (memcmp(signature, mac, mac_len) == 0) {
@@ -0,0 +1,246 @@
+/*
+ * This file is part of the Pico Keys SDK distribution (https://github.com/polhenarejos/pico-keys-sdk).
+ * Copyright (c) 2022 Pol Henarejos.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, version 3.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <stdint.h>
+#include <string.h>
+#include <stdio.h>
+#ifndef ENABLE_EMULATION
+#include "pico/stdlib.h"
+#include "hardware/flash.h"
+#else
+#define FLASH_SECTOR_SIZE       4096
+extern uint8_t *map;
+#endif
+#include "pico_keys.h"
+#include "asset.h"
+
+/*
+ * ----------------------------------------------------------------
+ * |        |                                 |                    |
+ * | header | entry[count] (id, len, offset)  | data of the entries |
+ * |        |                                 |                    |
+ * ----------------------------------------------------------------
+ * The CRC covers everything after the header, up to size bytes.
+ */
+
+#define ASSET_MAGIC     0x31414B50 // "PKA1"
+#define ASSET_NONE      0xFF
+
+typedef struct asset_header {
+    uint32_t magic;
+    uint32_t seq;
+    uint16_t count;
+    uint16_t size;
+    uint32_t crc;
+} asset_header_t;
+
+typedef struct asset_entry {
+    uint16_t id;
+    uint16_t len;
+    uint16_t off; // From the start of the bank
+    uint16_t rfu;
+} asset_entry_t;
+
+extern const uintptr_t start_asset_pool;
+extern uint32_t flash_crc32(uint32_t crc, const uint8_t *data, size_t len);
+extern uint8_t *flash_read(uintptr_t addr);
+extern int flash_program_block(uintptr_t addr, const uint8_t *data, size_t len);
+extern void low_flash_txn_begin();
+extern void low_flash_txn_commit();
+
+static bool asset_enabled = false;
+static uint8_t active = ASSET_NONE, pending = ASSET_NONE;
+static uint32_t pending_seq = 0;
+static uint32_t generation = 0;
+
+static uintptr_t asset_bank_addr(uint8_t bank) {
+    return start_asset_pool + bank * ASSET_BANK_SIZE;
+}
+
+static const uint8_t *asset_bank_ptr(uint8_t bank) {
+#ifndef ENABLE_EMULATION
+    return (const uint8_t *) asset_bank_addr(bank);
+#else
+    return map + asset_bank_addr(bank);
+#endif
+}
+
+static uint32_t asset_seq(uint8_t bank) {
+    return ((const asset_header_t *) asset_bank_ptr(bank))->seq;
+}
+
+static bool asset_bank_valid(const uint8_t *bank) {
+    const asset_header_t *h = (const asset_header_t *) bank;
+    if (h->magic != ASSET_MAGIC || h->count > ASSET_MAX_ENTRIES ||
+        h->size < h->count * sizeof(asset_entry_t) ||
+        h->size > ASSET_BANK_SIZE - sizeof(asset_header_t)) {
+        return false;
+    }
+    return flash_crc32(0, bank + sizeof(asset_header_t), h->size) == h->crc;
+}
+
+void asset_init() {
+    active = pending = ASSET_NONE;
+    generation++; // The banks may have been rewritten behind our back
+#ifndef ENABLE_EMULATION
+    // The area is at the top of the firmware half, usable only while the binary ends below it
+    extern char __flash_binary_end;
+    asset_enabled = (uintptr_t) &__flash_binary_end <= start_asset_pool;
+#else
+    asset_enabled = map != NULL;
+#endif
+    if (!asset_enabled) {
+        printf("Assets disabled: the firmware overlaps the asset area, files are read instead\r\n");
+        return;
+    }
+    for (uint8_t b = 0; b < 2; b++) {
+        if (asset_bank_valid(asset_bank_ptr(b))) {
+            if (active == ASSET_NONE || (int32_t) (asset_seq(b) - asset_seq(active)) > 0) {
+                active = b;
+            }
+        }
+    }
+}
+
+/* A written bank takes over as soon as the flash holds all of it. */
+static void asset_refresh() {
+    if (asset_seq(pending) == pending_seq && asset_bank_valid(asset_bank_ptr(pending))) {
+        active = pending;
+        pending = ASSET_NONE;
+        generation++;
+    }
+}
+
+uint32_t asset_generation() {
+    return generation;
+}
+
+const uint8_t *asset_get(uint16_t id, uint16_t *len) {
+    if (pending != ASSET_NONE) {
+        asset_refresh();
+        if (pending != ASSET_NONE) {
+            return NULL;
+        }
+    }
+    if (active == ASSET_NONE) {
+        return NULL;
+    }
+    const uint8_t *bank = asset_bank_ptr(active);
+    const asset_header_t *h = (const asset_header_t *) bank;
+    const asset_entry_t *e = (const asset_entry_t *) (bank + sizeof(asset_header_t));
+    for (uint16_t i = 0; i < h->count; i++) {
+        if (e[i].id == id) {
+            if (len) {
+                *len = e[i].len;
+            }
+            return bank + e[i].off;
+        }
+    }
+    return NULL;
+}
+
+/* Loads the latest bank, committed or not, through the page cache. */
+static bool asset_load(uint8_t bank, uint8_t *out) {
+    for (size_t s = 0; s < ASSET_BANK_SIZE; s += FLASH_SECTOR_SIZE) {
+        memcpy(out + s, flash_read(asset_bank_addr(bank) + s), FLASH_SECTOR_SIZE);
+    }
+    return asset_bank_valid(out);
+}
+
+int asset_write(uint16_t id, const uint8_t *data, uint16_t len) {
+    if (!asset_enabled) {
+        printf("Assets disabled: asset %04x not mirrored\r\n", id);
+        return CCID_ERR_NO_MEMORY;
+    }
+    // While a bank is pending it is the latest one, so it is rebuilt again in place
+    uint8_t dst = pending != ASSET_NONE ? pending : (active == 0 ? 1 : 0);
+    uint8_t *img = (uint8_t *) arena_alloc(ASSET_BANK_SIZE);
+    if (!img) {
+        return CCID_ERR_MEMORY_FATAL;
+    }
+    asset_header_t *h = (asset_header_t *) img;
+    asset_entry_t *e = (asset_entry_t *) (img + sizeof(asset_header_t));
+    // A pending bank whose write failed is not valid, then the active one is the latest content
+    if ((pending == ASSET_NONE || !asset_load(pending, img)) &&
+        (active == ASSET_NONE || !asset_load(active, img))) {
+        memset(h, 0, sizeof(asset_header_t));
+    }
+    uint32_t seq = h->seq;
+    if (active != ASSET_NONE && (int32_t) (asset_seq(active) - seq) > 0) {
+        seq = asset_seq(active);
+    }
+    size_t end = sizeof(asset_header_t) + h->size;
+    for (uint16_t i = 0; i < h->count; i++) {
+        if (e[i].id == id) {
+            uint16_t off = e[i].off, l = e[i].len;
+            memmove(img + off, img + off + l, end - off - l);
+            end -= l;
+            for (uint16_t j = 0; j < h->count; j++) {
+                if (e[j].off > off) {
+                    e[j].off -= l;
+                }
+            }
+            memmove(&e[i], &e[i + 1], (h->count - i - 1) * sizeof(asset_entry_t));
+            h->count--;
+            size_t dir = sizeof(asset_header_t) + h->count * sizeof(asset_entry_t);
+            end -= sizeof(asset_entry_t);
+            memmove(img + dir, img + dir + sizeof(asset_entry_t), end - dir);
+            for (uint16_t j = 0; j < h->count; j++) {
+                e[j].off -= sizeof(asset_entry_t);
+            }
+            break;
+        }
+    }
+    if (len > 0) {
+        if (h->count == ASSET_MAX_ENTRIES || end + sizeof(asset_entry_t) + len > ASSET_BANK_SIZE) {
+            arena_free(img);
+            return CCID_ERR_NO_MEMORY;
+        }
+        size_t dir = sizeof(asset_header_t) + h->count * sizeof(asset_entry_t);
+        memmove(img + dir + sizeof(asset_entry_t), img + dir, end - dir);
+        end += sizeof(asset_entry_t);
+        for (uint16_t j = 0; j < h->count; j++) {
+            e[j].off += sizeof(asset_entry_t);
+        }
+        e[h->count].id = id;
+        e[h->count].len = len;
+        e[h->count].off = (uint16_t) end;
+        e[h->count].rfu = 0;
+        h->count++;
+        memcpy(img + end, data, len);
+        end += len;
+    }
+    memset(img + end, 0xFF, ASSET_BANK_SIZE - end);
+    h->magic = ASSET_MAGIC;
+    h->seq = seq + 1;
+    h->size = (uint16_t) (end - sizeof(asset_header_t));
+    h->crc = flash_crc32(0, img + sizeof(asset_header_t), h->size);
+    int ret = CCID_OK;
+    // Pointers into the bank being rebuilt go stale from now on
+    generation++;
+    low_flash_txn_begin();
+    for (size_t s = 0; s < ASSET_BANK_SIZE && ret == CCID_OK; s += FLASH_SECTOR_SIZE) {
+        ret = flash_program_block(asset_bank_addr(dst) + s, img + s, FLASH_SECTOR_SIZE);
+    }
+    low_flash_txn_commit();
+    // Even a failed write leaves the area pending, so readers fall back to their files rather than
+    // seeing the previous content. The next write rebuilds it from the active bank in that case
+    pending = dst;
+    pending_seq = h->seq;
+    arena_free(img);
+    return ret;
+}
@@ -0,0 +1,44 @@
+/*
+ * This file is part of the Pico Keys SDK distribution (https://github.com/polhenarejos/pico-keys-sdk).
+ * Copyright (c) 2022 Pol Henarejos.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, version 3.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef _ASSET_H_
+#define _ASSET_H_
+
+#include <stdint.h>
+#include <stdbool.h>
+
+/* Read-only asset area. Data that rarely changes (attestation certificates and the like) is kept
+ * in two banks below the flash journal and read straight through XIP, with no flash mutex nor
+ * page cache lookup. A write rebuilds the whole bank into the other one, which takes over once
+ * the flash has committed it and its CRC checks. Until then asset_get() returns NULL, so callers
+ * fall back to their file copy.
+ *
+ * Returned pointers are valid until asset_generation() changes, which every asset_write() and
+ * every bank switch do. A caller keeping one across commands checks the generation first.
+ *
+ * The area is carved from the top of the firmware half. When the binary grows over it, the area
+ * is disabled, logged at boot and on every write, and callers keep reading their files. */
+
+#define ASSET_BANK_SIZE     (2 * 4096)
+#define ASSET_MAX_ENTRIES   16
+
+extern void asset_init();
+extern const uint8_t *asset_get(uint16_t id, uint16_t *len);
+extern int asset_write(uint16_t id, const uint8_t *data, uint16_t len);
+extern uint32_t asset_generation();
+
+#endif //_ASSET_H_
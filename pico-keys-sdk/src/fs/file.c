@@ -21,6 +21,7 @@
 #include <stdio.h>
 #include "asn1.h"
 #include "apdu.h"
+#include "asset.h"
 
 extern const uintptr_t end_data_pool;
 extern const uintptr_t start_data_pool;
@@ -220,6 +221,10 @@ bool authenticate_action(const file_t *ef, uint8_t op) {
     return false;
 }
 
+static void meta_reset();
+static void meta_scan(uint8_t *data);
+static void meta_migrate();
+
 void initialize_flash(bool hard) {
     if (hard) {
         const uint8_t empty[8] = { 0 };
@@ -232,8 +237,13 @@ void initialize_flash(bool hard) {
         }
     }
     dynamic_files = 0;
+    meta_reset();
 }
 
+/* Lets the application keep some records out of the dynamic file table. It returns true when the
+ * record was taken. */
+bool (*scan_file_cb)(uint16_t fid, uint8_t *data) = NULL;
+
 void scan_region(bool persistent) {
     uintptr_t endp = end_data_pool, startp = start_data_pool;
     if (persistent) {
@@ -247,15 +257,19 @@ void scan_region(bool persistent) {
         }
 
         uint16_t fid = flash_read_uint16(base + sizeof(uintptr_t) + sizeof(uintptr_t));
-        printf("[%x] scan fid %x, len %d\r\n", (unsigned int) base, fid,
-               flash_read_uint16(base + sizeof(uintptr_t) + sizeof(uintptr_t) + sizeof(uint16_t)));
-        file_t *file = (file_t *) search_by_fid(fid, NULL, SPECIFY_EF);
-        if (!file) {
-            file = file_new(fid);
+        uintptr_t data = base + sizeof(uintptr_t) + sizeof(uintptr_t) + sizeof(uint16_t);
+        printf("[%x] scan fid %x, len %d\r\n", (unsigned int) base, fid, flash_read_uint16(data));
+        if (fid == EF_META_RECORD) {
+            meta_scan((uint8_t *) data);
         }
-        if (file) {
-            file->data =
-                (uint8_t *) (base + sizeof(uintptr_t) + sizeof(uintptr_t) + sizeof(uint16_t));
+        else if (!scan_file_cb || !scan_file_cb(fid, (uint8_t *) data)) {
+            file_t *file = (file_t *) search_by_fid(fid, NULL, SPECIFY_EF);
+            if (!file) {
+                file = file_new(fid);
+            }
+            if (file) {
+                file->data = (uint8_t *) data;
+            }
         }
         if (flash_read_uintptr(base) == 0x0) {
             break;
@@ -263,7 +277,10 @@ void scan_region(bool persistent) {
     }
 }
 void wait_flash_finish();
+extern void low_flash_recover();
+extern int flash_migrate_pool();
 void scan_flash() {
+    low_flash_recover();
     initialize_flash(false); //soft initialization
     if (*(uintptr_t *) flash_read(end_rom_pool) == 0xffffffff &&
         *(uintptr_t *) flash_read(end_rom_pool + sizeof(uintptr_t)) == 0xffffffff) {
@@ -275,9 +292,13 @@ void scan_flash() {
         //low_flash_available();
         //wait_flash_finish();
     }
+    flash_migrate_pool();
     printf("SCAN\r\n");
     scan_region(true);
     scan_region(false);
+    meta_migrate();
+    flash_wear_load();
+    asset_init();
 }
 
 uint8_t *file_read(const uint8_t *addr) {
@@ -352,139 +373,133 @@ file_t *file_new(uint16_t fid) {
     //memset((uint8_t *)f->acl, 0x90, sizeof(f->acl));
     return f;
 }
-int meta_find(uint16_t fid, uint8_t **out) {
-    file_t *ef = search_by_fid(EF_META, NULL, SPECIFY_EF);
-    if (!ef) {
-        return CCID_ERR_FILE_NOT_FOUND;
-    }
-    uint16_t tag = 0x0;
-    uint8_t *tag_data = NULL, *p = NULL, *data = file_get_data(ef);
-    size_t tag_len = 0, data_len = file_get_size(ef);
-    while (walk_tlv(data, data_len, &p, &tag, &tag_len, &tag_data)) {
-        if (tag_len < 2) {
-            continue;
+/* Metadata store. Each FID with metadata has its own flash record, EF_META_RECORD, holding
+ * | fid (2) | metadata |, and an index sorted by FID keeps where each record lives. Updating
+ * the metadata of a file only rewrites its own record, in place when it does not grow. */
+#ifndef MAX_META_RECORDS
+#define MAX_META_RECORDS 256
+#endif
+
+typedef struct meta_record {
+    uint16_t fid;
+    uint8_t *data;
+} meta_record_t;
+
+static meta_record_t meta_records[MAX_META_RECORDS];
+static uint16_t meta_records_len = 0;
+
+static void meta_reset() {
+    meta_records_len = 0;
+}
+
+static int meta_search(uint16_t fid, bool *found) {
+    int lo = 0, hi = meta_records_len;
+    while (lo < hi) {
+        int mid = (lo + hi) / 2;
+        if (meta_records[mid].fid < fid) {
+            lo = mid + 1;
         }
-        uint16_t cfid = (tag_data[0] << 8 | tag_data[1]);
-        if (cfid == fid) {
-            if (out) {
-                *out = tag_data + 2;
-            }
-            return tag_len - 2;
+        else {
+            hi = mid;
         }
     }
-    return 0;
+    *found = lo < meta_records_len && meta_records[lo].fid == fid;
+    return lo;
 }
-int meta_delete(uint16_t fid) {
-    file_t *ef = search_by_fid(EF_META, NULL, SPECIFY_EF);
-    if (!ef) {
-        return CCID_ERR_FILE_NOT_FOUND;
-    }
-    uint16_t tag = 0x0;
-    uint8_t *tag_data = NULL, *p = NULL, *data = file_get_data(ef);
-    size_t tag_len = 0, data_len = file_get_size(ef);
-    uint8_t *fdata = NULL;
-    while (walk_tlv(data, data_len, &p, &tag, &tag_len, &tag_data)) {
-        uint8_t *tpos = p - tag_len - format_tlv_len(tag_len, NULL) - 1;
-        if (tag_len < 2) {
-            continue;
-        }
-        uint16_t cfid = (tag_data[0] << 8 | tag_data[1]);
-        if (cfid == fid) {
-            size_t new_len = data_len - 1 - tag_len - format_tlv_len(tag_len, NULL);
-            if (new_len == 0) {
-                flash_clear_file(ef);
-            }
-            else {
-                fdata = (uint8_t *) calloc(1, new_len);
-                if (tpos > data) {
-                    memcpy(fdata, data, tpos - data);
-                }
-                if (data + data_len > p) {
-                    memcpy(fdata + (tpos - data), p, data + data_len - p);
-                }
-                int r = flash_write_data_to_file(ef, fdata, new_len);
-                free(fdata);
-                if (r != CCID_OK) {
-                    return CCID_EXEC_ERROR;
-                }
-            }
-            low_flash_available();
-            break;
+
+static int meta_index(uint16_t fid, uint8_t *data) {
+    bool found = false;
+    int i = meta_search(fid, &found);
+    if (!found) {
+        if (meta_records_len == MAX_META_RECORDS) {
+            return CCID_ERR_NO_MEMORY;
         }
+        memmove(&meta_records[i + 1], &meta_records[i],
+                (meta_records_len - i) * sizeof(meta_record_t));
+        meta_records_len++;
+        meta_records[i].fid = fid;
     }
+    meta_records[i].data = data;
+    return CCID_OK;
+}
+
+static void meta_scan(uint8_t *data) {
+    const file_t ef = { .fid = EF_META_RECORD, .data = data };
+    if (file_get_size(&ef) >= 2) {
+        const uint8_t *p = file_get_data(&ef);
+        meta_index(p[0] << 8 | p[1], data);
+    }
+}
+
+int meta_find(uint16_t fid, uint8_t **out) {
+    bool found = false;
+    int i = meta_search(fid, &found);
+    if (!found) {
+        return 0;
+    }
+    const file_t ef = { .fid = EF_META_RECORD, .data = meta_records[i].data };
+    if (out) {
+        *out = file_get_data(&ef) + 2;
+    }
+    return file_get_size(&ef) - 2;
+}
+int meta_delete(uint16_t fid) {
+    bool found = false;
+    int i = meta_search(fid, &found);
+    if (!found) {
+        return CCID_OK;
+    }
+    file_t ef = { .fid = EF_META_RECORD, .data = meta_records[i].data };
+    flash_clear_file(&ef);
+    memmove(&meta_records[i], &meta_records[i + 1],
+            (meta_records_len - i - 1) * sizeof(meta_record_t));
+    meta_records_len--;
+    low_flash_available();
     return CCID_OK;
 }
 int meta_add(uint16_t fid, const uint8_t *data, uint16_t len) {
-    int r;
+    bool found = false;
+    int i = meta_search(fid, &found);
+    if (!found && meta_records_len == MAX_META_RECORDS) {
+        return CCID_ERR_NO_MEMORY;
+    }
+    file_t ef = { .fid = EF_META_RECORD, .data = found ? meta_records[i].data : NULL };
+    uint8_t *fdata = (uint8_t *) arena_alloc(len + 2);
+    if (!fdata) {
+        return CCID_ERR_MEMORY_FATAL;
+    }
+    fdata[0] = fid >> 8;
+    fdata[1] = fid & 0xff;
+    memcpy(fdata + 2, data, len);
+    int r = flash_write_data_to_file(&ef, fdata, len + 2);
+    arena_free(fdata);
+    if (r != CCID_OK) {
+        return CCID_EXEC_ERROR;
+    }
+    return meta_index(fid, ef.data);
+}
+
+/* Moves the metadata of the former single EF_META blob to per-FID records */
+static void meta_migrate() {
     file_t *ef = search_by_fid(EF_META, NULL, SPECIFY_EF);
-    if (!ef) {
-        return CCID_ERR_FILE_NOT_FOUND;
+    if (!file_has_data(ef)) {
+        return;
     }
-    uint16_t ef_size = file_get_size(ef);
-    uint8_t *fdata = (uint8_t *) calloc(1, ef_size);
-    memcpy(fdata, file_get_data(ef), ef_size);
-    uint16_t tag = 0x0;
-    uint8_t *tag_data = NULL, *p = NULL;
+    uint16_t tag = 0x0, data_len = file_get_size(ef);
+    uint8_t *tag_data = NULL, *p = NULL, *data = (uint8_t *) arena_alloc(data_len);
     size_t tag_len = 0;
-    while (walk_tlv(fdata, ef_size, &p, &tag, &tag_len, &tag_data)) {
-        if (tag_len < 2) {
-            continue;
-        }
-        uint16_t cfid = (tag_data[0] << 8 | tag_data[1]);
-        if (cfid == fid) {
-            if (tag_len - 2 == len) { //an update
-                memcpy(p - tag_len + 2, data, len);
-                r = flash_write_data_to_file(ef, fdata, ef_size);
-                free(fdata);
-                if (r != CCID_OK) {
-                    return CCID_EXEC_ERROR;
-                }
-                return CCID_OK;
-            }
-            else {   //needs reallocation
-                uint8_t *tpos = p - asn1_len_tag(tag, tag_len);
-                memmove(tpos, p, fdata + ef_size - p);
-                tpos += fdata + ef_size - p;
-                volatile uintptr_t meta_offset = tpos - fdata;
-                ef_size += len - (tag_len - 2);
-                if (len > tag_len - 2) {
-                    uint8_t *fdata_new = (uint8_t *) realloc(fdata, ef_size);
-                    if (fdata_new != NULL) {
-                        fdata = fdata_new;
-                    }
-                    else {
-                        free(fdata);
-                        return CCID_ERR_MEMORY_FATAL;
-                    }
-                }
-                uint8_t *f = fdata + meta_offset;
-                *f++ = fid & 0xff;
-                f += format_tlv_len(len + 2, f);
-                *f++ = fid >> 8;
-                *f++ = fid & 0xff;
-                memcpy(f, data, len);
-                r = flash_write_data_to_file(ef, fdata, ef_size);
-                free(fdata);
-                if (r != CCID_OK) {
-                    return CCID_EXEC_ERROR;
-                }
-                return CCID_OK;
-            }
-        }
+    if (!data) {
+        return;
     }
-    fdata = (uint8_t *) realloc(fdata, ef_size + asn1_len_tag(fid & 0x1f, len + 2));
-    uint8_t *f = fdata + ef_size;
-    *f++ = fid & 0x1f;
-    f += format_tlv_len(len + 2, f);
-    *f++ = fid >> 8;
-    *f++ = fid & 0xff;
-    memcpy(f, data, len);
-    r = flash_write_data_to_file(ef, fdata, ef_size + asn1_len_tag(fid & 0x1f, len + 2));
-    free(fdata);
-    if (r != CCID_OK) {
-        return CCID_EXEC_ERROR;
+    memcpy(data, file_get_data(ef), data_len);
+    while (walk_tlv(data, data_len, &p, &tag, &tag_len, &tag_data)) {
+        if (tag_len >= 2) {
+            meta_add(tag_data[0] << 8 | tag_data[1], tag_data + 2, tag_len - 2);
+        }
     }
-    return CCID_OK;
+    arena_free(data);
+    flash_clear_file(ef);
+    low_flash_available();
 }
 
 bool file_has_data(file_t *f) {
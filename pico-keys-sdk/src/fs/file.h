@@ -65,6 +65,8 @@
 #define EF_DODFS    0x6044
 #define EF_SKDFS    0x6045
 #define EF_META     0xE010
+#define EF_FLASH_WEAR 0xE011
+#define EF_META_RECORD 0xE012
 
 #define MAX_DEPTH 4
 
@@ -100,6 +102,7 @@ extern file_t *search_by_path(const uint8_t *pe_path, uint8_t pathlen, const fil
 extern bool authenticate_action(const file_t *ef, uint8_t op);
 extern void process_fci(const file_t *pe, int fmd);
 extern void scan_flash();
+extern bool (*scan_file_cb)(uint16_t fid, uint8_t *data);
 extern void initialize_flash(bool);
 
 extern file_t file_entries[];
@@ -124,4 +127,24 @@ extern int meta_delete(uint16_t fid);
 extern int meta_add(uint16_t fid, const uint8_t *data, uint16_t len);
 extern int delete_file(file_t *ef);
 
+typedef struct flash_stats {
+    uint32_t total;         // Bytes of the data pool
+    uint32_t used;          // Bytes taken by files, headers included
+    uint32_t free;
+    uint32_t fragmented;    // Free bytes in holes between files
+    uint32_t largest_free;  // Largest contiguous free extent
+    uint16_t files;
+    uint16_t alloc_failures;
+    uint32_t erase_total;
+    uint16_t erase_max;     // Erases of the most worn slot
+    uint16_t erase_slots;
+    uint16_t slot_sectors;  // Sectors accounted in each slot
+} flash_stats_t;
+
+extern void flash_get_stats(flash_stats_t *st);
+extern uint32_t flash_pool_changes();
+extern const uint16_t *flash_wear_counters(uint16_t *slots, uint16_t *slot_sectors);
+extern void flash_wear_load();
+extern void flash_wear_task();
+
 #endif
@@ -18,6 +18,7 @@
 
 #include <stdint.h>
 #include <string.h>
+#include <stdlib.h>
 
 #ifndef ENABLE_EMULATION
 #include "pico/stdlib.h"
@@ -41,10 +42,14 @@
 #define FLASH_TARGET_OFFSET (PICO_FLASH_SIZE_BYTES >> 1) // DATA starts at the mid of flash
 #define FLASH_DATA_HEADER_SIZE (sizeof(uintptr_t) + sizeof(uint32_t))
 #define FLASH_PERMANENT_REGION (4 * FLASH_SECTOR_SIZE) // 4 sectors (16kb) of permanent memory
+#define FLASH_JOURNAL_REGION (5 * FLASH_SECTOR_SIZE) // Journal of low_flash, header and 4 page images
+#define FLASH_ASSET_REGION (4 * FLASH_SECTOR_SIZE) // Two banks of read-only assets, right below the journal
 
 //To avoid possible future allocations, data region starts at the end of flash and goes upwards to the center region
 
-const uintptr_t start_data_pool = (XIP_BASE + FLASH_TARGET_OFFSET);
+const uintptr_t start_asset_pool = (XIP_BASE + FLASH_TARGET_OFFSET - FLASH_ASSET_REGION);
+const uintptr_t start_journal_pool = (XIP_BASE + FLASH_TARGET_OFFSET);
+const uintptr_t start_data_pool = (XIP_BASE + FLASH_TARGET_OFFSET + FLASH_JOURNAL_REGION); // See flash_migrate_pool()
 const uintptr_t end_data_pool = (XIP_BASE + PICO_FLASH_SIZE_BYTES) - FLASH_DATA_HEADER_SIZE -
                                 FLASH_PERMANENT_REGION - FLASH_DATA_HEADER_SIZE - 4;                                                           //This is a fixed value. DO NOT CHANGE
 const uintptr_t end_rom_pool = (XIP_BASE + PICO_FLASH_SIZE_BYTES) - FLASH_DATA_HEADER_SIZE - 4; //This is a fixed value. DO NOT CHANGE
@@ -59,6 +64,16 @@ extern uint16_t flash_read_uint16(uintptr_t addr);
 extern uint8_t *flash_read(uintptr_t addr);
 
 extern void low_flash_available();
+extern void flash_wear_restore(const uint8_t *data, uint16_t len);
+extern uint16_t flash_wear_due();
+extern void flash_wear_persisted(uint16_t erases);
+
+static uint16_t alloc_failures = 0;
+static uint32_t pool_changes = 0; // Bumped whenever the space taken by the files may change
+
+uint32_t flash_pool_changes() {
+    return pool_changes;
+}
 
 uintptr_t allocate_free_addr(uint16_t size, bool persistent) {
     if (size > FLASH_SECTOR_SIZE) {
@@ -113,10 +128,107 @@ uintptr_t allocate_free_addr(uint16_t size, bool persistent) {
     return 0x0; //probably never reached
 }
 
+/* Firmwares older than the journal started the data pool at the mid of the flash. The records they
+ * left in the region now taken by the journal are the tail of the chain. The tail is copied to RAM,
+ * since the journal may overwrite it as soon as the first group is flushed, and every record is
+ * given a place below the last record above start_data_pool before anything is written. The
+ * copies are chained among themselves and only once all of them are programmed the last record
+ * is pointed to them, which cuts the old tail. If anything fails, the chain is left as it was and
+ * the journal is held off, so the old tail survives until a later scan moves it. */
+int flash_migrate_pool() {
+    uintptr_t last = end_data_pool, tail = flash_read_uintptr(end_data_pool);
+    while (tail >= start_data_pool) {
+        last = tail;
+        tail = flash_read_uintptr(tail);
+    }
+    if (tail == 0x0 || tail < start_journal_pool) {
+        low_flash_journal_hold(false);
+        return CCID_OK;
+    }
+    printf("Moving records out of the journal region\r\n");
+    low_flash_journal_hold(true);
+    size_t tail_len = start_data_pool - tail;
+    uint16_t n = 0;
+    for (uintptr_t base = tail, next = 0x0; base >= tail && base < start_data_pool; base = next) {
+        next = flash_read_uintptr(base);
+        n++;
+        if (next >= base) { // Records go down the flash, anything else is not a chain
+            break;
+        }
+    }
+    uint8_t *copy = (uint8_t *) malloc(tail_len);
+    uintptr_t *dst = (uintptr_t *) calloc(n, sizeof(uintptr_t));
+    if (!copy || !dst) {
+        free(copy);
+        free(dst);
+        return CCID_ERR_MEMORY_FATAL;
+    }
+    memcpy(copy, flash_read(tail), tail_len);
+    int ret = CCID_OK;
+    // Places, as allocate_free_addr() would give them at the end of the chain
+    uintptr_t end = last, base = tail;
+    for (uint16_t i = 0; i < n && ret == CCID_OK; i++) {
+        const uint8_t *rec = copy + (base - tail);
+        uint16_t len = 0;
+        memcpy(&len, rec + 2 * sizeof(uintptr_t) + sizeof(uint16_t), sizeof(uint16_t));
+        size_t real_size = 2 * sizeof(uintptr_t) + 2 * sizeof(uint16_t) + len;
+        uintptr_t addr_alg = end & -FLASH_SECTOR_SIZE;
+        if (base + real_size > start_data_pool || len > FLASH_SECTOR_SIZE) {
+            ret = CCID_ERR_MEMORY_FATAL;
+        }
+        else if (addr_alg <= end - real_size) {
+            end = dst[i] = end - real_size;
+        }
+        else if (addr_alg - FLASH_SECTOR_SIZE >= start_data_pool) {
+            end = dst[i] = addr_alg - real_size;
+        }
+        else {
+            printf("ERROR: no room to move the records out of the journal region\r\n");
+            ret = CCID_ERR_NO_MEMORY;
+        }
+        memcpy(&base, rec, sizeof(uintptr_t));
+    }
+    low_flash_txn_begin();
+    base = tail;
+    for (uint16_t i = 0; i < n && ret == CCID_OK; i++) {
+        const uint8_t *rec = copy + (base - tail);
+        uint16_t fid = 0, len = 0;
+        memcpy(&fid, rec + 2 * sizeof(uintptr_t), sizeof(uint16_t));
+        memcpy(&len, rec + 2 * sizeof(uintptr_t) + sizeof(uint16_t), sizeof(uint16_t));
+        uintptr_t data = dst[i] + 2 * sizeof(uintptr_t) + sizeof(uint16_t);
+        if ((ret = flash_program_uintptr(dst[i], i + 1 < n ? dst[i + 1] : 0x0)) != CCID_OK ||
+            (ret = flash_program_uintptr(dst[i] + sizeof(uintptr_t),
+                                         i > 0 ? dst[i - 1] : last)) != CCID_OK ||
+            (ret = flash_program_halfword(dst[i] + 2 * sizeof(uintptr_t), fid)) != CCID_OK ||
+            (ret = flash_program_halfword(data, len)) != CCID_OK) {
+            break;
+        }
+        if (len > 0) {
+            ret = flash_program_block(data + sizeof(uint16_t),
+                                      rec + 2 * sizeof(uintptr_t) + 2 * sizeof(uint16_t), len);
+        }
+        memcpy(&base, rec, sizeof(uintptr_t));
+    }
+    if (ret == CCID_OK) {
+        ret = flash_program_uintptr(last, dst[0]);
+    }
+    low_flash_txn_commit();
+    if (ret == CCID_OK) {
+        low_flash_journal_hold(false);
+    }
+    else {
+        printf("ERROR: records left in the journal region (%d), journal held\r\n", ret);
+    }
+    free(dst);
+    free(copy);
+    return ret;
+}
+
 int flash_clear_file(file_t *file) {
     if (file == NULL || file->data == NULL) {
         return CCID_OK;
     }
+    pool_changes++;
     uintptr_t base_addr =
         (uintptr_t)(file->data - sizeof(uintptr_t) - sizeof(uint16_t) - sizeof(uintptr_t));
     uintptr_t prev_addr = flash_read_uintptr(base_addr + sizeof(uintptr_t));
@@ -144,6 +256,7 @@ int flash_write_data_to_file_offset(file_t *file, const uint8_t *data, uint16_t
     if (offset + len > FLASH_SECTOR_SIZE || offset > size_file_flash) {
         return CCID_ERR_NO_MEMORY;
     }
+    pool_changes++;
     if (file->data) { //already in flash
         if (offset + len <= size_file_flash) { //it fits, no need to move it
             flash_program_halfword((uintptr_t) file->data, offset + len);
@@ -153,20 +266,28 @@ int flash_write_data_to_file_offset(file_t *file, const uint8_t *data, uint16_t
             return CCID_OK;
         }
         else {   //we clear the old file
-            flash_clear_file(file);
             if (offset > 0) {
-                old_data = (uint8_t *) calloc(1, offset + len);
+                old_data = (uint8_t *) arena_alloc(offset + len);
+                if (!old_data) {
+                    return CCID_ERR_MEMORY_FATAL;
+                }
                 memcpy(old_data, flash_read((uintptr_t) (file->data + sizeof(uint16_t))), offset);
-                memcpy(old_data + offset, data, len);
+                if (data) {
+                    memcpy(old_data + offset, data, len);
+                }
                 len = offset + len;
                 data = old_data;
             }
+            flash_clear_file(file);
         }
     }
 
     uintptr_t new_addr = allocate_free_addr(len, (file->type & FILE_PERSISTENT) == FILE_PERSISTENT);
     //printf("na %x\r\n",new_addr);
     if (new_addr == 0x0) {
+        if (alloc_failures < UINT16_MAX) {
+            alloc_failures++;
+        }
         return CCID_ERR_NO_MEMORY;
     }
     file->data = (uint8_t *) new_addr + sizeof(uintptr_t) + sizeof(uint16_t) + sizeof(uintptr_t); //next addr+fid+prev addr
@@ -176,10 +297,72 @@ int flash_write_data_to_file_offset(file_t *file, const uint8_t *data, uint16_t
         flash_program_block((uintptr_t) file->data + sizeof(uint16_t), data, len);
     }
     if (old_data) {
-        free(old_data);
+        arena_free(old_data);
     }
     return CCID_OK;
 }
 int flash_write_data_to_file(file_t *file, const uint8_t *data, uint16_t len) {
     return flash_write_data_to_file_offset(file, data, len, 0);
 }
+
+void flash_get_stats(flash_stats_t *st) {
+    memset(st, 0, sizeof(flash_stats_t));
+    st->total = end_data_pool - start_data_pool;
+    uintptr_t top = end_data_pool;
+    for (uintptr_t base = flash_read_uintptr(end_data_pool); base >= start_data_pool && base != 0x0;
+         base = flash_read_uintptr(base)) {
+        uint32_t size = 2 * sizeof(uintptr_t) + 2 * sizeof(uint16_t) +
+                        flash_read_uint16(base + 2 * sizeof(uintptr_t) + sizeof(uint16_t));
+        if (top > base + size) {
+            uint32_t gap = top - (base + size);
+            st->fragmented += gap;
+            if (gap > st->largest_free) {
+                st->largest_free = gap;
+            }
+        }
+        st->used += size;
+        st->files++;
+        top = base;
+    }
+    if (top - start_data_pool > st->largest_free) {
+        st->largest_free = top - start_data_pool;
+    }
+    st->free = st->total - st->used;
+    st->alloc_failures = alloc_failures;
+
+    const uint16_t *wear = flash_wear_counters(&st->erase_slots, &st->slot_sectors);
+    for (int i = 0; i < st->erase_slots; i++) {
+        st->erase_total += wear[i];
+        if (wear[i] > st->erase_max) {
+            st->erase_max = wear[i];
+        }
+    }
+}
+
+void flash_wear_load() {
+    file_t *ef = search_dynamic_file(EF_FLASH_WEAR);
+    if (file_has_data(ef)) {
+        flash_wear_restore(file_get_data(ef), file_get_size(ef));
+    }
+}
+
+int flash_wear_save() {
+    file_t *ef = file_new(EF_FLASH_WEAR);
+    if (!ef) {
+        return CCID_ERR_NO_MEMORY;
+    }
+    uint16_t slots = 0;
+    const uint16_t *wear = flash_wear_counters(&slots, NULL);
+    return flash_write_data_to_file(ef, (const uint8_t *) wear, slots * sizeof(uint16_t));
+}
+
+/* Called by the card thread once a command has been answered, so the write never lands inside a
+ * transaction of the command. The counters only change in do_flash(), under the flash mutex, and
+ * they are copied to the page cache under the same mutex. */
+void flash_wear_task() {
+    uint16_t erases = flash_wear_due();
+    if (erases > 0 && flash_wear_save() == CCID_OK) {
+        flash_wear_persisted(erases);
+        low_flash_available();
+    }
+}
@@ -17,6 +17,7 @@
 
 
 #include <stdint.h>
+#include <stddef.h>
 #include <stdlib.h>
 #include <stdio.h>
 
@@ -37,10 +38,13 @@ int fd_map = 0;
 uint8_t *map = NULL;
 #endif
 #include "pico_keys.h"
+#include "telemetry.h"
 #include <string.h>
 
 #define TOTAL_FLASH_PAGES 4
 
+extern const uintptr_t start_asset_pool;
+extern const uintptr_t start_journal_pool;
 extern const uintptr_t start_data_pool;
 extern const uintptr_t end_rom_pool;
 
@@ -69,58 +73,200 @@ static uint8_t ready_pages = 0;
 
 bool flash_available = false;
 
+/* Erase counters of the upper half of the flash (journal, data and rom pools). Large flashes are
+ * accounted in slots of several sectors to keep the counters within a single file. */
+#define FLASH_WEAR_SECTORS      ((PICO_FLASH_SIZE_BYTES >> 1) / FLASH_SECTOR_SIZE)
+#if FLASH_WEAR_SECTORS > 1024
+#define FLASH_WEAR_SLOTS        1024
+#else
+#define FLASH_WEAR_SLOTS        FLASH_WEAR_SECTORS
+#endif
+#define FLASH_WEAR_SLOT_SECTORS ((FLASH_WEAR_SECTORS + FLASH_WEAR_SLOTS - 1) / FLASH_WEAR_SLOTS)
+#define FLASH_WEAR_PERSIST      16 // Erases accumulated before the counters are written back
+
+static uint16_t flash_wear[FLASH_WEAR_SLOTS];
+static uint16_t flash_wear_pending = 0;
+
+static void flash_wear_account(uintptr_t addr, size_t sectors) {
+    for (size_t s = 0; s < sectors; s++, addr += FLASH_SECTOR_SIZE) {
+        if (addr < start_journal_pool) {
+            continue;
+        }
+        size_t slot = (addr - start_journal_pool) / FLASH_SECTOR_SIZE / FLASH_WEAR_SLOT_SECTORS;
+        if (slot < FLASH_WEAR_SLOTS && flash_wear[slot] < UINT16_MAX) {
+            flash_wear[slot]++;
+        }
+        if (flash_wear_pending < UINT16_MAX) {
+            flash_wear_pending++;
+        }
+    }
+}
+
+const uint16_t *flash_wear_counters(uint16_t *slots, uint16_t *slot_sectors) {
+    if (slots) {
+        *slots = FLASH_WEAR_SLOTS;
+    }
+    if (slot_sectors) {
+        *slot_sectors = FLASH_WEAR_SLOT_SECTORS;
+    }
+    return flash_wear;
+}
+
+void flash_wear_restore(const uint8_t *data, uint16_t len) {
+    memset(flash_wear, 0, sizeof(flash_wear));
+    memcpy(flash_wear, data, MIN(len, sizeof(flash_wear)));
+    flash_wear_pending = 0;
+}
+
+
+#ifndef ENABLE_EMULATION
+static void low_flash_erase(uintptr_t addr, size_t size) {
+    while (multicore_lockout_start_timeout_us(1000) == false) {
+        ;
+    }
+    uint32_t ints = save_and_disable_interrupts();
+    flash_range_erase(addr - XIP_BASE, size);
+    restore_interrupts(ints);
+    while (multicore_lockout_end_timeout_us(1000) == false) {
+        ;
+    }
+}
+
+static void low_flash_program(uintptr_t addr, const uint8_t *data, size_t len) {
+    while (multicore_lockout_start_timeout_us(1000) == false) {
+        ;
+    }
+    uint32_t ints = save_and_disable_interrupts();
+    flash_range_erase(addr - XIP_BASE, FLASH_SECTOR_SIZE);
+    flash_range_program(addr - XIP_BASE, data, len);
+    restore_interrupts(ints);
+    while (multicore_lockout_end_timeout_us(1000) == false) {
+        ;
+    }
+}
+#else
+static void low_flash_erase(uintptr_t addr, size_t size) {
+    memset(map + addr, 0, size);
+}
+
+static void low_flash_program(uintptr_t addr, const uint8_t *data, size_t len) {
+    memset(map + addr, 0, FLASH_SECTOR_SIZE);
+    memcpy(map + addr, data, len);
+}
+#endif
+
+static const uint8_t *low_flash_ptr(uintptr_t addr) {
+#ifndef ENABLE_EMULATION
+    return (const uint8_t *) addr;
+#else
+    return map + addr;
+#endif
+}
+
+static size_t page_erase_size(const page_flash_t *p) {
+    return p->page_size ? (p->page_size / FLASH_SECTOR_SIZE) * FLASH_SECTOR_SIZE : FLASH_SECTOR_SIZE;
+}
+
+/* Intent journal. Pages cached inside a transaction are flushed as a group: when the group
+ * spans more than one sector, the images are written to the journal first, then the header
+ * that validates them, and only then the sectors in place. scan_flash() replays a complete
+ * journal and discards an incomplete one, so every sector of the group ends either in its old
+ * or in its new state. */
+#define FLASH_JOURNAL_MAGIC     0x4A524E4C
+#define FLASH_JOURNAL_SECTORS   (TOTAL_FLASH_PAGES + 1) // Header and one image per cached page
+#define FLASH_JOURNAL_HEADER    256 // Smallest programmable unit
+
+typedef struct flash_journal {
+    uint32_t magic;
+    uint32_t entries;
+    struct {
+        uint32_t address;
+        uint32_t erase_size; // 0 when the sector image follows in the journal
+    } entry[TOTAL_FLASH_PAGES];
+    uint32_t crc; // Of the header up to here and the images
+} flash_journal_t;
+
+static uint8_t txn_depth = 0;
+static bool txn_pages = false;      // Pages were modified inside a transaction
+static bool txn_flush = false;      // The cache is full inside a transaction and must be flushed
+static bool journal_stale = false;  // A journal was found by scan_flash() and must be cleared
+static bool journal_held = false;   // Records still live in the journal region
+
+uint32_t flash_crc32(uint32_t crc, const uint8_t *data, size_t len) {
+    crc = ~crc;
+    while (len--) {
+        crc ^= *data++;
+        for (int k = 0; k < 8; k++) {
+            crc = (crc >> 1) ^ (0xEDB88320 & -(crc & 1));
+        }
+    }
+    return ~crc;
+}
+
+static void low_flash_journal_write() {
+    uint8_t header[FLASH_JOURNAL_HEADER];
+    flash_journal_t *jr = (flash_journal_t *) header;
+    uintptr_t image = start_journal_pool + FLASH_SECTOR_SIZE;
+    memset(header, 0, sizeof(header));
+    for (int r = 0; r < TOTAL_FLASH_PAGES; r++) {
+        if (flash_pages[r].ready == true) {
+            jr->entry[jr->entries].address = (uint32_t) flash_pages[r].address;
+            jr->entry[jr->entries++].erase_size = 0;
+            low_flash_program(image, flash_pages[r].page, FLASH_SECTOR_SIZE);
+            flash_wear_account(image, 1);
+            image += FLASH_SECTOR_SIZE;
+        }
+        else if (flash_pages[r].erase == true) {
+            jr->entry[jr->entries].address = (uint32_t) flash_pages[r].address;
+            jr->entry[jr->entries++].erase_size = (uint32_t) page_erase_size(&flash_pages[r]);
+        }
+    }
+    jr->magic = FLASH_JOURNAL_MAGIC;
+    jr->crc = flash_crc32(0, header, offsetof(flash_journal_t, crc));
+    for (int r = 0; r < TOTAL_FLASH_PAGES; r++) {
+        if (flash_pages[r].ready == true) {
+            jr->crc = flash_crc32(jr->crc, flash_pages[r].page, FLASH_SECTOR_SIZE);
+        }
+    }
+    low_flash_program(start_journal_pool, header, sizeof(header));
+    flash_wear_account(start_journal_pool, 1);
+}
 
 //this function has to be called from the core 0
 void do_flash() {
 #ifndef ENABLE_EMULATION
     if (mutex_try_enter(&mtx_flash, NULL) == true) {
 #endif
-    if (locked_out == true && flash_available == true && ready_pages > 0) {
+    if (locked_out == true && flash_available == true && (ready_pages > 0 || journal_stale) &&
+        (txn_depth == 0 || txn_flush == true)) {
         //printf(" DO_FLASH AVAILABLE\r\n");
+        bool journal = txn_pages == true && ready_pages > 1 && journal_held == false;
+        if (journal) {
+            low_flash_journal_write();
+        }
         for (int r = 0; r < TOTAL_FLASH_PAGES; r++) {
             if (flash_pages[r].ready == true) {
-#ifndef ENABLE_EMULATION
-                //printf("WRITTING %X\r\n",flash_pages[r].address-XIP_BASE);
-                while (multicore_lockout_start_timeout_us(1000) == false) {
-                    ;
-                }
                 //printf("WRITTING %X\r\n",flash_pages[r].address-XIP_BASE);
-                uint32_t ints = save_and_disable_interrupts();
-                flash_range_erase(flash_pages[r].address - XIP_BASE, FLASH_SECTOR_SIZE);
-                flash_range_program(flash_pages[r].address - XIP_BASE,
-                                    flash_pages[r].page,
-                                    FLASH_SECTOR_SIZE);
-                restore_interrupts(ints);
-                while (multicore_lockout_end_timeout_us(1000) == false) {
-                    ;
-                }
-                //printf("WRITEN %X !\r\n",flash_pages[r].address);
-#else
-                memcpy(map + flash_pages[r].address, flash_pages[r].page, FLASH_SECTOR_SIZE);
-#endif
+                low_flash_program(flash_pages[r].address, flash_pages[r].page, FLASH_SECTOR_SIZE);
+                flash_wear_account(flash_pages[r].address, 1);
                 flash_pages[r].ready = false;
                 ready_pages--;
             }
             else if (flash_pages[r].erase == true) {
-#ifndef ENABLE_EMULATION
-                while (multicore_lockout_start_timeout_us(1000) == false) {
-                    ;
-                }
-                //printf("WRITTING\r\n");
-                flash_range_erase(flash_pages[r].address - XIP_BASE,
-                                  flash_pages[r].page_size ? ((int) (flash_pages[r].page_size /
-                                                                     FLASH_SECTOR_SIZE)) *
-                                  FLASH_SECTOR_SIZE : FLASH_SECTOR_SIZE);
-                while (multicore_lockout_end_timeout_us(1000) == false) {
-                    ;
-                }
-#else
-                memset(map + flash_pages[r].address, 0, FLASH_SECTOR_SIZE);
-#endif
+                low_flash_erase(flash_pages[r].address, page_erase_size(&flash_pages[r]));
+                flash_wear_account(flash_pages[r].address,
+                                   page_erase_size(&flash_pages[r]) / FLASH_SECTOR_SIZE);
                 flash_pages[r].erase = false;
                 ready_pages--;
             }
         }
+        if (journal || journal_stale) {
+            low_flash_erase(start_journal_pool, FLASH_SECTOR_SIZE);
+            flash_wear_account(start_journal_pool, 1);
+            journal_stale = false;
+        }
+        txn_pages = false;
+        txn_flush = false;
 #ifdef ENABLE_EMULATION
         msync(map, PICO_FLASH_SIZE_BYTES, MS_SYNC);
 #endif
@@ -143,7 +289,8 @@ void low_flash_init() {
     mutex_init(&mtx_flash);
     sem_init(&sem_wait, 0, 1);
 #else
-    fd_map = open("memory.flash", O_RDWR | O_CREAT, (mode_t) 0600);
+    const char *flash_file = getenv("PICO_KEYS_FLASH_FILE");
+    fd_map = open(flash_file ? flash_file : "memory.flash", O_RDWR | O_CREAT, (mode_t) 0600);
     lseek(fd_map, PICO_FLASH_SIZE_BYTES - 1, SEEK_SET);
     write(fd_map, "", 1);
     map = mmap(0, PICO_FLASH_SIZE_BYTES, PROT_READ | PROT_WRITE, MAP_SHARED, fd_map, 0);
@@ -179,6 +326,137 @@ void low_flash_available() {
 #endif
 }
 
+/* Erases accounted since the counters were last written back, or 0 while they are fewer than
+ * FLASH_WEAR_PERSIST. */
+uint16_t flash_wear_due() {
+#ifndef ENABLE_EMULATION
+    mutex_enter_blocking(&mtx_flash);
+#endif
+    uint16_t erases = flash_wear_pending >= FLASH_WEAR_PERSIST ? flash_wear_pending : 0;
+#ifndef ENABLE_EMULATION
+    mutex_exit(&mtx_flash);
+#endif
+    return erases;
+}
+
+void flash_wear_persisted(uint16_t erases) {
+#ifndef ENABLE_EMULATION
+    mutex_enter_blocking(&mtx_flash);
+#endif
+    flash_wear_pending -= MIN(erases, flash_wear_pending);
+#ifndef ENABLE_EMULATION
+    mutex_exit(&mtx_flash);
+#endif
+}
+
+void low_flash_txn_begin() {
+#ifndef ENABLE_EMULATION
+    mutex_enter_blocking(&mtx_flash);
+#endif
+    txn_depth++;
+#ifndef ENABLE_EMULATION
+    mutex_exit(&mtx_flash);
+#endif
+}
+
+void low_flash_txn_commit() {
+#ifndef ENABLE_EMULATION
+    mutex_enter_blocking(&mtx_flash);
+#endif
+    if (txn_depth > 0) {
+        txn_depth--;
+    }
+    bool outer = txn_depth == 0;
+#ifndef ENABLE_EMULATION
+    mutex_exit(&mtx_flash);
+#endif
+    if (outer) {
+        low_flash_available();
+    }
+}
+
+/* Groups are written in place, without the journal, while flash_migrate_pool() could not move the
+ * records out of its region yet. */
+void low_flash_journal_hold(bool hold) {
+#ifndef ENABLE_EMULATION
+    mutex_enter_blocking(&mtx_flash);
+#endif
+    journal_held = hold;
+#ifndef ENABLE_EMULATION
+    mutex_exit(&mtx_flash);
+#endif
+}
+
+/* Called by core0 before resetting core1, which may be killed inside a transaction. The pages it
+ * cached stay and are written by the next do_flash(), as if it had committed. */
+void low_flash_txn_reset() {
+#ifndef ENABLE_EMULATION
+    mutex_enter_blocking(&mtx_flash);
+#endif
+    bool open = txn_depth > 0;
+    txn_depth = 0;
+    txn_flush = false;
+    if (open) {
+        flash_available = true;
+    }
+#ifndef ENABLE_EMULATION
+    mutex_exit(&mtx_flash);
+#endif
+}
+
+page_flash_t *find_free_page(uintptr_t addr);
+
+/* Called from scan_flash(). A journal left behind by a power loss is rolled forward by loading
+ * its images into the page cache, so the next do_flash() writes them again. An incomplete one
+ * means that no sector was touched yet, and it is just discarded. */
+void low_flash_recover() {
+#ifndef ENABLE_EMULATION
+    mutex_enter_blocking(&mtx_flash);
+#endif
+    const flash_journal_t *jr = (const flash_journal_t *) low_flash_ptr(start_journal_pool);
+    if (jr->magic == FLASH_JOURNAL_MAGIC && journal_stale == false) {
+        bool valid = jr->entries <= TOTAL_FLASH_PAGES &&
+                     ready_pages + jr->entries <= TOTAL_FLASH_PAGES;
+        uint32_t crc = flash_crc32(0, (const uint8_t *) jr, offsetof(flash_journal_t, crc));
+        uintptr_t image = start_journal_pool + FLASH_SECTOR_SIZE;
+        for (uint32_t i = 0; valid && i < jr->entries; i++) {
+            if (jr->entry[i].erase_size == 0) {
+                crc = flash_crc32(crc, low_flash_ptr(image), FLASH_SECTOR_SIZE);
+                image += FLASH_SECTOR_SIZE;
+            }
+        }
+        if (valid && crc == jr->crc) {
+            printf("Flash journal found, rolling forward %u sectors\r\n", (unsigned int) jr->entries);
+            image = start_journal_pool + FLASH_SECTOR_SIZE;
+            for (uint32_t i = 0; i < jr->entries; i++) {
+                page_flash_t *p = find_free_page(jr->entry[i].address);
+                if (!p) {
+                    break;
+                }
+                if (jr->entry[i].erase_size == 0) {
+                    memcpy(p->page, low_flash_ptr(image), FLASH_SECTOR_SIZE);
+                    p->ready = true;
+                    p->erase = false;
+                    image += FLASH_SECTOR_SIZE;
+                }
+                else {
+                    p->erase = true;
+                    p->ready = false;
+                    p->page_size = jr->entry[i].erase_size;
+                }
+            }
+        }
+        else {
+            printf("Incomplete flash journal discarded\r\n");
+        }
+        journal_stale = true;
+        flash_available = true;
+    }
+#ifndef ENABLE_EMULATION
+    mutex_exit(&mtx_flash);
+#endif
+}
+
 page_flash_t *find_free_page(uintptr_t addr) {
     uintptr_t addr_alg = addr & -FLASH_SECTOR_SIZE;
     page_flash_t *p = NULL;
@@ -186,12 +464,13 @@ page_flash_t *find_free_page(uintptr_t addr) {
         if ((!flash_pages[r].ready && !flash_pages[r].erase) ||
             flash_pages[r].address == addr_alg) {                                                   //first available
             p = &flash_pages[r];
+            TELEMETRY_FLASH_CACHE(true, flash_pages[r].address == addr_alg && (flash_pages[r].ready || flash_pages[r].erase));
             if (!flash_pages[r].ready && !flash_pages[r].erase) {
 #ifndef ENABLE_EMULATION
                 memcpy(p->page, (uint8_t *) addr_alg, FLASH_SECTOR_SIZE);
 #else
                 memcpy(p->page,
-                       (addr >= start_data_pool &&
+                       (addr >= start_asset_pool &&
                         addr <= end_rom_pool) ? (uint8_t *) (map + addr_alg) : (uint8_t *) addr_alg,
                        FLASH_SECTOR_SIZE);
 #endif
@@ -205,6 +484,39 @@ page_flash_t *find_free_page(uintptr_t addr) {
     return NULL;
 }
 
+static bool page_cached(uintptr_t addr) {
+    uintptr_t addr_alg = addr & -FLASH_SECTOR_SIZE;
+    for (int r = 0; r < TOTAL_FLASH_PAGES; r++) {
+        if ((flash_pages[r].ready || flash_pages[r].erase) && flash_pages[r].address == addr_alg) {
+            return true;
+        }
+    }
+    return false;
+}
+
+/* A transaction that dirties more sectors than the cache holds is written back in groups instead
+ * of failing. Every group still goes through the journal, but the transaction as a whole is only
+ * atomic while it fits in the cache. Called with mtx_flash held. */
+static void low_flash_txn_flush() {
+    if (txn_depth == 0 || ready_pages < TOTAL_FLASH_PAGES) {
+        return;
+    }
+    txn_flush = true;
+    flash_available = true;
+#ifndef ENABLE_EMULATION
+    mutex_exit(&mtx_flash);
+    if (get_core_num() == 0) {
+        do_flash();
+    }
+    else {
+        wait_flash_finish();
+    }
+    mutex_enter_blocking(&mtx_flash);
+#else
+    do_flash();
+#endif
+}
+
 int flash_program_block(uintptr_t addr, const uint8_t *data, size_t len) {
     page_flash_t *p = NULL;
 
@@ -212,13 +524,18 @@ int flash_program_block(uintptr_t addr, const uint8_t *data, size_t len) {
         return CCID_ERR_NULL_PARAM;
     }
 
+    TELEMETRY_PHASE_START(t);
 #ifndef ENABLE_EMULATION
     mutex_enter_blocking(&mtx_flash);
 #endif
-    if (ready_pages == TOTAL_FLASH_PAGES) {
+    if (ready_pages == TOTAL_FLASH_PAGES && !page_cached(addr)) {
+        low_flash_txn_flush();
+    }
+    if (ready_pages == TOTAL_FLASH_PAGES && !page_cached(addr)) {
 #ifndef ENABLE_EMULATION
         mutex_exit(&mtx_flash);
 #endif
+        TELEMETRY_PHASE_END(TELEMETRY_PHASE_FLASH, t);
         printf("ERROR: ALL FLASH PAGES CACHED\r\n");
         return CCID_ERR_NO_MEMORY;
     }
@@ -226,14 +543,19 @@ int flash_program_block(uintptr_t addr, const uint8_t *data, size_t len) {
 #ifndef ENABLE_EMULATION
         mutex_exit(&mtx_flash);
 #endif
+        TELEMETRY_PHASE_END(TELEMETRY_PHASE_FLASH, t);
         printf("ERROR: FLASH CANNOT FIND A PAGE (rare error)\r\n");
         return CCID_ERR_MEMORY_FATAL;
     }
     memcpy(&p->page[addr & (FLASH_SECTOR_SIZE - 1)], data, len);
+    if (txn_depth > 0) {
+        txn_pages = true;
+    }
     //printf("Flash: modified page %X with data %x at [%x] (top page %X)\r\n",addr_alg,data,addr&(FLASH_SECTOR_SIZE-1),addr);
 #ifndef ENABLE_EMULATION
     mutex_exit(&mtx_flash);
 #endif
+    TELEMETRY_PHASE_END(TELEMETRY_PHASE_FLASH, t);
     return CCID_OK;
 }
 
@@ -251,6 +573,7 @@ int flash_program_uintptr(uintptr_t addr, uintptr_t data) {
 
 uint8_t *flash_read(uintptr_t addr) {
     uintptr_t addr_alg = addr & -FLASH_SECTOR_SIZE;
+    TELEMETRY_PHASE_START(t);
 #ifndef ENABLE_EMULATION
     mutex_enter_blocking(&mtx_flash);
 #endif
@@ -261,15 +584,19 @@ uint8_t *flash_read(uintptr_t addr) {
 #ifndef ENABLE_EMULATION
                 mutex_exit(&mtx_flash);
 #endif
+                TELEMETRY_FLASH_CACHE(false, true);
+                TELEMETRY_PHASE_END(TELEMETRY_PHASE_FLASH, t);
                 return v;
             }
         }
     }
     uint8_t *v = (uint8_t *) addr;
+    TELEMETRY_FLASH_CACHE(false, false);
+    TELEMETRY_PHASE_END(TELEMETRY_PHASE_FLASH, t);
 #ifndef ENABLE_EMULATION
     mutex_exit(&mtx_flash);
 #else
-    if (addr >= start_data_pool && addr <= end_rom_pool) {
+    if (addr >= start_asset_pool && addr <= end_rom_pool) {
         v += (uintptr_t) map;
     }
 #endif
@@ -302,7 +629,10 @@ int flash_erase_page(uintptr_t addr, size_t page_size) {
 #ifndef ENABLE_EMULATION
     mutex_enter_blocking(&mtx_flash);
 #endif
-    if (ready_pages == TOTAL_FLASH_PAGES) {
+    if (ready_pages == TOTAL_FLASH_PAGES && !page_cached(addr)) {
+        low_flash_txn_flush();
+    }
+    if (ready_pages == TOTAL_FLASH_PAGES && !page_cached(addr)) {
 #ifndef ENABLE_EMULATION
         mutex_exit(&mtx_flash);
 #endif
@@ -319,6 +649,9 @@ int flash_erase_page(uintptr_t addr, size_t page_size) {
     p->erase = true;
     p->ready = false;
     p->page_size = page_size;
+    if (txn_depth > 0) {
+        txn_pages = true;
+    }
 #ifndef ENABLE_EMULATION
     mutex_exit(&mtx_flash);
 #endif
@@ -44,6 +44,8 @@
 #endif
 
 #include "random.h"
+#include "crypto_utils.h"
+#include "crypto_jobs.h"
 #include "pico_keys.h"
 #include "apdu.h"
 #ifdef CYW43_WL_GPIO_LED_PIN
@@ -106,24 +108,33 @@ static inline void ws2812_program_init(PIO pio,
 extern void do_flash();
 extern void low_flash_init();
 
-app_t apps[4];
-uint8_t num_apps = 0;
+app_t *apps = NULL;
 
 app_t *current_app = NULL;
 
 const uint8_t *ccid_atr = NULL;
 
 int register_app(int (*select_aid)(app_t *), const uint8_t *aid) {
-    if (num_apps < sizeof(apps) / sizeof(app_t)) {
-        apps[num_apps].select_aid = select_aid;
-        apps[num_apps].aid = aid;
-        num_apps++;
-        return 1;
+    // Kept in registration order, which is also the order in which AIDs are matched
+    app_t **last = &apps;
+    while (*last) {
+        if ((*last)->aid == aid) {
+            return 1;
+        }
+        last = &(*last)->next;
     }
-    return 0;
+    app_t *app = (app_t *) calloc(1, sizeof(app_t));
+    if (!app) {
+        return 0;
+    }
+    app->select_aid = select_aid;
+    app->aid = aid;
+    *last = app;
+    return 1;
 }
 
 int (*button_pressed_cb)(uint8_t) = NULL;
+void (*idle_task_cb)() = NULL;
 
 static uint32_t blink_interval_ms = BLINK_NOT_MOUNTED;
 
@@ -280,8 +291,10 @@ void execute_tasks() {
     led_blinking_task();
 }
 
+#ifndef ENABLE_HARNESS
 int main(void) {
 #ifndef ENABLE_EMULATION
+    crypto_jobs_init();
     usb_init();
 
     board_init();
@@ -341,8 +354,16 @@ int main(void) {
                 button_pressed_time = button_press = 0;
             }
         }
+        if (idle_task_cb != NULL && !is_busy() && button_pressed_state == false) {
+            (*idle_task_cb)();
+        }
 #endif
+        // Jobs offloaded by the card thread go first, one step per loop so USB is not starved
+        if (!crypto_jobs_task() && !is_busy()) {
+            ecdsa_precompute_task();
+        }
     }
 
     return 0;
 }
+#endif
@@ -19,6 +19,7 @@
 #define _PICO_KEYS_H_
 
 #include "file.h"
+#include "arena.h"
 #ifndef ENABLE_EMULATION
 #include "pico/unique_id.h"
 #else
@@ -52,12 +53,17 @@ static inline void put_uint16_t(uint16_t n, uint8_t *b) {
 
 extern int flash_write_data_to_file(file_t *file, const uint8_t *data, uint16_t len);
 extern void low_flash_available();
+extern void low_flash_txn_begin();
+extern void low_flash_txn_commit();
+extern void low_flash_txn_reset();
+extern void low_flash_journal_hold(bool hold);
 extern int flash_clear_file(file_t *file);
 
 extern void timeout_stop();
 extern void timeout_start();
 
 extern int (*button_pressed_cb)(uint8_t);
+extern void (*idle_task_cb)();
 
 enum  {
     BLINK_NOT_MOUNTED = (250 << 16) | 250,
@@ -0,0 +1,187 @@
+/*
+ * This file is part of the Pico Keys SDK distribution (https://github.com/polhenarejos/pico-keys-sdk).
+ * Copyright (c) 2022 Pol Henarejos.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, version 3.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "telemetry.h"
+
+#ifdef ENABLE_TELEMETRY
+
+#include <string.h>
+#ifndef ENABLE_EMULATION
+#include "pico/stdlib.h"
+#include "pico/platform.h"
+#include <malloc.h>
+#else
+#include <time.h>
+#if !defined(__APPLE__)
+#include <malloc.h>
+#endif
+#endif
+
+telemetry_t telemetry = { 0 };
+
+/* Command in execution. It is only touched by the core running the card thread,
+ * except the transport counters, which are updated by the USB task while idle. */
+static struct {
+    bool active;
+    bool parsed;
+    uint8_t depth;
+    uint8_t type;
+    uint8_t code;
+    uint32_t start;
+    uint32_t heap_base;
+    uint32_t heap_max;
+    uint32_t phase_us[TELEMETRY_PHASES];
+} cur = { 0 };
+static telemetry_cmd_t *last = NULL;
+static uint32_t pending_rx = 0;
+
+uint32_t telemetry_now() {
+#ifndef ENABLE_EMULATION
+    return time_us_32();
+#else
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint32_t) (ts.tv_sec * 1000000 + ts.tv_nsec / 1000);
+#endif
+}
+
+static bool telemetry_core() {
+#ifndef ENABLE_EMULATION
+    return get_core_num() == 1;
+#else
+    return true;
+#endif
+}
+
+static uint32_t telemetry_heap_used() {
+#if defined(__GLIBC__) && (__GLIBC__ > 2 || (__GLIBC__ == 2 && __GLIBC_MINOR__ >= 33))
+    return (uint32_t) mallinfo2().uordblks;
+#elif !defined(__APPLE__)
+    return (uint32_t) mallinfo().uordblks;
+#else
+    return 0;
+#endif
+}
+
+static telemetry_cmd_t *telemetry_find(uint8_t type, uint8_t code) {
+    for (int i = 0; i < telemetry.num_cmds; i++) {
+        if (telemetry.cmds[i].type == type && telemetry.cmds[i].code == code) {
+            return &telemetry.cmds[i];
+        }
+    }
+    if (telemetry.num_cmds < TELEMETRY_MAX_CMDS) {
+        telemetry_cmd_t *tc = &telemetry.cmds[telemetry.num_cmds++];
+        tc->type = type;
+        tc->code = code;
+        return tc;
+    }
+    return NULL;
+}
+
+void telemetry_begin(uint8_t type, uint8_t code) {
+    memset(&cur, 0, sizeof(cur));
+    cur.type = type;
+    cur.code = code;
+    cur.phase_us[TELEMETRY_PHASE_TRANSPORT] = pending_rx;
+    pending_rx = 0;
+    cur.heap_base = cur.heap_max = telemetry_heap_used();
+    cur.start = telemetry_now();
+    cur.active = true;
+}
+
+void telemetry_end() {
+    if (!cur.active) {
+        return;
+    }
+    uint32_t elapsed = telemetry_now() - cur.start;
+    telemetry_heap_sample();
+    cur.active = false;
+    telemetry_cmd_t *tc = telemetry_find(cur.type, cur.code);
+    if (!tc) {
+        return;
+    }
+    uint8_t bin = 0;
+    while (bin < TELEMETRY_HIST_BINS - 1 && elapsed >= (1u << (bin + 8))) {
+        bin++;
+    }
+    if (tc->hist[bin] < UINT16_MAX) {
+        tc->hist[bin]++;
+    }
+    tc->count++;
+    tc->total_us += elapsed;
+    if (elapsed > tc->max_us) {
+        tc->max_us = elapsed;
+    }
+    for (int p = 0; p < TELEMETRY_PHASES; p++) {
+        tc->phase_us[p] += cur.phase_us[p];
+    }
+    uint32_t heap = cur.heap_max - cur.heap_base;
+    if (heap > tc->heap_peak) {
+        tc->heap_peak = heap;
+    }
+    if (heap > telemetry.heap_peak) {
+        telemetry.heap_peak = heap;
+    }
+    last = tc;
+}
+
+uint32_t telemetry_phase_begin() {
+    if (cur.active && telemetry_core()) {
+        cur.depth++;
+    }
+    return telemetry_now();
+}
+
+void telemetry_phase_end(uint8_t phase, uint32_t start) {
+    // Nested phases (i.e. flash reads while deriving a key) are accounted to the outer one
+    if (cur.active && telemetry_core() && cur.depth > 0 && --cur.depth == 0) {
+        cur.phase_us[phase] += telemetry_now() - start;
+    }
+}
+
+void telemetry_parsed() {
+    if (cur.active && !cur.parsed) {
+        cur.phase_us[TELEMETRY_PHASE_PARSE] = telemetry_now() - cur.start;
+        cur.parsed = true;
+    }
+}
+
+void telemetry_heap_sample() {
+    if (cur.active && telemetry_core()) {
+        uint32_t used = telemetry_heap_used();
+        if (used > cur.heap_max) {
+            cur.heap_max = used;
+        }
+    }
+}
+
+void telemetry_transport_rx(uint32_t us) {
+    pending_rx = us;
+}
+
+void telemetry_transport_tx(uint32_t us) {
+    if (last && !cur.active) {
+        last->phase_us[TELEMETRY_PHASE_TRANSPORT] += us;
+    }
+}
+
+void telemetry_reset() {
+    memset(&telemetry, 0, sizeof(telemetry));
+    last = NULL;
+}
+
+#endif
@@ -0,0 +1,98 @@
+/*
+ * This file is part of the Pico Keys SDK distribution (https://github.com/polhenarejos/pico-keys-sdk).
+ * Copyright (c) 2022 Pol Henarejos.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, version 3.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef _TELEMETRY_H_
+#define _TELEMETRY_H_
+
+#include <stdint.h>
+#include <stdbool.h>
+
+#define TELEMETRY_TYPE_APDU         0x01 // code is INS
+#define TELEMETRY_TYPE_CTAP         0x02 // code is CTAP2 command byte
+#define TELEMETRY_TYPE_CTAPHID      0x03 // code is CTAPHID command
+
+enum {
+    TELEMETRY_PHASE_PARSE = 0,
+    TELEMETRY_PHASE_CRYPTO,
+    TELEMETRY_PHASE_FLASH,
+    TELEMETRY_PHASE_TRANSPORT,
+    TELEMETRY_PHASES
+};
+
+#define TELEMETRY_MAX_CMDS          24
+#define TELEMETRY_HIST_BINS         12 // Bin i counts latencies below 2^(i+8) us, last bin the rest
+
+typedef struct telemetry_cmd {
+    uint8_t type;
+    uint8_t code;
+    uint16_t hist[TELEMETRY_HIST_BINS];
+    uint32_t count;
+    uint32_t total_us;
+    uint32_t max_us;
+    uint32_t phase_us[TELEMETRY_PHASES];
+    uint32_t heap_peak;
+} telemetry_cmd_t;
+
+typedef struct telemetry {
+    telemetry_cmd_t cmds[TELEMETRY_MAX_CMDS];
+    uint8_t num_cmds;
+    uint32_t flash_read_hits;
+    uint32_t flash_read_misses;
+    uint32_t flash_write_hits;
+    uint32_t flash_write_misses;
+    uint32_t heap_peak;
+} telemetry_t;
+
+#ifdef ENABLE_TELEMETRY
+
+extern telemetry_t telemetry;
+
+extern uint32_t telemetry_now();
+extern void telemetry_begin(uint8_t type, uint8_t code);
+extern void telemetry_end();
+extern uint32_t telemetry_phase_begin();
+extern void telemetry_phase_end(uint8_t phase, uint32_t start);
+extern void telemetry_parsed();
+extern void telemetry_heap_sample();
+extern void telemetry_transport_rx(uint32_t us);
+extern void telemetry_transport_tx(uint32_t us);
+extern void telemetry_reset();
+
+#define TELEMETRY_BEGIN(t, c)           telemetry_begin(t, c)
+#define TELEMETRY_END()                 telemetry_end()
+#define TELEMETRY_PHASE_START(v)        uint32_t v = telemetry_phase_begin()
+#define TELEMETRY_PHASE_END(p, v)       telemetry_phase_end(p, v)
+#define TELEMETRY_PARSED()              telemetry_parsed()
+#define TELEMETRY_HEAP_SAMPLE()         telemetry_heap_sample()
+#define TELEMETRY_FLASH_CACHE(w, h)     do { \
+        if (w) { if (h) { telemetry.flash_write_hits++; } else { telemetry.flash_write_misses++; } } \
+        else { if (h) { telemetry.flash_read_hits++; } else { telemetry.flash_read_misses++; } } \
+} while (0)
+
+#else
+
+#define TELEMETRY_BEGIN(t, c)           do { } while (0)
+#define TELEMETRY_END()                 do { } while (0)
+#define TELEMETRY_PHASE_START(v)
+#define TELEMETRY_PHASE_END(p, v)       do { } while (0)
+#define TELEMETRY_PARSED()              do { } while (0)
+#define TELEMETRY_HEAP_SAMPLE()         do { } while (0)
+#define TELEMETRY_FLASH_CACHE(w, h)     do { } while (0)
+
+#endif
+
+#endif //_TELEMETRY_H_
@@ -143,7 +143,7 @@ void tud_vendor_tx_cb(uint8_t itf, uint32_t sent_bytes) {
 int driver_write_ccid(const uint8_t *buffer, size_t buffer_size) {
     int r = tud_vendor_write(buffer, buffer_size);
     if (r > 0) {
-        return MAX(tud_vendor_flush(), r);
+        tud_vendor_flush();
     }
     return r;
 }
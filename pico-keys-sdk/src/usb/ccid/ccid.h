@@ -18,10 +18,13 @@
 #ifndef _CCID_H_
 #define _CCID_H_
 
+#include "usb.h"
+
 extern const uint8_t historical_bytes[];
 
-#define MAX_CMD_APDU_DATA_SIZE (24 + 4 + 512 * 4)
-#define MAX_RES_APDU_DATA_SIZE (5 + 9 + 512 * 4)
+// Extended APDUs are received and returned whole, sized to the CCID endpoint buffer
+#define MAX_CMD_APDU_DATA_SIZE (USB_CCID_BUFFER_SIZE - 32)
+#define MAX_RES_APDU_DATA_SIZE (USB_CCID_BUFFER_SIZE - 32)
 #define CCID_MSG_HEADER_SIZE    10
 #define USB_LL_BUF_SIZE         64
 
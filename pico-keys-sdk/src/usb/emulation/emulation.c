@@ -18,24 +18,58 @@
 #include "emulation.h"
 #include <stdio.h>
 #include <sys/socket.h>
+#include <sys/un.h>
 #include <arpa/inet.h>
 #include <stdlib.h>
 #include <unistd.h>
-#include <sys/ioctl.h>
 #include <errno.h>
 #include <fcntl.h>
 #include <time.h>
+#ifdef __linux__
+#include <sys/epoll.h>
+#else
 #include <poll.h>
+#endif
 
 #include "pico_keys.h"
 #include "apdu.h"
 #include "usb.h"
 #include "ccid/ccid.h"
+#include "telemetry.h"
 #include <netinet/tcp.h>
 
-int ccid_sock = 0;
-int hid_server_sock = 0;
-int hid_client_sock = -1;
+#ifndef MSG_NOSIGNAL
+#define MSG_NOSIGNAL 0
+#endif
+
+/*
+ * Every connection carries frames of [len (2 bytes, big endian) | payload]. Many clients may be
+ * connected at once, but the emulated device has a single state per interface: the connection
+ * whose frame is dispatched owns the interface until its transaction is finished, and the
+ * responses are queued to it. Other connections keep at most one frame buffered and are not
+ * read any further until it is dispatched.
+ */
+typedef struct emul_conn {
+    int fd;
+    uint8_t itf;
+    bool listener;
+    bool rx_ready;      // A complete frame is waiting to be dispatched
+    uint8_t hdr[2];
+    uint16_t rx_len;
+    uint16_t rx_off;    // Bytes received of the current frame, header included
+    uint8_t *rx;
+    uint8_t *tx;
+    size_t tx_len;
+    uint32_t events;
+} emul_conn_t;
+
+static emul_conn_t conns[EMUL_MAX_CONNS];
+static emul_conn_t *owner[ITF_TOTAL] = { NULL };
+static int next_conn = 0;
+#ifdef __linux__
+static int epoll_fd = -1;
+#endif
+
 extern uint8_t thread_type;
 extern const uint8_t *cbor_data;
 extern size_t cbor_len;
@@ -61,129 +95,371 @@ int msleep(long msec) {
     return res;
 }
 
-int emul_init(char *host, uint16_t port) {
-    struct sockaddr_in serv_addr;
-    fprintf(stderr, "\n Starting emulation envionrment\n");
-    if ((ccid_sock = socket(AF_INET, SOCK_STREAM, 0)) < 0) {
-        perror("socket");
-        return -1;
+static size_t conn_rx_size(uint8_t itf) {
+#ifdef USB_ITF_CCID
+    if (itf == ITF_CCID) {
+        return USB_CCID_BUFFER_SIZE;
     }
+#endif
+    return USB_BUFFER_SIZE;
+}
 
-    serv_addr.sin_family = AF_INET;
-    serv_addr.sin_port = htons(port);
+static void conn_set_events(emul_conn_t *c, uint32_t events) {
+    if (c->events == events) {
+        return;
+    }
+#ifdef __linux__
+    struct epoll_event ev = { .events = events, .data.ptr = c };
+    epoll_ctl(epoll_fd, EPOLL_CTL_MOD, c->fd, &ev);
+#endif
+    c->events = events;
+}
 
-    // Convert IPv4 and IPv6 addresses from text to binary
-    // form
-    if (inet_pton(AF_INET, host, &serv_addr.sin_addr) <= 0) {
-        perror("inet_pton");
-        close(ccid_sock);
-        return -1;
+static void conn_update(emul_conn_t *c) {
+    if (c->fd < 0 || c->listener) {
+        return;
     }
+    conn_set_events(c, (c->rx_ready ? 0 : EMUL_EV_IN) | (c->tx_len > 0 ? EMUL_EV_OUT : 0));
+}
 
-    if (connect(ccid_sock, (struct sockaddr *) &serv_addr, sizeof(serv_addr)) < 0) {
-        perror("connect");
-        close(ccid_sock);
-        return -1;
+static emul_conn_t *conn_add(int fd, uint8_t itf, bool listener) {
+    emul_conn_t *c = NULL;
+    for (int i = 0; i < EMUL_MAX_CONNS; i++) {
+        if (conns[i].fd < 0) {
+            c = &conns[i];
+            break;
+        }
+    }
+    if (!c) {
+        close(fd);
+        return NULL;
     }
-    int x = fcntl(ccid_sock, F_GETFL, 0);
-    fcntl(ccid_sock, F_SETFL, x | O_NONBLOCK);
-    int flag = 1;
-    setsockopt(ccid_sock, IPPROTO_TCP, TCP_NODELAY, (char *)&flag, sizeof(int));
+    memset(c, 0, sizeof(emul_conn_t));
+    if (!listener) {
+        c->rx = (uint8_t *) calloc(1, conn_rx_size(itf));
+        c->tx = (uint8_t *) calloc(1, EMUL_TX_SIZE);
+        if (!c->rx || !c->tx) {
+            free(c->rx);
+            free(c->tx);
+            c->fd = -1;
+            close(fd);
+            return NULL;
+        }
+    }
+    fcntl(fd, F_SETFL, fcntl(fd, F_GETFL, 0) | O_NONBLOCK);
+    c->fd = fd;
+    c->itf = itf;
+    c->listener = listener;
+    c->events = EMUL_EV_IN;
+#ifdef __linux__
+    struct epoll_event ev = { .events = c->events, .data.ptr = c };
+    if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, fd, &ev) != 0) {
+        perror("epoll_ctl");
+    }
+#endif
+    return c;
+}
 
-    // HID server
+static void conn_close(emul_conn_t *c) {
+#ifdef __linux__
+    epoll_ctl(epoll_fd, EPOLL_CTL_DEL, c->fd, NULL);
+#endif
+    close(c->fd);
+    free(c->rx);
+    free(c->tx);
+    if (owner[c->itf] == c) {
+        owner[c->itf] = NULL;
+    }
+    memset(c, 0, sizeof(emul_conn_t));
+    c->fd = -1;
+}
 
-    socklen_t yes = 1;
-    uint16_t hid_port = port - 1;
+static void conn_flush(emul_conn_t *c) {
+    size_t sent = 0;
+    while (sent < c->tx_len) {
+        ssize_t ret = send(c->fd, c->tx + sent, c->tx_len - sent, MSG_NOSIGNAL);
+        if (ret < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            if (errno != EAGAIN && errno != EWOULDBLOCK) {
+                conn_close(c);
+                return;
+            }
+            break;
+        }
+        sent += ret;
+    }
+    memmove(c->tx, c->tx + sent, c->tx_len - sent);
+    c->tx_len -= sent;
+    conn_update(c);
+}
+
+static void conn_recv(emul_conn_t *c) {
+    while (!c->rx_ready) {
+        ssize_t ret;
+        if (c->rx_off < sizeof(c->hdr)) {
+            ret = recv(c->fd, c->hdr + c->rx_off, sizeof(c->hdr) - c->rx_off, 0);
+        }
+        else {
+            ret = recv(c->fd, c->rx + c->rx_off - sizeof(c->hdr), c->rx_len + sizeof(c->hdr) - c->rx_off, 0);
+        }
+        if (ret == 0 || (ret < 0 && errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR)) {
+            conn_close(c);
+            return;
+        }
+        if (ret < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            break;
+        }
+        c->rx_off += ret;
+        if (c->rx_off == sizeof(c->hdr)) {
+            c->rx_len = (c->hdr[0] << 8) | c->hdr[1];
+            if (c->rx_len > conn_rx_size(c->itf)) {
+                printf("emulation: frame of %d bytes too long, dropping client\n", c->rx_len);
+                conn_close(c);
+                return;
+            }
+            if (c->rx_len == 0) {
+                c->rx_off = 0;
+            }
+        }
+        else if (c->rx_off > sizeof(c->hdr) && c->rx_off == c->rx_len + sizeof(c->hdr)) {
+            c->rx_ready = true;
+        }
+    }
+    conn_update(c);
+}
+
+static void conn_accept(emul_conn_t *l) {
+    while (true) {
+        int fd = accept(l->fd, NULL, NULL);
+        if (fd < 0) {
+            break;
+        }
+        int flag = 1;
+        setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, (char *) &flag, sizeof(int));
+        if (!conn_add(fd, l->itf, false)) {
+            printf("emulation: too many clients\n");
+        }
+    }
+}
+
+static void conn_event(emul_conn_t *c, uint32_t events) {
+    if (c->listener) {
+        conn_accept(c);
+        return;
+    }
+    if (events & (EMUL_EV_IN | EMUL_EV_ERR)) {
+        conn_recv(c);
+    }
+    if (c->fd >= 0 && (events & EMUL_EV_OUT)) {
+        conn_flush(c);
+    }
+}
+
+static void emul_poll(int timeout) {
+#ifdef __linux__
+    struct epoll_event events[64];
+    int n = epoll_wait(epoll_fd, events, sizeof(events) / sizeof(events[0]), timeout);
+    for (int i = 0; i < n; i++) {
+        conn_event((emul_conn_t *) events[i].data.ptr, events[i].events);
+    }
+#else
+    struct pollfd pfd[EMUL_MAX_CONNS];
+    emul_conn_t *pc[EMUL_MAX_CONNS];
+    nfds_t n = 0;
+    for (int i = 0; i < EMUL_MAX_CONNS; i++) {
+        if (conns[i].fd >= 0 && conns[i].events) {
+            pfd[n].fd = conns[i].fd;
+            pfd[n].events = conns[i].events;
+            pfd[n].revents = 0;
+            pc[n++] = &conns[i];
+        }
+    }
+    if (poll(pfd, n, timeout) > 0) {
+        for (nfds_t i = 0; i < n; i++) {
+            if (pfd[i].revents && pc[i]->fd == pfd[i].fd) {
+                conn_event(pc[i], pfd[i].revents);
+            }
+        }
+    }
+#endif
+}
+
+static int emul_listen_tcp(uint16_t port, uint8_t itf) {
+    int yes = 1, sock = 0;
     struct sockaddr_in server_sockaddr;
 
-    if ((hid_server_sock = socket(AF_INET, SOCK_STREAM, 0)) < 0) {
+    if ((sock = socket(AF_INET, SOCK_STREAM, 0)) < 0) {
         perror("socket");
         return -1;
     }
 
-    if (setsockopt(hid_server_sock, SOL_SOCKET, SO_REUSEADDR, (void *) &yes, sizeof yes) != 0) {
+    if (setsockopt(sock, SOL_SOCKET, SO_REUSEADDR, (void *) &yes, sizeof yes) != 0) {
         perror("setsockopt");
-        close(hid_server_sock);
-        return 1;
+        close(sock);
+        return -1;
     }
 
 #if HAVE_DECL_SO_NOSIGPIPE
-    if (setsockopt(hid_server_sock, SOL_SOCKET, SO_NOSIGPIPE, (void *) &yes, sizeof yes) != 0) {
+    if (setsockopt(sock, SOL_SOCKET, SO_NOSIGPIPE, (void *) &yes, sizeof yes) != 0) {
         perror("setsockopt");
-        close(hid_server_sock);
-        return 1;
+        close(sock);
+        return -1;
     }
 #endif
 
     memset(&server_sockaddr, 0, sizeof server_sockaddr);
     server_sockaddr.sin_family = PF_INET;
-    server_sockaddr.sin_port = htons(hid_port);
+    server_sockaddr.sin_port = htons(port);
     server_sockaddr.sin_addr.s_addr = htonl(INADDR_ANY);
 
-    if (bind(hid_server_sock, (struct sockaddr *) &server_sockaddr,
-             sizeof server_sockaddr) != 0) {
+    if (bind(sock, (struct sockaddr *) &server_sockaddr, sizeof server_sockaddr) != 0) {
         perror("bind");
-        close(hid_server_sock);
-        return 1;
+        close(sock);
+        return -1;
     }
 
-    if (listen(hid_server_sock, 0) != 0) {
+    if (listen(sock, SOMAXCONN) != 0) {
         perror("listen");
-        close(hid_server_sock);
-        return 1;
+        close(sock);
+        return -1;
     }
-    return 0;
+    return conn_add(sock, itf, true) ? 0 : -1;
 }
 
-uint8_t *driver_prepare_response_emul(uint8_t itf) {
-    apdu.rdata = usb_get_tx(itf);
-#ifdef USB_ITF_HID
-    if (itf == ITF_HID) {
-        apdu.rdata += 7;
+static int emul_listen_unix(const char *path, uint8_t itf) {
+    int sock = 0;
+    struct sockaddr_un server_sockaddr;
+
+    if (strlen(path) >= sizeof(server_sockaddr.sun_path)) {
+        printf("emulation: socket path %s too long\n", path);
+        return -1;
     }
-#endif
-    return apdu.rdata;
+    if ((sock = socket(AF_UNIX, SOCK_STREAM, 0)) < 0) {
+        perror("socket");
+        return -1;
+    }
+
+    memset(&server_sockaddr, 0, sizeof server_sockaddr);
+    server_sockaddr.sun_family = AF_UNIX;
+    strcpy(server_sockaddr.sun_path, path);
+    unlink(path);
+
+    if (bind(sock, (struct sockaddr *) &server_sockaddr, sizeof server_sockaddr) != 0) {
+        perror("bind");
+        close(sock);
+        return -1;
+    }
+
+    if (listen(sock, SOMAXCONN) != 0) {
+        perror("listen");
+        close(sock);
+        return -1;
+    }
+    return conn_add(sock, itf, true) ? 0 : -1;
 }
 
-int get_sock_itf(uint8_t itf) {
+int emul_init(char *host, uint16_t port) {
+    fprintf(stderr, "\n Starting emulation envionrment\n");
+    for (int i = 0; i < EMUL_MAX_CONNS; i++) {
+        conns[i].fd = -1;
+    }
+#ifdef __linux__
+    if ((epoll_fd = epoll_create1(0)) < 0) {
+        perror("epoll_create1");
+        return -1;
+    }
+#endif
+
 #ifdef USB_ITF_CCID
-    if (itf == ITF_CCID) {
-        return ccid_sock;
+    // CCID is served through a vpcd reader, to which we connect as its only client
+    struct sockaddr_in serv_addr;
+    int ccid_sock = 0;
+    if ((ccid_sock = socket(AF_INET, SOCK_STREAM, 0)) < 0) {
+        perror("socket");
+        return -1;
+    }
+
+    serv_addr.sin_family = AF_INET;
+    serv_addr.sin_port = htons(port);
+
+    // Convert IPv4 and IPv6 addresses from text to binary
+    // form
+    if (inet_pton(AF_INET, host, &serv_addr.sin_addr) <= 0) {
+        perror("inet_pton");
+        close(ccid_sock);
+        return -1;
+    }
+
+    if (connect(ccid_sock, (struct sockaddr *) &serv_addr, sizeof(serv_addr)) < 0) {
+        perror("connect");
+        close(ccid_sock);
+        ccid_sock = -1;
+    }
+    else {
+        int flag = 1;
+        setsockopt(ccid_sock, IPPROTO_TCP, TCP_NODELAY, (char *) &flag, sizeof(int));
+        conn_add(ccid_sock, ITF_CCID, false);
     }
 #endif
+
+#ifdef USB_ITF_HID
+    // HID server
+    if (emul_listen_tcp(port - 1, ITF_HID) != 0) {
+        return 1;
+    }
+    const char *path = getenv(EMUL_SOCKET_ENV);
+    if (path && *path && emul_listen_unix(path, ITF_HID) != 0) {
+        return 1;
+    }
+#endif
+    return 0;
+}
+
+uint8_t *driver_prepare_response_emul(uint8_t itf) {
+    apdu.rdata = usb_get_tx(itf);
 #ifdef USB_ITF_HID
     if (itf == ITF_HID) {
-        return hid_client_sock;
+        apdu.rdata += 7;
     }
 #endif
-    return -1;
+    return apdu.rdata;
 }
 
 extern void tud_hid_report_complete_cb(uint8_t instance, uint8_t const *report, uint16_t len);
 const uint8_t *complete_report = NULL;
 uint16_t complete_len = 0;
-extern bool last_write_result;
+extern bool last_write_result[ITF_TOTAL];
 extern uint16_t send_buffer_size[ITF_TOTAL];
+extern uint32_t last_packet_time;
 int driver_write_emul(uint8_t itf, const uint8_t *buffer, size_t buffer_size) {
-    uint16_t size = htons(buffer_size);
-    int sock = get_sock_itf(itf);
+    emul_conn_t *c = owner[itf];
     // DEBUG_PAYLOAD(buffer,buffer_size);
-    int ret = 0;
-    do {
-        ret = send(sock, &size, sizeof(size), 0);
-        if (ret < 0) {
-            msleep(10);
+    if (c) {
+        if (c->tx_len + sizeof(c->hdr) + buffer_size > EMUL_TX_SIZE) {
+            conn_flush(c);
         }
-    } while (ret <= 0);
-    do {
-        ret = send(sock, buffer, (uint16_t) buffer_size, 0);
-        if (ret < 0) {
-            msleep(10);
+        if (c->fd >= 0 && c->tx_len + sizeof(c->hdr) + buffer_size > EMUL_TX_SIZE) {
+            printf("emulation: client is not reading, dropping it\n");
+            conn_close(c);
+        }
+        else if (c->fd >= 0) {
+            c->tx[c->tx_len++] = buffer_size >> 8;
+            c->tx[c->tx_len++] = buffer_size & 0xff;
+            if (buffer_size > 0) {
+                memcpy(c->tx + c->tx_len, buffer, buffer_size);
+                c->tx_len += buffer_size;
+            }
+            conn_flush(c);
         }
-    } while (ret <= 0);
+    }
 #ifdef USB_ITF_HID
     if (itf == ITF_HID) {
-        last_write_result = true;
+        last_write_result[itf] = true;
         complete_report = buffer;
         complete_len = buffer_size;
     }
@@ -216,6 +492,16 @@ void driver_exec_finished_cont_emul(uint8_t itf, size_t size_next, size_t offset
 #endif
 }
 
+// Releases the interface once the transaction of its owner is complete
+static void emul_release(uint8_t itf) {
+#ifdef USB_ITF_HID
+    if (itf == ITF_HID && (last_packet_time > 0 || send_buffer_size[ITF_HID] > 0)) {
+        return;
+    }
+#endif
+    owner[itf] = NULL;
+}
+
 int driver_process_usb_packet_emul(uint8_t itf, uint16_t len) {
     if (len > 0) {
         uint8_t *data = usb_get_rx(itf), *rdata = usb_get_tx(itf);
@@ -234,9 +520,13 @@ int driver_process_usb_packet_emul(uint8_t itf, uint16_t len) {
                 size_t sent = 0;
                 DEBUG_PAYLOAD(data, len);
                 if ((sent = apdu_process(itf, data, len)) > 0) {
+                    TELEMETRY_BEGIN(TELEMETRY_TYPE_APDU, INS(apdu));
                     process_apdu();
+                    TELEMETRY_END();
+                    flash_wear_task();
                 }
                 apdu_finish();
+                arena_reset();
                 if (sent > 0) {
                     size_t ret = apdu_next();
                     DEBUG_PAYLOAD(rdata, ret);
@@ -249,9 +539,13 @@ int driver_process_usb_packet_emul(uint8_t itf, uint16_t len) {
         if (itf == ITF_HID) {
             if (driver_process_usb_packet_hid(len) > 0) {
                 if (thread_type == 1) {
+                    TELEMETRY_BEGIN(TELEMETRY_TYPE_APDU, INS(apdu));
                     process_apdu();
+                    TELEMETRY_END();
+                    flash_wear_task();
                     apdu_finish();
                     finished_data_size = apdu_next();
+                    arena_reset();
                 }
                 else if (thread_type == 2) {
                     apdu.sw = cbor_parse(cmd, cbor_data, cbor_len);
@@ -267,74 +561,39 @@ int driver_process_usb_packet_emul(uint8_t itf, uint16_t len) {
 #endif
     }
     usb_clear_rx(itf);
+    emul_release(itf);
     return 0;
 }
 
 uint16_t emul_read(uint8_t itf) {
-    /* First we look for a client */
 #ifdef USB_ITF_HID
-    if (itf == ITF_HID) {
-        struct sockaddr_in client_sockaddr;
-        socklen_t client_socklen = sizeof client_sockaddr;
-
-        int timeout;
-        struct pollfd pfd;
-
-        pfd.fd = hid_server_sock;
-        pfd.events = POLLIN;
-        pfd.revents = 0;
-
-        timeout = (0 * 1000 + 1000 / 1000);
-
-        if (poll(&pfd, 1, timeout) == -1) {
-            return 0;
-        }
-
-        if (pfd.revents & POLLIN) {
-            if (hid_client_sock > 0) {
-                close(hid_client_sock);
-            }
-            hid_client_sock = accept(hid_server_sock, (struct sockaddr *) &client_sockaddr,
-                                     &client_socklen);
-            printf("hid_client connected!\n");
-        }
-        if (send_buffer_size > 0) {
-            last_write_result = true;
-            tud_hid_report_complete_cb(ITF_HID, complete_report, complete_len);
-        }
+    // Pending HID reports of the response in course are sent one per loop, as the USB stack does
+    if (itf == ITF_HID && send_buffer_size[ITF_HID] > 0 && owner[ITF_HID]) {
+        last_write_result[ITF_HID] = true;
+        tud_hid_report_complete_cb(ITF_HID, complete_report, complete_len);
     }
 #endif
-    int sock = get_sock_itf(itf);
-    //printf("get_sockt itf %d - %d\n", itf, sock);
-    uint16_t len = 0;
-    fd_set input;
-    FD_ZERO(&input);
-    FD_SET(sock, &input);
-    struct timeval timeout;
-    timeout.tv_sec  = 0;
-    timeout.tv_usec = 0 * 1000;
-    int n = select(sock + 1, &input, NULL, NULL, &timeout);
-    if (n == -1) {
-        //printf("read wrong [itf:%d]\n", itf);
-        //something wrong
-    }
-    else if (n == 0) {
-        //printf("read timeout [itf:%d]\n", itf);
-    }
-    if (FD_ISSET(sock, &input)) {
-        int valread = recv(sock, &len, sizeof(len), 0);
-        len = ntohs(len);
-        if (len > 0) {
-            while (true) {
-                valread = recv(sock, usb_get_rx(itf), len, 0);
-                if (valread > 0) {
-                    return valread;
-                }
-                msleep(10);
+    emul_conn_t *c = owner[itf];
+    // Waits a bit only when there is nothing to do, to not spin the main loop
+    emul_poll(itf == 0 && !c ? 1 : 0);
+    c = owner[itf];
+    if (!c) {
+        for (int i = 0; i < EMUL_MAX_CONNS; i++) {
+            emul_conn_t *n = &conns[(next_conn + i) % EMUL_MAX_CONNS];
+            if (n->fd >= 0 && n->itf == itf && n->rx_ready && n->tx_len <= EMUL_TX_SIZE / 2) {
+                c = owner[itf] = n;
+                next_conn = (next_conn + i + 1) % EMUL_MAX_CONNS;
+                break;
             }
         }
     }
-    //else
-    //    printf("no input for sock %d - %d\n", itf, sock);
+    if (c && c->rx_ready) {
+        uint16_t len = c->rx_len;
+        memcpy(usb_get_rx(itf), c->rx, len);
+        c->rx_ready = false;
+        c->rx_off = 0;
+        conn_update(c);
+        return len;
+    }
     return 0;
 }
@@ -19,6 +19,24 @@
 #define _EMULATION_H_
 
 #include <stdint.h>
+#ifdef __linux__
+#include <sys/epoll.h>
+#define EMUL_EV_IN              EPOLLIN
+#define EMUL_EV_OUT             EPOLLOUT
+#define EMUL_EV_ERR             (EPOLLERR | EPOLLHUP)
+#else
+#include <poll.h>
+#define EMUL_EV_IN              POLLIN
+#define EMUL_EV_OUT             POLLOUT
+#define EMUL_EV_ERR             (POLLERR | POLLHUP)
+#endif
+
+#ifndef EMUL_MAX_CONNS
+#define EMUL_MAX_CONNS          512
+#endif
+#define EMUL_TX_SIZE            (2 * USB_CCID_BUFFER_SIZE) // Fits a whole response, also split in HID reports
+#define EMUL_SOCKET_ENV         "PICO_KEYS_EMUL_SOCKET"    // Unix socket path served besides TCP
+
 extern int emul_init(char *host, uint16_t port);
 
 #endif // _EMULATION_H_
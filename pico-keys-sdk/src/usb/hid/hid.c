@@ -478,9 +478,9 @@ int driver_process_usb_packet_hid(uint16_t read) {
                     if (current_app && current_app->unload) {
                         current_app->unload();
                     }
-                    for (int a = 0; a < num_apps; a++) {
-                        if (!memcmp(apps[a].aid + 1, fido_aid + 1, MIN(fido_aid[0], apps[a].aid[0]))) {
-                            current_app = &apps[a];
+                    for (app_t *a = apps; a; a = a->next) {
+                        if (!memcmp(a->aid + 1, fido_aid + 1, MIN(fido_aid[0], a->aid[0]))) {
+                            current_app = a;
                             current_app->select_aid(current_app);
                         }
                     }
@@ -516,7 +516,9 @@ int driver_process_usb_packet_hid(uint16_t read) {
                     apdu_sent = cbor_process_cb(last_cmd, msg_packet.data, msg_packet.len);
                 }
                 else {
-                    apdu_sent = cbor_process_cb(last_cmd, ctap_req->init.data, MSG_LEN(ctap_req));
+                    // Parsers keep views into the request, so it must not stay in the report buffer
+                    memcpy(msg_packet.data, ctap_req->init.data, MSG_LEN(ctap_req));
+                    apdu_sent = cbor_process_cb(last_cmd, msg_packet.data, MSG_LEN(ctap_req));
                 }
             }
             msg_packet.len = msg_packet.current_len = 0;
@@ -546,14 +548,14 @@ int driver_process_usb_packet_hid(uint16_t read) {
 }
 
 void send_keepalive() {
-    CTAPHID_FRAME *resp = (CTAPHID_FRAME *) (usb_get_tx(ITF_HID) + 4096);
+    CTAPHID_FRAME *resp = (CTAPHID_FRAME *) (usb_get_tx(ITF_HID) + USB_BUFFER_SIZE);
     //memset(ctap_resp, 0, sizeof(CTAPHID_FRAME));
     resp->cid = ctap_req->cid;
     resp->init.cmd = CTAPHID_KEEPALIVE;
     resp->init.bcntl = 1;
     resp->init.data[0] = is_req_button_pending() ? 2 : 1;
     send_buffer_size[ITF_HID] = 0;
-    hid_write_offset(64, 4096);
+    hid_write_offset(64, USB_BUFFER_SIZE);
 }
 
 void driver_exec_timeout_hid() {
@@ -566,7 +568,7 @@ uint8_t *driver_prepare_response_hid() {
     ctap_resp = (CTAPHID_FRAME *) usb_get_tx(ITF_HID);
     apdu.rdata = ctap_resp->init.data;
     send_buffer_size[ITF_HID] = 0;
-    memset(usb_get_tx(ITF_HID), 0, 4096);
+    memset(usb_get_tx(ITF_HID), 0, USB_BUFFER_SIZE);
     return ctap_resp->init.data;
 }
 
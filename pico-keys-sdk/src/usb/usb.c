@@ -27,16 +27,50 @@
 #include "pico_keys.h"
 #include "usb.h"
 #include "apdu.h"
+#include "telemetry.h"
+#include "crypto_jobs.h"
 
 // For memcpy
 #include <string.h>
 #include <stdlib.h>
 
 // Device specific functions
-static uint8_t rx_buffer[ITF_TOTAL][4096] = { 0 }, tx_buffer[ITF_TOTAL][4096 + 64] = { 0 };
+#ifdef USB_ITF_HID
+static uint8_t rx_buffer_hid[2][USB_BUFFER_SIZE] = { 0 }, tx_buffer_hid[2][USB_BUFFER_SIZE + 64] = { 0 };
+#endif
+#ifdef USB_ITF_CCID
+static uint8_t rx_buffer_ccid[USB_CCID_BUFFER_SIZE] = { 0 }, tx_buffer_ccid[USB_CCID_BUFFER_SIZE + 64] = { 0 };
+#endif
+static uint8_t *const rx_buffer[ITF_TOTAL] = {
+#ifdef USB_ITF_HID
+    [ITF_HID] = rx_buffer_hid[0], [ITF_KEYBOARD] = rx_buffer_hid[1],
+#endif
+#ifdef USB_ITF_CCID
+    [ITF_CCID] = rx_buffer_ccid,
+#endif
+};
+static uint8_t *const tx_buffer[ITF_TOTAL] = {
+#ifdef USB_ITF_HID
+    [ITF_HID] = tx_buffer_hid[0], [ITF_KEYBOARD] = tx_buffer_hid[1],
+#endif
+#ifdef USB_ITF_CCID
+    [ITF_CCID] = tx_buffer_ccid,
+#endif
+};
+static const uint16_t rx_buffer_size[ITF_TOTAL] = {
+#ifdef USB_ITF_HID
+    [ITF_HID] = USB_BUFFER_SIZE, [ITF_KEYBOARD] = USB_BUFFER_SIZE,
+#endif
+#ifdef USB_ITF_CCID
+    [ITF_CCID] = USB_CCID_BUFFER_SIZE,
+#endif
+};
 static uint16_t w_offset[ITF_TOTAL] = { 0 }, r_offset[ITF_TOTAL] = { 0 };
 static uint16_t w_len[ITF_TOTAL] = { 0 }, tx_r_offset[ITF_TOTAL] = { 0 };
 static uint32_t timeout_counter[ITF_TOTAL] = { 0 };
+#ifdef ENABLE_TELEMETRY
+static uint32_t rx_start[ITF_TOTAL] = { 0 }, tx_start[ITF_TOTAL] = { 0 };
+#endif
 uint8_t card_locked_itf = ITF_TOTAL; // no locked
 
 void usb_set_timeout_counter(uint8_t itf, uint32_t v) {
@@ -48,11 +82,14 @@ uint32_t usb_write_offset(uint8_t itf, uint16_t len, uint16_t offset) {
     uint8_t pkt_max = 64;
 #endif
     int w = 0;
-    if (len > sizeof(tx_buffer[itf])) {
-        len = sizeof(tx_buffer[itf]);
+    if (len > rx_buffer_size[itf] + 64) { // tx buffers carry 64 extra bytes
+        len = rx_buffer_size[itf] + 64;
     }
     w_len[itf] = len;
     tx_r_offset[itf] = offset;
+#ifdef ENABLE_TELEMETRY
+    tx_start[itf] = telemetry_now();
+#endif
 #ifndef ENABLE_EMULATION
 #ifdef USB_ITF_HID
     if (itf == ITF_HID || itf == ITF_KEYBOARD) {
@@ -60,8 +97,8 @@ uint32_t usb_write_offset(uint8_t itf, uint16_t len, uint16_t offset) {
     }
 #endif
 #ifdef USB_ITF_CCID
-    if (itf == ITF_CCID) {
-        w = driver_write_ccid(tx_buffer[itf] + offset, MIN(len, pkt_max));
+    if (itf == ITF_CCID) { // Bulk IN: queue as many packets as the endpoint FIFO accepts
+        w = driver_write_ccid(tx_buffer[itf] + offset, len);
     }
 #endif
 #else
@@ -69,11 +106,17 @@ uint32_t usb_write_offset(uint8_t itf, uint16_t len, uint16_t offset) {
 #endif
     w_len[itf] -= w;
     tx_r_offset[itf] += w;
+#ifdef ENABLE_TELEMETRY
+    if (w > 0 && w_len[itf] == 0) {
+        telemetry_transport_tx(telemetry_now() - tx_start[itf]);
+        rx_start[itf] = 0;
+    }
+#endif
     return w;
 }
 
 size_t usb_rx(uint8_t itf, const uint8_t *buffer, size_t len) {
-    uint16_t size = MIN(sizeof(rx_buffer[itf]) - w_offset[itf], len);
+    uint16_t size = MIN(rx_buffer_size[itf] - w_offset[itf], len);
     if (size > 0) {
         if (buffer == NULL) {
 #ifdef USB_ITF_HID
@@ -106,7 +149,7 @@ uint32_t usb_write_flush(uint8_t itf) {
 #endif
 #ifdef USB_ITF_CCID
         if (itf == ITF_CCID) {
-            w = driver_write_ccid(tx_buffer[itf] + tx_r_offset[itf], MIN(w_len[itf], 64));
+            w = driver_write_ccid(tx_buffer[itf] + tx_r_offset[itf], w_len[itf]);
         }
 #endif
 #else
@@ -114,6 +157,12 @@ uint32_t usb_write_flush(uint8_t itf) {
 #endif
         tx_r_offset[itf] += w;
         w_len[itf] -= w;
+#ifdef ENABLE_TELEMETRY
+        if (w > 0 && w_len[itf] == 0) {
+            telemetry_transport_tx(telemetry_now() - tx_start[itf]);
+            rx_start[itf] = 0;
+        }
+#endif
     }
     return w;
 }
@@ -173,6 +222,11 @@ static int usb_event_handle(uint8_t itf) {
     uint16_t rx_read = emul_read(itf);
 #endif
     int proc_packet = 0;
+#ifdef ENABLE_TELEMETRY
+    if (rx_read > 0 && rx_start[itf] == 0) {
+        rx_start[itf] = telemetry_now();
+    }
+#endif
 #ifndef ENABLE_EMULATION
 #ifdef USB_ITF_HID
     if (itf == ITF_HID) {
@@ -188,6 +242,10 @@ static int usb_event_handle(uint8_t itf) {
     proc_packet = driver_process_usb_packet_emul(itf, rx_read);
 #endif
     if (proc_packet > 0) {
+#ifdef ENABLE_TELEMETRY
+        telemetry_transport_rx(telemetry_now() - rx_start[itf]);
+        rx_start[itf] = 0;
+#endif
         card_locked_itf = itf;
         timeout_start();
 #ifndef ENABLE_EMULATION
@@ -232,6 +290,8 @@ void card_start(void (*func)(void)) {
             break;
         }
     }
+    crypto_jobs_flush();
+    low_flash_txn_reset();
     multicore_reset_core1();
     if (func) {
         multicore_launch_core1(func);
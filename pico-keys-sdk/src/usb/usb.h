@@ -24,6 +24,13 @@
 #include <stdbool.h>
 #endif
 
+#ifndef USB_BUFFER_SIZE
+#define USB_BUFFER_SIZE         4096
+#endif
+#ifndef USB_CCID_BUFFER_SIZE
+#define USB_CCID_BUFFER_SIZE    8192    // Extended APDU + CCID header
+#endif
+
 /* USB thread */
 #define EV_CARD_CHANGE        1
 #define EV_TX_FINISHED        2
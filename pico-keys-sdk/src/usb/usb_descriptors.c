@@ -107,7 +107,7 @@ static const struct ccid_class_descriptor desc_ccid = {
     .dwSynchProtocols       = (0),
     .dwMechanical           = (0),
     .dwFeatures             = 0x40840, //USB-ICC, short & extended APDU
-    .dwMaxCCIDMessageLength = 65544 + 10,
+    .dwMaxCCIDMessageLength = USB_CCID_BUFFER_SIZE,
     .bClassGetResponse      = 0xFF,
     .bclassEnvelope         = 0xFF,
     .wLcdLayout             = 0x0,
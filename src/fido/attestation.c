@@ -0,0 +1,289 @@
+/*
+ * This file is part of the Pico FIDO distribution (https://github.com/polhenarejos/pico-fido).
+ * Copyright (c) 2022 Pol Henarejos.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, version 3.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "attestation.h"
+#include "fido.h"
+#include "pico_keys.h"
+#include "ctap.h"
+#include "files.h"
+#include "asset.h"
+#include "mbedtls/x509_csr.h"
+#include "mbedtls/sha256.h"
+#include "random.h"
+#include <stdio.h>
+
+/* Attestation certificates are kept in flash as the DER certificates of the chain, concatenated
+ * from the leaf up, and indexed here once so makeCredential emits x5c straight from flash. The
+ * index is refreshed whenever a chain is written and checked against the file size before use.
+ * Both chains are mirrored in the asset area, so the hot path reads them through XIP. The files
+ * remain the reference: they are backed up and restored, and used while the mirror is pending.
+ *
+ * The enterprise attestation CSR is cached in EF_EE_DEV_CSR as | tag (8) | CSR DER |, where tag is
+ * the head of sha256(device key | board id). It is generated once and returned as is until the
+ * device key or the board changes. */
+
+#define ATT_CSR_TAG_LEN     8
+
+typedef struct att_chain {
+    uint16_t fid;
+    const uint8_t *base;
+    uint32_t gen;
+    uint8_t count;
+    uint16_t size;
+    uint16_t off[ATTESTATION_MAX_CHAIN];
+    uint16_t len[ATTESTATION_MAX_CHAIN];
+} att_chain_t;
+
+static att_chain_t chains[2] = { { .fid = EF_EE_DEV }, { .fid = EF_EE_DEV_EA } };
+
+int attestation_chain_parse(const uint8_t *data,
+                            size_t len,
+                            uint16_t *offsets,
+                            uint16_t *lens,
+                            uint8_t *count) {
+    uint8_t n = 0;
+    size_t p = 0;
+    while (p < len) {
+        if (n == ATTESTATION_MAX_CHAIN || len - p < 2 || data[p] != 0x30) {
+            return CCID_WRONG_DATA;
+        }
+        size_t hl = 2, cl = data[p + 1];
+        if (cl & 0x80) {
+            uint8_t nl = cl & 0x7f;
+            if (nl == 0 || nl > 2 || len - p < 2 + nl) {
+                return CCID_WRONG_DATA;
+            }
+            cl = 0;
+            for (uint8_t i = 0; i < nl; i++) {
+                cl = (cl << 8) | data[p + 2 + i];
+            }
+            hl += nl;
+        }
+        if (cl > len - p - hl) {
+            return CCID_WRONG_DATA;
+        }
+        if (offsets) {
+            offsets[n] = (uint16_t) p;
+        }
+        if (lens) {
+            lens[n] = (uint16_t) (hl + cl);
+        }
+        n++;
+        p += hl + cl;
+    }
+    if (count) {
+        *count = n;
+    }
+    return n > 0 ? CCID_OK : CCID_WRONG_DATA;
+}
+
+const uint8_t *attestation_cert(bool enterprise, uint16_t *len) {
+    uint16_t fid = enterprise ? EF_EE_DEV_EA : EF_EE_DEV;
+    const uint8_t *data = asset_get(fid, len);
+    if (!data) {
+        file_t *ef = search_by_fid(fid, NULL, SPECIFY_EF);
+        if (!file_has_data(ef)) {
+            return NULL;
+        }
+        data = file_get_data(ef);
+        *len = file_get_size(ef);
+    }
+    return data;
+}
+
+static att_chain_t *attestation_chain(bool enterprise) {
+    att_chain_t *ch = &chains[enterprise ? 1 : 0];
+    uint16_t size = 0;
+    const uint8_t *base = attestation_cert(enterprise, &size);
+    if (!base) {
+        return NULL;
+    }
+    // A bank rebuilt in place may hand out the same pointer with other content
+    if (ch->count == 0 || ch->base != base || ch->size != size || ch->gen != asset_generation()) {
+        ch->count = 0;
+        ch->base = base;
+        ch->gen = asset_generation();
+        ch->size = size;
+        if (attestation_chain_parse(base, ch->size, ch->off, ch->len, &ch->count) != CCID_OK) {
+            // Legacy blobs are emitted as a single certificate, as they always were
+            ch->count = 1;
+            ch->off[0] = 0;
+            ch->len[0] = ch->size;
+        }
+    }
+    return ch;
+}
+
+/* Brings the asset mirror of a chain in line with its file. */
+static void attestation_publish(uint16_t fid) {
+    file_t *ef = search_by_fid(fid, NULL, SPECIFY_EF);
+    uint16_t len = 0;
+    const uint8_t *data = asset_get(fid, &len);
+    if (file_has_data(ef)) {
+        if (!data || len != file_get_size(ef) || memcmp(data, file_get_data(ef), len) != 0) {
+            asset_write(fid, file_get_data(ef), file_get_size(ef));
+        }
+    }
+    else if (data) {
+        asset_write(fid, NULL, 0);
+    }
+}
+
+void attestation_init() {
+    for (int i = 0; i < (int) (sizeof(chains) / sizeof(chains[0])); i++) {
+        attestation_publish(chains[i].fid);
+        chains[i].count = 0;
+    }
+    attestation_chain(false);
+    attestation_chain(true);
+}
+
+CborError attestation_encode_x5c(CborEncoder *mapEncoder, bool enterprise) {
+    CborError error = CborNoError;
+    CborEncoder arrEncoder;
+    att_chain_t *ch = enterprise ? attestation_chain(true) : NULL;
+    if (!ch) {
+        ch = attestation_chain(false);
+    }
+    if (!ch) {
+        return CborErrorUnknownError;
+    }
+    const uint8_t *data = ch->base;
+    CBOR_CHECK(cbor_encode_text_stringz(mapEncoder, "x5c"));
+    CBOR_CHECK(cbor_encoder_create_array(mapEncoder, &arrEncoder, ch->count));
+    for (uint8_t i = 0; i < ch->count; i++) {
+        CBOR_CHECK(cbor_encode_byte_string(&arrEncoder, data + ch->off[i], ch->len[i]));
+    }
+    CBOR_CHECK(cbor_encoder_close_container(mapEncoder, &arrEncoder));
+err:
+    return error;
+}
+
+int attestation_set_ea(const uint8_t *data, size_t len) {
+    if (len > UINT16_MAX || attestation_chain_parse(data, len, NULL, NULL, NULL) != CCID_OK) {
+        return CCID_WRONG_DATA;
+    }
+    file_t *ef_ee_ea = search_by_fid(EF_EE_DEV_EA, NULL, SPECIFY_EF);
+    if (!ef_ee_ea) {
+        return CCID_ERR_FILE_NOT_FOUND;
+    }
+    int ret = flash_write_data_to_file(ef_ee_ea, data, (uint16_t) len);
+    if (ret == CCID_OK) {
+        // On failure the mirror stays pending and the file is read instead
+        asset_write(EF_EE_DEV_EA, data, (uint16_t) len);
+    }
+    chains[1].count = 0;
+    return ret;
+}
+
+static void attestation_board_id(uint8_t id[8]) {
+#ifndef ENABLE_EMULATION
+    pico_unique_board_id_t rpiid;
+    pico_get_unique_board_id(&rpiid);
+    memcpy(id, rpiid.id, 8);
+#else
+    memset(id, 0, 8);
+#endif
+}
+
+static void attestation_csr_tag(const uint8_t id[8], uint8_t tag[ATT_CSR_TAG_LEN]) {
+    uint8_t hash[32];
+    mbedtls_sha256_context ctx;
+    mbedtls_sha256_init(&ctx);
+    mbedtls_sha256_starts(&ctx, 0);
+    mbedtls_sha256_update(&ctx, file_get_data(ef_keydev), file_get_size(ef_keydev));
+    mbedtls_sha256_update(&ctx, id, 8);
+    mbedtls_sha256_finish(&ctx, hash);
+    mbedtls_sha256_free(&ctx);
+    memcpy(tag, hash, ATT_CSR_TAG_LEN);
+}
+
+int attestation_csr(const uint8_t **csr, size_t *csr_len) {
+    uint8_t id[8], tag[ATT_CSR_TAG_LEN];
+    if (!file_has_data(ef_keydev)) {
+        return CCID_ERR_MEMORY_FATAL;
+    }
+    attestation_board_id(id);
+    attestation_csr_tag(id, tag);
+    file_t *ef_csr = search_by_fid(EF_EE_DEV_CSR, NULL, SPECIFY_EF);
+    if (!ef_csr) {
+        return CCID_ERR_FILE_NOT_FOUND;
+    }
+    if (file_get_size(ef_csr) > ATT_CSR_TAG_LEN &&
+        memcmp(file_get_data(ef_csr), tag, ATT_CSR_TAG_LEN) == 0) {
+        *csr = file_get_data(ef_csr) + ATT_CSR_TAG_LEN;
+        *csr_len = file_get_size(ef_csr) - ATT_CSR_TAG_LEN;
+        return CCID_OK;
+    }
+
+    uint8_t buffer[1024];
+    mbedtls_ecdsa_context ekey;
+    mbedtls_ecdsa_init(&ekey);
+    int ret = mbedtls_ecp_read_key(MBEDTLS_ECP_DP_SECP256R1,
+                                   &ekey,
+                                   file_get_data(ef_keydev),
+                                   file_get_size(ef_keydev));
+    if (ret == 0) {
+        ret = mbedtls_ecp_mul(&ekey.grp, &ekey.Q, &ekey.d, &ekey.grp.G, random_gen, NULL);
+    }
+    if (ret != 0) {
+        mbedtls_ecdsa_free(&ekey);
+        return CCID_EXEC_ERROR;
+    }
+    mbedtls_x509write_csr ctx;
+    mbedtls_x509write_csr_init(&ctx);
+    snprintf((char *) buffer,
+             sizeof(buffer),
+             "C=ES,O=Pico Keys,OU=Authenticator Attestation,CN=Pico Fido EE Serial %02x%02x%02x%02x%02x%02x%02x%02x",
+             id[0],
+             id[1],
+             id[2],
+             id[3],
+             id[4],
+             id[5],
+             id[6],
+             id[7]);
+    mbedtls_x509write_csr_set_subject_name(&ctx, (char *) buffer);
+    mbedtls_pk_context key;
+    mbedtls_pk_init(&key);
+    mbedtls_pk_setup(&key, mbedtls_pk_info_from_type(MBEDTLS_PK_ECKEY));
+    key.pk_ctx = &ekey;
+    mbedtls_x509write_csr_set_key(&ctx, &key);
+    mbedtls_x509write_csr_set_md_alg(&ctx, MBEDTLS_MD_SHA256);
+    mbedtls_x509write_csr_set_extension(&ctx,
+                                        "\x2B\x06\x01\x04\x01\x82\xE5\x1C\x01\x01\x04",
+                                        0xB,
+                                        0,
+                                        aaguid,
+                                        sizeof(aaguid));
+    ret = mbedtls_x509write_csr_der(&ctx, buffer, sizeof(buffer), random_gen, NULL);
+    mbedtls_x509write_csr_free(&ctx);
+    mbedtls_ecdsa_free(&ekey);
+    if (ret <= 0 || ret > (int) sizeof(buffer) - ATT_CSR_TAG_LEN) {
+        return CCID_EXEC_ERROR;
+    }
+    uint8_t *p = buffer + sizeof(buffer) - ret - ATT_CSR_TAG_LEN;
+    memcpy(p, tag, ATT_CSR_TAG_LEN);
+    ret = flash_write_data_to_file(ef_csr, p, (uint16_t) (ret + ATT_CSR_TAG_LEN));
+    if (ret != CCID_OK) {
+        return ret;
+    }
+    low_flash_available();
+    *csr = file_get_data(ef_csr) + ATT_CSR_TAG_LEN;
+    *csr_len = file_get_size(ef_csr) - ATT_CSR_TAG_LEN;
+    return CCID_OK;
+}
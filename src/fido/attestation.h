@@ -0,0 +1,36 @@
+/*
+ * This file is part of the Pico FIDO distribution (https://github.com/polhenarejos/pico-fido).
+ * Copyright (c) 2022 Pol Henarejos.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, version 3.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef _ATTESTATION_H_
+#define _ATTESTATION_H_
+
+#include "ctap2_cbor.h"
+
+#define ATTESTATION_MAX_CHAIN       4 // Leaf and up to 3 intermediates
+
+extern int attestation_chain_parse(const uint8_t *data,
+                                   size_t len,
+                                   uint16_t *offsets,
+                                   uint16_t *lens,
+                                   uint8_t *count);
+extern void attestation_init();
+extern const uint8_t *attestation_cert(bool enterprise, uint16_t *len);
+extern CborError attestation_encode_x5c(CborEncoder *mapEncoder, bool enterprise);
+extern int attestation_set_ea(const uint8_t *data, size_t len);
+extern int attestation_csr(const uint8_t **csr, size_t *csr_len);
+
+#endif // _ATTESTATION_H_
@@ -0,0 +1,486 @@
+/*
+ * This file is part of the Pico FIDO distribution (https://github.com/polhenarejos/pico-fido).
+ * Copyright (c) 2022 Pol Henarejos.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, version 3.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "fido.h"
+#include "attestation.h"
+#include "pico_keys.h"
+#include "ctap.h"
+#include "files.h"
+#include "cred_index.h"
+#include "hid/ctap_hid.h"
+#include "mbedtls/chachapoly.h"
+#include "mbedtls/hkdf.h"
+#include "mbedtls/sha256.h"
+#include "mbedtls/platform_util.h"
+
+/* Backup of the whole device state. Files are serialized in file table order as a stream of
+ * records | fid (2) | len (2) | data (len) |, which is cut in chunks of BACKUP_CHUNK_SIZE bytes
+ * from chunk 1 on. Chunk 0 is the manifest:
+ * | version (1) | chunks (4) | records (2) | stream size (4) | stream sha256 (32) |
+ * Every chunk is sealed with ChaCha20-Poly1305 as | id (8) | index (4) | ciphertext | tag (16) |,
+ * where id is the head of the stream hash and id | index is the nonce. The key is derived from the
+ * device key recovered by the MSE unlock, so only a device unlocked with the same secure key can
+ * open the chunks. The device key itself travels with the single-file backup subcommands.
+ *
+ * A restore takes two passes over the same chunks. The first one authenticates every chunk and
+ * checks the stream hash without writing anything. Only then the manifest is sent again, the device
+ * files are wiped and the second pass writes the records. The PIN retries and the signature
+ * counter are never taken back from a backup. */
+
+#define BACKUP_VERSION          0x01
+#define BACKUP_ID_LEN           8
+#define BACKUP_NONCE_LEN        (BACKUP_ID_LEN + 4)
+#define BACKUP_TAG_LEN          16
+#define BACKUP_MANIFEST_LEN     (1 + 4 + 2 + 4 + 32)
+#define BACKUP_HASH_OFFSET      (1 + 4 + 2 + 4)
+
+extern uint8_t keydev_dec[32];
+extern bool has_keydev_dec;
+
+static uint8_t manifest[BACKUP_MANIFEST_LEN];
+static bool has_manifest = false;
+
+static struct {
+    bool active;
+    bool apply;     // Second pass, records are written
+    bool verified;  // The first pass of id ended with a valid stream
+    uint8_t id[BACKUP_ID_LEN];
+    uint8_t hash[32];
+    uint32_t chunks;
+    uint32_t next;
+    uint16_t records;
+    uint16_t restored;
+    mbedtls_sha256_context sha;
+    uint8_t hdr[4];
+    uint8_t hdr_len;
+    uint8_t *rec;
+    uint16_t rec_off;
+} restore = { .active = false };
+
+static void put_uint32_be(uint32_t n, uint8_t *b) {
+    b[0] = n >> 24;
+    b[1] = n >> 16;
+    b[2] = n >> 8;
+    b[3] = n;
+}
+
+static uint32_t get_uint32_be(const uint8_t *b) {
+    return ((uint32_t) b[0] << 24) | ((uint32_t) b[1] << 16) | ((uint32_t) b[2] << 8) | b[3];
+}
+
+static bool backup_excluded(uint16_t fid) {
+    return fid == EF_KEY_DEV || fid == EF_KEY_DEV_ENC || fid == EF_AUTHTOKEN ||
+           fid == EF_FLASH_WEAR || fid == EF_META || fid == EF_META_RECORD;
+}
+
+// Static files first, then the dynamic ones. Returns NULL past the last one.
+static file_t *backup_file(uint16_t i) {
+    uint16_t statics = (uint16_t) (file_last - file_entries);
+    if (i < statics) {
+        return &file_entries[i];
+    }
+    if (i < statics + dynamic_files) {
+        return &dynamic_file[i - statics];
+    }
+    return cred_index_file(i - statics - dynamic_files);
+}
+
+// Kept across the wipe and merged with the backup, so that a restore cannot roll them back
+static bool restore_merged(uint16_t fid) {
+    return fid == EF_PIN || fid == EF_COUNTER;
+}
+
+static bool backup_included(file_t *ef) {
+    return !backup_excluded(ef->fid) && file_has_data(ef);
+}
+
+static int backup_aead(bool seal, const uint8_t *nonce, uint8_t *data, size_t len, uint8_t *tag) {
+    uint8_t key[32];
+    mbedtls_chachapoly_context ctx;
+    mbedtls_chachapoly_init(&ctx);
+    int ret = mbedtls_hkdf(mbedtls_md_info_from_type(MBEDTLS_MD_SHA256), NULL, 0, keydev_dec,
+                           sizeof(keydev_dec), (const uint8_t *) "Pico FIDO backup", 16, key,
+                           sizeof(key));
+    if (ret == 0) {
+        ret = mbedtls_chachapoly_setkey(&ctx, key);
+    }
+    if (ret == 0) {
+        if (seal) {
+            ret = mbedtls_chachapoly_encrypt_and_tag(&ctx, len, nonce, NULL, 0, data, data, tag);
+        }
+        else {
+            ret = mbedtls_chachapoly_auth_decrypt(&ctx, len, nonce, NULL, 0, tag, data, data);
+        }
+    }
+    mbedtls_chachapoly_free(&ctx);
+    mbedtls_platform_zeroize(key, sizeof(key));
+    return ret;
+}
+
+static void backup_manifest() {
+    mbedtls_sha256_context ctx;
+    uint32_t size = 0;
+    uint16_t records = 0;
+    file_t *ef = NULL;
+    mbedtls_sha256_init(&ctx);
+    mbedtls_sha256_starts(&ctx, 0);
+    for (uint16_t i = 0; (ef = backup_file(i)) != NULL; i++) {
+        if (backup_included(ef)) {
+            uint8_t hdr[4];
+            uint16_t len = file_get_size(ef);
+            put_uint16_t(ef->fid, hdr);
+            put_uint16_t(len, hdr + 2);
+            mbedtls_sha256_update(&ctx, hdr, sizeof(hdr));
+            mbedtls_sha256_update(&ctx, file_get_data(ef), len);
+            size += sizeof(hdr) + len;
+            records++;
+        }
+    }
+    manifest[0] = BACKUP_VERSION;
+    put_uint32_be(1 + (size + BACKUP_CHUNK_SIZE - 1) / BACKUP_CHUNK_SIZE, manifest + 1);
+    put_uint16_t(records, manifest + 5);
+    put_uint32_be(size, manifest + 7);
+    mbedtls_sha256_finish(&ctx, manifest + BACKUP_HASH_OFFSET);
+    mbedtls_sha256_free(&ctx);
+    has_manifest = true;
+}
+
+static void backup_copy(const uint8_t *data, uint32_t len, uint32_t pos, uint32_t start,
+                        uint32_t end, uint8_t *out) {
+    uint32_t from = MAX(pos, start), to = MIN(pos + len, end);
+    if (from < to) {
+        memcpy(out + (from - start), data + (from - pos), to - from);
+    }
+}
+
+// Copies the stream bytes of chunk index, which are the records overlapping it
+static uint16_t backup_fill(uint32_t index, uint8_t *out) {
+    uint32_t start = (index - 1) * BACKUP_CHUNK_SIZE, end = start + BACKUP_CHUNK_SIZE, pos = 0;
+    file_t *ef = NULL;
+    for (uint16_t i = 0; (ef = backup_file(i)) != NULL && pos < end; i++) {
+        if (backup_included(ef)) {
+            uint8_t hdr[4];
+            uint16_t len = file_get_size(ef);
+            put_uint16_t(ef->fid, hdr);
+            put_uint16_t(len, hdr + 2);
+            backup_copy(hdr, sizeof(hdr), pos, start, end, out);
+            pos += sizeof(hdr);
+            if (pos + len > start) {
+                backup_copy(file_get_data(ef), len, pos, start, end, out);
+            }
+            pos += len;
+        }
+    }
+    return (uint16_t) (MIN(pos, end) - start);
+}
+
+int backup_read(uint32_t index, uint8_t *out, size_t *out_len, uint32_t *chunks) {
+    if (has_keydev_dec == false) {
+        return CTAP2_ERR_PIN_AUTH_INVALID;
+    }
+    if (index == 0) {
+        backup_manifest();
+    }
+    else if (has_manifest == false) {
+        return CTAP2_ERR_NOT_ALLOWED;
+    }
+    *chunks = get_uint32_be(manifest + 1);
+    if (index >= *chunks) {
+        return CTAP1_ERR_INVALID_PARAMETER;
+    }
+    memcpy(out, manifest + BACKUP_HASH_OFFSET, BACKUP_ID_LEN);
+    put_uint32_be(index, out + BACKUP_ID_LEN);
+    uint8_t *pt = out + BACKUP_NONCE_LEN;
+    size_t len = BACKUP_MANIFEST_LEN;
+    if (index == 0) {
+        memcpy(pt, manifest, len);
+    }
+    else {
+        len = backup_fill(index, pt);
+    }
+    if (backup_aead(true, out, pt, len, pt + len) != 0) {
+        return CTAP2_ERR_PROCESSING;
+    }
+    *out_len = BACKUP_NONCE_LEN + len + BACKUP_TAG_LEN;
+    return 0;
+}
+
+static void restore_stop() {
+    if (restore.rec) {
+        free(restore.rec);
+        restore.rec = NULL;
+    }
+    if (restore.active) {
+        mbedtls_sha256_free(&restore.sha);
+    }
+    restore.active = false;
+}
+
+// Files missing from the backup must not survive, so that restoring twice gives the same state
+static int restore_wipe() {
+    int ret = CCID_OK;
+    low_flash_txn_begin();
+    for (uint16_t i = 0; i < file_last - file_entries && ret == CCID_OK; i++) {
+        if (backup_included(&file_entries[i]) && !restore_merged(file_entries[i].fid)) {
+            ret = flash_clear_file(&file_entries[i]);
+        }
+    }
+    for (int i = dynamic_files - 1; i >= 0 && ret == CCID_OK; i--) {
+        if (!backup_excluded(dynamic_file[i].fid)) {
+            ret = delete_file(&dynamic_file[i]);
+        }
+    }
+    if (ret == CCID_OK) {
+        ret = cred_index_wipe();
+    }
+    low_flash_txn_commit();
+    return ret == CCID_OK ? 0 : CTAP2_ERR_PROCESSING;
+}
+
+// The PIN comes from the backup, but with the retries left on the device
+static int restore_pin(const uint8_t *data, uint16_t len) {
+    uint8_t pin[64];
+    if (len < 2 + 16 || len > sizeof(pin)) {
+        return CTAP2_ERR_INTEGRITY_FAILURE;
+    }
+    if (restore.apply == false) {
+        return 0;
+    }
+    memcpy(pin, data, len);
+    if (file_has_data(ef_pin)) {
+        pin[0] = *file_get_data(ef_pin);
+    }
+    int ret = flash_write_data_to_file(ef_pin, pin, len);
+    mbedtls_platform_zeroize(pin, sizeof(pin));
+    return ret == CCID_OK ? 0 : CTAP2_ERR_KEY_STORE_FULL;
+}
+
+// The signature counter only moves forward, whatever the backup says
+static int restore_counter(const uint8_t *data, uint16_t len) {
+    if (len != sizeof(uint32_t)) {
+        return CTAP2_ERR_INTEGRITY_FAILURE;
+    }
+    if (restore.apply == false) {
+        return 0;
+    }
+    uint32_t ctr = (uint32_t) data[0] | ((uint32_t) data[1] << 8) | ((uint32_t) data[2] << 16) |
+                   ((uint32_t) data[3] << 24);
+    if (file_has_data(ef_counter) && get_sign_counter() >= ctr) {
+        return 0;
+    }
+    if (flash_write_data_to_file(ef_counter, (uint8_t *) &ctr, sizeof(ctr)) != CCID_OK) {
+        return CTAP2_ERR_KEY_STORE_FULL;
+    }
+    return 0;
+}
+
+static int restore_record(const uint8_t *data) {
+    uint16_t fid = get_uint16_t(restore.hdr, 0), len = get_uint16_t(restore.hdr, 2);
+    restore.hdr_len = 0;
+    restore.restored++;
+    if (backup_excluded(fid)) {
+        return CTAP2_ERR_INTEGRITY_FAILURE;
+    }
+    if (fid == EF_PIN) {
+        return restore_pin(data, len);
+    }
+    if (fid == EF_COUNTER) {
+        return restore_counter(data, len);
+    }
+    if (restore.apply == false) {
+        if (cred_index_owns(fid) && cred_index_check(fid, len) == false) {
+            return CTAP2_ERR_INTEGRITY_FAILURE;
+        }
+        return 0;
+    }
+    if (cred_index_owns(fid)) {
+        int ret = cred_index_restore(fid, data, len);
+        if (ret == CCID_WRONG_DATA) {
+            return CTAP2_ERR_INTEGRITY_FAILURE;
+        }
+        return ret == CCID_OK ? 0 : CTAP2_ERR_KEY_STORE_FULL;
+    }
+    file_t *ef = file_new(fid);
+    if (!ef || flash_write_data_to_file(ef, data, len) != CCID_OK) {
+        return CTAP2_ERR_KEY_STORE_FULL;
+    }
+    return 0;
+}
+
+// Records split across chunks are gathered in a heap buffer, the rest are written in place
+static int restore_feed(const uint8_t *p, size_t len) {
+    mbedtls_sha256_update(&restore.sha, p, len);
+    while (len > 0) {
+        if (restore.hdr_len < sizeof(restore.hdr)) {
+            size_t n = MIN(len, sizeof(restore.hdr) - restore.hdr_len);
+            memcpy(restore.hdr + restore.hdr_len, p, n);
+            restore.hdr_len += n;
+            p += n;
+            len -= n;
+            if (restore.hdr_len < sizeof(restore.hdr)) {
+                break;
+            }
+            if (get_uint16_t(restore.hdr, 2) == 0) {
+                return CTAP2_ERR_INTEGRITY_FAILURE;
+            }
+            restore.rec_off = 0;
+        }
+        uint16_t rec_len = get_uint16_t(restore.hdr, 2);
+        if (restore.rec == NULL && len >= rec_len) {
+            int ret = restore_record(p);
+            p += rec_len;
+            len -= rec_len;
+            if (ret != 0) {
+                return ret;
+            }
+            continue;
+        }
+        if (restore.rec == NULL && (restore.rec = (uint8_t *) calloc(1, rec_len)) == NULL) {
+            return CTAP2_ERR_LIMIT_EXCEEDED;
+        }
+        size_t n = MIN(len, (size_t) (rec_len - restore.rec_off));
+        memcpy(restore.rec + restore.rec_off, p, n);
+        restore.rec_off += n;
+        p += n;
+        len -= n;
+        if (restore.rec_off == rec_len) {
+            int ret = restore_record(restore.rec);
+            free(restore.rec);
+            restore.rec = NULL;
+            if (ret != 0) {
+                return ret;
+            }
+        }
+    }
+    return 0;
+}
+
+static int restore_finish() {
+    uint8_t hash[32];
+    mbedtls_sha256_finish(&restore.sha, hash);
+    bool complete = restore.hdr_len == 0 && restore.rec == NULL &&
+                    restore.restored == restore.records && memcmp(hash, restore.hash, 32) == 0;
+    restore_stop();
+    if (!complete) {
+        restore.next = 0;
+        return CTAP2_ERR_INTEGRITY_FAILURE;
+    }
+    if (restore.apply == false) {
+        // The whole stream is genuine, the host sends it again from the manifest to apply it
+        restore.verified = true;
+        restore.next = 0;
+        return 0;
+    }
+    // Caches built from the restored files
+    extern int resetPinUvAuthToken();
+    init_known_apps();
+    attestation_init();
+#ifndef ENABLE_EMULATION
+    // Tokens and HOTP counters precomputed from the replaced OTP slots
+    extern void otp_precomp_invalidate();
+    otp_precomp_invalidate();
+#endif
+    resetPinUvAuthToken();
+    return 0;
+}
+
+/* Chunks must come in order. One that was already applied, or that comes ahead, is not applied
+ * again and the reply tells the index to resume from. Sending the manifest again restarts, in the
+ * apply pass if the previous pass verified the same backup. */
+int backup_restore(uint8_t *in, size_t in_len, uint32_t *next) {
+    if (has_keydev_dec == false) {
+        return CTAP2_ERR_PIN_AUTH_INVALID;
+    }
+    if (in_len < BACKUP_NONCE_LEN + BACKUP_TAG_LEN ||
+        in_len > BACKUP_SEALED_SIZE) {
+        return CTAP1_ERR_INVALID_PARAMETER;
+    }
+    uint32_t index = get_uint32_be(in + BACKUP_ID_LEN);
+    size_t len = in_len - BACKUP_NONCE_LEN - BACKUP_TAG_LEN;
+    uint8_t *pt = in + BACKUP_NONCE_LEN;
+    if (index != 0) {
+        if (restore.chunks == 0 || memcmp(in, restore.id, BACKUP_ID_LEN) != 0) {
+            return CTAP2_ERR_NOT_ALLOWED;
+        }
+        if (index != restore.next || restore.active == false) {
+            *next = restore.next;
+            return 0;
+        }
+    }
+    if (backup_aead(false, in, pt, len, pt + len) != 0) {
+        return CTAP2_ERR_INTEGRITY_FAILURE;
+    }
+    if (index == 0) {
+        if (len != BACKUP_MANIFEST_LEN || pt[0] != BACKUP_VERSION ||
+            memcmp(in, pt + BACKUP_HASH_OFFSET, BACKUP_ID_LEN) != 0 ||
+            get_uint32_be(pt + 1) == 0) {
+            return CTAP2_ERR_INTEGRITY_FAILURE;
+        }
+        bool apply = restore.verified && memcmp(in, restore.id, BACKUP_ID_LEN) == 0 &&
+                     restore.chunks == get_uint32_be(pt + 1);
+        restore_stop();
+        restore.verified = false;
+        memcpy(restore.id, in, BACKUP_ID_LEN);
+        memcpy(restore.hash, pt + BACKUP_HASH_OFFSET, sizeof(restore.hash));
+        restore.chunks = get_uint32_be(pt + 1);
+        restore.records = get_uint16_t(pt, 5);
+        restore.restored = 0;
+        restore.hdr_len = 0;
+        restore.next = 1;
+        mbedtls_sha256_init(&restore.sha);
+        mbedtls_sha256_starts(&restore.sha, 0);
+        restore.active = true;
+        restore.apply = apply;
+        if (apply) {
+            int ret = restore_wipe();
+            if (ret != 0) {
+                restore_stop();
+                restore.next = 0;
+                return ret;
+            }
+        }
+    }
+    else {
+        if (len == 0 || (index + 1 < restore.chunks && len != BACKUP_CHUNK_SIZE)) {
+            restore_stop();
+            restore.next = 0;
+            return CTAP2_ERR_INTEGRITY_FAILURE;
+        }
+        int ret = restore_feed(pt, len);
+        if (ret != 0) {
+            restore_stop();
+            restore.next = 0;
+            low_flash_available();
+            return ret;
+        }
+        restore.next++;
+    }
+    int ret = 0;
+    if (restore.next == restore.chunks) {
+        ret = restore_finish();
+    }
+    low_flash_available();
+    *next = restore.next;
+    return ret;
+}
+
+const uint8_t *backup_restore_status(uint32_t *next, uint32_t *chunks, bool *apply) {
+    *next = restore.next;
+    *apply = restore.apply;
+    *chunks = restore.chunks;
+    return restore.id;
+}
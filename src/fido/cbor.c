@@ -21,6 +21,7 @@
 #include "hid/ctap_hid.h"
 #include "ctap.h"
 #include "fido.h"
+#include "pico_keys.h"
 #include "usb.h"
 #include "apdu.h"
 #include "management.h"
@@ -50,7 +51,30 @@ const uint8_t *cbor_data = NULL;
 size_t cbor_len = 0;
 uint8_t cmd = 0;
 
-int cbor_parse(uint8_t cmd, const uint8_t *data, size_t len) {
+static int cbor_get_first_assertion(const uint8_t *data, size_t len) {
+    return cbor_get_assertion(data, len, false);
+}
+
+// Handlers of CTAPHID_CBOR, called with the parameters that follow the command byte. CTAP makes
+// user presence and PIN/UV auth depend on the request, so each handler checks them itself and
+// only CMD_FLASH is set here.
+static const cmd_t ctap_cmds[] = {
+    { CTAP_MAKE_CREDENTIAL, cbor_make_credential, CMD_FLASH },
+    { CTAP_GET_ASSERTION, cbor_get_first_assertion, CMD_FLASH },
+    { CTAP_GET_INFO, cbor_get_info, 0 },
+    { CTAP_CLIENT_PIN, cbor_client_pin, CMD_FLASH },
+    { CTAP_RESET, cbor_reset, CMD_FLASH },
+    { CTAP_GET_NEXT_ASSERTION, cbor_get_next_assertion, CMD_FLASH },
+    { CTAP_SELECTION, cbor_selection, 0 },
+    { CTAP_CREDENTIAL_MGMT, cbor_cred_mgmt, CMD_FLASH },
+    { 0x41, cbor_cred_mgmt, CMD_FLASH }, // Preview of credential management
+    { CTAP_CONFIG, cbor_config, CMD_FLASH },
+    { CTAP_LARGE_BLOBS, cbor_large_blobs, CMD_FLASH },
+    { 0x00, 0x0 }
+};
+static cmd_table_t ctap_table = { .cmds = ctap_cmds };
+
+static int cbor_parse_cmd(uint8_t cmd, const uint8_t *data, size_t len) {
     if (len == 0 && cmd == CTAPHID_CBOR) {
         return CTAP1_ERR_INVALID_LEN;
     }
@@ -60,35 +84,13 @@ int cbor_parse(uint8_t cmd, const uint8_t *data, size_t len) {
     if (cap_supported(CAP_FIDO2)) {
         driver_prepare_response_hid();
         if (cmd == CTAPHID_CBOR) {
-            if (data[0] == CTAP_MAKE_CREDENTIAL) {
-                return cbor_make_credential(data + 1, len - 1);
-            }
-            if (data[0] == CTAP_GET_INFO) {
-                return cbor_get_info();
-            }
-            else if (data[0] == CTAP_RESET) {
-                return cbor_reset();
-            }
-            else if (data[0] == CTAP_CLIENT_PIN) {
-                return cbor_client_pin(data + 1, len - 1);
-            }
-            else if (data[0] == CTAP_GET_ASSERTION) {
-                return cbor_get_assertion(data + 1, len - 1, false);
-            }
-            else if (data[0] == CTAP_GET_NEXT_ASSERTION) {
-                return cbor_get_next_assertion(data + 1, len - 1);
-            }
-            else if (data[0] == CTAP_SELECTION) {
-                return cbor_selection();
-            }
-            else if (data[0] == CTAP_CREDENTIAL_MGMT || data[0] == 0x41) {
-                return cbor_cred_mgmt(data + 1, len - 1);
-            }
-            else if (data[0] == CTAP_CONFIG) {
-                return cbor_config(data + 1, len - 1);
-            }
-            else if (data[0] == CTAP_LARGE_BLOBS) {
-                return cbor_large_blobs(data + 1, len - 1);
+            const cmd_t *c = cmd_find(&ctap_table, data[0]);
+            if (c) {
+                int ret = c->cmd_handler(data + 1, len - 1);
+                if (c->flags & CMD_FLASH) {
+                    low_flash_available();
+                }
+                return ret;
             }
         }
         else if (cmd == CTAP_VENDOR_CBOR) {
@@ -104,6 +106,21 @@ int cbor_parse(uint8_t cmd, const uint8_t *data, size_t len) {
     return CTAP1_ERR_INVALID_CMD;
 }
 
+int cbor_parse(uint8_t cmd, const uint8_t *data, size_t len) {
+    if (cmd == CTAPHID_CBOR && len > 0) {
+        TELEMETRY_BEGIN(TELEMETRY_TYPE_CTAP, data[0]);
+    }
+    else {
+        TELEMETRY_BEGIN(TELEMETRY_TYPE_CTAPHID, cmd);
+    }
+    int ret = cbor_parse_cmd(cmd, data, len);
+    paut = NULL; // A token only authenticates the command that carried it
+    TELEMETRY_END();
+    flash_wear_task();
+    arena_reset();
+    return ret;
+}
+
 #ifndef ENABLE_EMULATION
 void cbor_thread() {
 
@@ -213,11 +230,11 @@ CborError COSE_key(mbedtls_ecp_keypair *key, CborEncoder *mapEncoderParent,
 CborError COSE_key_shared(mbedtls_ecdh_context *key,
                           CborEncoder *mapEncoderParent,
                           CborEncoder *mapEncoder) {
-    int crv = mbedtls_curve_to_fido(key->ctx.mbed_ecdh.grp.id), alg = FIDO2_ALG_ECDH_ES_HKDF_256;
+    int crv = mbedtls_curve_to_fido(key->grp.id), alg = FIDO2_ALG_ECDH_ES_HKDF_256;
     return COSE_key_params(crv,
                            alg,
-                           &key->ctx.mbed_ecdh.grp,
-                           &key->ctx.mbed_ecdh.Q,
+                           &key->grp,
+                           &key->Q,
                            mapEncoderParent,
                            mapEncoder);
 }
@@ -253,10 +270,10 @@ CborError COSE_read_key(CborValue *f,
             CBOR_FIELD_GET_INT(*crv, 0);
         }
         else if (kkey == -2) {
-            CBOR_FIELD_GET_BYTES(*kax, 0);
+            CBOR_FIELD_VIEW_BYTES(*kax, 0);
         }
         else if (kkey == -3) {
-            CBOR_FIELD_GET_BYTES(*kay, 0);
+            CBOR_FIELD_VIEW_BYTES(*kay, 0);
         }
         else {
             CBOR_ADVANCE(0);
@@ -266,3 +283,184 @@ CborError COSE_read_key(CborValue *f,
 err:
     return error;
 }
+
+#define CBOR_MAX_DEPTH  8
+
+// Decodes the head of an item in p and returns the first byte after it, or NULL if it is not in
+// its shortest form or it has an indefinite length.
+static const uint8_t *cbor_canonical_head(const uint8_t *p, const uint8_t *end, uint64_t *arg) {
+    if (p >= end) {
+        return NULL;
+    }
+    uint8_t mt = *p >> 5, ai = *p & 0x1F;
+    if (ai < 24) {
+        *arg = ai;
+        return p + 1;
+    }
+    if (ai > 27) {
+        return NULL;
+    }
+    size_t n = 1 << (ai - 24);
+    if ((size_t) (end - p - 1) < n) {
+        return NULL;
+    }
+    uint64_t v = 0;
+    for (size_t i = 1; i <= n; i++) {
+        v = (v << 8) | p[i];
+    }
+    if (mt == 7) { // Floats are taken as they come, simple values must not fit in the initial byte
+        if (ai == 24 && v < 32) {
+            return NULL;
+        }
+    }
+    else if ((ai == 24 && v < 24) || (ai > 24 && (v >> (4 << (ai - 24))) == 0)) {
+        return NULL;
+    }
+    *arg = v;
+    return p + 1 + n;
+}
+
+// Map keys sort by major type, then by encoded length and then bytewise (CTAP2 canonical form)
+static int cbor_key_cmp(const uint8_t *a, size_t alen, const uint8_t *b, size_t blen) {
+    if ((a[0] >> 5) != (b[0] >> 5)) {
+        return (a[0] >> 5) - (b[0] >> 5);
+    }
+    if (alen != blen) {
+        return alen < blen ? -1 : 1;
+    }
+    return memcmp(a, b, alen);
+}
+
+// Returns the first byte after the item in p, or NULL if it is not canonical.
+static const uint8_t *cbor_canonical_skip(const uint8_t *p, const uint8_t *end, uint8_t depth) {
+    uint64_t arg = 0;
+    if (p >= end || depth > CBOR_MAX_DEPTH) {
+        return NULL;
+    }
+    uint8_t mt = *p >> 5;
+    if (!(p = cbor_canonical_head(p, end, &arg))) {
+        return NULL;
+    }
+    if (mt == 2 || mt == 3) {
+        return arg <= (uint64_t) (end - p) ? p + arg : NULL;
+    }
+    if (mt == 4) {
+        for (; arg > 0 && p; arg--) {
+            p = cbor_canonical_skip(p, end, depth + 1);
+        }
+    }
+    else if (mt == 5) {
+        const uint8_t *prev = NULL;
+        size_t prev_len = 0;
+        for (; arg > 0 && p; arg--) {
+            const uint8_t *key = p;
+            if (!(p = cbor_canonical_skip(key, end, depth + 1))) {
+                return NULL;
+            }
+            if (prev && cbor_key_cmp(prev, prev_len, key, p - key) >= 0) {
+                return NULL;
+            }
+            prev = key;
+            prev_len = p - key;
+            p = cbor_canonical_skip(p, end, depth + 1);
+        }
+    }
+    else if (mt == 6) {
+        p = cbor_canonical_skip(p, end, depth + 1);
+    }
+    return p;
+}
+
+// Copies a byte or text string to the request arena, NUL terminated as tinycbor does
+CborError cbor_arena_dup_string(CborValue *it, void **data, size_t *len) {
+    CborError error = CborNoError;
+    *data = NULL;
+    CBOR_CHECK(cbor_value_calculate_string_length(it, len));
+    *data = arena_alloc(*len + 1);
+    if (!*data) {
+        CBOR_ERROR(CTAP2_ERR_PROCESSING);
+    }
+    size_t n = *len + 1;
+    if (cbor_value_is_text_string(it)) {
+        CBOR_CHECK(cbor_value_copy_text_string(it, (char *) *data, &n, it));
+    }
+    else {
+        CBOR_CHECK(cbor_value_copy_byte_string(it, (uint8_t *) *data, &n, it));
+    }
+err:
+    if (error != CborNoError && *data) {
+        arena_free(*data);
+        *data = NULL;
+    }
+    return error;
+}
+
+CborError cbor_string_view(const CborValue *it, const uint8_t **data, size_t *len) {
+    CborError error = CborNoError;
+    // Only definite-length strings follow their head. Some callers parse input that was not
+    // checked to be canonical, so a chunked string is rejected here instead of viewed.
+    if (!cbor_value_is_length_known(it)) {
+        CBOR_ERROR(CTAP2_ERR_INVALID_CBOR);
+    }
+    CBOR_CHECK(cbor_value_get_string_length(it, len));
+    const uint8_t *p = cbor_value_get_next_byte(it);
+    uint8_t ai = *p & 0x1F;
+    if (ai > 27) {
+        CBOR_ERROR(CTAP2_ERR_INVALID_CBOR);
+    }
+    *data = p + (ai < 24 ? 1 : 1 + (1 << (ai - 24)));
+err:
+    return error;
+}
+
+CborError cbor_parse_params(const uint8_t *data,
+                            size_t len,
+                            CborParser *parser,
+                            const uint16_t *schema,
+                            size_t schema_len,
+                            cbor_params_t *params) {
+    CborValue map, it;
+    CborError error = CborNoError;
+    const uint8_t *p = data, *end = data + len;
+    uint64_t items = 0, key = 0, last = 0;
+    params->present = 0;
+    CBOR_CHECK(cbor_parser_init(data, len, 0, parser, &map));
+    if (cbor_value_is_map(&map) == false) {
+        CBOR_ERROR(CTAP2_ERR_CBOR_UNEXPECTED_TYPE);
+    }
+    if (!(p = cbor_canonical_head(p, end, &items))) {
+        CBOR_ERROR(CTAP2_ERR_INVALID_CBOR);
+    }
+    CBOR_CHECK(cbor_value_enter_container(&map, &it));
+    for (uint64_t i = 0; i < items; i++) {
+        if (p >= end || (*p >> 5) != 0) {
+            CBOR_ERROR(CTAP2_ERR_CBOR_UNEXPECTED_TYPE);
+        }
+        if (!(p = cbor_canonical_head(p, end, &key)) || (i > 0 && key <= last)) {
+            CBOR_ERROR(CTAP2_ERR_INVALID_CBOR);
+        }
+        last = key;
+        const uint8_t *val = p;
+        if (!(p = cbor_canonical_skip(val, end, 1))) {
+            CBOR_ERROR(CTAP2_ERR_INVALID_CBOR);
+        }
+        CBOR_CHECK(cbor_value_advance_fixed(&it));
+        // Unknown keys are ignored, as the specification asks for
+        if (key < schema_len && key < CBOR_PARAMS_MAX && schema[key] != 0) {
+            if (!(schema[key] & (1 << (*val >> 5)))) {
+                CBOR_ERROR(CTAP2_ERR_CBOR_UNEXPECTED_TYPE);
+            }
+            params->value[key] = it;
+            params->present |= 1 << key;
+        }
+        CBOR_CHECK(cbor_value_advance(&it));
+    }
+    CBOR_CHECK(cbor_value_leave_container(&map, &it));
+    for (size_t k = 0; k < schema_len && k < CBOR_PARAMS_MAX; k++) {
+        if ((schema[k] & CBOR_PARAM_REQUIRED) && !CBOR_PARAM_PRESENT(*params, k)) {
+            CBOR_ERROR(CTAP2_ERR_MISSING_PARAMETER);
+        }
+    }
+err:
+    return error;
+}
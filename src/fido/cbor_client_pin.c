@@ -20,6 +20,7 @@
 #include "mbedtls/ecdh.h"
 #include "mbedtls/sha256.h"
 #include "mbedtls/hkdf.h"
+#include "mbedtls/constant_time.h"
 #include "cbor.h"
 #include "ctap.h"
 #include "ctap2_cbor.h"
@@ -34,62 +35,113 @@
 #include "pico_keys.h"
 #include "apdu.h"
 
-uint32_t usage_timer = 0, initial_usage_time_limit = 0;
+uint32_t initial_usage_time_limit = TRANSPORT_TIME_LIMIT;
 uint32_t max_usage_time_period  = 600 * 1000;
 bool needs_power_cycle = false;
 static mbedtls_ecdh_context hkey;
 static bool hkey_init = false;
 
+/* PIN/UV auth token sessions. Each token issued by getPinUvAuthToken keeps its own scope and timers,
+ * so a new token does not revoke the others. They live in RAM, so they survive a restart of the
+ * card thread but not a power cycle. paut is the session that authenticated the current command. */
+static pinUvAuthToken_t sessions[MAX_PIN_UV_AUTH_TOKENS];
+pinUvAuthToken_t *paut = NULL;
+
+static void pinUvAuthTokenSetKey(pinUvAuthToken_t *t) {
+    uint8_t pad[64];
+    memset(pad, 0x36, sizeof(pad));
+    for (int i = 0; i < sizeof(t->data); i++) {
+        pad[i] ^= t->data[i];
+    }
+    mbedtls_sha256_init(&t->hmac_inner);
+    mbedtls_sha256_starts(&t->hmac_inner, 0);
+    mbedtls_sha256_update(&t->hmac_inner, pad, sizeof(pad));
+    for (int i = 0; i < sizeof(pad); i++) {
+        pad[i] ^= 0x36 ^ 0x5c;
+    }
+    mbedtls_sha256_init(&t->hmac_outer);
+    mbedtls_sha256_starts(&t->hmac_outer, 0);
+    mbedtls_sha256_update(&t->hmac_outer, pad, sizeof(pad));
+    mbedtls_platform_zeroize(pad, sizeof(pad));
+}
+
+static void pinUvAuthTokenHmac(const pinUvAuthToken_t *t,
+                               const uint8_t *data,
+                               size_t len,
+                               uint8_t *hmac) {
+    mbedtls_sha256_context ctx;
+    mbedtls_sha256_init(&ctx);
+    mbedtls_sha256_clone(&ctx, &t->hmac_inner);
+    mbedtls_sha256_update(&ctx, data, len);
+    mbedtls_sha256_finish(&ctx, hmac);
+    mbedtls_sha256_clone(&ctx, &t->hmac_outer);
+    mbedtls_sha256_update(&ctx, hmac, 32);
+    mbedtls_sha256_finish(&ctx, hmac);
+    mbedtls_sha256_free(&ctx);
+}
+
+static void pinUvAuthTokenStop(pinUvAuthToken_t *t) {
+    mbedtls_sha256_free(&t->hmac_inner);
+    mbedtls_sha256_free(&t->hmac_outer);
+    mbedtls_platform_zeroize(t, sizeof(pinUvAuthToken_t));
+    if (paut == t) {
+        paut = NULL;
+    }
+}
+
 int beginUsingPinUvAuthToken(bool userIsPresent) {
-    paut.user_present = userIsPresent;
-    paut.user_verified = true;
-    initial_usage_time_limit = board_millis();
-    usage_timer = board_millis();
-    paut.in_use = true;
+    pinUvAuthToken_t *t = &sessions[0];
+    for (int i = 0; i < MAX_PIN_UV_AUTH_TOKENS; i++) {
+        if (sessions[i].in_use == false) {
+            t = &sessions[i];
+            break;
+        }
+        if (sessions[i].last_used < t->last_used) {
+            t = &sessions[i];
+        }
+    }
+    pinUvAuthTokenStop(t);
+    random_gen(NULL, t->data, sizeof(t->data));
+    pinUvAuthTokenSetKey(t);
+    t->user_present = userIsPresent;
+    t->user_verified = true;
+    t->usage_timer = t->last_used = board_millis();
+    t->in_use = true;
+    paut = t;
     return 0;
 }
 
 void clearUserPresentFlag() {
-    if (paut.in_use == true) {
-        paut.user_present = false;
+    if (paut && paut->in_use == true) {
+        paut->user_present = false;
     }
 }
 
 void clearUserVerifiedFlag() {
-    if (paut.in_use == true) {
-        paut.user_verified = false;
+    if (paut && paut->in_use == true) {
+        paut->user_verified = false;
     }
 }
 
 void clearPinUvAuthTokenPermissionsExceptLbw() {
-    if (paut.in_use == true) {
-        paut.permissions = CTAP_PERMISSION_LBW;
+    if (paut && paut->in_use == true) {
+        paut->permissions = CTAP_PERMISSION_LBW;
     }
 }
 
 void stopUsingPinUvAuthToken() {
-    paut.permissions = 0;
-    usage_timer = 0;
-    paut.in_use = false;
-    memset(paut.rp_id_hash, 0, sizeof(paut.rp_id_hash));
-    paut.has_rp_id = false;
-    initial_usage_time_limit = 0;
-    paut.user_present = paut.user_verified = false;
+    if (paut) {
+        pinUvAuthTokenStop(paut);
+    }
     user_present_time_limit = 0;
 }
 
 bool getUserPresentFlagValue() {
-    if (paut.in_use != true) {
-        paut.user_present = false;
-    }
-    return paut.user_present;
+    return paut && paut->in_use == true && paut->user_present;
 }
 
 bool getUserVerifiedFlagValue() {
-    if (paut.in_use != true) {
-        paut.user_verified = false;
-    }
-    return paut.user_verified;
+    return paut && paut->in_use == true && paut->user_verified;
 }
 
 int regenerate() {
@@ -100,12 +152,12 @@ int regenerate() {
     mbedtls_ecdh_init(&hkey);
     hkey_init = true;
     mbedtls_ecdh_setup(&hkey, MBEDTLS_ECP_DP_SECP256R1);
-    int ret = mbedtls_ecdh_gen_public(&hkey.ctx.mbed_ecdh.grp,
-                                      &hkey.ctx.mbed_ecdh.d,
-                                      &hkey.ctx.mbed_ecdh.Q,
+    int ret = mbedtls_ecdh_gen_public(&hkey.grp,
+                                      &hkey.d,
+                                      &hkey.Q,
                                       random_gen,
                                       NULL);
-    mbedtls_mpi_lset(&hkey.ctx.mbed_ecdh.Qp.Z, 1);
+    mbedtls_mpi_lset(&hkey.Qp.Z, 1);
     if (ret != 0) {
         return ret;
     }
@@ -152,29 +204,40 @@ int kdf(uint8_t protocol, const mbedtls_mpi *z, uint8_t *sharedSecret) {
     return -1;
 }
 
+/* Shared secret with the peer key Q. With a restart context, the scalar multiplication stops
+ * after the ECP budget and returns MBEDTLS_ERR_ECP_IN_PROGRESS; it is resumed by calling again
+ * with the same R and rs_ctx. */
+int ecdh_restartable(uint8_t protocol,
+                     const mbedtls_ecp_point *Q,
+                     mbedtls_ecp_point *R,
+                     mbedtls_ecp_restart_ctx *rs_ctx,
+                     uint8_t *sharedSecret,
+                     int (*f_rng)(void *, unsigned char *, size_t),
+                     void *p_rng) {
+    int ret = mbedtls_ecp_mul_restartable(&hkey.grp, R, &hkey.d, Q, f_rng, p_rng, rs_ctx);
+    if (ret != 0) {
+        return ret;
+    }
+    if (mbedtls_ecp_is_zero(R)) {
+        return MBEDTLS_ERR_ECP_BAD_INPUT_DATA;
+    }
+    return kdf(protocol, &R->X, sharedSecret);
+}
+
 int ecdh(uint8_t protocol, const mbedtls_ecp_point *Q, uint8_t *sharedSecret) {
-    mbedtls_mpi z;
-    mbedtls_mpi_init(&z);
-    int ret = mbedtls_ecdh_compute_shared(&hkey.ctx.mbed_ecdh.grp,
-                                          &z,
-                                          Q,
-                                          &hkey.ctx.mbed_ecdh.d,
-                                          random_gen,
-                                          NULL);
-    ret = kdf(protocol, &z, sharedSecret);
-    mbedtls_mpi_free(&z);
+    TELEMETRY_PHASE_START(t);
+    mbedtls_ecp_point R;
+    mbedtls_ecp_point_init(&R);
+    int ret = ecdh_restartable(protocol, Q, &R, NULL, sharedSecret, random_gen, NULL);
+    mbedtls_ecp_point_free(&R);
+    TELEMETRY_PHASE_END(TELEMETRY_PHASE_CRYPTO, t);
     return ret;
 }
 
 int resetPinUvAuthToken() {
-    uint8_t t[32];
-    random_gen(NULL, t, sizeof(t));
-    flash_write_data_to_file(ef_authtoken, t, sizeof(t));
-    paut.permissions = 0;
-    paut.data = file_get_data(ef_authtoken);
-    paut.len = file_get_size(ef_authtoken);
-
-    low_flash_available();
+    for (int i = 0; i < MAX_PIN_UV_AUTH_TOKENS; i++) {
+        pinUvAuthTokenStop(&sessions[i]);
+    }
     return 0;
 }
 
@@ -230,8 +293,6 @@ int authenticate(uint8_t protocol,
 
 int verify(uint8_t protocol, const uint8_t *key, const uint8_t *data, size_t len, uint8_t *sign) {
     uint8_t hmac[32];
-    //if (paut.in_use == false)
-    //    return -2;
     int ret =
         mbedtls_md_hmac(mbedtls_md_info_from_type(MBEDTLS_MD_SHA256), key, 32, data, len, hmac);
     if (ret != 0) {
@@ -255,82 +316,99 @@ int getPublicKey() {
     return 0;
 }
 
-int pinUvAuthTokenUsageTimerObserver() {
-    if (usage_timer == 0) {
-        return -1;
-    }
-    if (usage_timer + max_usage_time_period > board_millis()) {
-        if (user_present_time_limit == 0 ||
-            user_present_time_limit + TRANSPORT_TIME_LIMIT < board_millis()) {
-            clearUserPresentFlag();
-        }
-        if (paut.in_use == true) {
-            if (initial_usage_time_limit == 0 ||
-                initial_usage_time_limit + TRANSPORT_TIME_LIMIT < board_millis()) {
-                stopUsingPinUvAuthToken();
-                return 1;
-            }
-        }
-        // TO DO: implement a rolling timer
+/* A token expires max_usage_time_period after it was issued, or initial_usage_time_limit after it
+ * was issued if it was not used in between. Its user present flag does not outlive the user
+ * presence time limit. */
+static int pinUvAuthTokenUsageTimerObserver(pinUvAuthToken_t *t) {
+    uint32_t now = board_millis();
+    if (now - t->usage_timer >= max_usage_time_period ||
+        (t->used == false && now - t->usage_timer >= initial_usage_time_limit)) {
+        pinUvAuthTokenStop(t);
+        return 1;
+    }
+    if (user_present_time_limit == 0 || now - user_present_time_limit > TRANSPORT_TIME_LIMIT) {
+        t->user_present = false;
     }
     return 0;
 }
 
+int checkPinUvAuthToken(uint8_t protocol,
+                        const uint8_t *data,
+                        size_t len,
+                        const uint8_t *sign,
+                        uint8_t permissions,
+                        const uint8_t *rp_id_hash) {
+    static pinUvAuthToken_t *last = NULL;
+    uint8_t hmac[32];
+    paut = NULL;
+    if (protocol != 1 && protocol != 2) {
+        return CTAP2_ERR_PIN_AUTH_INVALID;
+    }
+    // Platforms usually stick to one token, so the last one used is tried first
+    for (int i = -1; i < MAX_PIN_UV_AUTH_TOKENS; i++) {
+        pinUvAuthToken_t *t = i < 0 ? last : &sessions[i];
+        if (t == NULL || (i >= 0 && t == last) || t->in_use == false ||
+            pinUvAuthTokenUsageTimerObserver(t) != 0) {
+            continue;
+        }
+        pinUvAuthTokenHmac(t, data, len, hmac);
+        if (mbedtls_ct_memcmp(hmac, sign, protocol == 1 ? 16 : 32) != 0) {
+            continue;
+        }
+        mbedtls_platform_zeroize(hmac, sizeof(hmac));
+        if ((t->permissions & permissions) != permissions ||
+            (rp_id_hash && t->has_rp_id == true && memcmp(t->rp_id_hash, rp_id_hash, 32) != 0)) {
+            return CTAP2_ERR_PIN_AUTH_INVALID;
+        }
+        t->used = true;
+        t->last_used = board_millis();
+        last = paut = t;
+        return 0;
+    }
+    mbedtls_platform_zeroize(hmac, sizeof(hmac));
+    return CTAP2_ERR_PIN_AUTH_INVALID;
+}
+
 uint8_t new_pin_mismatches = 0;
 
+static const uint16_t client_pin_params[] = {
+    [0x01] = CBOR_PARAM_UINT | CBOR_PARAM_REQUIRED,     // pinUvAuthProtocol
+    [0x02] = CBOR_PARAM_UINT | CBOR_PARAM_REQUIRED,     // subCommand
+    [0x03] = CBOR_PARAM_MAP,                            // keyAgreement
+    [0x04] = CBOR_PARAM_BYTES,                          // pinUvAuthParam
+    [0x05] = CBOR_PARAM_BYTES,                          // newPinEnc
+    [0x06] = CBOR_PARAM_BYTES,                          // pinHashEnc
+    [0x09] = CBOR_PARAM_UINT,                           // permissions
+    [0x0A] = CBOR_PARAM_TEXT,                           // rpId
+};
+
 int cbor_client_pin(const uint8_t *data, size_t len) {
     size_t resp_size = 0;
     uint64_t subcommand = 0x0, pinUvAuthProtocol = 0, permissions = 0;
     int64_t kty = 0, alg = 0, crv = 0;
     CborParser parser;
     CborEncoder encoder, mapEncoder;
-    CborValue map;
+    cbor_params_t params;
     CborError error = CborNoError;
     CborByteString pinUvAuthParam = { 0 }, newPinEnc = { 0 }, pinHashEnc = { 0 }, kax = { 0 },
                    kay = { 0 };
     CborCharString rpId = { 0 };
-    CBOR_CHECK(cbor_parser_init(data, len, 0, &parser, &map));
-    uint64_t val_c = 1;
     if (hkey_init == false) {
         initialize();
     }
-    CBOR_PARSE_MAP_START(map, 1)
-    {
-        uint64_t val_u = 0;
-        CBOR_FIELD_GET_UINT(val_u, 1);
-        if (val_c <= 2 && val_c != val_u) {
-            CBOR_ERROR(CTAP2_ERR_MISSING_PARAMETER);
-        }
-        if (val_u < val_c) {
-            CBOR_ERROR(CTAP2_ERR_INVALID_CBOR);
-        }
-        val_c = val_u + 1;
-        if (val_u == 0x01) {
-            CBOR_FIELD_GET_UINT(pinUvAuthProtocol, 1);
-        }
-        else if (val_u == 0x02) {
-            CBOR_FIELD_GET_UINT(subcommand, 1);
-        }
-        else if (val_u == 0x03) {
-            CBOR_CHECK(COSE_read_key(&_f1, &kty, &alg, &crv, &kax, &kay));
-        }
-        else if (val_u == 0x04) {
-            CBOR_FIELD_GET_BYTES(pinUvAuthParam, 1);
-        }
-        else if (val_u == 0x05) {
-            CBOR_FIELD_GET_BYTES(newPinEnc, 1);
-        }
-        else if (val_u == 0x06) {
-            CBOR_FIELD_GET_BYTES(pinHashEnc, 1);
-        }
-        else if (val_u == 0x09) {
-            CBOR_FIELD_GET_UINT(permissions, 1);
-        }
-        else if (val_u == 0x0A) {
-            CBOR_FIELD_GET_TEXT(rpId, 1);
-        }
-    }
-    CBOR_PARSE_MAP_END(map, 1);
+    CBOR_CHECK(cbor_parse_params(data, len, &parser, client_pin_params,
+                                 sizeof(client_pin_params) / sizeof(uint16_t), &params));
+    CBOR_PARAM_GET_UINT(params, 0x01, pinUvAuthProtocol);
+    CBOR_PARAM_GET_UINT(params, 0x02, subcommand);
+    if (CBOR_PARAM_PRESENT(params, 0x03)) {
+        CBOR_CHECK(COSE_read_key(&params.value[0x03], &kty, &alg, &crv, &kax, &kay));
+    }
+    CBOR_PARAM_GET_STRING(params, 0x04, pinUvAuthParam);
+    CBOR_PARAM_GET_STRING(params, 0x05, newPinEnc);
+    CBOR_PARAM_GET_STRING(params, 0x06, pinHashEnc);
+    CBOR_PARAM_GET_UINT(params, 0x09, permissions);
+    CBOR_PARAM_GET_STRING(params, 0x0A, rpId);
+    TELEMETRY_PARSED();
 
     cbor_encoder_init(&encoder, ctap_resp->init.data + 1, CTAP_MAX_PACKET_SIZE, 0);
     if (subcommand == 0x0) {
@@ -375,14 +453,14 @@ int cbor_client_pin(const uint8_t *data, size_t len) {
             (pinUvAuthProtocol == 2 && newPinEnc.len != 64 + IV_SIZE)) {
             CBOR_ERROR(CTAP1_ERR_INVALID_PARAMETER);
         }
-        if (mbedtls_mpi_read_binary(&hkey.ctx.mbed_ecdh.Qp.X, kax.data, kax.len) != 0) {
+        if (mbedtls_mpi_read_binary(&hkey.Qp.X, kax.data, kax.len) != 0) {
             CBOR_ERROR(CTAP1_ERR_INVALID_PARAMETER);
         }
-        if (mbedtls_mpi_read_binary(&hkey.ctx.mbed_ecdh.Qp.Y, kay.data, kay.len) != 0) {
+        if (mbedtls_mpi_read_binary(&hkey.Qp.Y, kay.data, kay.len) != 0) {
             CBOR_ERROR(CTAP1_ERR_INVALID_PARAMETER);
         }
         uint8_t sharedSecret[64];
-        int ret = ecdh(pinUvAuthProtocol, &hkey.ctx.mbed_ecdh.Qp, sharedSecret);
+        int ret = ecdh(pinUvAuthProtocol, &hkey.Qp, sharedSecret);
         if (ret != 0) {
             mbedtls_platform_zeroize(sharedSecret, sizeof(sharedSecret));
             CBOR_ERROR(CTAP1_ERR_INVALID_PARAMETER);
@@ -441,14 +519,14 @@ int cbor_client_pin(const uint8_t *data, size_t len) {
              (newPinEnc.len != 64 + IV_SIZE || pinHashEnc.len != 16 + IV_SIZE))) {
             CBOR_ERROR(CTAP1_ERR_INVALID_PARAMETER);
         }
-        if (mbedtls_mpi_read_binary(&hkey.ctx.mbed_ecdh.Qp.X, kax.data, kax.len) != 0) {
+        if (mbedtls_mpi_read_binary(&hkey.Qp.X, kax.data, kax.len) != 0) {
             CBOR_ERROR(CTAP1_ERR_INVALID_PARAMETER);
         }
-        if (mbedtls_mpi_read_binary(&hkey.ctx.mbed_ecdh.Qp.Y, kay.data, kay.len) != 0) {
+        if (mbedtls_mpi_read_binary(&hkey.Qp.Y, kay.data, kay.len) != 0) {
             CBOR_ERROR(CTAP1_ERR_INVALID_PARAMETER);
         }
         uint8_t sharedSecret[64];
-        int ret = ecdh(pinUvAuthProtocol, &hkey.ctx.mbed_ecdh.Qp, sharedSecret);
+        int ret = ecdh(pinUvAuthProtocol, &hkey.Qp, sharedSecret);
         if (ret != 0) {
             mbedtls_platform_zeroize(sharedSecret, sizeof(sharedSecret));
             CBOR_ERROR(CTAP1_ERR_INVALID_PARAMETER);
@@ -520,15 +598,20 @@ int cbor_client_pin(const uint8_t *data, size_t len) {
             memcmp(hsh + 2, file_get_data(ef_pin) + 2, 16) == 0) {
             CBOR_ERROR(CTAP2_ERR_PIN_POLICY_VIOLATION);
         }
+        low_flash_txn_begin();
         flash_write_data_to_file(ef_pin, hsh, 2 + 16);
         if (file_has_data(ef_minpin) && file_get_data(ef_minpin)[1] == 1) {
-            uint8_t *tmp = (uint8_t *) calloc(1, file_get_size(ef_minpin));
+            uint8_t *tmp = (uint8_t *) arena_alloc(file_get_size(ef_minpin));
+            if (!tmp) {
+                low_flash_txn_commit();
+                CBOR_ERROR(CTAP2_ERR_PROCESSING);
+            }
             memcpy(tmp, file_get_data(ef_minpin), file_get_size(ef_minpin));
             tmp[1] = 0;
             flash_write_data_to_file(ef_minpin, tmp, file_get_size(ef_minpin));
-            free(tmp);
+            arena_free(tmp);
         }
-        low_flash_available();
+        low_flash_txn_commit();
         resetPinUvAuthToken();
         goto err; // No return
     }
@@ -558,14 +641,14 @@ int cbor_client_pin(const uint8_t *data, size_t len) {
         if (*file_get_data(ef_pin) == 0) {
             CBOR_ERROR(CTAP2_ERR_PIN_BLOCKED);
         }
-        if (mbedtls_mpi_read_binary(&hkey.ctx.mbed_ecdh.Qp.X, kax.data, kax.len) != 0) {
+        if (mbedtls_mpi_read_binary(&hkey.Qp.X, kax.data, kax.len) != 0) {
             CBOR_ERROR(CTAP1_ERR_INVALID_PARAMETER);
         }
-        if (mbedtls_mpi_read_binary(&hkey.ctx.mbed_ecdh.Qp.Y, kay.data, kay.len) != 0) {
+        if (mbedtls_mpi_read_binary(&hkey.Qp.Y, kay.data, kay.len) != 0) {
             CBOR_ERROR(CTAP1_ERR_INVALID_PARAMETER);
         }
         uint8_t sharedSecret[64];
-        int ret = ecdh(pinUvAuthProtocol, &hkey.ctx.mbed_ecdh.Qp, sharedSecret);
+        int ret = ecdh(pinUvAuthProtocol, &hkey.Qp, sharedSecret);
         if (ret != 0) {
             mbedtls_platform_zeroize(sharedSecret, sizeof(sharedSecret));
             CBOR_ERROR(CTAP1_ERR_INVALID_PARAMETER);
@@ -605,21 +688,20 @@ int cbor_client_pin(const uint8_t *data, size_t len) {
         if (file_has_data(ef_minpin) && file_get_data(ef_minpin)[1] == 1) {
             CBOR_ERROR(CTAP2_ERR_PIN_INVALID);
         }
-        resetPinUvAuthToken();
         beginUsingPinUvAuthToken(false);
         if (subcommand == 0x05) {
             permissions = CTAP_PERMISSION_MC | CTAP_PERMISSION_GA;
         }
-        paut.permissions = permissions;
+        paut->permissions = permissions;
         if (rpId.present == true) {
-            mbedtls_sha256((uint8_t *) rpId.data, rpId.len, paut.rp_id_hash, 0);
-            paut.has_rp_id = true;
+            mbedtls_sha256((uint8_t *) rpId.data, rpId.len, paut->rp_id_hash, 0);
+            paut->has_rp_id = true;
         }
         else {
-            paut.has_rp_id = false;
+            paut->has_rp_id = false;
         }
         uint8_t pinUvAuthToken_enc[32 + IV_SIZE];
-        encrypt(pinUvAuthProtocol, sharedSecret, paut.data, 32, pinUvAuthToken_enc);
+        encrypt(pinUvAuthProtocol, sharedSecret, paut->data, 32, pinUvAuthToken_enc);
         CBOR_CHECK(cbor_encoder_create_map(&encoder, &mapEncoder, 1));
         CBOR_CHECK(cbor_encode_uint(&mapEncoder, 0x02));
         CBOR_CHECK(cbor_encode_byte_string(&mapEncoder, pinUvAuthToken_enc, 32 + poff));
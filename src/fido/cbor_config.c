@@ -115,25 +115,25 @@ int cbor_config(const uint8_t *data, size_t len) {
         CBOR_ERROR(CTAP2_ERR_MISSING_PARAMETER);
     }
 
-    uint8_t *verify_payload = (uint8_t *) calloc(1, 32 + 1 + 1 + raw_subpara_len);
+    uint8_t *verify_payload = (uint8_t *) arena_alloc(32 + 1 + 1 + raw_subpara_len);
+    if (!verify_payload) {
+        CBOR_ERROR(CTAP2_ERR_PROCESSING);
+    }
     memset(verify_payload, 0xff, 32);
     verify_payload[32] = 0x0d;
     verify_payload[33] = subcommand;
     memcpy(verify_payload + 34, raw_subpara, raw_subpara_len);
-    error = verify(pinUvAuthProtocol,
-                   paut.data,
-                   verify_payload,
-                   32 + 1 + 1 + raw_subpara_len,
-                   pinUvAuthParam.data);
-    free(verify_payload);
+    error = checkPinUvAuthToken(pinUvAuthProtocol,
+                                verify_payload,
+                                32 + 1 + 1 + raw_subpara_len,
+                                pinUvAuthParam.data,
+                                CTAP_PERMISSION_ACFG,
+                                NULL);
+    arena_free(verify_payload);
     if (error != CborNoError) {
         CBOR_ERROR(CTAP2_ERR_PIN_AUTH_INVALID);
     }
 
-    if (!(paut.permissions & CTAP_PERMISSION_ACFG)) {
-        CBOR_ERROR(CTAP2_ERR_PIN_AUTH_INVALID);
-    }
-
     if (subcommand == 0x7f) {
         if (vendorCommandId == CTAP_CONFIG_AUT_DISABLE) {
             if (!file_has_data(ef_keydev_enc)) {
@@ -142,10 +142,11 @@ int cbor_config(const uint8_t *data, size_t len) {
             if (has_keydev_dec == false) {
                 CBOR_ERROR(CTAP2_ERR_PIN_AUTH_INVALID);
             }
+            low_flash_txn_begin();
             flash_write_data_to_file(ef_keydev, keydev_dec, sizeof(keydev_dec));
             mbedtls_platform_zeroize(keydev_dec, sizeof(keydev_dec));
             flash_write_data_to_file(ef_keydev_enc, NULL, 0); // Set ef to 0 bytes
-            low_flash_available();
+            low_flash_txn_commit();
         }
         else if (vendorCommandId == CTAP_CONFIG_AUT_ENABLE) {
             if (!file_has_data(ef_keydev)) {
@@ -178,11 +179,13 @@ int cbor_config(const uint8_t *data, size_t len) {
                 CBOR_ERROR(CTAP1_ERR_INVALID_PARAMETER);
             }
 
+            // Both keys must never be lost nor coexist in clear after a power loss
+            low_flash_txn_begin();
             flash_write_data_to_file(ef_keydev_enc, key_dev_enc, sizeof(key_dev_enc));
             mbedtls_platform_zeroize(key_dev_enc, sizeof(key_dev_enc));
             flash_write_data_to_file(ef_keydev, key_dev_enc, file_get_size(ef_keydev)); // Overwrite ef with 0
             flash_write_data_to_file(ef_keydev, NULL, 0); // Set ef to 0 bytes
-            low_flash_available();
+            low_flash_txn_commit();
         }
         else {
             CBOR_ERROR(CTAP2_ERR_INVALID_SUBCOMMAND);
@@ -207,7 +210,10 @@ int cbor_config(const uint8_t *data, size_t len) {
         if (file_has_data(ef_pin) && file_get_data(ef_pin)[1] < newMinPinLength) {
             forceChangePin = ptrue;
         }
-        uint8_t *data = (uint8_t *) calloc(1, 2 + minPinLengthRPIDs_len * 32);
+        uint8_t *data = (uint8_t *) arena_alloc(2 + minPinLengthRPIDs_len * 32);
+        if (!data) {
+            CBOR_ERROR(CTAP2_ERR_PROCESSING);
+        }
         data[0] = newMinPinLength;
         data[1] = forceChangePin == ptrue ? 1 : 0;
         for (int m = 0; m < minPinLengthRPIDs_len; m++) {
@@ -217,6 +223,7 @@ int cbor_config(const uint8_t *data, size_t len) {
                            0);
         }
         flash_write_data_to_file(ef_minpin, data, 2 + minPinLengthRPIDs_len * 32);
+        arena_free(data);
         low_flash_available();
         goto err; //No return
     }
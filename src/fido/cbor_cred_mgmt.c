@@ -20,15 +20,16 @@
 #include "hid/ctap_hid.h"
 #include "cbor_make_credential.h"
 #include "files.h"
+#include "cred_index.h"
 #include "apdu.h"
 #include "credential.h"
 #include "pico_keys.h"
 
-uint8_t rp_counter = 1;
-uint8_t rp_total = 0;
-uint8_t cred_counter = 1;
-uint8_t cred_total = 0;
-CborByteString rpIdHashx = { 0 };
+uint16_t rp_counter = 1;
+uint16_t rp_total = 0;
+uint16_t cred_counter = 1;
+uint16_t cred_total = 0;
+uint8_t rpIdHashx[32] = { 0 };
 
 int cbor_cred_mgmt(const uint8_t *data, size_t len) {
     CborParser parser;
@@ -42,7 +43,7 @@ int cbor_cred_mgmt(const uint8_t *data, size_t len) {
     CborEncoder encoder, mapEncoder, mapEncoder2;
     uint8_t *raw_subpara = NULL;
     size_t raw_subpara_len = 0;
-    bool asserted = false, is_preview = *(data - 1) == 0x41; // Backwards compatibility
+    bool is_preview = *(data - 1) == 0x41; // Backwards compatibility
 
     CBOR_CHECK(cbor_parser_init(data, len, 0, &parser, &map));
     uint64_t val_c = 1;
@@ -122,35 +123,26 @@ int cbor_cred_mgmt(const uint8_t *data, size_t len) {
 
     cbor_encoder_init(&encoder, ctap_resp->init.data + 1, CTAP_MAX_PACKET_SIZE, 0);
     if (subcommand == 0x01) {
-        if (verify(pinUvAuthProtocol, paut.data, (const uint8_t *) "\x01", 1,
-                   pinUvAuthParam.data) != CborNoError) {
+        if (checkPinUvAuthToken(pinUvAuthProtocol, (const uint8_t *) "\x01", 1,
+                                pinUvAuthParam.data, is_preview ? 0 : CTAP_PERMISSION_CM,
+                                NULL) != 0 ||
+            (is_preview == false && paut->has_rp_id == true)) {
             CBOR_ERROR(CTAP2_ERR_PIN_AUTH_INVALID);
         }
-        if (is_preview == false &&
-            (!(paut.permissions & CTAP_PERMISSION_CM) || paut.has_rp_id == true)) {
-            CBOR_ERROR(CTAP2_ERR_PIN_AUTH_INVALID);
-        }
-        uint8_t existing = 0;
-        for (int i = 0; i < MAX_RESIDENT_CREDENTIALS; i++) {
-            if (file_has_data(search_dynamic_file(EF_CRED + i))) {
-                existing++;
-            }
-        }
         CBOR_CHECK(cbor_encoder_create_map(&encoder, &mapEncoder, 2));
         CBOR_CHECK(cbor_encode_uint(&mapEncoder, 0x01));
-        CBOR_CHECK(cbor_encode_uint(&mapEncoder, existing));
+        CBOR_CHECK(cbor_encode_uint(&mapEncoder, cred_index_count()));
         CBOR_CHECK(cbor_encode_uint(&mapEncoder, 0x02));
-        CBOR_CHECK(cbor_encode_uint(&mapEncoder, MAX_RESIDENT_CREDENTIALS - existing));
+        CBOR_CHECK(cbor_encode_uint(&mapEncoder, cred_index_remaining()));
     }
     else if (subcommand == 0x02 || subcommand == 0x03) {
-        file_t *rp_ef = NULL;
+        const uint8_t *rp_data = NULL;
+        uint16_t rp_len = 0;
         if (subcommand == 0x02) {
-            if (verify(pinUvAuthProtocol, paut.data, (const uint8_t *) "\x02", 1,
-                       pinUvAuthParam.data) != CborNoError) {
-                CBOR_ERROR(CTAP2_ERR_PIN_AUTH_INVALID);
-            }
-            if (is_preview == false &&
-                (!(paut.permissions & CTAP_PERMISSION_CM) || paut.has_rp_id == true)) {
+            if (checkPinUvAuthToken(pinUvAuthProtocol, (const uint8_t *) "\x02", 1,
+                                    pinUvAuthParam.data, is_preview ? 0 : CTAP_PERMISSION_CM,
+                                    NULL) != 0 ||
+                (is_preview == false && paut->has_rp_id == true)) {
                 CBOR_ERROR(CTAP2_ERR_PIN_AUTH_INVALID);
             }
             rp_counter = 1;
@@ -161,13 +153,15 @@ int cbor_cred_mgmt(const uint8_t *data, size_t len) {
                 CBOR_ERROR(CTAP2_ERR_NOT_ALLOWED);
             }
         }
-        uint8_t skip = 0;
-        for (int i = 0; i < MAX_RESIDENT_CREDENTIALS; i++) {
-            file_t *tef = search_dynamic_file(EF_RP + i);
-            if (file_has_data(tef) && *file_get_data(tef) > 0) {
+        uint16_t skip = 0;
+        for (uint16_t i = 0; i < cred_index_rp_count(); i++) {
+            uint16_t tlen = 0;
+            const uint8_t *tdata = cred_index_rp(i, &tlen);
+            if (*tdata > 0) {
                 if (++skip == rp_counter) {
-                    if (rp_ef == NULL) {
-                        rp_ef = tef;
+                    if (rp_data == NULL) {
+                        rp_data = tdata;
+                        rp_len = tlen;
                     }
                     if (subcommand == 0x03) {
                         break;
@@ -178,7 +172,7 @@ int cbor_cred_mgmt(const uint8_t *data, size_t len) {
                 }
             }
         }
-        if (rp_ef == NULL) {
+        if (rp_data == NULL) {
             CBOR_ERROR(CTAP2_ERR_NO_CREDENTIALS);
         }
         rp_counter++;
@@ -186,11 +180,10 @@ int cbor_cred_mgmt(const uint8_t *data, size_t len) {
         CBOR_CHECK(cbor_encode_uint(&mapEncoder, 0x03));
         CBOR_CHECK(cbor_encoder_create_map(&mapEncoder, &mapEncoder2, 1));
         CBOR_CHECK(cbor_encode_text_stringz(&mapEncoder2, "id"));
-        CBOR_CHECK(cbor_encode_text_string(&mapEncoder2, (char *) file_get_data(rp_ef) + 33,
-                                           file_get_size(rp_ef) - 33));
+        CBOR_CHECK(cbor_encode_text_string(&mapEncoder2, (char *) rp_data + 33, rp_len - 33));
         CBOR_CHECK(cbor_encoder_close_container(&mapEncoder, &mapEncoder2));
         CBOR_CHECK(cbor_encode_uint(&mapEncoder, 0x04));
-        CBOR_CHECK(cbor_encode_byte_string(&mapEncoder, file_get_data(rp_ef) + 1, 32));
+        CBOR_CHECK(cbor_encode_byte_string(&mapEncoder, rp_data + 1, 32));
         if (subcommand == 0x02) {
             CBOR_CHECK(cbor_encode_uint(&mapEncoder, 0x05));
             CBOR_CHECK(cbor_encode_uint(&mapEncoder, rp_total));
@@ -200,15 +193,14 @@ int cbor_cred_mgmt(const uint8_t *data, size_t len) {
         if (subcommand == 0x04 && rpIdHash.present == false) {
             CBOR_ERROR(CTAP2_ERR_MISSING_PARAMETER);
         }
+        if (subcommand == 0x04 && rpIdHash.len != 32) {
+            CBOR_ERROR(CTAP1_ERR_INVALID_PARAMETER);
+        }
         if (subcommand == 0x04) {
             *(raw_subpara - 1) = 0x04;
-            if (verify(pinUvAuthProtocol, paut.data, raw_subpara - 1, raw_subpara_len + 1,
-                       pinUvAuthParam.data) != CborNoError) {
-                CBOR_ERROR(CTAP2_ERR_PIN_AUTH_INVALID);
-            }
-            if (is_preview == false &&
-                (!(paut.permissions & CTAP_PERMISSION_CM) ||
-                 (paut.has_rp_id == true && memcmp(paut.rp_id_hash, rpIdHash.data, 32) != 0))) {
+            if (checkPinUvAuthToken(pinUvAuthProtocol, raw_subpara - 1, raw_subpara_len + 1,
+                                    pinUvAuthParam.data, is_preview ? 0 : CTAP_PERMISSION_CM,
+                                    is_preview ? NULL : rpIdHash.data) != 0) {
                 CBOR_ERROR(CTAP2_ERR_PIN_AUTH_INVALID);
             }
             cred_counter = 1;
@@ -218,16 +210,22 @@ int cbor_cred_mgmt(const uint8_t *data, size_t len) {
             if (cred_counter > cred_total) {
                 CBOR_ERROR(CTAP2_ERR_NOT_ALLOWED);
             }
-            rpIdHash = rpIdHashx;
-        }
-        file_t *cred_ef = NULL;
-        uint8_t skip = 0;
-        for (int i = 0; i < MAX_RESIDENT_CREDENTIALS; i++) {
-            file_t *tef = search_dynamic_file(EF_CRED + i);
-            if (file_has_data(tef) && memcmp(file_get_data(tef), rpIdHash.data, 32) == 0) {
+            rpIdHash.data = rpIdHashx;
+            rpIdHash.len = sizeof(rpIdHashx);
+            rpIdHash.present = true;
+            rpIdHash.nofree = true;
+        }
+        const uint8_t *cred_data = NULL;
+        uint16_t cred_len = 0, skip = 0, first = 0;
+        uint16_t n = cred_index_find(rpIdHash.data, &first);
+        for (uint16_t i = first; i < first + n; i++) {
+            uint16_t tlen = 0;
+            const uint8_t *tdata = cred_index_cred(i, &tlen);
+            if (memcmp(tdata, rpIdHash.data, 32) == 0) {
                 if (++skip == cred_counter) {
-                    if (cred_ef == NULL) {
-                        cred_ef = tef;
+                    if (cred_data == NULL) {
+                        cred_data = tdata;
+                        cred_len = tlen;
                     }
                     if (subcommand == 0x05) {
                         break;
@@ -238,19 +236,18 @@ int cbor_cred_mgmt(const uint8_t *data, size_t len) {
                 }
             }
         }
-        if (!file_has_data(cred_ef)) {
+        if (cred_data == NULL) {
             CBOR_ERROR(CTAP2_ERR_NO_CREDENTIALS);
         }
 
         Credential cred = { 0 };
-        if (credential_load(file_get_data(cred_ef) + 32, file_get_size(cred_ef) - 32, rpIdHash.data,
-                            &cred) != 0) {
+        if (credential_load(cred_data + 32, cred_len - 32, rpIdHash.data, &cred) != 0) {
             CBOR_ERROR(CTAP2_ERR_NOT_ALLOWED);
         }
 
         mbedtls_ecdsa_context key;
         mbedtls_ecdsa_init(&key);
-        if (fido_load_key(cred.curve, cred.id.data, &key) != 0) {
+        if (fido_load_key(cred.curve, cred.id.data, &key) != 0 || derive_public_key(&key) != 0) {
             credential_free(&cred);
             mbedtls_ecdsa_free(&key);
             CBOR_ERROR(CTAP2_ERR_NOT_ALLOWED);
@@ -316,8 +313,8 @@ int cbor_cred_mgmt(const uint8_t *data, size_t len) {
             CBOR_CHECK(cbor_encode_uint(&mapEncoder, cred_total));
         }
         if (cred_counter <= cred_total) {
-            asserted = true;
-            rpIdHashx = rpIdHash;
+            // The parsed hash goes away with the request arena
+            memcpy(rpIdHashx, rpIdHash.data, sizeof(rpIdHashx));
         }
         if (cred.extensions.present == true) {
             if (cred.extensions.credProtect > 0) {
@@ -351,44 +348,17 @@ int cbor_cred_mgmt(const uint8_t *data, size_t len) {
             CBOR_ERROR(CTAP2_ERR_MISSING_PARAMETER);
         }
         *(raw_subpara - 1) = 0x06;
-        if (verify(pinUvAuthProtocol, paut.data, raw_subpara - 1, raw_subpara_len + 1,
-                   pinUvAuthParam.data) != CborNoError) {
+        if (checkPinUvAuthToken(pinUvAuthProtocol, raw_subpara - 1, raw_subpara_len + 1,
+                                pinUvAuthParam.data, is_preview ? 0 : CTAP_PERMISSION_CM,
+                                is_preview ? NULL : rpIdHash.data) != 0) {
             CBOR_ERROR(CTAP2_ERR_PIN_AUTH_INVALID);
         }
-        if (is_preview == false &&
-            (!(paut.permissions & CTAP_PERMISSION_CM) ||
-             (paut.has_rp_id == true && memcmp(paut.rp_id_hash, rpIdHash.data, 32) != 0))) {
-            CBOR_ERROR(CTAP2_ERR_PIN_AUTH_INVALID);
-        }
-        for (int i = 0; i < MAX_RESIDENT_CREDENTIALS; i++) {
-            file_t *ef = search_dynamic_file(EF_CRED + i);
-            if (file_has_data(ef) &&
-                memcmp(file_get_data(ef) + 32, credentialId.id.data,
-                       MIN(file_get_size(ef) - 32, credentialId.id.len)) == 0) {
-                uint8_t *rp_id_hash = file_get_data(ef);
-                if (delete_file(ef) != 0) {
-                    CBOR_ERROR(CTAP2_ERR_NOT_ALLOWED);
-                }
-                for (int j = 0; j < MAX_RESIDENT_CREDENTIALS; j++) {
-                    file_t *rp_ef = search_dynamic_file(EF_RP + j);
-                    if (file_has_data(rp_ef) &&
-                        memcmp(file_get_data(rp_ef) + 1, rp_id_hash, 32) == 0) {
-                        uint8_t *rp_data = (uint8_t *) calloc(1, file_get_size(rp_ef));
-                        memcpy(rp_data, file_get_data(rp_ef), file_get_size(rp_ef));
-                        rp_data[0] -= 1;
-                        if (rp_data[0] == 0) {
-                            delete_file(rp_ef);
-                        }
-                        else {
-                            flash_write_data_to_file(rp_ef, rp_data, file_get_size(rp_ef));
-                        }
-                        free(rp_data);
-                        break;
-                    }
-                }
-                low_flash_available();
-                goto err; //no error
+        int pos = cred_index_find_id(credentialId.id.data, credentialId.id.len);
+        if (pos >= 0) {
+            if (cred_index_delete((uint16_t) pos) != CCID_OK) {
+                CBOR_ERROR(CTAP2_ERR_NOT_ALLOWED);
             }
+            goto err; //no error
         }
         CBOR_ERROR(CTAP2_ERR_NO_CREDENTIALS);
     }
@@ -397,47 +367,41 @@ int cbor_cred_mgmt(const uint8_t *data, size_t len) {
             CBOR_ERROR(CTAP2_ERR_MISSING_PARAMETER);
         }
         *(raw_subpara - 1) = 0x07;
-        if (verify(pinUvAuthProtocol, paut.data, raw_subpara - 1, raw_subpara_len + 1,
-                   pinUvAuthParam.data) != CborNoError) {
+        if (checkPinUvAuthToken(pinUvAuthProtocol, raw_subpara - 1, raw_subpara_len + 1,
+                                pinUvAuthParam.data, is_preview ? 0 : CTAP_PERMISSION_CM,
+                                is_preview ? NULL : rpIdHash.data) != 0) {
             CBOR_ERROR(CTAP2_ERR_PIN_AUTH_INVALID);
         }
-        if (is_preview == false &&
-            (!(paut.permissions & CTAP_PERMISSION_CM) ||
-             (paut.has_rp_id == true && memcmp(paut.rp_id_hash, rpIdHash.data, 32) != 0))) {
-            CBOR_ERROR(CTAP2_ERR_PIN_AUTH_INVALID);
-        }
-        for (int i = 0; i < MAX_RESIDENT_CREDENTIALS; i++) {
-            file_t *ef = search_dynamic_file(EF_CRED + i);
-            if (file_has_data(ef) &&
-                memcmp(file_get_data(ef) + 32, credentialId.id.data,
-                       MIN(file_get_size(ef) - 32, credentialId.id.len)) == 0) {
-                Credential cred = { 0 };
-                uint8_t *rp_id_hash = file_get_data(ef);
-                if (credential_load(rp_id_hash + 32, file_get_size(ef) - 32, rp_id_hash,
-                                    &cred) != 0) {
-                    CBOR_ERROR(CTAP2_ERR_NOT_ALLOWED);
-                }
-                if (memcmp(user.id.data, cred.userId.data,
-                           MIN(user.id.len, cred.userId.len)) != 0) {
-                    credential_free(&cred);
-                    CBOR_ERROR(CTAP1_ERR_INVALID_PARAMETER);
-                }
-                uint8_t newcred[MAX_CRED_ID_LENGTH];
-                size_t newcred_len = 0;
-                if (credential_create(&cred.rpId, &cred.userId, &user.parent.name,
-                                      &user.displayName, &cred.opts, &cred.extensions,
-                                      cred.use_sign_count, cred.alg,
-                                      cred.curve, newcred, &newcred_len) != 0) {
-                    credential_free(&cred);
-                    CBOR_ERROR(CTAP2_ERR_NOT_ALLOWED);
-                }
+        int pos = cred_index_find_id(credentialId.id.data, credentialId.id.len);
+        if (pos >= 0) {
+            Credential cred = { 0 };
+            uint16_t ef_len = 0;
+            uint8_t rp_id_hash[32];
+            const uint8_t *ef_data = cred_index_cred((uint16_t) pos, &ef_len);
+            memcpy(rp_id_hash, ef_data, 32); // The record moves when it is rewritten
+            if (credential_load(ef_data + 32, ef_len - 32, rp_id_hash, &cred) != 0) {
+                CBOR_ERROR(CTAP2_ERR_NOT_ALLOWED);
+            }
+            if (memcmp(user.id.data, cred.userId.data,
+                       MIN(user.id.len, cred.userId.len)) != 0) {
                 credential_free(&cred);
-                if (credential_store(newcred, newcred_len, rp_id_hash) != 0) {
-                    CBOR_ERROR(CTAP2_ERR_NOT_ALLOWED);
-                }
-                low_flash_available();
-                goto err; //no error
+                CBOR_ERROR(CTAP1_ERR_INVALID_PARAMETER);
+            }
+            uint8_t newcred[MAX_CRED_ID_LENGTH];
+            size_t newcred_len = 0;
+            if (credential_create(&cred.rpId, &cred.userId, &user.parent.name,
+                                  &user.displayName, &cred.opts, &cred.extensions,
+                                  cred.use_sign_count == ptrue, cred.alg,
+                                  cred.curve, newcred, &newcred_len) != 0) {
+                credential_free(&cred);
+                CBOR_ERROR(CTAP2_ERR_NOT_ALLOWED);
             }
+            credential_free(&cred);
+            if (credential_store(newcred, newcred_len, rp_id_hash) != 0) {
+                CBOR_ERROR(CTAP2_ERR_NOT_ALLOWED);
+            }
+            low_flash_available();
+            goto err; //no error
         }
         CBOR_ERROR(CTAP2_ERR_NO_CREDENTIALS);
     }
@@ -446,9 +410,7 @@ int cbor_cred_mgmt(const uint8_t *data, size_t len) {
 err:
     CBOR_FREE_BYTE_STRING(pinUvAuthParam);
 
-    if (asserted == false) {
-        CBOR_FREE_BYTE_STRING(rpIdHash);
-    }
+    CBOR_FREE_BYTE_STRING(rpIdHash);
     CBOR_FREE_BYTE_STRING(user.id);
     CBOR_FREE_BYTE_STRING(user.displayName);
     CBOR_FREE_BYTE_STRING(user.parent.name);
@@ -23,18 +23,36 @@
 #include "hid/ctap_hid.h"
 #include "fido.h"
 #include "files.h"
+#include "cred_index.h"
 #include "crypto_utils.h"
 #include "pico_keys.h"
+#include "telemetry.h"
 #include "apdu.h"
 #include "cbor_make_credential.h"
 #include "credential.h"
 #include "mbedtls/sha256.h"
 #include "random.h"
+#include "crypto_jobs.h"
 
 int cbor_get_assertion(const uint8_t *data, size_t len, bool next);
 
+typedef struct hmac_secret_job {
+    uint8_t protocol;
+    mbedtls_ecp_point Qp;
+    mbedtls_ecp_point R;
+    mbedtls_ecp_restart_ctx rs;
+    crypto_job_rng_t rng;
+    uint8_t sharedSecret[64];
+} hmac_secret_job_t;
+
+static int hmac_secret_ecdh(void *arg) {
+    hmac_secret_job_t *hs = (hmac_secret_job_t *) arg;
+    return ecdh_restartable(hs->protocol, &hs->Qp, &hs->R, &hs->rs, hs->sharedSecret,
+                            crypto_job_rng, &hs->rng);
+}
+
 bool residentx = false;
-Credential credsx[MAX_CREDENTIAL_COUNT_IN_LIST] = { 0 };
+CborByteString credsx[MAX_CREDENTIAL_COUNT_IN_LIST] = { 0 }; // Ids of the pending credentials
 uint8_t credentialCounter = 1;
 uint8_t numberOfCredentialsx = 0;
 uint8_t flagsx = 0;
@@ -56,7 +74,7 @@ int cbor_get_next_assertion(const uint8_t *data, size_t len) {
 err:
     if (error != CborNoError || credentialCounter == numberOfCredentialsx) {
         for (int i = 0; i < MAX_CREDENTIAL_COUNT_IN_LIST; i++) {
-            credential_free(&credsx[i]);
+            CBOR_FREE_BYTE_STRING(credsx[i]);
         }
         if (datax) {
             free(datax);
@@ -76,6 +94,16 @@ err:
     return 0;
 }
 
+static const uint16_t get_assertion_params[] = {
+    [0x01] = CBOR_PARAM_TEXT | CBOR_PARAM_REQUIRED,     // rpId
+    [0x02] = CBOR_PARAM_BYTES | CBOR_PARAM_REQUIRED,    // clientDataHash
+    [0x03] = CBOR_PARAM_ARRAY,                          // allowList
+    [0x04] = CBOR_PARAM_MAP,                            // extensions
+    [0x05] = CBOR_PARAM_MAP,                            // options
+    [0x06] = CBOR_PARAM_BYTES,                          // pinUvAuthParam
+    [0x07] = CBOR_PARAM_UINT,                           // pinUvAuthProtocol
+};
+
 int cbor_get_assertion(const uint8_t *data, size_t len, bool next) {
     size_t resp_size = 0;
     uint64_t pinUvAuthProtocol = 0, hmacSecretPinUvAuthProtocol = 1;
@@ -83,7 +111,7 @@ int cbor_get_assertion(const uint8_t *data, size_t len, bool next) {
     CredExtensions extensions = { 0 };
     CborParser parser;
     CborEncoder encoder, mapEncoder, mapEncoder2;
-    CborValue map;
+    cbor_params_t params;
     CborError error = CborNoError;
     CborByteString pinUvAuthParam = { 0 }, clientDataHash = { 0 };
     CborCharString rpId = { 0 };
@@ -91,110 +119,102 @@ int cbor_get_assertion(const uint8_t *data, size_t len, bool next) {
     Credential creds[MAX_CREDENTIAL_COUNT_IN_LIST] = { 0 };
     size_t allowList_len = 0, creds_len = 0;
     uint8_t *aut_data = NULL;
-    bool asserted = false, up = true, uv = false;
+    bool up = true, uv = false;
     int64_t kty = 2, alg = 0, crv = 0;
     CborByteString kax = { 0 }, kay = { 0 }, salt_enc = { 0 }, salt_auth = { 0 };
     const bool *credBlob = NULL;
+    crypto_job_t hs_job = { 0 };
+    hmac_secret_job_t hs = { 0 };
 
-    CBOR_CHECK(cbor_parser_init(data, len, 0, &parser, &map));
-    uint64_t val_c = 1;
-    CBOR_PARSE_MAP_START(map, 1)
-    {
-        uint64_t val_u = 0;
-        CBOR_FIELD_GET_UINT(val_u, 1);
-        if (val_c <= 2 && val_c != val_u) {
-            CBOR_ERROR(CTAP2_ERR_MISSING_PARAMETER);
-        }
-        if (val_u < val_c) {
-            CBOR_ERROR(CTAP2_ERR_INVALID_CBOR);
-        }
-        val_c = val_u + 1;
-        if (val_u == 0x01) {
-            CBOR_FIELD_GET_TEXT(rpId, 1);
-        }
-        else if (val_u == 0x02) {
-            CBOR_FIELD_GET_BYTES(clientDataHash, 1);
-        }
-        else if (val_u == 0x03) { // excludeList
-            CBOR_PARSE_ARRAY_START(_f1, 2)
+    CBOR_CHECK(cbor_parse_params(data, len, &parser, get_assertion_params,
+                                 sizeof(get_assertion_params) / sizeof(uint16_t), &params));
+    CBOR_PARAM_GET_STRING(params, 0x01, rpId);
+    CBOR_PARAM_GET_STRING(params, 0x02, clientDataHash);
+    if (CBOR_PARAM_PRESENT(params, 0x03)) { // allowList
+        CBOR_PARSE_ARRAY_START(params.value[0x03], 2)
+        {
+            if (allowList_len >= MAX_CREDENTIAL_COUNT_IN_LIST) {
+                CBOR_ERROR(CTAP2_ERR_LIMIT_EXCEEDED);
+            }
+            PublicKeyCredentialDescriptor *pc = &allowList[allowList_len];
+            CBOR_PARSE_MAP_START(_f2, 3)
             {
-                PublicKeyCredentialDescriptor *pc = &allowList[allowList_len];
-                CBOR_PARSE_MAP_START(_f2, 3)
-                {
-                    CBOR_FIELD_GET_KEY_TEXT(3);
-                    CBOR_FIELD_KEY_TEXT_VAL_BYTES(3, "id", pc->id);
-                    CBOR_FIELD_KEY_TEXT_VAL_TEXT(3, "type", pc->type);
-                    if (strcmp(_fd3, "transports") == 0) {
-                        CBOR_PARSE_ARRAY_START(_f3, 4)
-                        {
-                            CBOR_FIELD_GET_TEXT(pc->transports[pc->transports_len], 4);
-                            pc->transports_len++;
-                        }
-                        CBOR_PARSE_ARRAY_END(_f3, 4);
-                    }
-                }
-                CBOR_PARSE_MAP_END(_f2, 3);
-                allowList_len++;
-            }
-            CBOR_PARSE_ARRAY_END(_f1, 2);
-        }
-        else if (val_u == 0x04) { // extensions
-            extensions.present = true;
-            CBOR_PARSE_MAP_START(_f1, 2)
-            {
-                CBOR_FIELD_GET_KEY_TEXT(2);
-                if (strcmp(_fd2, "hmac-secret") == 0) {
-                    extensions.hmac_secret = ptrue;
-                    uint64_t ukey = 0;
-                    CBOR_PARSE_MAP_START(_f2, 3)
+                CBOR_FIELD_GET_KEY_TEXT(3);
+                CBOR_FIELD_KEY_TEXT_VIEW_BYTES(3, "id", pc->id);
+                CBOR_FIELD_KEY_TEXT_VIEW_TEXT(3, "type", pc->type);
+                if (strcmp(_fd3, "transports") == 0) {
+                    CBOR_PARSE_ARRAY_START(_f3, 4)
                     {
-                        CBOR_FIELD_GET_UINT(ukey, 3);
-                        if (ukey == 0x01) {
-                            CBOR_CHECK(COSE_read_key(&_f3, &kty, &alg, &crv, &kax, &kay));
-                        }
-                        else if (ukey == 0x02) {
-                            CBOR_FIELD_GET_BYTES(salt_enc, 3);
-                        }
-                        else if (ukey == 0x03) {
-                            CBOR_FIELD_GET_BYTES(salt_auth, 3);
-                        }
-                        else if (ukey == 0x04) {
-                            CBOR_FIELD_GET_UINT(hmacSecretPinUvAuthProtocol, 3);
+                        if (pc->transports_len < sizeof(pc->transports) / sizeof(pc->transports[0])) {
+                            CBOR_FIELD_VIEW_TEXT(pc->transports[pc->transports_len], 4);
+                            pc->transports_len++;
                         }
                         else {
-                            CBOR_ADVANCE(3);
+                            CBOR_ADVANCE(4);
                         }
                     }
-                    CBOR_PARSE_MAP_END(_f2, 3);
+                    CBOR_PARSE_ARRAY_END(_f3, 4);
                     continue;
                 }
-                CBOR_FIELD_KEY_TEXT_VAL_BOOL(2, "credBlob", credBlob);
-                CBOR_FIELD_KEY_TEXT_VAL_BOOL(2, "largeBlobKey", extensions.largeBlobKey);
-                CBOR_FIELD_KEY_TEXT_VAL_BOOL(2, "thirdPartyPayment", extensions.thirdPartyPayment);
-                CBOR_ADVANCE(2);
+                CBOR_ADVANCE(3);
             }
-            CBOR_PARSE_MAP_END(_f1, 2);
+            CBOR_PARSE_MAP_END(_f2, 3);
+            allowList_len++;
         }
-        else if (val_u == 0x05) { // options
-            options.present = true;
-            CBOR_PARSE_MAP_START(_f1, 2)
-            {
-                CBOR_FIELD_GET_KEY_TEXT(2);
-                CBOR_FIELD_KEY_TEXT_VAL_BOOL(2, "rk", options.rk);
-                CBOR_FIELD_KEY_TEXT_VAL_BOOL(2, "up", options.up);
-                CBOR_FIELD_KEY_TEXT_VAL_BOOL(2, "uv", options.uv);
-                CBOR_ADVANCE(2);
+        CBOR_PARSE_ARRAY_END(params.value[0x03], 2);
+    }
+    if (CBOR_PARAM_PRESENT(params, 0x04)) { // extensions
+        extensions.present = true;
+        CBOR_PARSE_MAP_START(params.value[0x04], 2)
+        {
+            CBOR_FIELD_GET_KEY_TEXT(2);
+            if (strcmp(_fd2, "hmac-secret") == 0) {
+                extensions.hmac_secret = ptrue;
+                uint64_t ukey = 0;
+                CBOR_PARSE_MAP_START(_f2, 3)
+                {
+                    CBOR_FIELD_GET_UINT(ukey, 3);
+                    if (ukey == 0x01) {
+                        CBOR_CHECK(COSE_read_key(&_f3, &kty, &alg, &crv, &kax, &kay));
+                    }
+                    else if (ukey == 0x02) {
+                        CBOR_FIELD_VIEW_BYTES(salt_enc, 3);
+                    }
+                    else if (ukey == 0x03) {
+                        CBOR_FIELD_VIEW_BYTES(salt_auth, 3);
+                    }
+                    else if (ukey == 0x04) {
+                        CBOR_FIELD_GET_UINT(hmacSecretPinUvAuthProtocol, 3);
+                    }
+                    else {
+                        CBOR_ADVANCE(3);
+                    }
+                }
+                CBOR_PARSE_MAP_END(_f2, 3);
+                continue;
             }
-            CBOR_PARSE_MAP_END(_f1, 2);
-        }
-        else if (val_u == 0x06) { // pinUvAuthParam
-            CBOR_FIELD_GET_BYTES(pinUvAuthParam, 1);
-        }
-        else if (val_u == 0x07) { // pinUvAuthProtocol
-            CBOR_FIELD_GET_UINT(pinUvAuthProtocol, 1);
+            CBOR_FIELD_KEY_TEXT_VAL_BOOL(2, "credBlob", credBlob);
+            CBOR_FIELD_KEY_TEXT_VAL_BOOL(2, "largeBlobKey", extensions.largeBlobKey);
+            CBOR_FIELD_KEY_TEXT_VAL_BOOL(2, "thirdPartyPayment", extensions.thirdPartyPayment);
+            CBOR_ADVANCE(2);
         }
+        CBOR_PARSE_MAP_END(params.value[0x04], 2);
     }
-    CBOR_PARSE_MAP_END(map, 1);
+    if (CBOR_PARAM_PRESENT(params, 0x05)) { // options
+        options.present = true;
+        CBOR_PARSE_MAP_START(params.value[0x05], 2)
+        {
+            CBOR_FIELD_GET_KEY_TEXT(2);
+            CBOR_FIELD_KEY_TEXT_VAL_BOOL(2, "rk", options.rk);
+            CBOR_FIELD_KEY_TEXT_VAL_BOOL(2, "up", options.up);
+            CBOR_FIELD_KEY_TEXT_VAL_BOOL(2, "uv", options.uv);
+            CBOR_ADVANCE(2);
+        }
+        CBOR_PARSE_MAP_END(params.value[0x05], 2);
+    }
+    CBOR_PARAM_GET_STRING(params, 0x06, pinUvAuthParam);
+    CBOR_PARAM_GET_UINT(params, 0x07, pinUvAuthProtocol);
+    TELEMETRY_PARSED();
 
     if (rpId.present == false || clientDataHash.present == false) {
         CBOR_ERROR(CTAP2_ERR_MISSING_PARAMETER);
@@ -250,23 +270,18 @@ int cbor_get_assertion(const uint8_t *data, size_t len, bool next) {
         }
 
         if (pinUvAuthParam.present == true) { //6.1
-            int ret = verify(pinUvAuthProtocol,
-                             paut.data,
-                             clientDataHash.data,
-                             clientDataHash.len,
-                             pinUvAuthParam.data);
-            if (ret != CborNoError) {
+            int ret = checkPinUvAuthToken(pinUvAuthProtocol,
+                                          clientDataHash.data,
+                                          clientDataHash.len,
+                                          pinUvAuthParam.data,
+                                          CTAP_PERMISSION_GA,
+                                          rp_id_hash);
+            if (ret != 0) {
                 CBOR_ERROR(CTAP2_ERR_PIN_AUTH_INVALID);
             }
             if (getUserVerifiedFlagValue() == false) {
                 CBOR_ERROR(CTAP2_ERR_PIN_AUTH_INVALID);
             }
-            if (!(paut.permissions & CTAP_PERMISSION_GA)) {
-                CBOR_ERROR(CTAP2_ERR_PIN_AUTH_INVALID);
-            }
-            if (paut.has_rp_id == true && memcmp(paut.rp_id_hash, rp_id_hash, 32) != 0) {
-                CBOR_ERROR(CTAP2_ERR_PIN_AUTH_INVALID);
-            }
             flags |= FIDO2_AUT_FLAG_UV;
             // Check pinUvAuthToken permissions. See 6.2.2.4
         }
@@ -279,6 +294,18 @@ int cbor_get_assertion(const uint8_t *data, size_t len, bool next) {
                 salt_enc.len != 64 + (hmacSecretPinUvAuthProtocol - 1) * IV_SIZE) {
                 CBOR_ERROR(CTAP1_ERR_INVALID_LEN);
             }
+            // The shared secret only depends on the request, so the other core computes it while
+            // the credentials are loaded and the user confirms presence
+            mbedtls_ecp_point_init(&hs.Qp);
+            mbedtls_ecp_point_init(&hs.R);
+            mbedtls_ecp_restart_init(&hs.rs);
+            if (mbedtls_mpi_lset(&hs.Qp.Z, 1) == 0 &&
+                mbedtls_mpi_read_binary(&hs.Qp.X, kax.data, kax.len) == 0 &&
+                mbedtls_mpi_read_binary(&hs.Qp.Y, kay.data, kay.len) == 0) {
+                hs.protocol = (uint8_t) hmacSecretPinUvAuthProtocol;
+                crypto_job_rng_seed(&hs.rng);
+                crypto_job_submit(&hs_job, hmac_secret_ecdh, &hs);
+            }
         }
 
         if (allowList_len > 0) {
@@ -286,7 +313,7 @@ int cbor_get_assertion(const uint8_t *data, size_t len, bool next) {
                 if (allowList[e].type.present == false || allowList[e].id.present == false) {
                     CBOR_ERROR(CTAP2_ERR_MISSING_PARAMETER);
                 }
-                if (strcmp(allowList[e].type.data, "public-key") != 0) {
+                if (!CBOR_TEXT_EQUALS(allowList[e].type, "public-key")) {
                     continue;
                 }
                 if (credential_load(allowList[e].id.data, allowList[e].id.len, rp_id_hash,
@@ -300,17 +327,15 @@ int cbor_get_assertion(const uint8_t *data, size_t len, bool next) {
             }
         }
         else {
-            for (int i = 0;
-                 i < MAX_RESIDENT_CREDENTIALS && creds_len < MAX_CREDENTIAL_COUNT_IN_LIST;
+            uint16_t first = 0, n = cred_index_find(rp_id_hash, &first);
+            for (uint16_t i = first; i < first + n && creds_len < MAX_CREDENTIAL_COUNT_IN_LIST;
                  i++) {
-                file_t *ef = search_dynamic_file(EF_CRED + i);
-                if (!file_has_data(ef) || memcmp(file_get_data(ef), rp_id_hash, 32) != 0) {
+                uint16_t ef_len = 0;
+                const uint8_t *ef_data = cred_index_cred(i, &ef_len);
+                if (memcmp(ef_data, rp_id_hash, 32) != 0) {
                     continue;
                 }
-                int ret = credential_load(file_get_data(ef) + 32,
-                                          file_get_size(ef) - 32,
-                                          rp_id_hash,
-                                          &creds[creds_len]);
+                int ret = credential_load(ef_data + 32, ef_len - 32, rp_id_hash, &creds[creds_len]);
                 if (ret != 0) {
                     credential_free(&creds[creds_len]);
                 }
@@ -385,10 +410,16 @@ int cbor_get_assertion(const uint8_t *data, size_t len, bool next) {
         else {
             selcred = &creds[0];
             if (numberOfCredentials > 1) {
-                asserted = true;
                 residentx = resident;
+                // Loaded credentials live in the request arena, so only their ids are kept
                 for (int i = 0; i < MAX_CREDENTIAL_COUNT_IN_LIST; i++) {
-                    credsx[i] = creds[i];
+                    CBOR_FREE_BYTE_STRING(credsx[i]);
+                }
+                for (int i = 0; i < numberOfCredentials; i++) {
+                    credsx[i].data = (uint8_t *) calloc(1, creds[i].id.len);
+                    memcpy(credsx[i].data, creds[i].id.data, creds[i].id.len);
+                    credsx[i].len = creds[i].id.len;
+                    credsx[i].present = true;
                 }
                 numberOfCredentialsx = numberOfCredentials;
                 datax = (uint8_t *) calloc(1, len);
@@ -404,7 +435,11 @@ int cbor_get_assertion(const uint8_t *data, size_t len, bool next) {
         resident = residentx;
         numberOfCredentials = numberOfCredentialsx;
         flags = flagsx;
-        selcred = &credsx[credentialCounter];
+        if (credential_load(credsx[credentialCounter].data, credsx[credentialCounter].len,
+                            rp_id_hash, &creds[0]) != 0) {
+            CBOR_ERROR(CTAP2_ERR_NOT_ALLOWED);
+        }
+        selcred = &creds[0];
     }
     mbedtls_ecdsa_context ekey;
     mbedtls_ecdsa_init(&ekey);
@@ -456,27 +491,18 @@ int cbor_get_assertion(const uint8_t *data, size_t len, bool next) {
 
             CBOR_CHECK(cbor_encode_text_stringz(&mapEncoder, "hmac-secret"));
 
-            uint8_t sharedSecret[64];
-            mbedtls_ecp_point Qp;
-            mbedtls_ecp_point_init(&Qp);
-            mbedtls_mpi_lset(&Qp.Z, 1);
-            if (mbedtls_mpi_read_binary(&Qp.X, kax.data, kax.len) != 0) {
-                mbedtls_ecp_point_free(&Qp);
+            uint8_t *sharedSecret = hs.sharedSecret;
+            if (hs_job.state == CRYPTO_JOB_IDLE) {
                 CBOR_ERROR(CTAP1_ERR_INVALID_PARAMETER);
             }
-            if (mbedtls_mpi_read_binary(&Qp.Y, kay.data, kay.len) != 0) {
-                mbedtls_ecp_point_free(&Qp);
-                CBOR_ERROR(CTAP1_ERR_INVALID_PARAMETER);
-            }
-            int ret = ecdh(hmacSecretPinUvAuthProtocol, &Qp, sharedSecret);
-            mbedtls_ecp_point_free(&Qp);
+            int ret = crypto_job_wait(&hs_job);
             if (ret != 0) {
-                mbedtls_platform_zeroize(sharedSecret, sizeof(sharedSecret));
+                mbedtls_platform_zeroize(sharedSecret, sizeof(hs.sharedSecret));
                 CBOR_ERROR(CTAP1_ERR_INVALID_PARAMETER);
             }
             if (verify(hmacSecretPinUvAuthProtocol, sharedSecret, salt_enc.data, salt_enc.len,
                        salt_auth.data) != 0) {
-                mbedtls_platform_zeroize(sharedSecret, sizeof(sharedSecret));
+                mbedtls_platform_zeroize(sharedSecret, sizeof(hs.sharedSecret));
                 CBOR_ERROR(CTAP2_ERR_EXTENSION_FIRST);
             }
             uint8_t salt_dec[64], poff = (hmacSecretPinUvAuthProtocol - 1) * IV_SIZE;
@@ -486,13 +512,13 @@ int cbor_get_assertion(const uint8_t *data, size_t len, bool next) {
                           salt_enc.len,
                           salt_dec);
             if (ret != 0) {
-                mbedtls_platform_zeroize(sharedSecret, sizeof(sharedSecret));
+                mbedtls_platform_zeroize(sharedSecret, sizeof(hs.sharedSecret));
                 CBOR_ERROR(CTAP1_ERR_INVALID_PARAMETER);
             }
             uint8_t cred_random[64], *crd = NULL;
             ret = credential_derive_hmac_key(selcred->id.data, selcred->id.len, cred_random);
             if (ret != 0) {
-                mbedtls_platform_zeroize(sharedSecret, sizeof(sharedSecret));
+                mbedtls_platform_zeroize(sharedSecret, sizeof(hs.sharedSecret));
                 CBOR_ERROR(CTAP1_ERR_INVALID_PARAMETER);
             }
             if (flags & FIDO2_AUT_FLAG_UV) {
@@ -537,7 +563,11 @@ int cbor_get_assertion(const uint8_t *data, size_t len, bool next) {
     uint32_t ctr = get_sign_counter();
 
     size_t aut_data_len = 32 + 1 + 4 + ext_len;
-    aut_data = (uint8_t *) calloc(1, aut_data_len + clientDataHash.len);
+    aut_data = (uint8_t *) arena_alloc(aut_data_len + clientDataHash.len);
+    if (!aut_data) {
+        mbedtls_ecdsa_free(&ekey);
+        CBOR_ERROR(CTAP2_ERR_PROCESSING);
+    }
     uint8_t *pa = aut_data;
     memcpy(pa, rp_id_hash, 32); pa += 32;
     *pa++ = flags;
@@ -564,15 +594,17 @@ int cbor_get_assertion(const uint8_t *data, size_t len, bool next) {
                      aut_data_len + clientDataHash.len,
                      hash);
     size_t olen = 0;
-    ret = mbedtls_ecdsa_write_signature(&ekey,
-                                        mbedtls_md_get_type(md),
-                                        hash,
-                                        mbedtls_md_get_size(md),
-                                        sig,
-                                        sizeof(sig),
-                                        &olen,
-                                        random_gen,
-                                        NULL);
+    TELEMETRY_PHASE_START(t);
+    ret = ecdsa_write_signature(&ekey,
+                                mbedtls_md_get_type(md),
+                                hash,
+                                mbedtls_md_get_size(md),
+                                sig,
+                                sizeof(sig),
+                                &olen,
+                                random_gen,
+                                NULL);
+    TELEMETRY_PHASE_END(TELEMETRY_PHASE_CRYPTO, t);
     mbedtls_ecdsa_free(&ekey);
 
     uint8_t lfields = 3;
@@ -643,13 +675,17 @@ int cbor_get_assertion(const uint8_t *data, size_t len, bool next) {
     flash_write_data_to_file(ef_counter, (uint8_t *) &ctr, sizeof(ctr));
     low_flash_available();
 err:
+    // The job may still be queued or running on the other core over this stack frame
+    crypto_job_cancel(&hs_job);
+    mbedtls_ecp_restart_free(&hs.rs);
+    mbedtls_ecp_point_free(&hs.R);
+    mbedtls_ecp_point_free(&hs.Qp);
+    mbedtls_platform_zeroize(&hs, sizeof(hs));
     CBOR_FREE_BYTE_STRING(clientDataHash);
     CBOR_FREE_BYTE_STRING(pinUvAuthParam);
     CBOR_FREE_BYTE_STRING(rpId);
-    if (asserted == false) {
-        for (int i = 0; i < MAX_CREDENTIAL_COUNT_IN_LIST; i++) {
-            credential_free(&creds[i]);
-        }
+    for (int i = 0; i < MAX_CREDENTIAL_COUNT_IN_LIST; i++) {
+        credential_free(&creds[i]);
     }
 
     for (int m = 0; m < allowList_len; m++) {
@@ -660,7 +696,7 @@ err:
         }
     }
     if (aut_data) {
-        free(aut_data);
+        arena_free(aut_data);
     }
     if (error != CborNoError) {
         if (error == CborErrorImproperValue) {
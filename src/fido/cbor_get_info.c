@@ -20,14 +20,51 @@
 #include "fido.h"
 #include "ctap.h"
 #include "files.h"
+#include "cred_index.h"
 #include "apdu.h"
 #include "version.h"
 
+/* The response is serialized once and replayed while the state it reflects is unchanged.
+ * Everything else in it is fixed at build time. */
+typedef struct get_info_state {
+    bool pin_set;
+    bool ep;
+    bool force_pin_change;
+    uint8_t min_pin_length;
+    uint16_t remaining;
+} get_info_state_t;
+
+static uint8_t info_cache[512];
+static uint16_t info_cache_len = 0;
+static get_info_state_t info_state;
+
+static void get_info_current_state(get_info_state_t *st) {
+    memset(st, 0, sizeof(get_info_state_t));
+    st->pin_set = file_has_data(ef_pin);
+    st->ep = get_opts() & FIDO2_OPT_EA;
+    file_t *ef_minpin = search_by_fid(EF_MINPINLEN, NULL, SPECIFY_EF);
+    if (file_has_data(ef_minpin)) {
+        st->force_pin_change = file_get_data(ef_minpin)[1] == 1;
+        st->min_pin_length = *file_get_data(ef_minpin);
+    }
+    else {
+        st->min_pin_length = 4;
+    }
+    st->remaining = cred_index_remaining();
+}
+
 int cbor_get_info() {
     CborEncoder encoder, mapEncoder, arrayEncoder, mapEncoder2;
     CborError error = CborNoError;
+    get_info_state_t st;
+    get_info_current_state(&st);
+    if (info_cache_len > 0 && memcmp(&st, &info_state, sizeof(st)) == 0) {
+        memcpy(res_APDU + 1, info_cache, info_cache_len);
+        res_APDU_size = info_cache_len;
+        return 0;
+    }
     cbor_encoder_init(&encoder, ctap_resp->init.data + 1, CTAP_MAX_PACKET_SIZE, 0);
-    CBOR_CHECK(cbor_encoder_create_map(&encoder, &mapEncoder, 15));
+    CBOR_CHECK(cbor_encoder_create_map(&encoder, &mapEncoder, 16));
 
     CBOR_CHECK(cbor_encode_uint(&mapEncoder, 0x01));
     CBOR_CHECK(cbor_encoder_create_array(&mapEncoder, &arrayEncoder, 3));
@@ -52,7 +89,7 @@ int cbor_get_info() {
     CBOR_CHECK(cbor_encode_uint(&mapEncoder, 0x04));
     CBOR_CHECK(cbor_encoder_create_map(&mapEncoder, &arrayEncoder, 8));
     CBOR_CHECK(cbor_encode_text_stringz(&arrayEncoder, "ep"));
-    CBOR_CHECK(cbor_encode_boolean(&arrayEncoder, get_opts() & FIDO2_OPT_EA));
+    CBOR_CHECK(cbor_encode_boolean(&arrayEncoder, st.ep));
     CBOR_CHECK(cbor_encode_text_stringz(&arrayEncoder, "rk"));
     CBOR_CHECK(cbor_encode_boolean(&arrayEncoder, true));
     CBOR_CHECK(cbor_encode_text_stringz(&arrayEncoder, "credMgmt"));
@@ -60,12 +97,7 @@ int cbor_get_info() {
     CBOR_CHECK(cbor_encode_text_stringz(&arrayEncoder, "authnrCfg"));
     CBOR_CHECK(cbor_encode_boolean(&arrayEncoder, true));
     CBOR_CHECK(cbor_encode_text_stringz(&arrayEncoder, "clientPin"));
-    if (file_has_data(ef_pin)) {
-        CBOR_CHECK(cbor_encode_boolean(&arrayEncoder, true));
-    }
-    else {
-        CBOR_CHECK(cbor_encode_boolean(&arrayEncoder, false));
-    }
+    CBOR_CHECK(cbor_encode_boolean(&arrayEncoder, st.pin_set));
     CBOR_CHECK(cbor_encode_text_stringz(&arrayEncoder, "largeBlobs"));
     CBOR_CHECK(cbor_encode_boolean(&arrayEncoder, true));
     CBOR_CHECK(cbor_encode_text_stringz(&arrayEncoder, "pinUvAuthToken"));
@@ -100,28 +132,19 @@ int cbor_get_info() {
     CBOR_CHECK(cbor_encode_uint(&mapEncoder, 0x0B));
     CBOR_CHECK(cbor_encode_uint(&mapEncoder, MAX_LARGE_BLOB_SIZE)); // maxSerializedLargeBlobArray
 
-    file_t *ef_minpin = search_by_fid(EF_MINPINLEN, NULL, SPECIFY_EF);
     CBOR_CHECK(cbor_encode_uint(&mapEncoder, 0x0C));
-    if (file_has_data(ef_minpin) && file_get_data(ef_minpin)[1] == 1) {
-        CBOR_CHECK(cbor_encode_boolean(&mapEncoder, true));
-    }
-    else {
-        CBOR_CHECK(cbor_encode_boolean(&mapEncoder, false));
-    }
+    CBOR_CHECK(cbor_encode_boolean(&mapEncoder, st.force_pin_change));
     CBOR_CHECK(cbor_encode_uint(&mapEncoder, 0x0D));
-    if (file_has_data(ef_minpin)) {
-        CBOR_CHECK(cbor_encode_uint(&mapEncoder, *file_get_data(ef_minpin))); // minPINLength
-    }
-    else {
-        CBOR_CHECK(cbor_encode_uint(&mapEncoder, 4)); // minPINLength
-
-    }
+    CBOR_CHECK(cbor_encode_uint(&mapEncoder, st.min_pin_length)); // minPINLength
     CBOR_CHECK(cbor_encode_uint(&mapEncoder, 0x0E));
     CBOR_CHECK(cbor_encode_uint(&mapEncoder, PICO_FIDO_VERSION)); // firmwareVersion
 
     CBOR_CHECK(cbor_encode_uint(&mapEncoder, 0x0F));
     CBOR_CHECK(cbor_encode_uint(&mapEncoder, MAX_CREDBLOB_LENGTH)); // maxCredBlobLength
 
+    CBOR_CHECK(cbor_encode_uint(&mapEncoder, 0x14));
+    CBOR_CHECK(cbor_encode_uint(&mapEncoder, st.remaining)); // remainingDiscoverableCredentials
+
     CBOR_CHECK(cbor_encode_uint(&mapEncoder, 0x15));
     CBOR_CHECK(cbor_encoder_create_array(&mapEncoder, &arrayEncoder, 2));
     CBOR_CHECK(cbor_encode_uint(&arrayEncoder, CTAP_CONFIG_AUT_ENABLE));
@@ -134,5 +157,10 @@ err:
         return -CTAP2_ERR_INVALID_CBOR;
     }
     res_APDU_size = cbor_encoder_get_buffer_size(&encoder, res_APDU + 1);
+    if (res_APDU_size <= sizeof(info_cache)) {
+        memcpy(info_cache, res_APDU + 1, res_APDU_size);
+        info_cache_len = res_APDU_size;
+        info_state = st;
+    }
     return 0;
 }
@@ -134,11 +134,8 @@ int cbor_large_blobs(const uint8_t *data, size_t len) {
         verify_data[36] = offset >> 16;
         verify_data[37] = offset >> 24;
         mbedtls_sha256(set.data, set.len, verify_data + 38, 0);
-        if (verify(pinUvAuthProtocol, paut.data, verify_data, sizeof(verify_data),
-                   pinUvAuthParam.data) != 0) {
-            CBOR_ERROR(CTAP2_ERR_PIN_AUTH_INVALID);
-        }
-        if (!(paut.permissions & CTAP_PERMISSION_LBW)) {
+        if (checkPinUvAuthToken(pinUvAuthProtocol, verify_data, sizeof(verify_data),
+                                pinUvAuthParam.data, CTAP_PERMISSION_LBW, NULL) != 0) {
             CBOR_ERROR(CTAP2_ERR_PIN_AUTH_INVALID);
         }
         if (offset + set.len > expectedLength) {
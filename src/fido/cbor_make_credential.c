@@ -23,13 +23,28 @@
 #include "files.h"
 #include "apdu.h"
 #include "credential.h"
+#include "attestation.h"
 #include "mbedtls/sha256.h"
 #include "random.h"
+#include "crypto_utils.h"
 #include "pico_keys.h"
 
+static const uint16_t make_credential_params[] = {
+    [0x01] = CBOR_PARAM_BYTES | CBOR_PARAM_REQUIRED,    // clientDataHash
+    [0x02] = CBOR_PARAM_MAP | CBOR_PARAM_REQUIRED,      // rp
+    [0x03] = CBOR_PARAM_MAP | CBOR_PARAM_REQUIRED,      // user
+    [0x04] = CBOR_PARAM_ARRAY | CBOR_PARAM_REQUIRED,    // pubKeyCredParams
+    [0x05] = CBOR_PARAM_ARRAY,                          // excludeList
+    [0x06] = CBOR_PARAM_MAP,                            // extensions
+    [0x07] = CBOR_PARAM_MAP,                            // options
+    [0x08] = CBOR_PARAM_BYTES,                          // pinUvAuthParam
+    [0x09] = CBOR_PARAM_UINT,                           // pinUvAuthProtocol
+    [0x0A] = CBOR_PARAM_UINT,                           // enterpriseAttestation
+};
+
 int cbor_make_credential(const uint8_t *data, size_t len) {
     CborParser parser;
-    CborValue map;
+    cbor_params_t params;
     CborError error = CborNoError;
     CborByteString clientDataHash = { 0 }, pinUvAuthParam = { 0 };
     PublicKeyCredentialRpEntity rp = { 0 };
@@ -48,118 +63,113 @@ int cbor_make_credential(const uint8_t *data, size_t len) {
     //options.uv = pfalse;
     //options.rk = pfalse;
 
-    CBOR_CHECK(cbor_parser_init(data, len, 0, &parser, &map));
-    uint64_t val_c = 1;
-    CBOR_PARSE_MAP_START(map, 1)
-    {
-        uint64_t val_u = 0;
-        CBOR_FIELD_GET_UINT(val_u, 1);
-        if (val_c <= 4 && val_c != val_u) {
-            CBOR_ERROR(CTAP2_ERR_MISSING_PARAMETER);
-        }
-        if (val_u < val_c) {
-            CBOR_ERROR(CTAP2_ERR_INVALID_CBOR);
-        }
-        val_c = val_u + 1;
-        if (val_u == 0x01) { // clientDataHash
-            CBOR_FIELD_GET_BYTES(clientDataHash, 1);
-        }
-        else if (val_u == 0x02) { // rp
-            CBOR_PARSE_MAP_START(_f1, 2)
-            {
-                CBOR_FIELD_GET_KEY_TEXT(2);
-                CBOR_FIELD_KEY_TEXT_VAL_TEXT(2, "id", rp.id);
-                CBOR_FIELD_KEY_TEXT_VAL_TEXT(2, "name", rp.parent.name);
+    CBOR_CHECK(cbor_parse_params(data, len, &parser, make_credential_params,
+                                 sizeof(make_credential_params) / sizeof(uint16_t), &params));
+    CBOR_PARAM_GET_STRING(params, 0x01, clientDataHash);
+    if (CBOR_PARAM_PRESENT(params, 0x02)) { // rp
+        CBOR_PARSE_MAP_START(params.value[0x02], 2)
+        {
+            CBOR_FIELD_GET_KEY_TEXT(2);
+            CBOR_FIELD_KEY_TEXT_VIEW_TEXT(2, "id", rp.id);
+            CBOR_FIELD_KEY_TEXT_VIEW_TEXT(2, "name", rp.parent.name);
+            CBOR_ADVANCE(2);
+        }
+        CBOR_PARSE_MAP_END(params.value[0x02], 2);
+    }
+    if (CBOR_PARAM_PRESENT(params, 0x03)) { // user
+        CBOR_PARSE_MAP_START(params.value[0x03], 2)
+        {
+            CBOR_FIELD_GET_KEY_TEXT(2);
+            CBOR_FIELD_KEY_TEXT_VIEW_BYTES(2, "id", user.id);
+            CBOR_FIELD_KEY_TEXT_VIEW_TEXT(2, "name", user.parent.name);
+            CBOR_FIELD_KEY_TEXT_VIEW_TEXT(2, "displayName", user.displayName);
+            CBOR_ADVANCE(2);
+        }
+        CBOR_PARSE_MAP_END(params.value[0x03], 2);
+    }
+    if (CBOR_PARAM_PRESENT(params, 0x04)) { // pubKeyCredParams
+        CBOR_PARSE_ARRAY_START(params.value[0x04], 2)
+        {
+            if (pubKeyCredParams_len >= MAX_CREDENTIAL_COUNT_IN_LIST) {
+                CBOR_ERROR(CTAP2_ERR_LIMIT_EXCEEDED);
             }
-            CBOR_PARSE_MAP_END(_f1, 2);
-        }
-        else if (val_u == 0x03) { // user
-            CBOR_PARSE_MAP_START(_f1, 2)
+            PublicKeyCredentialParameters *pk = &pubKeyCredParams[pubKeyCredParams_len];
+            CBOR_PARSE_MAP_START(_f2, 3)
             {
-                CBOR_FIELD_GET_KEY_TEXT(2);
-                CBOR_FIELD_KEY_TEXT_VAL_BYTES(2, "id", user.id);
-                CBOR_FIELD_KEY_TEXT_VAL_TEXT(2, "name", user.parent.name);
-                CBOR_FIELD_KEY_TEXT_VAL_TEXT(2, "displayName", user.displayName);
-                CBOR_ADVANCE(2);
+                CBOR_FIELD_GET_KEY_TEXT(3);
+                CBOR_FIELD_KEY_TEXT_VIEW_TEXT(3, "type", pk->type);
+                CBOR_FIELD_KEY_TEXT_VAL_INT(3, "alg", pk->alg);
+                CBOR_ADVANCE(3);
             }
-            CBOR_PARSE_MAP_END(_f1, 2);
+            CBOR_PARSE_MAP_END(_f2, 3);
+            pubKeyCredParams_len++;
         }
-        else if (val_u == 0x04) { // pubKeyCredParams
-            CBOR_PARSE_ARRAY_START(_f1, 2)
-            {
-                PublicKeyCredentialParameters *pk = &pubKeyCredParams[pubKeyCredParams_len];
-                CBOR_PARSE_MAP_START(_f2, 3)
-                {
-                    CBOR_FIELD_GET_KEY_TEXT(3);
-                    CBOR_FIELD_KEY_TEXT_VAL_TEXT(3, "type", pk->type);
-                    CBOR_FIELD_KEY_TEXT_VAL_INT(3, "alg", pk->alg);
-                }
-                CBOR_PARSE_MAP_END(_f2, 3);
-                pubKeyCredParams_len++;
+        CBOR_PARSE_ARRAY_END(params.value[0x04], 2);
+    }
+    if (CBOR_PARAM_PRESENT(params, 0x05)) { // excludeList
+        CBOR_PARSE_ARRAY_START(params.value[0x05], 2)
+        {
+            if (excludeList_len >= MAX_CREDENTIAL_COUNT_IN_LIST) {
+                CBOR_ERROR(CTAP2_ERR_LIMIT_EXCEEDED);
             }
-            CBOR_PARSE_ARRAY_END(_f1, 2);
-        }
-        else if (val_u == 0x05) { // excludeList
-            CBOR_PARSE_ARRAY_START(_f1, 2)
+            PublicKeyCredentialDescriptor *pc = &excludeList[excludeList_len];
+            CBOR_PARSE_MAP_START(_f2, 3)
             {
-                PublicKeyCredentialDescriptor *pc = &excludeList[excludeList_len];
-                CBOR_PARSE_MAP_START(_f2, 3)
-                {
-                    CBOR_FIELD_GET_KEY_TEXT(3);
-                    CBOR_FIELD_KEY_TEXT_VAL_BYTES(3, "id", pc->id);
-                    CBOR_FIELD_KEY_TEXT_VAL_TEXT(3, "type", pc->type);
-                    if (strcmp(_fd3, "transports") == 0) {
-                        CBOR_PARSE_ARRAY_START(_f3, 4)
-                        {
-                            CBOR_FIELD_GET_TEXT(pc->transports[pc->transports_len], 4);
+                CBOR_FIELD_GET_KEY_TEXT(3);
+                CBOR_FIELD_KEY_TEXT_VIEW_BYTES(3, "id", pc->id);
+                CBOR_FIELD_KEY_TEXT_VIEW_TEXT(3, "type", pc->type);
+                if (strcmp(_fd3, "transports") == 0) {
+                    CBOR_PARSE_ARRAY_START(_f3, 4)
+                    {
+                        if (pc->transports_len < sizeof(pc->transports) / sizeof(pc->transports[0])) {
+                            CBOR_FIELD_VIEW_TEXT(pc->transports[pc->transports_len], 4);
                             pc->transports_len++;
                         }
-                        CBOR_PARSE_ARRAY_END(_f3, 4);
+                        else {
+                            CBOR_ADVANCE(4);
+                        }
                     }
+                    CBOR_PARSE_ARRAY_END(_f3, 4);
+                    continue;
                 }
-                CBOR_PARSE_MAP_END(_f2, 3);
-                excludeList_len++;
-            }
-            CBOR_PARSE_ARRAY_END(_f1, 2);
-        }
-        else if (val_u == 0x06) { // extensions
-            extensions.present = true;
-            CBOR_PARSE_MAP_START(_f1, 2)
-            {
-                CBOR_FIELD_GET_KEY_TEXT(2);
-                CBOR_FIELD_KEY_TEXT_VAL_BOOL(2, "hmac-secret", extensions.hmac_secret);
-                CBOR_FIELD_KEY_TEXT_VAL_UINT(2, "credProtect", extensions.credProtect);
-                CBOR_FIELD_KEY_TEXT_VAL_BOOL(2, "minPinLength", extensions.minPinLength);
-                CBOR_FIELD_KEY_TEXT_VAL_BYTES(2, "credBlob", extensions.credBlob);
-                CBOR_FIELD_KEY_TEXT_VAL_BOOL(2, "largeBlobKey", extensions.largeBlobKey);
-                CBOR_FIELD_KEY_TEXT_VAL_BOOL(2, "thirdPartyPayment", extensions.thirdPartyPayment);
-                CBOR_ADVANCE(2);
+                CBOR_ADVANCE(3);
             }
-            CBOR_PARSE_MAP_END(_f1, 2);
-        }
-        else if (val_u == 0x07) { // options
-            options.present = true;
-            CBOR_PARSE_MAP_START(_f1, 2)
-            {
-                CBOR_FIELD_GET_KEY_TEXT(2);
-                CBOR_FIELD_KEY_TEXT_VAL_BOOL(2, "rk", options.rk);
-                CBOR_FIELD_KEY_TEXT_VAL_BOOL(2, "up", options.up);
-                CBOR_FIELD_KEY_TEXT_VAL_BOOL(2, "uv", options.uv);
-                CBOR_ADVANCE(2);
-            }
-            CBOR_PARSE_MAP_END(_f1, 2);
-        }
-        else if (val_u == 0x08) { // pinUvAuthParam
-            CBOR_FIELD_GET_BYTES(pinUvAuthParam, 1);
-        }
-        else if (val_u == 0x09) { // pinUvAuthProtocol
-            CBOR_FIELD_GET_UINT(pinUvAuthProtocol, 1);
-        }
-        else if (val_u == 0x0A) { // enterpriseAttestation
-            CBOR_FIELD_GET_UINT(enterpriseAttestation, 1);
+            CBOR_PARSE_MAP_END(_f2, 3);
+            excludeList_len++;
         }
+        CBOR_PARSE_ARRAY_END(params.value[0x05], 2);
+    }
+    if (CBOR_PARAM_PRESENT(params, 0x06)) { // extensions
+        extensions.present = true;
+        CBOR_PARSE_MAP_START(params.value[0x06], 2)
+        {
+            CBOR_FIELD_GET_KEY_TEXT(2);
+            CBOR_FIELD_KEY_TEXT_VAL_BOOL(2, "hmac-secret", extensions.hmac_secret);
+            CBOR_FIELD_KEY_TEXT_VAL_UINT(2, "credProtect", extensions.credProtect);
+            CBOR_FIELD_KEY_TEXT_VAL_BOOL(2, "minPinLength", extensions.minPinLength);
+            CBOR_FIELD_KEY_TEXT_VIEW_BYTES(2, "credBlob", extensions.credBlob);
+            CBOR_FIELD_KEY_TEXT_VAL_BOOL(2, "largeBlobKey", extensions.largeBlobKey);
+            CBOR_FIELD_KEY_TEXT_VAL_BOOL(2, "thirdPartyPayment", extensions.thirdPartyPayment);
+            CBOR_ADVANCE(2);
+        }
+        CBOR_PARSE_MAP_END(params.value[0x06], 2);
     }
-    CBOR_PARSE_MAP_END(map, 1);
+    if (CBOR_PARAM_PRESENT(params, 0x07)) { // options
+        options.present = true;
+        CBOR_PARSE_MAP_START(params.value[0x07], 2)
+        {
+            CBOR_FIELD_GET_KEY_TEXT(2);
+            CBOR_FIELD_KEY_TEXT_VAL_BOOL(2, "rk", options.rk);
+            CBOR_FIELD_KEY_TEXT_VAL_BOOL(2, "up", options.up);
+            CBOR_FIELD_KEY_TEXT_VAL_BOOL(2, "uv", options.uv);
+            CBOR_ADVANCE(2);
+        }
+        CBOR_PARSE_MAP_END(params.value[0x07], 2);
+    }
+    CBOR_PARAM_GET_STRING(params, 0x08, pinUvAuthParam);
+    CBOR_PARAM_GET_UINT(params, 0x09, pinUvAuthProtocol);
+    CBOR_PARAM_GET_UINT(params, 0x0A, enterpriseAttestation);
+    TELEMETRY_PARSED();
 
     uint8_t flags = FIDO2_AUT_FLAG_AT;
     uint8_t rp_id_hash[32];
@@ -199,7 +209,7 @@ int cbor_make_credential(const uint8_t *data, size_t len) {
         if (pubKeyCredParams[i].alg == 0) {
             CBOR_ERROR(CTAP2_ERR_INVALID_CBOR);
         }
-        if (strcmp(pubKeyCredParams[i].type.data, "public-key") != 0) {
+        if (!CBOR_TEXT_EQUALS(pubKeyCredParams[i].type, "public-key")) {
             CBOR_ERROR(CTAP2_ERR_CBOR_UNEXPECTED_TYPE);
         }
         if (pubKeyCredParams[i].alg == FIDO2_ALG_ES256) {
@@ -259,27 +269,22 @@ int cbor_make_credential(const uint8_t *data, size_t len) {
         //Unfinished. See 6.1.2.9
     }
     if (pinUvAuthParam.present == true) { //11.1
-        int ret = verify(pinUvAuthProtocol,
-                         paut.data,
-                         clientDataHash.data,
-                         clientDataHash.len,
-                         pinUvAuthParam.data);
-        if (ret != CborNoError) {
-            CBOR_ERROR(CTAP2_ERR_PIN_AUTH_INVALID);
-        }
-        if (!(paut.permissions & CTAP_PERMISSION_MC)) {
-            CBOR_ERROR(CTAP2_ERR_PIN_AUTH_INVALID);
-        }
-        if (paut.has_rp_id == true && memcmp(paut.rp_id_hash, rp_id_hash, 32) != 0) {
+        int ret = checkPinUvAuthToken(pinUvAuthProtocol,
+                                      clientDataHash.data,
+                                      clientDataHash.len,
+                                      pinUvAuthParam.data,
+                                      CTAP_PERMISSION_MC,
+                                      rp_id_hash);
+        if (ret != 0) {
             CBOR_ERROR(CTAP2_ERR_PIN_AUTH_INVALID);
         }
         if (getUserVerifiedFlagValue() == false) {
             CBOR_ERROR(CTAP2_ERR_PIN_AUTH_INVALID);
         }
         flags |= FIDO2_AUT_FLAG_UV;
-        if (paut.has_rp_id == false) {
-            memcpy(paut.rp_id_hash, rp_id_hash, 32);
-            paut.has_rp_id = true;
+        if (paut->has_rp_id == false) {
+            memcpy(paut->rp_id_hash, rp_id_hash, 32);
+            paut->has_rp_id = true;
         }
     }
 
@@ -287,7 +292,7 @@ int cbor_make_credential(const uint8_t *data, size_t len) {
         if (excludeList[e].type.present == false || excludeList[e].id.present == false) {
             CBOR_ERROR(CTAP2_ERR_MISSING_PARAMETER);
         }
-        if (strcmp(excludeList[e].type.data, "public-key") != 0) {
+        if (!CBOR_TEXT_EQUALS(excludeList[e].type, "public-key")) {
             continue;
         }
         Credential ecred;
@@ -318,7 +323,8 @@ int cbor_make_credential(const uint8_t *data, size_t len) {
         clearPinUvAuthTokenPermissionsExceptLbw();
     }
 
-    const known_app_t *ka = find_app_by_rp_id_hash(rp_id_hash);
+    known_app_t ka_user;
+    const known_app_t *ka = find_app_by_rp_id_hash(rp_id_hash, &ka_user);
 
     uint8_t cred_id[MAX_CRED_ID_LENGTH];
     size_t cred_id_len = 0;
@@ -389,6 +395,9 @@ int cbor_make_credential(const uint8_t *data, size_t len) {
     mbedtls_ecdsa_context ekey;
     mbedtls_ecdsa_init(&ekey);
     int ret = fido_load_key(curve, cred_id, &ekey);
+    if (ret == 0) {
+        ret = derive_public_key(&ekey);
+    }
     if (ret != 0) {
         mbedtls_ecdsa_free(&ekey);
         CBOR_ERROR(CTAP1_ERR_OTHER);
@@ -406,7 +415,11 @@ int cbor_make_credential(const uint8_t *data, size_t len) {
     size_t rs = cbor_encoder_get_buffer_size(&encoder, cbor_buf);
 
     size_t aut_data_len = 32 + 1 + 4 + (16 + 2 + cred_id_len + rs) + ext_len;
-    aut_data = (uint8_t *) calloc(1, aut_data_len + clientDataHash.len);
+    aut_data = (uint8_t *) arena_alloc(aut_data_len + clientDataHash.len);
+    if (!aut_data) {
+        mbedtls_ecdsa_free(&ekey);
+        CBOR_ERROR(CTAP2_ERR_PROCESSING);
+    }
     uint8_t *pa = aut_data;
     memcpy(pa, rp_id_hash, 32); pa += 32;
     *pa++ = flags;
@@ -447,15 +460,17 @@ int cbor_make_credential(const uint8_t *data, size_t len) {
         md = mbedtls_md_info_from_type(MBEDTLS_MD_SHA256);
         self_attestation = false;
     }
-    ret = mbedtls_ecdsa_write_signature(&ekey,
-                                        mbedtls_md_get_type(md),
-                                        hash,
-                                        mbedtls_md_get_size(md),
-                                        sig,
-                                        sizeof(sig),
-                                        &olen,
-                                        random_gen,
-                                        NULL);
+    TELEMETRY_PHASE_START(t);
+    ret = ecdsa_write_signature(&ekey,
+                                mbedtls_md_get_type(md),
+                                hash,
+                                mbedtls_md_get_size(md),
+                                sig,
+                                sizeof(sig),
+                                &olen,
+                                random_gen,
+                                NULL);
+    TELEMETRY_PHASE_END(TELEMETRY_PHASE_CRYPTO, t);
     mbedtls_ecdsa_free(&ekey);
 
     uint8_t largeBlobKey[32];
@@ -485,19 +500,7 @@ int cbor_make_credential(const uint8_t *data, size_t len) {
     CBOR_CHECK(cbor_encode_text_stringz(&mapEncoder2, "sig"));
     CBOR_CHECK(cbor_encode_byte_string(&mapEncoder2, sig, olen));
     if (self_attestation == false || is_nitrokey) {
-        CborEncoder arrEncoder;
-        file_t *ef_cert = NULL;
-        if (enterpriseAttestation == 2) {
-            ef_cert = search_by_fid(EF_EE_DEV_EA, NULL, SPECIFY_EF);
-        }
-        if (!file_has_data(ef_cert)) {
-            ef_cert = ef_certdev;
-        }
-        CBOR_CHECK(cbor_encode_text_stringz(&mapEncoder2, "x5c"));
-        CBOR_CHECK(cbor_encoder_create_array(&mapEncoder2, &arrEncoder, 1));
-        CBOR_CHECK(cbor_encode_byte_string(&arrEncoder, file_get_data(ef_cert),
-                                           file_get_size(ef_cert)));
-        CBOR_CHECK(cbor_encoder_close_container(&mapEncoder2, &arrEncoder));
+        CBOR_CHECK(attestation_encode_x5c(&mapEncoder2, enterpriseAttestation == 2));
     }
     CBOR_CHECK(cbor_encoder_close_container(&mapEncoder, &mapEncoder2));
 
@@ -512,14 +515,17 @@ int cbor_make_credential(const uint8_t *data, size_t len) {
     CBOR_CHECK(cbor_encoder_close_container(&encoder, &mapEncoder));
     resp_size = cbor_encoder_get_buffer_size(&encoder, ctap_resp->init.data + 1);
 
+    // The credential, its RP and the counter reach the flash together
+    low_flash_txn_begin();
     if (options.rk == ptrue) {
         if (credential_store(cred_id, cred_id_len, rp_id_hash) != 0) {
+            low_flash_txn_commit();
             CBOR_ERROR(CTAP2_ERR_KEY_STORE_FULL);
         }
     }
     ctr++;
     flash_write_data_to_file(ef_counter, (uint8_t *) &ctr, sizeof(ctr));
-    low_flash_available();
+    low_flash_txn_commit();
 err:
     CBOR_FREE_BYTE_STRING(clientDataHash);
     CBOR_FREE_BYTE_STRING(pinUvAuthParam);
@@ -540,7 +546,7 @@ err:
         }
     }
     if (aut_data) {
-        free(aut_data);
+        arena_free(aut_data);
     }
     if (error != CborNoError) {
         if (error == CborErrorImproperValue) {
@@ -23,6 +23,7 @@
 #endif
 
 extern void scan_all();
+extern int resetPinUvAuthToken();
 
 int cbor_reset() {
 #ifndef ENABLE_EMULATION
@@ -37,5 +38,6 @@ int cbor_reset() {
 #endif
     initialize_flash(true);
     init_fido();
+    resetPinUvAuthToken();
     return 0;
 }
@@ -16,17 +16,19 @@
  */
 
 #include "ctap2_cbor.h"
+#include "attestation.h"
 #include "fido.h"
 #include "ctap.h"
 #include "hid/ctap_hid.h"
 #include "files.h"
 #include "apdu.h"
 #include "pico_keys.h"
+#include "credential.h"
+#include "cred_index.h"
 #include "random.h"
 #include "mbedtls/ecdh.h"
 #include "mbedtls/chachapoly.h"
 #include "mbedtls/hkdf.h"
-#include "mbedtls/x509_csr.h"
 
 extern uint8_t keydev_dec[32];
 extern bool has_keydev_dec;
@@ -49,6 +51,41 @@ int mse_decrypt_ct(uint8_t *data, size_t len) {
     return ret;
 }
 
+/* Vendor commands that change the device state are authorized as authenticatorConfig does, but
+ * over 32 x 0xff | CTAP_VENDOR_CBOR | cmd | vendorCmd | subpara. The command byte differs from
+ * authenticatorConfig's 0x0d, so a signature cannot be replayed from one to the other. */
+static int vendor_check_auth(uint8_t cmd, uint8_t vendorCmd, const uint8_t *subpara,
+                             size_t subpara_len, uint64_t protocol,
+                             const CborByteString *pinUvAuthParam, uint8_t permissions) {
+    if (pinUvAuthParam->present == false) {
+        return CTAP2_ERR_PUAT_REQUIRED;
+    }
+    if (protocol == 0) {
+        return CTAP2_ERR_MISSING_PARAMETER;
+    }
+    if (pinUvAuthParam->len != (protocol == 1 ? 16 : 32)) {
+        return CTAP2_ERR_PIN_AUTH_INVALID;
+    }
+    uint8_t *msg = (uint8_t *) arena_alloc(32 + 3 + subpara_len);
+    if (!msg) {
+        return CTAP2_ERR_PROCESSING;
+    }
+    memset(msg, 0xff, 32);
+    msg[32] = CTAP_VENDOR_CBOR;
+    msg[33] = cmd;
+    msg[34] = vendorCmd;
+    if (subpara_len > 0) {
+        memcpy(msg + 35, subpara, subpara_len);
+    }
+    int ret = checkPinUvAuthToken((uint8_t) protocol, msg, 32 + 3 + subpara_len,
+                                  pinUvAuthParam->data, permissions, NULL);
+    arena_free(msg);
+    if (ret != 0 || paut->has_rp_id == true) {
+        return CTAP2_ERR_PIN_AUTH_INVALID;
+    }
+    return 0;
+}
+
 int cbor_vendor_generic(uint8_t cmd, const uint8_t *data, size_t len) {
     CborParser parser;
     CborValue map;
@@ -57,7 +94,12 @@ int cbor_vendor_generic(uint8_t cmd, const uint8_t *data, size_t len) {
     size_t resp_size = 0;
     uint64_t vendorCmd = 0, pinUvAuthProtocol = 0;
     int64_t kty = 0, alg = 0, crv = 0;
-    CborEncoder encoder, mapEncoder, mapEncoder2;
+    CborEncoder encoder, mapEncoder, mapEncoder2, arrEncoder;
+    uint8_t *raw_subpara = NULL;
+    size_t raw_subpara_len = 0;
+#ifdef ENABLE_TELEMETRY
+    CborEncoder arrEncoder2;
+#endif
 
     CBOR_CHECK(cbor_parser_init(data, len, 0, &parser, &map));
     uint64_t val_c = 1;
@@ -77,6 +119,7 @@ int cbor_vendor_generic(uint8_t cmd, const uint8_t *data, size_t len) {
         }
         else if (val_u == 0x02) {
             uint64_t subpara = 0;
+            raw_subpara = (uint8_t *) cbor_value_get_next_byte(&_f1);
             CBOR_PARSE_MAP_START(_f1, 2)
             {
                 CBOR_FIELD_GET_UINT(subpara, 2);
@@ -91,6 +134,7 @@ int cbor_vendor_generic(uint8_t cmd, const uint8_t *data, size_t len) {
                 }
             }
             CBOR_PARSE_MAP_END(_f1, 2);
+            raw_subpara_len = cbor_value_get_next_byte(&_f1) - raw_subpara;
         }
         else if (val_u == 0x03) {
             CBOR_FIELD_GET_UINT(pinUvAuthProtocol, 1);
@@ -121,12 +165,57 @@ int cbor_vendor_generic(uint8_t cmd, const uint8_t *data, size_t len) {
             }
             uint8_t zeros[32];
             memset(zeros, 0, sizeof(zeros));
+            low_flash_txn_begin();
             flash_write_data_to_file(ef_keydev_enc, vendorParam.data, vendorParam.len);
             flash_write_data_to_file(ef_keydev, zeros, file_get_size(ef_keydev)); // Overwrite ef with 0
             flash_write_data_to_file(ef_keydev, NULL, 0); // Set ef to 0 bytes
-            low_flash_available();
+            low_flash_txn_commit();
             goto err;
         }
+        else if (vendorCmd == 0x03) { // Full state, chunk given by a 4 bytes index
+            if (vendorParam.present == false || vendorParam.len != 4) {
+                CBOR_ERROR(CTAP2_ERR_MISSING_PARAMETER);
+            }
+            uint32_t index = ((uint32_t) vendorParam.data[0] << 24) | (vendorParam.data[1] << 16) |
+                             (vendorParam.data[2] << 8) | vendorParam.data[3], chunks = 0;
+            size_t chunk_len = 0;
+            uint8_t *chunk = (uint8_t *) arena_alloc(BACKUP_SEALED_SIZE);
+            if (!chunk) {
+                CBOR_ERROR(CTAP2_ERR_LIMIT_EXCEEDED);
+            }
+            int ret = backup_read(index, chunk, &chunk_len, &chunks);
+            if (ret != 0) {
+                CBOR_ERROR(ret);
+            }
+            CBOR_CHECK(cbor_encoder_create_map(&encoder, &mapEncoder, 2));
+            CBOR_CHECK(cbor_encode_uint(&mapEncoder, 0x01));
+            CBOR_CHECK(cbor_encode_byte_string(&mapEncoder, chunk, chunk_len));
+            CBOR_APPEND_KEY_UINT_VAL_UINT(mapEncoder, 0x02, chunks);
+        }
+        else if (vendorCmd == 0x04) { // Full state restore, one sealed chunk
+            if (vendorParam.present == false) {
+                CBOR_ERROR(CTAP2_ERR_MISSING_PARAMETER);
+            }
+            uint32_t next = 0;
+            int ret = backup_restore(vendorParam.data, vendorParam.len, &next);
+            if (ret != 0) {
+                CBOR_ERROR(ret);
+            }
+            CBOR_CHECK(cbor_encoder_create_map(&encoder, &mapEncoder, 1));
+            CBOR_APPEND_KEY_UINT_VAL_UINT(mapEncoder, 0x01, next);
+        }
+        else if (vendorCmd == 0x05) { // Full state restore progress
+            uint32_t next = 0, chunks = 0;
+            bool apply = false;
+            const uint8_t *id = backup_restore_status(&next, &chunks, &apply);
+            CBOR_CHECK(cbor_encoder_create_map(&encoder, &mapEncoder, 4));
+            CBOR_APPEND_KEY_UINT_VAL_UINT(mapEncoder, 0x01, next);
+            CBOR_APPEND_KEY_UINT_VAL_UINT(mapEncoder, 0x02, chunks);
+            CBOR_CHECK(cbor_encode_uint(&mapEncoder, 0x03));
+            CBOR_CHECK(cbor_encode_byte_string(&mapEncoder, id, 8));
+            CBOR_CHECK(cbor_encode_uint(&mapEncoder, 0x04));
+            CBOR_CHECK(cbor_encode_boolean(&mapEncoder, apply));
+        }
         else {
             CBOR_ERROR(CTAP2_ERR_INVALID_SUBCOMMAND);
         }
@@ -140,28 +229,28 @@ int cbor_vendor_generic(uint8_t cmd, const uint8_t *data, size_t len) {
             mbedtls_ecdh_context hkey;
             mbedtls_ecdh_init(&hkey);
             mbedtls_ecdh_setup(&hkey, MBEDTLS_ECP_DP_SECP256R1);
-            int ret = mbedtls_ecdh_gen_public(&hkey.ctx.mbed_ecdh.grp,
-                                              &hkey.ctx.mbed_ecdh.d,
-                                              &hkey.ctx.mbed_ecdh.Q,
+            int ret = mbedtls_ecdh_gen_public(&hkey.grp,
+                                              &hkey.d,
+                                              &hkey.Q,
                                               random_gen,
                                               NULL);
-            mbedtls_mpi_lset(&hkey.ctx.mbed_ecdh.Qp.Z, 1);
+            mbedtls_mpi_lset(&hkey.Qp.Z, 1);
             if (ret != 0) {
                 CBOR_ERROR(CTAP1_ERR_INVALID_PARAMETER);
             }
-            if (mbedtls_mpi_read_binary(&hkey.ctx.mbed_ecdh.Qp.X, kax.data, kax.len) != 0) {
+            if (mbedtls_mpi_read_binary(&hkey.Qp.X, kax.data, kax.len) != 0) {
                 mbedtls_ecdh_free(&hkey);
                 CBOR_ERROR(CTAP1_ERR_INVALID_PARAMETER);
             }
-            if (mbedtls_mpi_read_binary(&hkey.ctx.mbed_ecdh.Qp.Y, kay.data, kay.len) != 0) {
+            if (mbedtls_mpi_read_binary(&hkey.Qp.Y, kay.data, kay.len) != 0) {
                 mbedtls_ecdh_free(&hkey);
                 CBOR_ERROR(CTAP1_ERR_INVALID_PARAMETER);
             }
 
             uint8_t buf[MBEDTLS_ECP_MAX_BYTES];
             size_t olen = 0;
-            ret = mbedtls_ecp_point_write_binary(&hkey.ctx.mbed_ecdh.grp,
-                                                 &hkey.ctx.mbed_ecdh.Qp,
+            ret = mbedtls_ecp_point_write_binary(&hkey.grp,
+                                                 &hkey.Qp,
                                                  MBEDTLS_ECP_PF_UNCOMPRESSED,
                                                  &olen,
                                                  mse.Qpt,
@@ -240,78 +329,191 @@ int cbor_vendor_generic(uint8_t cmd, const uint8_t *data, size_t len) {
     }
     else if (cmd == CTAP_VENDOR_EA) {
         if (vendorCmd == 0x01) {
-            uint8_t buffer[1024];
-            mbedtls_ecdsa_context ekey;
-            mbedtls_ecdsa_init(&ekey);
-            int ret = mbedtls_ecp_read_key(MBEDTLS_ECP_DP_SECP256R1,
-                                           &ekey,
-                                           file_get_data(ef_keydev),
-                                           file_get_size(ef_keydev));
-            if (ret != 0) {
-                mbedtls_ecdsa_free(&ekey);
+            const uint8_t *csr = NULL;
+            size_t csr_len = 0;
+            if (attestation_csr(&csr, &csr_len) != CCID_OK) {
                 CBOR_ERROR(CTAP2_ERR_PROCESSING);
             }
-            ret = mbedtls_ecp_mul(&ekey.grp, &ekey.Q, &ekey.d, &ekey.grp.G, random_gen, NULL);
-            if (ret != 0) {
-                mbedtls_ecdsa_free(&ekey);
-                CBOR_ERROR(CTAP2_ERR_PROCESSING);
+            CBOR_CHECK(cbor_encoder_create_map(&encoder, &mapEncoder, 1));
+            CBOR_CHECK(cbor_encode_uint(&mapEncoder, 0x01));
+            CBOR_CHECK(cbor_encode_byte_string(&mapEncoder, csr, csr_len));
+        }
+        else if (vendorCmd == 0x02) {
+            if (vendorParam.present == false) {
+                CBOR_ERROR(CTAP2_ERR_MISSING_PARAMETER);
             }
-#ifndef ENABLE_EMULATION
-            pico_unique_board_id_t rpiid;
-            pico_get_unique_board_id(&rpiid);
-#else
-            struct {
-                uint8_t id[8];
-            } rpiid = { 0 };
-#endif
-            mbedtls_x509write_csr ctx;
-            mbedtls_x509write_csr_init(&ctx);
-            snprintf((char *) buffer,
-                     sizeof(buffer),
-                     "C=ES,O=Pico Keys,OU=Authenticator Attestation,CN=Pico Fido EE Serial %02x%02x%02x%02x%02x%02x%02x%02x",
-                     rpiid.id[0],
-                     rpiid.id[1],
-                     rpiid.id[2],
-                     rpiid.id[3],
-                     rpiid.id[4],
-                     rpiid.id[5],
-                     rpiid.id[6],
-                     rpiid.id[7]);
-            mbedtls_x509write_csr_set_subject_name(&ctx, (char *) buffer);
-            mbedtls_pk_context key;
-            mbedtls_pk_init(&key);
-            mbedtls_pk_setup(&key, mbedtls_pk_info_from_type(MBEDTLS_PK_ECKEY));
-            key.pk_ctx = &ekey;
-            mbedtls_x509write_csr_set_key(&ctx, &key);
-            mbedtls_x509write_csr_set_md_alg(&ctx, MBEDTLS_MD_SHA256);
-            mbedtls_x509write_csr_set_extension(&ctx,
-                                                "\x2B\x06\x01\x04\x01\x82\xE5\x1C\x01\x01\x04",
-                                                0xB,
-                                                0,
-                                                aaguid,
-                                                sizeof(aaguid));
-            ret = mbedtls_x509write_csr_der(&ctx, buffer, sizeof(buffer), random_gen, NULL);
-            mbedtls_ecdsa_free(&ekey);
-            if (ret <= 0) {
-                mbedtls_x509write_csr_free(&ctx);
+            int ret = attestation_set_ea(vendorParam.data, vendorParam.len);
+            if (ret == CCID_WRONG_DATA) {
+                CBOR_ERROR(CTAP1_ERR_INVALID_PARAMETER);
+            }
+            else if (ret != CCID_OK) {
                 CBOR_ERROR(CTAP2_ERR_PROCESSING);
             }
-            CBOR_CHECK(cbor_encoder_create_map(&encoder, &mapEncoder, 1));
+            low_flash_available();
+            goto err;
+        }
+    }
+    else if (cmd == CTAP_VENDOR_KNOWN_APPS) {
+        file_t *ef_known_apps = search_by_fid(EF_KNOWN_APPS, NULL, SPECIFY_EF);
+        if (!ef_known_apps) {
+            CBOR_ERROR(CTAP2_ERR_NOT_ALLOWED);
+        }
+        if (vendorCmd == 0x01) { // Up to KNOWN_APPS_CHUNK_SIZE bytes from a 2 bytes offset
+            uint16_t off = 0, size = file_get_size(ef_known_apps);
+            if (vendorParam.present == true) {
+                if (vendorParam.len != 2) {
+                    CBOR_ERROR(CTAP1_ERR_INVALID_PARAMETER);
+                }
+                off = get_uint16_t(vendorParam.data, 0);
+            }
+            if (off > size) {
+                CBOR_ERROR(CTAP1_ERR_INVALID_PARAMETER);
+            }
+            CBOR_CHECK(cbor_encoder_create_map(&encoder, &mapEncoder, 2));
             CBOR_CHECK(cbor_encode_uint(&mapEncoder, 0x01));
-            CBOR_CHECK(cbor_encode_byte_string(&mapEncoder, buffer + sizeof(buffer) - ret, ret));
+            CBOR_CHECK(cbor_encode_byte_string(&mapEncoder, file_get_data(ef_known_apps) + off,
+                                               MIN(size - off, KNOWN_APPS_CHUNK_SIZE)));
+            CBOR_APPEND_KEY_UINT_VAL_UINT(mapEncoder, 0x02, size);
         }
         else if (vendorCmd == 0x02) {
             if (vendorParam.present == false) {
                 CBOR_ERROR(CTAP2_ERR_MISSING_PARAMETER);
             }
-            file_t *ef_ee_ea = search_by_fid(EF_EE_DEV_EA, NULL, SPECIFY_EF);
-            if (ef_ee_ea) {
-                flash_write_data_to_file(ef_ee_ea, vendorParam.data, vendorParam.len);
+            int ret = vendor_check_auth(cmd, (uint8_t) vendorCmd, raw_subpara, raw_subpara_len,
+                                        pinUvAuthProtocol, &pinUvAuthParam, CTAP_PERMISSION_ACFG);
+            if (ret != 0) {
+                CBOR_ERROR(ret);
+            }
+            if (known_apps_parse(vendorParam.data, vendorParam.len, NULL, NULL) != CCID_OK) {
+                CBOR_ERROR(CTAP1_ERR_INVALID_PARAMETER);
+            }
+            if (flash_write_data_to_file(ef_known_apps, vendorParam.data,
+                                         vendorParam.len) != CCID_OK) {
+                CBOR_ERROR(CTAP2_ERR_KEY_STORE_FULL);
             }
+            init_known_apps();
             low_flash_available();
             goto err;
         }
+        else {
+            CBOR_ERROR(CTAP2_ERR_INVALID_SUBCOMMAND);
+        }
+    }
+    else if (cmd == CTAP_VENDOR_FLASH_STATS) {
+        if (vendorCmd == 0x01) {
+            flash_stats_t st;
+            flash_get_stats(&st);
+            CBOR_CHECK(cbor_encoder_create_map(&encoder, &mapEncoder, 11));
+            CBOR_APPEND_KEY_UINT_VAL_UINT(mapEncoder, 0x01, st.total);
+            CBOR_APPEND_KEY_UINT_VAL_UINT(mapEncoder, 0x02, st.used);
+            CBOR_APPEND_KEY_UINT_VAL_UINT(mapEncoder, 0x03, st.free);
+            CBOR_APPEND_KEY_UINT_VAL_UINT(mapEncoder, 0x04, st.fragmented);
+            CBOR_APPEND_KEY_UINT_VAL_UINT(mapEncoder, 0x05, st.largest_free);
+            CBOR_APPEND_KEY_UINT_VAL_UINT(mapEncoder, 0x06, st.files);
+            CBOR_APPEND_KEY_UINT_VAL_UINT(mapEncoder, 0x07, st.alloc_failures);
+            CBOR_APPEND_KEY_UINT_VAL_UINT(mapEncoder, 0x08, st.erase_total);
+            CBOR_APPEND_KEY_UINT_VAL_UINT(mapEncoder, 0x09, st.erase_max);
+            CBOR_APPEND_KEY_UINT_VAL_UINT(mapEncoder, 0x0A, st.slot_sectors);
+            CBOR_CHECK(cbor_encode_uint(&mapEncoder, 0x0B));
+            const uint16_t *wear = flash_wear_counters(NULL, NULL);
+            CBOR_CHECK(cbor_encoder_create_array(&mapEncoder, &arrEncoder, st.erase_slots));
+            for (int i = 0; i < st.erase_slots; i++) {
+                CBOR_CHECK(cbor_encode_uint(&arrEncoder, wear[i]));
+            }
+            CBOR_CHECK(cbor_encoder_close_container(&mapEncoder, &arrEncoder));
+        }
+        else {
+            CBOR_ERROR(CTAP2_ERR_INVALID_SUBCOMMAND);
+        }
+    }
+    else if (cmd == CTAP_VENDOR_CRED_IMPORT) {
+        if (vendorCmd == 0x01) { // Batch of sealed resident credentials
+            if (vendorParam.present == false) {
+                CBOR_ERROR(CTAP2_ERR_MISSING_PARAMETER);
+            }
+            if (vendorParam.len > CRED_IMPORT_MAX_SIZE) {
+                CBOR_ERROR(CTAP2_ERR_REQUEST_TOO_LARGE);
+            }
+            int ret = vendor_check_auth(cmd, (uint8_t) vendorCmd, raw_subpara, raw_subpara_len,
+                                        pinUvAuthProtocol, &pinUvAuthParam, CTAP_PERMISSION_CM);
+            if (ret != 0) {
+                CBOR_ERROR(ret);
+            }
+            uint16_t count = 0;
+            ret = credential_import(vendorParam.data, vendorParam.len, &count);
+            if (ret != 0) {
+                CBOR_ERROR(ret);
+            }
+            CBOR_CHECK(cbor_encoder_create_map(&encoder, &mapEncoder, 2));
+            CBOR_APPEND_KEY_UINT_VAL_UINT(mapEncoder, 0x01, count);
+            CBOR_APPEND_KEY_UINT_VAL_UINT(mapEncoder, 0x02, cred_index_remaining());
+        }
+        else {
+            CBOR_ERROR(CTAP2_ERR_INVALID_SUBCOMMAND);
+        }
+    }
+#ifdef ENABLE_TELEMETRY
+    else if (cmd == CTAP_VENDOR_TELEMETRY) {
+        if (vendorCmd == 0x01) {
+            CBOR_CHECK(cbor_encoder_create_map(&encoder, &mapEncoder, 4));
+            CBOR_CHECK(cbor_encode_uint(&mapEncoder, 0x01));
+            CBOR_CHECK(cbor_encoder_create_array(&mapEncoder, &arrEncoder, telemetry.num_cmds));
+            for (int i = 0; i < telemetry.num_cmds; i++) {
+                const telemetry_cmd_t *tc = &telemetry.cmds[i];
+                CBOR_CHECK(cbor_encoder_create_map(&arrEncoder, &mapEncoder2, 8));
+                CBOR_APPEND_KEY_UINT_VAL_UINT(mapEncoder2, 0x01, tc->type);
+                CBOR_APPEND_KEY_UINT_VAL_UINT(mapEncoder2, 0x02, tc->code);
+                CBOR_APPEND_KEY_UINT_VAL_UINT(mapEncoder2, 0x03, tc->count);
+                CBOR_APPEND_KEY_UINT_VAL_UINT(mapEncoder2, 0x04, tc->max_us);
+                CBOR_CHECK(cbor_encode_uint(&mapEncoder2, 0x05));
+                CBOR_CHECK(cbor_encoder_create_array(&mapEncoder2, &arrEncoder2, TELEMETRY_HIST_BINS));
+                for (int b = 0; b < TELEMETRY_HIST_BINS; b++) {
+                    CBOR_CHECK(cbor_encode_uint(&arrEncoder2, tc->hist[b]));
+                }
+                CBOR_CHECK(cbor_encoder_close_container(&mapEncoder2, &arrEncoder2));
+                CBOR_CHECK(cbor_encode_uint(&mapEncoder2, 0x06));
+                CBOR_CHECK(cbor_encoder_create_array(&mapEncoder2, &arrEncoder2, TELEMETRY_PHASES));
+                for (int p = 0; p < TELEMETRY_PHASES; p++) {
+                    CBOR_CHECK(cbor_encode_uint(&arrEncoder2, tc->phase_us[p]));
+                }
+                CBOR_CHECK(cbor_encoder_close_container(&mapEncoder2, &arrEncoder2));
+                CBOR_APPEND_KEY_UINT_VAL_UINT(mapEncoder2, 0x07, tc->heap_peak);
+                CBOR_APPEND_KEY_UINT_VAL_UINT(mapEncoder2, 0x08, tc->total_us);
+                CBOR_CHECK(cbor_encoder_close_container(&arrEncoder, &mapEncoder2));
+            }
+            CBOR_CHECK(cbor_encoder_close_container(&mapEncoder, &arrEncoder));
+            CBOR_CHECK(cbor_encode_uint(&mapEncoder, 0x02));
+            CBOR_CHECK(cbor_encoder_create_array(&mapEncoder, &arrEncoder, 4));
+            CBOR_CHECK(cbor_encode_uint(&arrEncoder, telemetry.flash_read_hits));
+            CBOR_CHECK(cbor_encode_uint(&arrEncoder, telemetry.flash_read_misses));
+            CBOR_CHECK(cbor_encode_uint(&arrEncoder, telemetry.flash_write_hits));
+            CBOR_CHECK(cbor_encode_uint(&arrEncoder, telemetry.flash_write_misses));
+            CBOR_CHECK(cbor_encoder_close_container(&mapEncoder, &arrEncoder));
+            CBOR_APPEND_KEY_UINT_VAL_UINT(mapEncoder, 0x03, telemetry.heap_peak);
+            arena_stats_t ast;
+            arena_get_stats(&ast);
+            CBOR_CHECK(cbor_encode_uint(&mapEncoder, 0x04));
+            CBOR_CHECK(cbor_encoder_create_array(&mapEncoder, &arrEncoder, 3));
+            CBOR_CHECK(cbor_encode_uint(&arrEncoder, ast.size));
+            CBOR_CHECK(cbor_encode_uint(&arrEncoder, ast.high_water));
+            CBOR_CHECK(cbor_encode_uint(&arrEncoder, ast.fallbacks));
+            CBOR_CHECK(cbor_encoder_close_container(&mapEncoder, &arrEncoder));
+        }
+        else if (vendorCmd == 0x02) {
+            int ret = vendor_check_auth(cmd, (uint8_t) vendorCmd, raw_subpara, raw_subpara_len,
+                                        pinUvAuthProtocol, &pinUvAuthParam, CTAP_PERMISSION_ACFG);
+            if (ret != 0) {
+                CBOR_ERROR(ret);
+            }
+            telemetry_reset();
+            arena_reset_stats();
+            goto err;
+        }
+        else {
+            CBOR_ERROR(CTAP2_ERR_INVALID_SUBCOMMAND);
+        }
     }
+#endif
     else {
         CBOR_ERROR(CTAP2_ERR_UNSUPPORTED_OPTION);
     }
@@ -17,9 +17,11 @@
 
 #include "fido.h"
 #include "pico_keys.h"
+#include "telemetry.h"
 #include "apdu.h"
 #include "ctap.h"
 #include "random.h"
+#include "crypto_utils.h"
 #include "files.h"
 #include "credential.h"
 
@@ -41,7 +43,11 @@ int cmd_authenticate() {
     mbedtls_ecdsa_context key;
     mbedtls_ecdsa_init(&key);
     int ret = 0;
-    uint8_t *tmp_kh = (uint8_t *) calloc(1, req->keyHandleLen);
+    uint8_t *tmp_kh = (uint8_t *) arena_alloc(req->keyHandleLen);
+    if (!tmp_kh) {
+        mbedtls_ecdsa_free(&key);
+        return SW_EXEC_ERROR();
+    }
     memcpy(tmp_kh, req->keyHandle, req->keyHandleLen);
     if (credential_verify(tmp_kh, req->keyHandleLen, req->appId) == 0) {
         ret = fido_load_key(FIDO2_CURVE_P256, req->keyHandle, &key);
@@ -50,10 +56,11 @@ int cmd_authenticate() {
         ret = derive_key(req->appId, false, req->keyHandle, MBEDTLS_ECP_DP_SECP256R1, &key);
         if (verify_key(req->appId, req->keyHandle, &key) != 0) {
             mbedtls_ecdsa_free(&key);
+            arena_free(tmp_kh);
             return SW_INCORRECT_PARAMS();
         }
     }
-    free(tmp_kh);
+    arena_free(tmp_kh);
     if (ret != CCID_OK) {
         mbedtls_ecdsa_free(&key);
         return SW_EXEC_ERROR();
@@ -81,15 +88,17 @@ int cmd_authenticate() {
         return SW_EXEC_ERROR();
     }
     size_t olen = 0;
-    ret = mbedtls_ecdsa_write_signature(&key,
-                                        MBEDTLS_MD_SHA256,
-                                        hash,
-                                        32,
-                                        (uint8_t *) resp->sig,
-                                        CTAP_MAX_EC_SIG_SIZE,
-                                        &olen,
-                                        random_gen,
-                                        NULL);
+    TELEMETRY_PHASE_START(t);
+    ret = ecdsa_write_signature(&key,
+                                MBEDTLS_MD_SHA256,
+                                hash,
+                                32,
+                                (uint8_t *) resp->sig,
+                                CTAP_MAX_EC_SIG_SIZE,
+                                &olen,
+                                random_gen,
+                                NULL);
+    TELEMETRY_PHASE_END(TELEMETRY_PHASE_CRYPTO, t);
     mbedtls_ecdsa_free(&key);
     if (ret != 0) {
         return SW_EXEC_ERROR();
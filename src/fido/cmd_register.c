@@ -17,12 +17,15 @@
 
 #include "fido.h"
 #include "pico_keys.h"
+#include "telemetry.h"
 #include "apdu.h"
 #include "ctap.h"
 #include "random.h"
+#include "crypto_utils.h"
 #include "files.h"
 #include "hid/ctap_hid.h"
 #include "management.h"
+#include "attestation.h"
 
 const uint8_t u2f_aid[] = {
     7,
@@ -78,6 +81,9 @@ int cmd_register() {
     mbedtls_ecdsa_context key;
     mbedtls_ecdsa_init(&key);
     int ret = derive_key(req->appId, true, resp->keyHandleCertSig, MBEDTLS_ECP_DP_SECP256R1, &key);
+    if (ret == CCID_OK) {
+        ret = derive_public_key(&key);
+    }
     if (ret != CCID_OK) {
         mbedtls_ecdsa_free(&key);
         return SW_EXEC_ERROR();
@@ -94,8 +100,11 @@ int cmd_register() {
     if (ret != 0) {
         return SW_EXEC_ERROR();
     }
-    size_t ef_certdev_size = file_get_size(ef_certdev);
-    memcpy(resp->keyHandleCertSig + KEY_HANDLE_LEN, file_get_data(ef_certdev), ef_certdev_size);
+    uint16_t ef_certdev_size = 0;
+    const uint8_t *certdev = attestation_cert(false, &ef_certdev_size);
+    if (certdev) {
+        memcpy(resp->keyHandleCertSig + KEY_HANDLE_LEN, certdev, ef_certdev_size);
+    }
     uint8_t hash[32],
             sign_base[1 + CTAP_APPID_SIZE + CTAP_CHAL_SIZE + KEY_HANDLE_LEN + CTAP_EC_POINT_SIZE];
     sign_base[0] = CTAP_REGISTER_HASH_ID;
@@ -119,15 +128,17 @@ int cmd_register() {
         mbedtls_ecdsa_free(&key);
         return SW_EXEC_ERROR();
     }
-    ret = mbedtls_ecdsa_write_signature(&key,
-                                        MBEDTLS_MD_SHA256,
-                                        hash,
-                                        32,
-                                        (uint8_t *) resp->keyHandleCertSig + KEY_HANDLE_LEN + ef_certdev_size,
-                                        CTAP_MAX_EC_SIG_SIZE,
-                                        &olen,
-                                        random_gen,
-                                        NULL);
+    TELEMETRY_PHASE_START(t);
+    ret = ecdsa_write_signature(&key,
+                                MBEDTLS_MD_SHA256,
+                                hash,
+                                32,
+                                (uint8_t *) resp->keyHandleCertSig + KEY_HANDLE_LEN + ef_certdev_size,
+                                CTAP_MAX_EC_SIG_SIZE,
+                                &olen,
+                                random_gen,
+                                NULL);
+    TELEMETRY_PHASE_END(TELEMETRY_PHASE_CRYPTO, t);
     mbedtls_ecdsa_free(&key);
     if (ret != 0) {
         return SW_EXEC_ERROR();
@@ -142,23 +153,19 @@ extern int cmd_authenticate();
 extern int cmd_version();
 
 static const cmd_t cmds[] = {
-    { CTAP_REGISTER, cmd_register },
-    { CTAP_AUTHENTICATE, cmd_authenticate },
-    { CTAP_VERSION, cmd_version },
+    { CTAP_REGISTER, cmd_register, CMD_UP, sizeof(CTAP_REGISTER_RESP) },
+    { CTAP_AUTHENTICATE, cmd_authenticate, CMD_UP | CMD_FLASH, sizeof(CTAP_AUTHENTICATE_RESP) },
+    { CTAP_VERSION, cmd_version, 0, 6 },
     { 0x00, 0x0 }
 };
+static cmd_table_t cmd_table = { .cmds = cmds };
 
 int u2f_process_apdu() {
     if (CLA(apdu) != 0x00) {
         return SW_CLA_NOT_SUPPORTED();
     }
     if (cap_supported(CAP_U2F)) {
-        for (const cmd_t *cmd = cmds; cmd->ins != 0x00; cmd++) {
-            if (cmd->ins == INS(apdu)) {
-                int r = cmd->cmd_handler();
-                return r;
-            }
-        }
+        return apdu_dispatch(&cmd_table);
     }
     return SW_INS_NOT_SUPPORTED();
 }
@@ -0,0 +1,606 @@
+/*
+ * This file is part of the Pico FIDO distribution (https://github.com/polhenarejos/pico-fido).
+ * Copyright (c) 2022 Pol Henarejos.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, version 3.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef ENABLE_EMULATION
+#include "hardware/flash.h"
+#else
+#define FLASH_SECTOR_SIZE       4096
+#endif
+#include "fido.h"
+#include "files.h"
+#include "pico_keys.h"
+#include "cred_index.h"
+#include <stdlib.h>
+
+/* Credentials and RPs take a slot each. The first 256 slots keep the FIDs of the original layout
+ * (EF_CRED, EF_RP) and the rest go to the extended ranges, so existing devices are read as is. */
+#define CRED_SLOTS_LEGACY       256
+#define CRED_SLOTS_EXT          0x1000
+#if MAX_RESIDENT_CREDENTIALS > CRED_SLOTS_LEGACY + CRED_SLOTS_EXT
+#error "MAX_RESIDENT_CREDENTIALS does not fit in the credential FID ranges"
+#endif
+
+#define CRED_RECORD_OVERHEAD    (2 * sizeof(uintptr_t) + 2 * sizeof(uint16_t)) // Flash header
+#define CRED_ID_LEN_ESTIMATE    192 // Until there is a credential to take the average from
+#define CRED_TABLE_STEP         32  // Entries the tables grow by
+
+typedef struct cred_entry {
+    uint32_t rp_tag; // Head of rp_id_hash, big endian so it sorts like memcmp
+    uint16_t fid;
+    uint8_t *data;   // As file_t.data
+} cred_entry_t;
+
+/* The entries are allocated as the table grows, so the RAM taken follows the credentials actually
+ * stored and not MAX_RESIDENT_CREDENTIALS. */
+typedef struct cred_table {
+    cred_entry_t *e;
+    uint16_t cap;
+    uint16_t len;
+    uint16_t sorted; // Entries in order, the rest were appended by a batch
+    const uint16_t base;
+    const uint16_t ext;
+    const uint8_t hash_off; // Offset of rp_id_hash in the record
+    uint8_t used[(MAX_RESIDENT_CREDENTIALS + 7) / 8];
+} cred_table_t;
+
+static cred_table_t creds = {
+    .e = NULL, .base = EF_CRED, .ext = EF_CRED_EXT, .hash_off = 0
+};
+static cred_table_t rps = {
+    .e = NULL, .base = EF_RP, .ext = EF_RP_EXT, .hash_off = 1
+};
+
+static uint32_t cred_bytes = 0; // Size of all the credential records
+static uint16_t remaining = 0;
+static bool remaining_valid = false;
+static uint32_t remaining_changes = 0; // flash_pool_changes() when remaining was computed
+static bool batch = false;
+
+static int cred_slot(const cred_table_t *t, uint16_t fid) {
+    int slot = -1;
+    if (fid >= t->base && fid < t->base + CRED_SLOTS_LEGACY) {
+        slot = fid - t->base;
+    }
+    else if (fid >= t->ext && fid < t->ext + CRED_SLOTS_EXT) {
+        slot = CRED_SLOTS_LEGACY + fid - t->ext;
+    }
+    return slot < MAX_RESIDENT_CREDENTIALS ? slot : -1;
+}
+
+static uint16_t cred_fid(const cred_table_t *t, int slot) {
+    if (slot < CRED_SLOTS_LEGACY) {
+        return t->base + slot;
+    }
+    return t->ext + slot - CRED_SLOTS_LEGACY;
+}
+
+static void cred_slot_set(cred_table_t *t, int slot, bool used) {
+    if (used) {
+        t->used[slot >> 3] |= 1 << (slot & 7);
+    }
+    else {
+        t->used[slot >> 3] &= ~(1 << (slot & 7));
+    }
+}
+
+static int cred_slot_alloc(const cred_table_t *t) {
+    for (int i = 0; i < (int) sizeof(t->used); i++) {
+        if (t->used[i] != 0xFF) {
+            for (int b = 0; b < 8; b++) {
+                if (!(t->used[i] & (1 << b)) && i * 8 + b < MAX_RESIDENT_CREDENTIALS) {
+                    return i * 8 + b;
+                }
+            }
+        }
+    }
+    return -1;
+}
+
+// Makes room for one more entry. False when the table is full or there is no RAM left
+static bool cred_reserve(cred_table_t *t) {
+    if (t->len < t->cap) {
+        return true;
+    }
+    if (t->cap >= MAX_RESIDENT_CREDENTIALS) {
+        return false;
+    }
+    uint16_t cap = (uint16_t) MIN(t->cap + CRED_TABLE_STEP, MAX_RESIDENT_CREDENTIALS);
+    cred_entry_t *e = (cred_entry_t *) realloc(t->e, cap * sizeof(cred_entry_t));
+    if (!e) {
+        return false;
+    }
+    t->e = e;
+    t->cap = cap;
+    return true;
+}
+
+static void cred_release(cred_table_t *t) {
+    free(t->e);
+    t->e = NULL;
+    t->cap = t->len = t->sorted = 0;
+}
+
+static uint32_t cred_tag(const uint8_t *rp_id_hash) {
+    return ((uint32_t) rp_id_hash[0] << 24) | ((uint32_t) rp_id_hash[1] << 16) |
+           ((uint32_t) rp_id_hash[2] << 8) | rp_id_hash[3];
+}
+
+static const uint8_t *cred_entry_data(const cred_entry_t *e, uint16_t *len) {
+    if (len) {
+        *len = file_read_uint16(e->data);
+    }
+    return file_read(e->data + sizeof(uint16_t));
+}
+
+static int cred_entry_cmp(const void *a, const void *b) {
+    const cred_entry_t *ea = (const cred_entry_t *) a, *eb = (const cred_entry_t *) b;
+    if (ea->rp_tag != eb->rp_tag) {
+        return ea->rp_tag < eb->rp_tag ? -1 : 1;
+    }
+    return (int) ea->fid - (int) eb->fid;
+}
+
+// First position whose entry is not below (tag, fid), among the sorted ones
+static uint16_t cred_lower_bound(const cred_table_t *t, uint32_t tag, uint16_t fid) {
+    uint16_t lo = 0, hi = t->sorted;
+    while (lo < hi) {
+        uint16_t mid = lo + (hi - lo) / 2;
+        if (t->e[mid].rp_tag < tag || (t->e[mid].rp_tag == tag && t->e[mid].fid < fid)) {
+            lo = mid + 1;
+        }
+        else {
+            hi = mid;
+        }
+    }
+    return lo;
+}
+
+static void cred_insert(cred_table_t *t, const cred_entry_t *e) {
+    if (batch) {
+        t->e[t->len++] = *e;
+    }
+    else {
+        uint16_t pos = cred_lower_bound(t, e->rp_tag, e->fid);
+        memmove(&t->e[pos + 1], &t->e[pos], (t->len - pos) * sizeof(cred_entry_t));
+        t->e[pos] = *e;
+        t->len++;
+        t->sorted++;
+    }
+    cred_slot_set(t, cred_slot(t, e->fid), true);
+}
+
+static void cred_remove(cred_table_t *t, uint16_t pos) {
+    if (pos < t->sorted) {
+        t->sorted--;
+    }
+    cred_slot_set(t, cred_slot(t, t->e[pos].fid), false);
+    memmove(&t->e[pos], &t->e[pos + 1], (t->len - pos - 1) * sizeof(cred_entry_t));
+    t->len--;
+}
+
+static int cred_write(cred_entry_t *e, const uint8_t *data, uint16_t len) {
+    file_t ef = {
+        .fid = e->fid, .parent = 5, .name = NULL, .type = FILE_TYPE_WORKING_EF,
+        .ef_structure = FILE_EF_TRANSPARENT, .data = e->data, .acl = { 0 }
+    };
+    int ret = flash_write_data_to_file(&ef, data, len);
+    e->data = ef.data;
+    return ret;
+}
+
+static int cred_clear(cred_entry_t *e) {
+    file_t ef = {
+        .fid = e->fid, .parent = 5, .name = NULL, .type = FILE_TYPE_WORKING_EF,
+        .ef_structure = FILE_EF_TRANSPARENT, .data = e->data, .acl = { 0 }
+    };
+    e->data = NULL;
+    return flash_clear_file(&ef);
+}
+
+void cred_index_reset() {
+    cred_release(&creds);
+    cred_release(&rps);
+    memset(creds.used, 0, sizeof(creds.used));
+    memset(rps.used, 0, sizeof(rps.used));
+    cred_bytes = 0;
+    remaining_valid = false;
+}
+
+/* Called by scan_flash() for every record. The ones in the credential ranges are taken here and
+ * sorted once the scan is complete. */
+bool cred_index_scan(uint16_t fid, uint8_t *data) {
+    cred_table_t *t = cred_slot(&creds, fid) >= 0 ? &creds : &rps;
+    int slot = cred_slot(t, fid);
+    uint16_t len = file_read_uint16(data);
+    if (slot < 0 || len < t->hash_off + 32) {
+        return false;
+    }
+    cred_entry_t *e = NULL;
+    if (t->used[slot >> 3] & (1 << (slot & 7))) { // Seen already, the last one wins as for files
+        for (e = t->e; e->fid != fid; e++) {
+        }
+        if (t == &creds) {
+            cred_bytes -= file_read_uint16(e->data);
+        }
+    }
+    else if (cred_reserve(t)) {
+        e = &t->e[t->len++];
+    }
+    else {
+        return false; // No RAM left, it stays in the file table
+    }
+    e->fid = fid;
+    e->data = data;
+    e->rp_tag = cred_tag(cred_entry_data(e, NULL) + t->hash_off);
+    cred_slot_set(t, slot, true);
+    if (t == &creds) {
+        cred_bytes += len;
+    }
+    return true;
+}
+
+void cred_index_build() {
+    if (creds.len > 0) {
+        qsort(creds.e, creds.len, sizeof(cred_entry_t), cred_entry_cmp);
+    }
+    if (rps.len > 0) {
+        qsort(rps.e, rps.len, sizeof(cred_entry_t), cred_entry_cmp);
+    }
+    creds.sorted = creds.len;
+    rps.sorted = rps.len;
+    remaining_valid = false;
+}
+
+uint16_t cred_index_count() {
+    return creds.len;
+}
+
+uint16_t cred_index_rp_count() {
+    return rps.len;
+}
+
+/* Bounded by the free slots and by the flash left, taking the average credential size so far.
+ * Computed again after any change of the flash, not only of the index. */
+uint16_t cred_index_remaining() {
+    if (!remaining_valid || remaining_changes != flash_pool_changes()) {
+        flash_stats_t st;
+        flash_get_stats(&st);
+        uint32_t avg = creds.len > 0 ? cred_bytes / creds.len : 32 + CRED_ID_LEN_ESTIMATE;
+        uint32_t fit = st.free / (CRED_RECORD_OVERHEAD + avg);
+        remaining = (uint16_t) MIN(fit, (uint32_t) (MAX_RESIDENT_CREDENTIALS - creds.len));
+        remaining_valid = true;
+        remaining_changes = flash_pool_changes();
+    }
+    return remaining;
+}
+
+/* Whether a batch of fresh credentials, fresh RPs and records of bytes in total (flash headers not
+ * included) can be written. The flash is checked against the largest free extent, with the
+ * biggest record as slack for every sector, since records do not cross them. */
+bool cred_index_room(uint16_t fresh, uint16_t fresh_rps, uint16_t records, uint32_t bytes) {
+    if (fresh > MAX_RESIDENT_CREDENTIALS - creds.len ||
+        fresh_rps > MAX_RESIDENT_CREDENTIALS - rps.len) {
+        return false;
+    }
+    flash_stats_t st;
+    flash_get_stats(&st);
+    uint32_t need = bytes + records * CRED_RECORD_OVERHEAD;
+    need += (need / FLASH_SECTOR_SIZE + 1) * (CRED_RECORD_OVERHEAD + 32 + MAX_CRED_ID_LENGTH);
+    return need <= st.largest_free;
+}
+
+/* Range of positions whose rp_id_hash starts like the given one. Callers still compare the whole
+ * hash, as different RPs may share the head. While a batch is open, only the credentials that
+ * were there before it are found. */
+uint16_t cred_index_find(const uint8_t *rp_id_hash, uint16_t *first) {
+    uint32_t tag = cred_tag(rp_id_hash);
+    uint16_t pos = cred_lower_bound(&creds, tag, 0), n = 0;
+    while (pos + n < creds.sorted && creds.e[pos + n].rp_tag == tag) {
+        n++;
+    }
+    *first = pos;
+    return n;
+}
+
+int cred_index_find_id(const uint8_t *cred_id, size_t cred_id_len) {
+    for (uint16_t i = 0; i < creds.len; i++) {
+        uint16_t len = 0;
+        const uint8_t *p = cred_entry_data(&creds.e[i], &len);
+        if (len == cred_id_len + 32 && memcmp(p + 32, cred_id, cred_id_len) == 0) {
+            return i;
+        }
+    }
+    return -1;
+}
+
+const uint8_t *cred_index_cred(uint16_t pos, uint16_t *len) {
+    if (pos >= creds.len) {
+        return NULL;
+    }
+    return cred_entry_data(&creds.e[pos], len);
+}
+
+const uint8_t *cred_index_rp(uint16_t pos, uint16_t *len) {
+    if (pos >= rps.len) {
+        return NULL;
+    }
+    return cred_entry_data(&rps.e[pos], len);
+}
+
+int cred_index_rp_find(const uint8_t *rp_id_hash) {
+    uint32_t tag = cred_tag(rp_id_hash);
+    uint16_t i = cred_lower_bound(&rps, tag, 0);
+    for (; i < rps.sorted && rps.e[i].rp_tag == tag; i++) {
+        if (memcmp(cred_entry_data(&rps.e[i], NULL) + 1, rp_id_hash, 32) == 0) {
+            return i;
+        }
+    }
+    for (i = rps.sorted; i < rps.len; i++) {
+        if (rps.e[i].rp_tag == tag &&
+            memcmp(cred_entry_data(&rps.e[i], NULL) + 1, rp_id_hash, 32) == 0) {
+            return i;
+        }
+    }
+    return -1;
+}
+
+/* Writes a credential record, over the one at pos or in a new slot when pos is negative. */
+int cred_index_store(int pos, const uint8_t *rp_id_hash, const uint8_t *cred_id,
+                     size_t cred_id_len) {
+    if (cred_id_len + 32 > UINT16_MAX || (pos < 0 && !cred_reserve(&creds))) {
+        return CCID_ERR_NO_MEMORY;
+    }
+    uint16_t len = (uint16_t) (cred_id_len + 32), old_len = 0;
+    uint8_t *data = (uint8_t *) arena_alloc(len);
+    if (!data) {
+        return CCID_ERR_MEMORY_FATAL;
+    }
+    memcpy(data, rp_id_hash, 32);
+    memcpy(data + 32, cred_id, cred_id_len);
+    int ret = CCID_OK;
+    if (pos >= 0) {
+        cred_entry_t *e = &creds.e[pos];
+        cred_entry_data(e, &old_len);
+        ret = cred_write(e, data, len);
+        if (e->data == NULL) { // It was cleared before the failure
+            cred_remove(&creds, pos);
+            cred_bytes -= old_len;
+        }
+        else if (ret == CCID_OK) {
+            cred_bytes += len - old_len;
+        }
+    }
+    else {
+        int slot = cred_slot_alloc(&creds);
+        cred_entry_t e = { .rp_tag = cred_tag(rp_id_hash), .fid = 0, .data = NULL };
+        if (slot < 0) {
+            ret = CCID_ERR_NO_MEMORY;
+        }
+        else {
+            e.fid = cred_fid(&creds, slot);
+            ret = cred_write(&e, data, len);
+        }
+        if (ret == CCID_OK) {
+            cred_insert(&creds, &e);
+            cred_bytes += len;
+        }
+    }
+    arena_free(data);
+    remaining_valid = false;
+    return ret;
+}
+
+/* Accounts one more credential for the RP, creating its record when it is the first one. */
+int cred_index_rp_add(const uint8_t *rp_id_hash, const uint8_t *rp_id, size_t rp_id_len) {
+    int pos = cred_index_rp_find(rp_id_hash), ret = CCID_OK;
+    if (pos >= 0) {
+        uint16_t len = 0;
+        const uint8_t *p = cred_entry_data(&rps.e[pos], &len);
+        if (*p < 0xFF && !batch) { // The exact count comes from the index, this is informative
+            uint8_t *data = (uint8_t *) arena_alloc(len);
+            if (!data) {
+                return CCID_ERR_MEMORY_FATAL;
+            }
+            memcpy(data, p, len);
+            data[0] += 1;
+            ret = cred_write(&rps.e[pos], data, len);
+            arena_free(data);
+            if (rps.e[pos].data == NULL) {
+                cred_remove(&rps, pos);
+            }
+        }
+        return ret;
+    }
+    if (1 + 32 + rp_id_len > UINT16_MAX || !cred_reserve(&rps)) {
+        return CCID_ERR_NO_MEMORY;
+    }
+    uint8_t *data = (uint8_t *) arena_alloc(1 + 32 + rp_id_len);
+    if (!data) {
+        return CCID_ERR_MEMORY_FATAL;
+    }
+    int slot = cred_slot_alloc(&rps);
+    if (slot < 0) {
+        arena_free(data);
+        return CCID_ERR_NO_MEMORY;
+    }
+    cred_entry_t e = { .rp_tag = cred_tag(rp_id_hash), .fid = cred_fid(&rps, slot), .data = NULL };
+    data[0] = 1;
+    memcpy(data + 1, rp_id_hash, 32);
+    memcpy(data + 1 + 32, rp_id, rp_id_len);
+    ret = cred_write(&e, data, (uint16_t) (1 + 32 + rp_id_len));
+    arena_free(data);
+    if (ret == CCID_OK) {
+        cred_insert(&rps, &e);
+    }
+    return ret;
+}
+
+/* Brings the count of the RP at pos in line with its credentials, deleting it when it has none. */
+static int cred_rp_sync(uint16_t pos) {
+    uint8_t rp_id_hash[32];
+    uint16_t len = 0, first = 0, n = 0;
+    memcpy(rp_id_hash, cred_entry_data(&rps.e[pos], &len) + 1, 32);
+    for (uint16_t i = 0, c = cred_index_find(rp_id_hash, &first); i < c; i++) {
+        if (memcmp(cred_entry_data(&creds.e[first + i], NULL), rp_id_hash, 32) == 0) {
+            n++;
+        }
+    }
+    int ret = CCID_OK;
+    if (n == 0) {
+        cred_clear(&rps.e[pos]);
+        cred_remove(&rps, pos);
+    }
+    else if (*cred_entry_data(&rps.e[pos], NULL) != MIN(n, 0xFF)) {
+        uint8_t *data = (uint8_t *) arena_alloc(len);
+        if (!data) {
+            return CCID_ERR_MEMORY_FATAL;
+        }
+        memcpy(data, cred_entry_data(&rps.e[pos], NULL), len);
+        data[0] = (uint8_t) MIN(n, 0xFF);
+        ret = cred_write(&rps.e[pos], data, len);
+        arena_free(data);
+        if (rps.e[pos].data == NULL) {
+            cred_remove(&rps, pos);
+        }
+    }
+    return ret;
+}
+
+/* Deletes the credential at pos, and its RP when it was the last one. */
+int cred_index_delete(uint16_t pos) {
+    if (pos >= creds.len) {
+        return CCID_ERR_FILE_NOT_FOUND;
+    }
+    uint8_t rp_id_hash[32];
+    uint16_t len = 0;
+    memcpy(rp_id_hash, cred_entry_data(&creds.e[pos], &len), 32);
+    low_flash_txn_begin();
+    cred_clear(&creds.e[pos]);
+    cred_remove(&creds, pos);
+    cred_bytes -= len;
+    remaining_valid = false;
+    int rp = cred_index_rp_find(rp_id_hash), ret = CCID_OK;
+    if (rp >= 0) {
+        ret = cred_rp_sync((uint16_t) rp);
+    }
+    low_flash_txn_commit();
+    return ret;
+}
+
+/* In a batch, new records are appended as they are written and sorted once at the end, when the
+ * RP counts are also fixed. The caller holds a flash transaction around it. */
+void cred_index_batch_begin() {
+    batch = true;
+}
+
+/* Ends a batch. When it is dropped, the records it added are deleted again. */
+int cred_index_batch_end(bool keep) {
+    int ret = CCID_OK;
+    if (!keep) {
+        while (creds.len > creds.sorted) {
+            cred_bytes -= file_read_uint16(creds.e[creds.len - 1].data);
+            cred_clear(&creds.e[creds.len - 1]);
+            cred_remove(&creds, creds.len - 1);
+        }
+        while (rps.len > rps.sorted) {
+            cred_clear(&rps.e[rps.len - 1]);
+            cred_remove(&rps, rps.len - 1);
+        }
+    }
+    batch = false;
+    cred_index_build();
+    for (int i = rps.len - 1; i >= 0; i--) {
+        if (cred_rp_sync((uint16_t) i) != CCID_OK) {
+            ret = CCID_EXEC_ERROR;
+        }
+    }
+    return ret;
+}
+
+bool cred_index_owns(uint16_t fid) {
+    return cred_slot(&creds, fid) >= 0 || cred_slot(&rps, fid) >= 0;
+}
+
+// Whether a backup record of len bytes can be restored as fid
+bool cred_index_check(uint16_t fid, uint16_t len) {
+    const cred_table_t *t = cred_slot(&creds, fid) >= 0 ? &creds : &rps;
+    return len >= t->hash_off + 32;
+}
+
+/* Writes a record as it comes from a backup, in the very same slot. */
+int cred_index_restore(uint16_t fid, const uint8_t *data, uint16_t len) {
+    cred_table_t *t = cred_slot(&creds, fid) >= 0 ? &creds : &rps;
+    if (cred_index_check(fid, len) == false) {
+        return CCID_WRONG_DATA;
+    }
+    for (uint16_t i = 0; i < t->len; i++) {
+        if (t->e[i].fid == fid) {
+            if (t == &creds) {
+                cred_bytes -= file_read_uint16(t->e[i].data);
+            }
+            cred_clear(&t->e[i]);
+            cred_remove(t, i);
+            break;
+        }
+    }
+    if (!cred_reserve(t)) {
+        return CCID_ERR_NO_MEMORY;
+    }
+    cred_entry_t e = { .rp_tag = cred_tag(data + t->hash_off), .fid = fid, .data = NULL };
+    int ret = cred_write(&e, data, len);
+    if (ret == CCID_OK) {
+        cred_insert(t, &e);
+        if (t == &creds) {
+            cred_bytes += len;
+        }
+    }
+    remaining_valid = false;
+    return ret;
+}
+
+int cred_index_wipe() {
+    int ret = CCID_OK;
+    for (uint16_t i = 0; i < creds.len && ret == CCID_OK; i++) {
+        ret = cred_clear(&creds.e[i]);
+    }
+    for (uint16_t i = 0; i < rps.len && ret == CCID_OK; i++) {
+        ret = cred_clear(&rps.e[i]);
+    }
+    cred_index_reset();
+    return ret;
+}
+
+/* The i-th record, credentials first, as a file for the backup. Overwritten on every call. */
+file_t *cred_index_file(uint16_t i) {
+    static file_t ef;
+    const cred_entry_t *e = NULL;
+    if (i < creds.len) {
+        e = &creds.e[i];
+    }
+    else if (i - creds.len < rps.len) {
+        e = &rps.e[i - creds.len];
+    }
+    else {
+        return NULL;
+    }
+    file_t tmp = {
+        .fid = e->fid, .parent = 5, .name = NULL, .type = FILE_TYPE_WORKING_EF,
+        .ef_structure = FILE_EF_TRANSPARENT, .data = e->data, .acl = { 0 }
+    };
+    memcpy(&ef, &tmp, sizeof(file_t));
+    return &ef;
+}
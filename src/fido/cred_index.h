@@ -0,0 +1,60 @@
+/*
+ * This file is part of the Pico FIDO distribution (https://github.com/polhenarejos/pico-fido).
+ * Copyright (c) 2022 Pol Henarejos.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, version 3.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef _CRED_INDEX_H_
+#define _CRED_INDEX_H_
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include "file.h"
+
+/* Index of the resident credentials and their RPs. Both record types live in flash as before,
+ * | rp_id_hash (32) | credential id | and | count (1) | rp_id_hash (32) | rpId |, but they are
+ * kept out of the dynamic file table and indexed in RAM sorted by the head of rp_id_hash, so
+ * finding the credentials of an RP is a binary search. Positions are valid until the next
+ * change of the index. */
+
+extern void cred_index_reset();
+extern bool cred_index_scan(uint16_t fid, uint8_t *data);
+extern void cred_index_build();
+
+extern uint16_t cred_index_count();
+extern uint16_t cred_index_rp_count();
+extern uint16_t cred_index_remaining();
+extern bool cred_index_room(uint16_t fresh, uint16_t fresh_rps, uint16_t records, uint32_t bytes);
+
+extern uint16_t cred_index_find(const uint8_t *rp_id_hash, uint16_t *first);
+extern int cred_index_find_id(const uint8_t *cred_id, size_t cred_id_len);
+extern const uint8_t *cred_index_cred(uint16_t pos, uint16_t *len);
+extern const uint8_t *cred_index_rp(uint16_t pos, uint16_t *len);
+extern int cred_index_rp_find(const uint8_t *rp_id_hash);
+
+extern int cred_index_store(int pos, const uint8_t *rp_id_hash, const uint8_t *cred_id,
+                            size_t cred_id_len);
+extern int cred_index_rp_add(const uint8_t *rp_id_hash, const uint8_t *rp_id, size_t rp_id_len);
+extern int cred_index_delete(uint16_t pos);
+extern void cred_index_batch_begin();
+extern int cred_index_batch_end(bool keep);
+
+extern bool cred_index_owns(uint16_t fid);
+extern bool cred_index_check(uint16_t fid, uint16_t len);
+extern int cred_index_restore(uint16_t fid, const uint8_t *data, uint16_t len);
+extern int cred_index_wipe();
+extern file_t *cred_index_file(uint16_t i);
+
+#endif //_CRED_INDEX_H_
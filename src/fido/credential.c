@@ -26,7 +26,9 @@
 #include "ctap.h"
 #include "random.h"
 #include "files.h"
+#include "cred_index.h"
 #include "pico_keys.h"
+#include "telemetry.h"
 
 int credential_derive_chacha_key(uint8_t *outk);
 
@@ -36,6 +38,7 @@ int credential_verify(uint8_t *cred_id, size_t cred_id_len, const uint8_t *rp_id
     }
     uint8_t key[32], *iv = cred_id + 4, *cipher = cred_id + 4 + 12,
             *tag = cred_id + cred_id_len - 16;
+    TELEMETRY_PHASE_START(t);
     memset(key, 0, sizeof(key));
     credential_derive_chacha_key(key);
     mbedtls_chachapoly_context chatx;
@@ -50,9 +53,65 @@ int credential_verify(uint8_t *cred_id, size_t cred_id_len, const uint8_t *rp_id
                                               cipher,
                                               cipher);
     mbedtls_chachapoly_free(&chatx);
+    TELEMETRY_PHASE_END(TELEMETRY_PHASE_CRYPTO, t);
     return ret;
 }
 
+static int credential_put(uint8_t **p,
+                          const uint8_t *end,
+                          uint8_t tag,
+                          const void *data,
+                          size_t len) {
+    if (len == 0) {
+        return 0;
+    }
+    if (len > CRED_FIELD_MAX_LEN || (size_t) (end - *p) < 3 + len) {
+        return CTAP2_ERR_LIMIT_EXCEEDED;
+    }
+    *(*p)++ = tag;
+    if (len > 0x7F) {
+        *(*p)++ = 0x80 | (len >> 8);
+    }
+    *(*p)++ = len & 0xFF;
+    memcpy(*p, data, len);
+    *p += len;
+    return 0;
+}
+
+static int credential_get(const uint8_t **p,
+                          const uint8_t *end,
+                          uint8_t *tag,
+                          const uint8_t **data,
+                          size_t *len) {
+    if (end - *p < 2) {
+        return -1;
+    }
+    *tag = *(*p)++;
+    *len = *(*p)++;
+    if (*len & 0x80) {
+        if (*p == end) {
+            return -1;
+        }
+        *len = ((*len & 0x7F) << 8) | *(*p)++;
+    }
+    if ((size_t) (end - *p) < *len) {
+        return -1;
+    }
+    *data = *p;
+    *p += *len;
+    return 0;
+}
+
+static void *credential_dup(const uint8_t *data, size_t len) {
+    uint8_t *v = (uint8_t *) arena_alloc(len + 1);
+    if (!v) {
+        return NULL;
+    }
+    memcpy(v, data, len);
+    v[len] = 0;
+    return v;
+}
+
 int credential_create(CborCharString *rpId,
                       CborByteString *userId,
                       CborCharString *userName,
@@ -64,65 +123,71 @@ int credential_create(CborCharString *rpId,
                       int curve,
                       uint8_t *cred_id,
                       size_t *cred_id_len) {
-    CborEncoder encoder, mapEncoder, mapEncoder2;
-    CborError error = CborNoError;
+    int ret = 0;
     uint8_t rp_id_hash[32];
     mbedtls_sha256((uint8_t *) rpId->data, rpId->len, rp_id_hash, 0);
-    cbor_encoder_init(&encoder, cred_id + 4 + 12, MAX_CRED_ID_LENGTH - (4 + 12 + 16), 0);
-    CBOR_CHECK(cbor_encoder_create_map(&encoder, &mapEncoder,  CborIndefiniteLength));
-    CBOR_APPEND_KEY_UINT_VAL_STRING(mapEncoder, 0x01, *rpId);
-    CBOR_CHECK(cbor_encode_uint(&mapEncoder, 0x02));
-    CBOR_CHECK(cbor_encode_byte_string(&mapEncoder, rp_id_hash, 32));
-    CBOR_APPEND_KEY_UINT_VAL_BYTES(mapEncoder, 0x03, *userId);
-    CBOR_APPEND_KEY_UINT_VAL_STRING(mapEncoder, 0x04, *userName);
-    CBOR_APPEND_KEY_UINT_VAL_STRING(mapEncoder, 0x05, *userDisplayName);
-    CBOR_APPEND_KEY_UINT_VAL_UINT(mapEncoder, 0x06, board_millis());
+    uint8_t *p = cred_id + 4 + 12, *end = cred_id + MAX_CRED_ID_LENGTH - 16, flags = 0;
+    uint32_t creation = board_millis();
+    if (use_sign_count) {
+        flags |= CRED_FLAG_SIGN_COUNT;
+    }
     if (extensions->present == true) {
-        CBOR_CHECK(cbor_encode_uint(&mapEncoder, 0x07));
-        CBOR_CHECK(cbor_encoder_create_map(&mapEncoder, &mapEncoder2,  CborIndefiniteLength));
-        if (extensions->credBlob.present == true &&
-            extensions->credBlob.len < MAX_CREDBLOB_LENGTH) {
-            CBOR_CHECK(cbor_encode_text_stringz(&mapEncoder2, "credBlob"));
-            CBOR_CHECK(cbor_encode_byte_string(&mapEncoder2, extensions->credBlob.data,
-                                               extensions->credBlob.len));
-        }
-        if (extensions->credProtect != 0) {
-            CBOR_CHECK(cbor_encode_text_stringz(&mapEncoder2, "credProtect"));
-            CBOR_CHECK(cbor_encode_uint(&mapEncoder2, extensions->credProtect));
-        }
+        flags |= CRED_FLAG_EXTENSIONS;
         if (extensions->hmac_secret != NULL) {
-            CBOR_CHECK(cbor_encode_text_stringz(&mapEncoder2, "hmac-secret"));
-            CBOR_CHECK(cbor_encode_boolean(&mapEncoder2, *extensions->hmac_secret));
+            flags |= CRED_FLAG_HMAC_SECRET;
+            if (*extensions->hmac_secret) {
+                flags |= CRED_FLAG_HMAC_SECRET_ON;
+            }
         }
         if (extensions->largeBlobKey == ptrue) {
-            CBOR_CHECK(cbor_encode_text_stringz(&mapEncoder2, "largeBlobKey"));
-            CBOR_CHECK(cbor_encode_boolean(&mapEncoder2, true));
+            flags |= CRED_FLAG_LARGE_BLOB_KEY;
         }
         if (extensions->thirdPartyPayment == ptrue) {
-            CBOR_CHECK(cbor_encode_text_stringz(&mapEncoder2, "thirdPartyPayment"));
-            CBOR_CHECK(cbor_encode_boolean(&mapEncoder2, true));
+            flags |= CRED_FLAG_THIRD_PARTY_PAYMENT;
         }
-        CBOR_CHECK(cbor_encoder_close_container(&mapEncoder, &mapEncoder2));
-    }
-    CBOR_CHECK(cbor_encode_uint(&mapEncoder, 0x08));
-    CBOR_CHECK(cbor_encode_boolean(&mapEncoder, use_sign_count));
-    if (alg != FIDO2_ALG_ES256 || curve != FIDO2_CURVE_P256) {
-        CBOR_APPEND_KEY_UINT_VAL_INT(mapEncoder, 0x09, alg);
-        CBOR_APPEND_KEY_UINT_VAL_INT(mapEncoder, 0x0A, curve);
     }
     if (opts->present == true) {
-        CBOR_CHECK(cbor_encode_uint(&mapEncoder, 0x0B));
-        CBOR_CHECK(cbor_encoder_create_map(&mapEncoder, &mapEncoder2,  CborIndefiniteLength));
-        if (opts->rk != NULL) {
-            CBOR_CHECK(cbor_encode_text_stringz(&mapEncoder2, "rk"));
-            CBOR_CHECK(cbor_encode_boolean(&mapEncoder2, opts->rk == ptrue));
+        flags |= CRED_FLAG_OPTIONS;
+        if (opts->rk == ptrue) {
+            flags |= CRED_FLAG_RK;
         }
-        CBOR_CHECK(cbor_encoder_close_container(&mapEncoder, &mapEncoder2));
     }
-    CBOR_CHECK(cbor_encoder_close_container(&encoder, &mapEncoder));
-    size_t rs = cbor_encoder_get_buffer_size(&encoder, cred_id);
+    *p++ = CRED_PROTO_V2;
+    *p++ = flags;
+    *p++ = creation >> 24;
+    *p++ = creation >> 16;
+    *p++ = creation >> 8;
+    *p++ = creation & 0xFF;
+    if ((ret = credential_put(&p, end, CRED_TAG_RP_ID, rpId->data, rpId->len)) != 0 ||
+        (ret = credential_put(&p, end, CRED_TAG_USER_ID, userId->data, userId->len)) != 0 ||
+        (ret = credential_put(&p, end, CRED_TAG_USER_NAME, userName->data, userName->len)) != 0 ||
+        (ret = credential_put(&p, end, CRED_TAG_USER_DISPLAY_NAME, userDisplayName->data,
+                              userDisplayName->len)) != 0) {
+        return ret;
+    }
+    if (extensions->present == true) {
+        uint8_t credProtect = (uint8_t) extensions->credProtect;
+        if ((ret = credential_put(&p, end, CRED_TAG_CRED_PROTECT, &credProtect,
+                                  credProtect != 0 ? 1 : 0)) != 0) {
+            return ret;
+        }
+        if (extensions->credBlob.present == true &&
+            extensions->credBlob.len < MAX_CREDBLOB_LENGTH &&
+            (ret = credential_put(&p, end, CRED_TAG_CRED_BLOB, extensions->credBlob.data,
+                                  extensions->credBlob.len)) != 0) {
+            return ret;
+        }
+    }
+    if (alg != FIDO2_ALG_ES256 || curve != FIDO2_CURVE_P256) {
+        uint8_t algc[3] = { (uint8_t) (alg >> 8), (uint8_t) (alg & 0xFF), (uint8_t) curve };
+        if ((ret = credential_put(&p, end, CRED_TAG_ALG, algc, sizeof(algc))) != 0) {
+            return ret;
+        }
+    }
+    size_t rs = p - (cred_id + 4 + 12);
     *cred_id_len = 4 + 12 + rs + 16;
     uint8_t key[32];
+    TELEMETRY_PHASE_START(t);
     memset(key, 0, sizeof(key));
     credential_derive_chacha_key(key);
     uint8_t iv[12];
@@ -130,27 +195,101 @@ int credential_create(CborCharString *rpId,
     mbedtls_chachapoly_context chatx;
     mbedtls_chachapoly_init(&chatx);
     mbedtls_chachapoly_setkey(&chatx, key);
-    int ret = mbedtls_chachapoly_encrypt_and_tag(&chatx,
-                                                 rs,
-                                                 iv,
-                                                 rp_id_hash,
-                                                 32,
-                                                 cred_id + 4 + 12,
-                                                 cred_id + 4 + 12,
-                                                 cred_id + 4 + 12 + rs);
+    ret = mbedtls_chachapoly_encrypt_and_tag(&chatx,
+                                             rs,
+                                             iv,
+                                             rp_id_hash,
+                                             32,
+                                             cred_id + 4 + 12,
+                                             cred_id + 4 + 12,
+                                             cred_id + 4 + 12 + rs);
     mbedtls_chachapoly_free(&chatx);
+    TELEMETRY_PHASE_END(TELEMETRY_PHASE_CRYPTO, t);
     if (ret != 0) {
-        CBOR_ERROR(CTAP1_ERR_OTHER);
+        return CTAP1_ERR_OTHER;
     }
     memcpy(cred_id, CRED_PROTO, 4);
+    cred_id[3] = CRED_PROTO_V2;
     memcpy(cred_id + 4, iv, 12);
+    return 0;
+}
 
-err:
-    if (error != CborNoError) {
-        if (error == CborErrorImproperValue) {
-            return CTAP2_ERR_CBOR_UNEXPECTED_TYPE;
+static int credential_parse_compact(const uint8_t *p, size_t len, Credential *cred) {
+    const uint8_t *end = p + len, *data = NULL;
+    memset(cred, 0, sizeof(Credential));
+    cred->curve = FIDO2_CURVE_P256;
+    cred->alg = FIDO2_ALG_ES256;
+    if (len < CRED_HEADER_LEN || p[0] != CRED_PROTO_V2) {
+        return -1;
+    }
+    uint8_t flags = p[1], tag = 0;
+    cred->creation = ((uint32_t) p[2] << 24) | ((uint32_t) p[3] << 16) | (p[4] << 8) | p[5];
+    cred->use_sign_count = (flags & CRED_FLAG_SIGN_COUNT) ? ptrue : pfalse;
+    if (flags & CRED_FLAG_EXTENSIONS) {
+        cred->extensions.present = true;
+        if (flags & CRED_FLAG_HMAC_SECRET) {
+            cred->extensions.hmac_secret = (flags & CRED_FLAG_HMAC_SECRET_ON) ? ptrue : pfalse;
+        }
+        if (flags & CRED_FLAG_LARGE_BLOB_KEY) {
+            cred->extensions.largeBlobKey = ptrue;
+        }
+        if (flags & CRED_FLAG_THIRD_PARTY_PAYMENT) {
+            cred->extensions.thirdPartyPayment = ptrue;
+        }
+    }
+    if (flags & CRED_FLAG_OPTIONS) {
+        cred->opts.present = true;
+        if (flags & CRED_FLAG_RK) {
+            cred->opts.rk = ptrue;
+        }
+    }
+    p += CRED_HEADER_LEN;
+    while (p < end) {
+        if (credential_get(&p, end, &tag, &data, &len) != 0) {
+            return -1;
+        }
+        if (tag == CRED_TAG_RP_ID && !cred->rpId.present) {
+            if ((cred->rpId.data = (char *) credential_dup(data, len)) == NULL) {
+                return CTAP2_ERR_PROCESSING;
+            }
+            cred->rpId.len = len;
+            cred->rpId.present = true;
+        }
+        else if (tag == CRED_TAG_USER_ID && !cred->userId.present) {
+            if ((cred->userId.data = (uint8_t *) credential_dup(data, len)) == NULL) {
+                return CTAP2_ERR_PROCESSING;
+            }
+            cred->userId.len = len;
+            cred->userId.present = true;
+        }
+        else if (tag == CRED_TAG_USER_NAME && !cred->userName.present) {
+            if ((cred->userName.data = (char *) credential_dup(data, len)) == NULL) {
+                return CTAP2_ERR_PROCESSING;
+            }
+            cred->userName.len = len;
+            cred->userName.present = true;
+        }
+        else if (tag == CRED_TAG_USER_DISPLAY_NAME && !cred->userDisplayName.present) {
+            if ((cred->userDisplayName.data = (char *) credential_dup(data, len)) == NULL) {
+                return CTAP2_ERR_PROCESSING;
+            }
+            cred->userDisplayName.len = len;
+            cred->userDisplayName.present = true;
+        }
+        else if (tag == CRED_TAG_CRED_PROTECT && len == 1) {
+            cred->extensions.credProtect = data[0];
+        }
+        else if (tag == CRED_TAG_CRED_BLOB && !cred->extensions.credBlob.present) {
+            if ((cred->extensions.credBlob.data = (uint8_t *) credential_dup(data, len)) == NULL) {
+                return CTAP2_ERR_PROCESSING;
+            }
+            cred->extensions.credBlob.len = len;
+            cred->extensions.credBlob.present = true;
+        }
+        else if (tag == CRED_TAG_ALG && len == 3) {
+            cred->alg = (int16_t) ((data[0] << 8) | data[1]);
+            cred->curve = data[2];
         }
-        return error;
     }
     return 0;
 }
@@ -161,7 +300,10 @@ int credential_load(const uint8_t *cred_id,
                     Credential *cred) {
     int ret = 0;
     CborError error = CborNoError;
-    uint8_t *copy_cred_id = (uint8_t *) calloc(1, cred_id_len);
+    uint8_t *copy_cred_id = (uint8_t *) arena_alloc(cred_id_len);
+    if (!copy_cred_id) {
+        return CTAP2_ERR_PROCESSING;
+    }
     memcpy(copy_cred_id, cred_id, cred_id_len);
     ret = credential_verify(copy_cred_id, cred_id_len, rp_id_hash);
     if (ret != 0) { // U2F?
@@ -169,6 +311,12 @@ int credential_load(const uint8_t *cred_id,
             CBOR_ERROR(CTAP2_ERR_INVALID_CREDENTIAL);
         }
     }
+    else if (copy_cred_id[3] == CRED_PROTO_V2) {
+        ret = credential_parse_compact(copy_cred_id + 4 + 12, cred_id_len - (4 + 12 + 16), cred);
+        if (ret != 0) {
+            CBOR_ERROR(ret == CTAP2_ERR_PROCESSING ? ret : CTAP2_ERR_INVALID_CREDENTIAL);
+        }
+    }
     else {
         CborParser parser;
         CborValue map;
@@ -237,12 +385,15 @@ int credential_load(const uint8_t *cred_id,
         }
     }
     cred->id.present = true;
-    cred->id.data = (uint8_t *) calloc(1, cred_id_len);
+    cred->id.data = (uint8_t *) arena_alloc(cred_id_len);
+    if (!cred->id.data) {
+        CBOR_ERROR(CTAP2_ERR_PROCESSING);
+    }
     memcpy(cred->id.data, cred_id, cred_id_len);
     cred->id.len = cred_id_len;
     cred->present = true;
 err:
-    free(copy_cred_id);
+    arena_free(copy_cred_id);
     if (error != CborNoError) {
         if (error == CborErrorImproperValue) {
             return CTAP2_ERR_CBOR_UNEXPECTED_TYPE;
@@ -263,90 +414,170 @@ void credential_free(Credential *cred) {
     cred->opts.present = false;
 }
 
-int credential_store(const uint8_t *cred_id, size_t cred_id_len, const uint8_t *rp_id_hash) {
-    int sloti = -1;
-    Credential cred = { 0 };
-    int ret = 0;
-    bool new_record = true;
-    ret = credential_load(cred_id, cred_id_len, rp_id_hash, &cred);
-    if (ret != 0) {
-        credential_free(&cred);
-        return ret;
-    }
-    for (int i = 0; i < MAX_RESIDENT_CREDENTIALS; i++) {
-        file_t *ef = search_dynamic_file(EF_CRED + i);
+// Position of the credential stored for the same RP and user, or -1
+static int credential_find_user(const uint8_t *rp_id_hash, const Credential *cred) {
+    uint16_t first = 0, n = cred_index_find(rp_id_hash, &first);
+    for (uint16_t i = first; i < first + n; i++) {
+        uint16_t len = 0;
+        const uint8_t *data = cred_index_cred(i, &len);
         Credential rcred = { 0 };
-        if (!file_has_data(ef)) {
-            if (sloti == -1) {
-                sloti = i;
-            }
+        if (memcmp(data, rp_id_hash, 32) != 0) {
             continue;
         }
-        if (memcmp(file_get_data(ef), rp_id_hash, 32) != 0) {
-            continue;
-        }
-        ret = credential_load(file_get_data(ef) + 32, file_get_size(ef) - 32, rp_id_hash, &rcred);
-        if (ret != 0) {
+        if (credential_load(data + 32, len - 32, rp_id_hash, &rcred) != 0) {
             credential_free(&rcred);
             continue;
         }
-        if (memcmp(rcred.userId.data, cred.userId.data,
-                   MIN(rcred.userId.len, cred.userId.len)) == 0) {
-            sloti = i;
+        if (memcmp(rcred.userId.data, cred->userId.data,
+                   MIN(rcred.userId.len, cred->userId.len)) == 0) {
             credential_free(&rcred);
-            new_record = false;
-            break;
+            return i;
         }
         credential_free(&rcred);
     }
-    if (sloti == -1) {
+    return -1;
+}
+
+int credential_store(const uint8_t *cred_id, size_t cred_id_len, const uint8_t *rp_id_hash) {
+    Credential cred = { 0 };
+    int ret = credential_load(cred_id, cred_id_len, rp_id_hash, &cred);
+    if (ret != 0) {
+        credential_free(&cred);
+        return ret;
+    }
+    int pos = credential_find_user(rp_id_hash, &cred);
+    low_flash_txn_begin();
+    ret = cred_index_store(pos, rp_id_hash, cred_id, cred_id_len);
+    if (ret == CCID_OK && pos == -1) { //increase rps
+        ret = cred_index_rp_add(rp_id_hash, (const uint8_t *) cred.rpId.data, cred.rpId.len);
+    }
+    low_flash_txn_commit();
+    credential_free(&cred);
+    return ret == CCID_OK ? 0 : -1;
+}
+
+// Next record of a batch of | rp_id_hash (32) | id len (2) | id |, 0 at the end, -1 if malformed
+static int credential_batch_next(const uint8_t *data, size_t len, size_t *p,
+                                 const uint8_t **rp_id_hash, const uint8_t **id, uint16_t *id_len) {
+    if (*p == len) {
+        return 0;
+    }
+    if (len - *p < 32 + 2) {
         return -1;
     }
-    uint8_t *data = (uint8_t *) calloc(1, cred_id_len + 32);
-    memcpy(data, rp_id_hash, 32);
-    memcpy(data + 32, cred_id, cred_id_len);
-    file_t *ef = file_new(EF_CRED + sloti);
-    flash_write_data_to_file(ef, data, cred_id_len + 32);
-    free(data);
+    *rp_id_hash = data + *p;
+    *id_len = get_uint16_t(data + *p, 32);
+    *id = data + *p + 32 + 2;
+    if (*id_len == 0 || *id_len > MAX_CRED_ID_LENGTH || len - *p - 32 - 2 < *id_len) {
+        return -1;
+    }
+    *p += 32 + 2 + *id_len;
+    return 1;
+}
 
-    if (new_record == true) { //increase rps
-        sloti = -1;
-        for (int i = 0; i < MAX_RESIDENT_CREDENTIALS; i++) {
-            ef = search_dynamic_file(EF_RP + i);
-            if (!file_has_data(ef)) {
-                if (sloti == -1) {
-                    sloti = i;
+/* Imports a batch of resident credentials sealed by this device. Every record is checked before
+ * anything is written, along with the slots and the flash the whole batch needs, and then all of
+ * them reach the flash in a single transaction, with the index sorted once at the end. A
+ * credential for a user already stored replaces it, as in credential_store(). The new ones are
+ * written first, so if one of them still fails, they are dropped again before any stored
+ * credential is overwritten. */
+int credential_import(const uint8_t *data, size_t len, uint16_t *count) {
+    const uint8_t *rp_id_hash = NULL, *id = NULL;
+    uint16_t id_len = 0, n = 0, fresh = 0, fresh_rps = 0, records = 0;
+    uint32_t bytes = 0;
+    size_t p = 0;
+    int r = 0;
+    while ((r = credential_batch_next(data, len, &p, &rp_id_hash, &id, &id_len)) > 0) {
+        n++;
+    }
+    if (r < 0) {
+        return CTAP1_ERR_INVALID_LEN;
+    }
+    if (n == 0) {
+        return CTAP2_ERR_MISSING_PARAMETER;
+    }
+    // A tag per record catches the same user twice in the batch
+    uint8_t *users = (uint8_t *) arena_alloc(n * 32);
+    if (!users) {
+        return CTAP2_ERR_PROCESSING;
+    }
+    int ret = 0;
+    p = 0;
+    for (uint16_t i = 0; i < n && ret == 0; i++) {
+        Credential cred = { 0 };
+        credential_batch_next(data, len, &p, &rp_id_hash, &id, &id_len);
+        if (credential_load(id, id_len, rp_id_hash, &cred) != 0 || cred.opts.rk != ptrue) {
+            ret = CTAP2_ERR_INVALID_CREDENTIAL;
+        }
+        else {
+            mbedtls_sha256_context ctx;
+            mbedtls_sha256_init(&ctx);
+            mbedtls_sha256_starts(&ctx, 0);
+            mbedtls_sha256_update(&ctx, rp_id_hash, 32);
+            mbedtls_sha256_update(&ctx, cred.userId.data, cred.userId.len);
+            mbedtls_sha256_finish(&ctx, users + i * 32);
+            mbedtls_sha256_free(&ctx);
+            for (uint16_t j = 0; j < i; j++) {
+                if (memcmp(users + j * 32, users + i * 32, 32) == 0) {
+                    ret = CTAP1_ERR_INVALID_PARAMETER;
                 }
-                continue;
             }
-            if (memcmp(file_get_data(ef) + 1, rp_id_hash, 32) == 0) {
-                sloti = i;
-                break;
+            // Only fresh users take a slot. A replacement only needs flash when it grows
+            int pos = credential_find_user(rp_id_hash, &cred);
+            uint16_t old_len = 0;
+            if (pos >= 0) {
+                cred_index_cred((uint16_t) pos, &old_len);
+            }
+            else {
+                fresh++;
+                if (cred_index_rp_find(rp_id_hash) < 0) { // Counted once per credential, at worst
+                    fresh_rps++;
+                    records++;
+                    bytes += 1 + 32 + cred.rpId.len;
+                }
+            }
+            if (32 + id_len > old_len) {
+                records++;
+                bytes += 32 + id_len;
             }
         }
-        if (sloti == -1) {
-            return -1;
-        }
-        ef = search_dynamic_file(EF_RP + sloti);
-        if (file_has_data(ef)) {
-            data = (uint8_t *) calloc(1, file_get_size(ef));
-            memcpy(data, file_get_data(ef), file_get_size(ef));
-            data[0] += 1;
-            flash_write_data_to_file(ef, data, file_get_size(ef));
-            free(data);
-        }
-        else {
-            ef = file_new(EF_RP + sloti);
-            data = (uint8_t *) calloc(1, 1 + 32 + cred.rpId.len);
-            data[0] = 1;
-            memcpy(data + 1, rp_id_hash, 32);
-            memcpy(data + 1 + 32, cred.rpId.data, cred.rpId.len);
-            flash_write_data_to_file(ef, data, 1 + 32 + cred.rpId.len);
-            free(data);
+        credential_free(&cred);
+    }
+    arena_free(users);
+    if (ret != 0) {
+        return ret;
+    }
+    if (fresh > cred_index_remaining() || !cred_index_room(fresh, fresh_rps, records, bytes)) {
+        return CTAP2_ERR_KEY_STORE_FULL;
+    }
+
+    low_flash_txn_begin();
+    cred_index_batch_begin();
+    for (int replace = 0; replace < 2 && ret == CCID_OK; replace++) {
+        p = 0;
+        for (uint16_t i = 0; i < n && ret == CCID_OK; i++) {
+            Credential cred = { 0 };
+            credential_batch_next(data, len, &p, &rp_id_hash, &id, &id_len);
+            credential_load(id, id_len, rp_id_hash, &cred);
+            int pos = credential_find_user(rp_id_hash, &cred);
+            if ((pos >= 0) == (replace == 1)) {
+                ret = cred_index_store(pos, rp_id_hash, id, id_len);
+                if (ret == CCID_OK && pos == -1) {
+                    ret = cred_index_rp_add(rp_id_hash, (const uint8_t *) cred.rpId.data,
+                                            cred.rpId.len);
+                }
+            }
+            credential_free(&cred);
         }
     }
-    credential_free(&cred);
-    low_flash_available();
+    if (cred_index_batch_end(ret == CCID_OK) != CCID_OK && ret == CCID_OK) {
+        ret = CCID_EXEC_ERROR;
+    }
+    low_flash_txn_commit();
+    if (ret != CCID_OK) {
+        return CTAP2_ERR_KEY_STORE_FULL;
+    }
+    *count = n;
     return 0;
 }
 
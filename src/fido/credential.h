@@ -56,7 +56,33 @@ typedef struct Credential {
 #define CRED_PROT_UV_OPTIONAL_WITH_LIST     0x02
 #define CRED_PROT_UV_REQUIRED               0x03
 
-#define CRED_PROTO                          "\xf1\xd0\x02\x01"
+#define CRED_PROTO                          "\xf1\xd0\x02\x01" // Also the label of the derived keys
+#define CRED_PROTO_V1                       0x01 // Plaintext is a CBOR map
+#define CRED_PROTO_V2                       0x02 // Plaintext is the compact layout below
+
+/* Compact layout. The last byte of the header carries the version and the plaintext is:
+ * | version (1) | flags (1) | creation (4) | fields |
+ * Each field is | tag (1) | len (1 or 2) | value |, where lengths above 127 take two bytes with
+ * the top bit set. Empty fields and defaults are omitted and unknown tags are skipped. */
+#define CRED_FLAG_SIGN_COUNT                0x01
+#define CRED_FLAG_EXTENSIONS                0x02
+#define CRED_FLAG_HMAC_SECRET               0x04
+#define CRED_FLAG_HMAC_SECRET_ON            0x08
+#define CRED_FLAG_LARGE_BLOB_KEY            0x10
+#define CRED_FLAG_THIRD_PARTY_PAYMENT       0x20
+#define CRED_FLAG_OPTIONS                   0x40
+#define CRED_FLAG_RK                        0x80
+
+#define CRED_TAG_RP_ID                      0x01
+#define CRED_TAG_USER_ID                    0x03
+#define CRED_TAG_USER_NAME                  0x04
+#define CRED_TAG_USER_DISPLAY_NAME          0x05
+#define CRED_TAG_CRED_PROTECT               0x07 // | credProtect (1) |
+#define CRED_TAG_CRED_BLOB                  0x08
+#define CRED_TAG_ALG                        0x09 // | alg (2, signed) | curve (1) |, not on ES256
+
+#define CRED_HEADER_LEN                     (1 + 1 + 4)
+#define CRED_FIELD_MAX_LEN                  0x7FFF
 
 extern int credential_verify(uint8_t *cred_id, size_t cred_id_len, const uint8_t *rp_id_hash);
 extern int credential_create(CborCharString *rpId,
@@ -72,6 +98,7 @@ extern int credential_create(CborCharString *rpId,
                              size_t *cred_id_len);
 extern void credential_free(Credential *cred);
 extern int credential_store(const uint8_t *cred_id, size_t cred_id_len, const uint8_t *rp_id_hash);
+extern int credential_import(const uint8_t *data, size_t len, uint16_t *count);
 extern int credential_load(const uint8_t *cred_id,
                            size_t cred_id_len,
                            const uint8_t *rp_id_hash,
@@ -128,6 +128,10 @@ typedef struct {
 #define CTAP_VENDOR_MSE                 0x02
 #define CTAP_VENDOR_UNLOCK              0x03
 #define CTAP_VENDOR_EA                  0x04
+#define CTAP_VENDOR_KNOWN_APPS          0x05
+#define CTAP_VENDOR_TELEMETRY           0x06
+#define CTAP_VENDOR_FLASH_STATS         0x07
+#define CTAP_VENDOR_CRED_IMPORT         0x08
 
 #define CTAP_PERMISSION_MC              0x01  // MakeCredential
 #define CTAP_PERMISSION_GA              0x02  // GetAssertion
@@ -22,6 +22,8 @@
 #include "common.h"
 #include "mbedtls/ecp.h"
 #include "mbedtls/ecdh.h"
+#include "telemetry.h"
+#include "arena.h"
 
 extern uint8_t *driver_prepare_response();
 extern void driver_exec_finished(size_t size_next);
@@ -48,7 +50,8 @@ extern const bool _btrue, _bfalse;
     {                \
         if (x)       \
         {            \
-            free(x); \
+            TELEMETRY_HEAP_SAMPLE(); \
+            arena_free(x); \
             x = NULL; \
         }            \
     } while (0)
@@ -104,6 +107,53 @@ typedef struct CborCharString {
         (v).present = false; \
     } while (0)
 
+/* Request parameters. Each command describes its top level map once, as a table indexed by
+ * key with the major types accepted for that key. cbor_parse_params() walks the map a single
+ * time: it checks the types and the required keys, rejects non canonical encodings and
+ * unsorted or duplicated keys at any depth, and leaves every parameter positioned in
+ * value[key]. Strings are then taken as views into the request, without copying them. */
+#define CBOR_PARAM_UINT             0x0001
+#define CBOR_PARAM_NINT             0x0002
+#define CBOR_PARAM_INT              (CBOR_PARAM_UINT | CBOR_PARAM_NINT)
+#define CBOR_PARAM_BYTES            0x0004
+#define CBOR_PARAM_TEXT             0x0008
+#define CBOR_PARAM_ARRAY            0x0010
+#define CBOR_PARAM_MAP              0x0020
+#define CBOR_PARAM_BOOL             0x0080
+#define CBOR_PARAM_REQUIRED         0x8000
+
+#define CBOR_PARAMS_MAX             16
+
+typedef struct cbor_params {
+    uint16_t present;
+    CborValue value[CBOR_PARAMS_MAX];
+} cbor_params_t;
+
+#define CBOR_PARAM_PRESENT(p, k)    (((p).present & (1 << (k))) != 0)
+
+#define CBOR_VIEW_STRING(it, v) \
+    do { \
+        const uint8_t *_vd = NULL; \
+        CBOR_CHECK(cbor_string_view((it), &_vd, &(v).len)); \
+        (v).data = (void *) _vd; \
+        (v).present = true; \
+        (v).nofree = true; \
+    } while (0)
+
+#define CBOR_PARAM_GET_UINT(p, k, v) \
+    do { \
+        if (CBOR_PARAM_PRESENT(p, k)) { \
+            CBOR_CHECK(cbor_value_get_uint64(&(p).value[k], &(v))); \
+        } } while (0)
+
+#define CBOR_PARAM_GET_STRING(p, k, v) \
+    do { \
+        if (CBOR_PARAM_PRESENT(p, k)) { \
+            CBOR_VIEW_STRING(&(p).value[k], v); \
+        } } while (0)
+
+#define CBOR_TEXT_EQUALS(v, s) ((v).len == strlen(s) && memcmp((v).data, s, (v).len) == 0)
+
 #define CBOR_PARSE_MAP_START(_p, _n)                   \
     CBOR_ASSERT(cbor_value_is_map(&(_p)) == true); \
     CborValue _f##_n; \
@@ -133,17 +183,31 @@ typedef struct CborCharString {
 #define CBOR_FIELD_GET_BYTES(v, _n) \
     do { \
         CBOR_ASSERT(cbor_value_is_byte_string(&(_f##_n)) == true); \
-        CBOR_CHECK(cbor_value_dup_byte_string(&(_f##_n), &(v).data, &(v).len, &(_f##_n))); \
+        CBOR_CHECK(cbor_arena_dup_string(&(_f##_n), (void **) &(v).data, &(v).len)); \
         (v).present = true; \
     } while (0)
 
 #define CBOR_FIELD_GET_TEXT(v, _n) \
     do { \
         CBOR_ASSERT(cbor_value_is_text_string(&(_f##_n)) == true); \
-        CBOR_CHECK(cbor_value_dup_text_string(&(_f##_n), &(v).data, &(v).len, &(_f##_n))); \
+        CBOR_CHECK(cbor_arena_dup_string(&(_f##_n), (void **) &(v).data, &(v).len)); \
         (v).present = true; \
     } while (0)
 
+#define CBOR_FIELD_VIEW_BYTES(v, _n) \
+    do { \
+        CBOR_ASSERT(cbor_value_is_byte_string(&(_f##_n)) == true); \
+        CBOR_VIEW_STRING(&(_f##_n), v); \
+        CBOR_CHECK(cbor_value_advance(&(_f##_n))); \
+    } while (0)
+
+#define CBOR_FIELD_VIEW_TEXT(v, _n) \
+    do { \
+        CBOR_ASSERT(cbor_value_is_text_string(&(_f##_n)) == true); \
+        CBOR_VIEW_STRING(&(_f##_n), v); \
+        CBOR_CHECK(cbor_value_advance(&(_f##_n))); \
+    } while (0)
+
 #define CBOR_FIELD_GET_BOOL(v, _n) \
     do { \
         CBOR_ASSERT(cbor_value_is_boolean(&(_f##_n)) == true); \
@@ -162,7 +226,7 @@ typedef struct CborCharString {
 #define CBOR_FIELD_KEY_TEXT_VAL_TEXT(_n, _t, _v) \
     if (strcmp(_fd##_n, _t) == 0) { \
         CBOR_ASSERT(cbor_value_is_text_string(&_f##_n) == true); \
-        CBOR_CHECK(cbor_value_dup_text_string(&(_f##_n), &(_v).data, &(_v).len, &(_f##_n))); \
+        CBOR_CHECK(cbor_arena_dup_string(&(_f##_n), (void **) &(_v).data, &(_v).len)); \
         (_v).present = true; \
         continue; \
     }
@@ -170,11 +234,23 @@ typedef struct CborCharString {
 #define CBOR_FIELD_KEY_TEXT_VAL_BYTES(_n, _t, _v) \
     if (strcmp(_fd##_n, _t) == 0) { \
         CBOR_ASSERT(cbor_value_is_byte_string(&_f##_n) == true); \
-        CBOR_CHECK(cbor_value_dup_byte_string(&(_f##_n), &(_v).data, &(_v).len, &(_f##_n))); \
+        CBOR_CHECK(cbor_arena_dup_string(&(_f##_n), (void **) &(_v).data, &(_v).len)); \
         (_v).present = true; \
         continue; \
     }
 
+#define CBOR_FIELD_KEY_TEXT_VIEW_TEXT(_n, _t, _v) \
+    if (strcmp(_fd##_n, _t) == 0) { \
+        CBOR_FIELD_VIEW_TEXT(_v, _n); \
+        continue; \
+    }
+
+#define CBOR_FIELD_KEY_TEXT_VIEW_BYTES(_n, _t, _v) \
+    if (strcmp(_fd##_n, _t) == 0) { \
+        CBOR_FIELD_VIEW_BYTES(_v, _n); \
+        continue; \
+    }
+
 #define CBOR_FIELD_KEY_TEXT_VAL_INT(_n, _t, _v) \
     if (strcmp(_fd##_n, _t) == 0) { \
         CBOR_FIELD_GET_INT(_v, _n); \
@@ -194,7 +270,8 @@ typedef struct CborCharString {
     }
 
 #define CBOR_PARSE_MAP_END(_p, _n)  \
-    CBOR_CHECK(cbor_value_leave_container(&(_p), &(_f##_n)))
+    CBOR_CHECK(cbor_value_leave_container(&(_p), &(_f##_n))); \
+    if ((_n) == 1) { TELEMETRY_PARSED(); }
 
 #define CBOR_PARSE_ARRAY_END(_p, _n)  CBOR_PARSE_MAP_END(_p, _n)
 
@@ -211,7 +288,7 @@ typedef struct CborCharString {
     do { \
         if ((v).data && (v).len > 0) { \
             CBOR_CHECK(cbor_encode_uint(&(p), (k))); \
-            CBOR_CHECK(cbor_encode_text_stringz(&(p), (v).data)); \
+            CBOR_CHECK(cbor_encode_text_string(&(p), (v).data, (v).len)); \
         } } while (0)
 
 
@@ -251,5 +328,13 @@ extern CborError COSE_read_key(CborValue *f,
                                int64_t *crv,
                                CborByteString *kax,
                                CborByteString *kay);
+extern CborError cbor_arena_dup_string(CborValue *it, void **data, size_t *len);
+extern CborError cbor_string_view(const CborValue *it, const uint8_t **data, size_t *len);
+extern CborError cbor_parse_params(const uint8_t *data,
+                                   size_t len,
+                                   CborParser *parser,
+                                   const uint16_t *schema,
+                                   size_t schema_len,
+                                   cbor_params_t *params);
 
 #endif //_CTAP2_CBOR_H_
@@ -17,9 +17,12 @@
 
 #include "fido.h"
 #include "pico_keys.h"
+#include "telemetry.h"
 #include "apdu.h"
 #include "ctap.h"
 #include "files.h"
+#include "attestation.h"
+#include "cred_index.h"
 #include "usb.h"
 #include "random.h"
 #include "mbedtls/x509_crt.h"
@@ -38,8 +41,6 @@
 int fido_process_apdu();
 int fido_unload();
 
-pinUvAuthToken_t paut = { 0 };
-
 uint8_t keydev_dec[32];
 bool has_keydev_dec = false;
 
@@ -133,7 +134,7 @@ int mbedtls_curve_to_fido(mbedtls_ecp_group_id id) {
         return FIDO2_CURVE_P256K1;
     }
     else if (id == MBEDTLS_ECP_DP_CURVE25519) {
-        return MBEDTLS_ECP_DP_CURVE25519;
+        return FIDO2_CURVE_X25519;
     }
     else if (id == MBEDTLS_ECP_DP_CURVE448) {
         return FIDO2_CURVE_X448;
@@ -236,13 +237,25 @@ int verify_key(const uint8_t *appId, const uint8_t *keyHandle, mbedtls_ecdsa_con
     return memcmp(keyHandle + KEY_PATH_LEN, hmac, sizeof(hmac));
 }
 
-int derive_key(const uint8_t *app_id,
-               bool new_key,
-               uint8_t *key_handle,
-               int curve,
-               mbedtls_ecdsa_context *key) {
+/* Every step expands to the 64 bytes that seed the next one, and only SECP521R1 needs more.
+ * The first 64 bytes of an HKDF output do not depend on its length, so keys of any curve are
+ * the same they were when 67 bytes were always expanded, for a cost that only grows with P-521.
+ * The public key is not computed here, see derive_public_key(). */
+static int derive_key_path(const uint8_t *app_id,
+                           bool new_key,
+                           uint8_t *key_handle,
+                           int curve,
+                           mbedtls_ecdsa_context *key) {
     uint8_t outk[67] = { 0 }; //SECP521R1 key is 66 bytes length
     int r = 0;
+    const mbedtls_ecp_curve_info *cinfo = NULL;
+    size_t outk_len = 64;
+    if (key != NULL) {
+        if ((cinfo = mbedtls_ecp_curve_info_from_grp_id(curve)) == NULL) {
+            return 1;
+        }
+        outk_len = MAX(outk_len, (size_t) (cinfo->bit_size + 7) / 8);
+    }
     memset(outk, 0, sizeof(outk));
     if ((r = load_keydev(outk)) != CCID_OK) {
         return r;
@@ -263,7 +276,7 @@ int derive_key(const uint8_t *app_id,
                          outk + 32,
                          32,
                          outk,
-                         sizeof(outk));
+                         outk_len);
         if (r != 0) {
             mbedtls_platform_zeroize(outk, sizeof(outk));
             return r;
@@ -281,25 +294,46 @@ int derive_key(const uint8_t *app_id,
         }
     }
     if (key != NULL) {
-        mbedtls_ecp_group_load(&key->grp, curve);
-        const mbedtls_ecp_curve_info *cinfo = mbedtls_ecp_curve_info_from_grp_id(curve);
-        if (cinfo == NULL) {
-            return 1;
+        if ((r = mbedtls_ecp_group_load(&key->grp, curve)) != 0) {
+            mbedtls_platform_zeroize(outk, sizeof(outk));
+            return r;
         }
         if (cinfo->bit_size % 8 != 0) {
             outk[0] >>= 8 - (cinfo->bit_size % 8);
         }
-        r = mbedtls_ecp_read_key(curve, key, outk, ceil((float) cinfo->bit_size / 8));
+        r = mbedtls_mpi_read_binary(&key->d, outk, (cinfo->bit_size + 7) / 8);
         mbedtls_platform_zeroize(outk, sizeof(outk));
-        if (r != 0) {
-            return r;
+        // A scalar above the order is rare (SECP256K1, SECP521R1) and it is reduced instead of failing
+        if (r == 0 && mbedtls_mpi_cmp_mpi(&key->d, &key->grp.N) >= 0) {
+            r = mbedtls_mpi_mod_mpi(&key->d, &key->d, &key->grp.N);
         }
-        return mbedtls_ecp_mul(&key->grp, &key->Q, &key->d, &key->grp.G, random_gen, NULL);
+        if (r == 0) {
+            r = mbedtls_ecp_check_privkey(&key->grp, &key->d);
+        }
+        return r;
     }
     mbedtls_platform_zeroize(outk, sizeof(outk));
     return r;
 }
 
+int derive_key(const uint8_t *app_id,
+               bool new_key,
+               uint8_t *key_handle,
+               int curve,
+               mbedtls_ecdsa_context *key) {
+    TELEMETRY_PHASE_START(t);
+    int r = derive_key_path(app_id, new_key, key_handle, curve, key);
+    TELEMETRY_PHASE_END(TELEMETRY_PHASE_CRYPTO, t);
+    return r;
+}
+
+int derive_public_key(mbedtls_ecdsa_context *key) {
+    TELEMETRY_PHASE_START(t);
+    int r = mbedtls_ecp_mul(&key->grp, &key->Q, &key->d, &key->grp.G, random_gen, NULL);
+    TELEMETRY_PHASE_END(TELEMETRY_PHASE_CRYPTO, t);
+    return r;
+}
+
 int scan_files() {
     ef_keydev = search_by_fid(EF_KEY_DEV, NULL, SPECIFY_EF);
     ef_keydev_enc = search_by_fid(EF_KEY_DEV_ENC, NULL, SPECIFY_EF);
@@ -359,6 +393,7 @@ int scan_files() {
     else {
         printf("FATAL ERROR: CERT DEV not found in memory!\r\n");
     }
+    attestation_init();
     ef_counter = search_by_fid(EF_COUNTER, NULL, SPECIFY_EF);
     if (ef_counter) {
         if (!file_has_data(ef_counter)) {
@@ -370,31 +405,22 @@ int scan_files() {
         printf("FATAL ERROR: Global counter not found in memory!\r\n");
     }
     ef_pin = search_by_fid(EF_PIN, NULL, SPECIFY_EF);
-    ef_authtoken = search_by_fid(EF_AUTHTOKEN, NULL, SPECIFY_EF);
-    if (ef_authtoken) {
-        if (!file_has_data(ef_authtoken)) {
-            uint8_t t[32];
-            random_gen(NULL, t, sizeof(t));
-            flash_write_data_to_file(ef_authtoken, t, sizeof(t));
-        }
-        paut.data = file_get_data(ef_authtoken);
-        paut.len = file_get_size(ef_authtoken);
-    }
-    else {
-        printf("FATAL ERROR: Auth Token not found in memory!\r\n");
-    }
     ef_largeblob = search_by_fid(EF_LARGEBLOB, NULL, SPECIFY_EF);
     if (!file_has_data(ef_largeblob)) {
         flash_write_data_to_file(ef_largeblob,
                                  (const uint8_t *) "\x80\x76\xbe\x8b\x52\x8d\x00\x75\xf7\xaa\xe9\x8d\x6f\xa5\x7a\x6d\x3c",
                                  17);
     }
+    init_known_apps();
     low_flash_available();
     return CCID_OK;
 }
 
 void scan_all() {
+    cred_index_reset();
+    scan_file_cb = cred_index_scan;
     scan_flash();
+    cred_index_build();
     scan_files();
 }
 
@@ -471,24 +497,20 @@ int cmd_cbor() {
 }
 
 static const cmd_t cmds[] = {
-    { CTAP_REGISTER, cmd_register },
-    { CTAP_AUTHENTICATE, cmd_authenticate },
-    { CTAP_VERSION, cmd_version },
-    { CTAP_CBOR, cmd_cbor },
+    { CTAP_REGISTER, cmd_register, CMD_UP, sizeof(CTAP_REGISTER_RESP) },
+    { CTAP_AUTHENTICATE, cmd_authenticate, CMD_UP | CMD_FLASH, sizeof(CTAP_AUTHENTICATE_RESP) },
+    { CTAP_VERSION, cmd_version, 0, 6 },
+    { CTAP_CBOR, cmd_cbor, CMD_FLASH, 0 },
     { 0x00, 0x0 }
 };
+static cmd_table_t cmd_table = { .cmds = cmds };
 
 int fido_process_apdu() {
     if (CLA(apdu) != 0x00 && CLA(apdu) != 0x80) {
         return SW_CLA_NOT_SUPPORTED();
     }
     if (cap_supported(CAP_U2F)) {
-        for (const cmd_t *cmd = cmds; cmd->ins != 0x00; cmd++) {
-            if (cmd->ins == INS(apdu)) {
-                int r = cmd->cmd_handler();
-                return r;
-            }
-        }
+        return apdu_dispatch(&cmd_table);
     }
     return SW_INS_NOT_SUPPORTED();
 }
@@ -23,6 +23,7 @@
 #endif
 #include "common.h"
 #include "mbedtls/ecdsa.h"
+#include "mbedtls/sha256.h"
 #ifndef ENABLE_EMULATION
 #include "ctap_hid.h"
 #else
@@ -41,6 +42,7 @@ extern int derive_key(const uint8_t *app_id,
                       uint8_t *key_handle,
                       int,
                       mbedtls_ecdsa_context *key);
+extern int derive_public_key(mbedtls_ecdsa_context *key);
 extern int verify_key(const uint8_t *appId, const uint8_t *keyHandle, mbedtls_ecdsa_context *);
 extern bool wait_button_pressed();
 extern void init_fido();
@@ -59,6 +61,13 @@ extern int decrypt(uint8_t protocol,
                    size_t in_len,
                    uint8_t *out);
 extern int ecdh(uint8_t protocol, const mbedtls_ecp_point *Q, uint8_t *sharedSecret);
+extern int ecdh_restartable(uint8_t protocol,
+                            const mbedtls_ecp_point *Q,
+                            mbedtls_ecp_point *R,
+                            mbedtls_ecp_restart_ctx *rs_ctx,
+                            uint8_t *sharedSecret,
+                            int (*f_rng)(void *, unsigned char *, size_t),
+                            void *p_rng);
 
 #define FIDO2_ALG_ES256     -7 //ECDSA-SHA256 P256
 #define FIDO2_ALG_EDDSA     -8 //EdDSA
@@ -98,7 +107,9 @@ extern uint8_t get_opts();
 extern void set_opts(uint8_t);
 #define MAX_CREDENTIAL_COUNT_IN_LIST 16
 #define MAX_CRED_ID_LENGTH        1024
-#define MAX_RESIDENT_CREDENTIALS  256
+#ifndef MAX_RESIDENT_CREDENTIALS
+#define MAX_RESIDENT_CREDENTIALS  1024
+#endif
 #define MAX_CREDBLOB_LENGTH       128
 #define MAX_MSG_SIZE              1024
 #define MAX_FRAGMENT_LENGTH       (MAX_MSG_SIZE - 64)
@@ -111,26 +122,57 @@ typedef struct known_app {
     const bool *use_self_attestation;
 } known_app_t;
 
-extern const known_app_t *find_app_by_rp_id_hash(const uint8_t *rp_id_hash);
+#define MAX_USER_KNOWN_APPS        256
+#define KNOWN_APPS_CHUNK_SIZE      1024 // Largest read of EF_KNOWN_APPS in one vendor response
+#define KAPP_FLAG_SIGN_COUNT       0x01
+#define KAPP_FLAG_SIGN_COUNT_VALUE 0x02
+#define KAPP_FLAG_SELF_ATT         0x04
+#define KAPP_FLAG_SELF_ATT_VALUE   0x08
+
+extern const known_app_t *find_app_by_rp_id_hash(const uint8_t *rp_id_hash, known_app_t *buf);
+extern int known_apps_parse(const uint8_t *data, size_t len, uint16_t *offsets, uint16_t *count);
+extern void init_known_apps();
+
+#define BACKUP_CHUNK_SIZE          2048
+#define BACKUP_SEALED_SIZE         (12 + BACKUP_CHUNK_SIZE + 16) // | id | index | chunk | tag |
+
+extern int backup_read(uint32_t index, uint8_t *out, size_t *out_len, uint32_t *chunks);
+extern int backup_restore(uint8_t *in, size_t in_len, uint32_t *next);
+extern const uint8_t *backup_restore_status(uint32_t *next, uint32_t *chunks, bool *apply);
+
+// A batch is imported in one flash transaction, so what it writes must fit the journal
+#define CRED_IMPORT_MAX_SIZE       2048
 
 #define TRANSPORT_TIME_LIMIT (30 * 1000) //USB
 
 bool check_user_presence();
 
+#define MAX_PIN_UV_AUTH_TOKENS          4
+
 typedef struct pinUvAuthToken {
-    uint8_t *data;
-    size_t len;
+    uint8_t data[32];
     bool in_use;
     uint8_t permissions;
     uint8_t rp_id_hash[32];
     bool has_rp_id;
     bool user_present;
     bool user_verified;
+    bool used;              // Authenticated a request since it was issued
+    uint32_t usage_timer;
+    uint32_t last_used;
+    mbedtls_sha256_context hmac_inner; // Keyed with the token, so checking a request costs one HMAC
+    mbedtls_sha256_context hmac_outer;
 } pinUvAuthToken_t;
 
 extern uint32_t user_present_time_limit;
 
-extern pinUvAuthToken_t paut;
+extern pinUvAuthToken_t *paut;
+extern int checkPinUvAuthToken(uint8_t protocol,
+                               const uint8_t *data,
+                               size_t len,
+                               const uint8_t *sign,
+                               uint8_t permissions,
+                               const uint8_t *rp_id_hash);
 extern int verify(uint8_t protocol,
                   const uint8_t *key,
                   const uint8_t *data,
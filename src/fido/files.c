@@ -30,6 +30,9 @@ file_t file_entries[] = {
     { .fid = EF_EE_DEV_EA,  .parent = 0, .name = NULL,
       .type = FILE_TYPE_INTERNAL_EF | FILE_DATA_FLASH, .data = NULL,
       .ef_structure = FILE_EF_TRANSPARENT, .acl = { 0xff } },                                                                                                               // End Entity Enterprise Attestation Certificate
+    { .fid = EF_EE_DEV_CSR,  .parent = 0, .name = NULL,
+      .type = FILE_TYPE_INTERNAL_EF | FILE_DATA_FLASH, .data = NULL,
+      .ef_structure = FILE_EF_TRANSPARENT, .acl = { 0xff } },                                                                                                               // Enterprise Attestation CSR
     { .fid = EF_COUNTER,  .parent = 0, .name = NULL,
       .type = FILE_TYPE_INTERNAL_EF | FILE_DATA_FLASH, .data = NULL,
       .ef_structure = FILE_EF_TRANSPARENT, .acl = { 0xff } },                                                                                                             // Global counter
@@ -46,6 +49,9 @@ file_t file_entries[] = {
     { .fid = EF_LARGEBLOB,  .parent = 0, .name = NULL,
       .type = FILE_TYPE_INTERNAL_EF | FILE_DATA_FLASH, .data = NULL,
       .ef_structure = FILE_EF_TRANSPARENT, .acl = { 0xff } },                                                                                                               // Large Blob
+    { .fid = EF_KNOWN_APPS,  .parent = 0, .name = NULL,
+      .type = FILE_TYPE_INTERNAL_EF | FILE_DATA_FLASH, .data = NULL,
+      .ef_structure = FILE_EF_TRANSPARENT, .acl = { 0xff } },                                                                                                               // Known apps
     { .fid = EF_OTP_PIN,  .parent = 0, .name = NULL,
       .type = FILE_TYPE_INTERNAL_EF | FILE_DATA_FLASH,
       .data = NULL, .ef_structure = FILE_EF_TRANSPARENT, .acl = { 0xff } },
@@ -59,6 +65,5 @@ file_t *ef_keydev = NULL;
 file_t *ef_certdev = NULL;
 file_t *ef_counter = NULL;
 file_t *ef_pin = NULL;
-file_t *ef_authtoken = NULL;
 file_t *ef_keydev_enc = NULL;
 file_t *ef_largeblob = NULL;
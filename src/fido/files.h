@@ -24,6 +24,7 @@
 #define EF_KEY_DEV_ENC  0xCC01
 #define EF_EE_DEV       0xCE00
 #define EF_EE_DEV_EA    0xCE01
+#define EF_EE_DEV_CSR   0xCE02 // Cached EA CSR
 #define EF_COUNTER      0xC000
 #define EF_OPTS         0xC001
 #define EF_PIN          0x1080
@@ -32,7 +33,10 @@
 #define EF_DEV_CONF     0x1122
 #define EF_CRED         0xCF00 // Creds at 0xCF00 - 0xCFFF
 #define EF_RP           0xD000 // RPs at 0xD000 - 0xD0FF
+#define EF_CRED_EXT     0x4000 // Creds beyond the first 256 at 0x4000 - 0x4FFF
+#define EF_RP_EXT       0x5000 // RPs beyond the first 256 at 0x5000 - 0x5FFF
 #define EF_LARGEBLOB    0x1101 // Large Blob Array
+#define EF_KNOWN_APPS   0x1102 // User defined known apps
 #define EF_OATH_CRED    0xBA00 // OATH Creds at 0xBA00 - 0xBAFE
 #define EF_OATH_CODE    0xBAFF
 #define EF_OTP_SLOT1    0xBB00
@@ -43,7 +47,6 @@ extern file_t *ef_keydev;
 extern file_t *ef_certdev;
 extern file_t *ef_counter;
 extern file_t *ef_pin;
-extern file_t *ef_authtoken;
 extern file_t *ef_keydev_enc;
 extern file_t *ef_largeblob;
 
@@ -17,6 +17,8 @@
 
 #include "fido.h"
 #include "ctap2_cbor.h"
+#include "files.h"
+#include "pico_keys.h"
 
 static const known_app_t kapps[] = {
     {
@@ -381,8 +383,100 @@ static const known_app_t kapps[] = {
     }
 };
 
-const known_app_t *find_app_by_rp_id_hash(const uint8_t *rp_id_hash) {
-    for (const known_app_t *ka = &kapps[0]; ka->rp_id_hash != NULL; ka++) {
+#define KAPPS_BUILTIN        (sizeof(kapps) / sizeof(known_app_t) - 1)
+#define KAPPS_HASH_SIZE      1024 // Power of 2, at least twice the number of apps
+#define KAPPS_HASH_EMPTY     0xFFFF
+
+/* User known apps are stored in EF_KNOWN_APPS as a sequence of records:
+ *  rp_id_hash (32) | flags (1) | label (NUL terminated)
+ * Only record offsets are indexed, since the file data may move to a pending flash page. */
+static file_t *ef_known_apps = NULL;
+static uint16_t kapps_user_off[MAX_USER_KNOWN_APPS];
+static uint16_t kapps_user_count = 0;
+static uint16_t kapps_hash[KAPPS_HASH_SIZE];
+
+static const bool *known_app_flag(uint8_t flags, uint8_t present, uint8_t value) {
+    if (!(flags & present)) {
+        return NULL;
+    }
+    return flags & value ? ptrue : pfalse;
+}
+
+// User entries are decoded into ka, built-in ones are returned from the table
+static const known_app_t *known_app_get(uint16_t idx, known_app_t *ka) {
+    if (idx < kapps_user_count) {
+        const uint8_t *p = file_get_data(ef_known_apps) + kapps_user_off[idx];
+        ka->rp_id_hash = p;
+        ka->label = (const char *) p + 33;
+        ka->use_sign_count = known_app_flag(p[32], KAPP_FLAG_SIGN_COUNT, KAPP_FLAG_SIGN_COUNT_VALUE);
+        ka->use_self_attestation = known_app_flag(p[32], KAPP_FLAG_SELF_ATT, KAPP_FLAG_SELF_ATT_VALUE);
+        return ka;
+    }
+    return &kapps[idx - kapps_user_count];
+}
+
+static uint16_t known_app_slot(const uint8_t *rp_id_hash) {
+    // rp_id_hash is a SHA-256 digest, its prefix is already uniformly distributed
+    return (rp_id_hash[0] | (rp_id_hash[1] << 8)) & (KAPPS_HASH_SIZE - 1);
+}
+
+static void known_app_insert(uint16_t idx) {
+    known_app_t ka, other;
+    const uint8_t *rp_id_hash = known_app_get(idx, &ka)->rp_id_hash;
+    for (uint16_t s = known_app_slot(rp_id_hash);; s = (s + 1) & (KAPPS_HASH_SIZE - 1)) {
+        if (kapps_hash[s] == KAPPS_HASH_EMPTY) {
+            kapps_hash[s] = idx;
+            return;
+        }
+        if (memcmp(known_app_get(kapps_hash[s], &other)->rp_id_hash, rp_id_hash, 32) == 0) {
+            return; // User entries are inserted first and take precedence
+        }
+    }
+}
+
+int known_apps_parse(const uint8_t *data, size_t len, uint16_t *offsets, uint16_t *count) {
+    const uint8_t *p = data, *end = data + len;
+    uint16_t n = 0;
+    while (p < end) {
+        const uint8_t *label = p + 33;
+        if (label >= end || n >= MAX_USER_KNOWN_APPS) {
+            return CCID_WRONG_LENGTH;
+        }
+        const uint8_t *eos = memchr(label, 0, end - label);
+        if (eos == NULL || eos == label) {
+            return CCID_WRONG_DATA;
+        }
+        if (offsets) {
+            offsets[n] = p - data;
+        }
+        n++;
+        p = eos + 1;
+    }
+    if (count) {
+        *count = n;
+    }
+    return CCID_OK;
+}
+
+void init_known_apps() {
+    kapps_user_count = 0;
+    ef_known_apps = search_by_fid(EF_KNOWN_APPS, NULL, SPECIFY_EF);
+    if (file_has_data(ef_known_apps)) {
+        if (known_apps_parse(file_get_data(ef_known_apps), file_get_size(ef_known_apps), kapps_user_off, &kapps_user_count) != CCID_OK) {
+            kapps_user_count = 0;
+        }
+    }
+    memset(kapps_hash, 0xFF, sizeof(kapps_hash));
+    for (uint16_t i = 0; i < kapps_user_count + KAPPS_BUILTIN; i++) {
+        known_app_insert(i);
+    }
+}
+
+/* The entry found, which is either buf or a built-in one. A user entry points into EF_KNOWN_APPS,
+ * so it is only valid until the file is written again. */
+const known_app_t *find_app_by_rp_id_hash(const uint8_t *rp_id_hash, known_app_t *buf) {
+    for (uint16_t s = known_app_slot(rp_id_hash); kapps_hash[s] != KAPPS_HASH_EMPTY; s = (s + 1) & (KAPPS_HASH_SIZE - 1)) {
+        const known_app_t *ka = known_app_get(kapps_hash[s], buf);
         if (memcmp(rp_id_hash, ka->rp_id_hash, 32) == 0) {
             return ka;
         }
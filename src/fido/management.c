@@ -114,6 +114,20 @@ int man_get_config() {
         memcpy(res_APDU + res_APDU_size, file_get_data(ef), file_get_size(ef));
         res_APDU_size += file_get_size(ef);
     }
+    flash_stats_t st;
+    flash_get_stats(&st);
+    const uint32_t stats[] = {
+        st.total, st.used, st.free, st.fragmented, st.largest_free,
+        st.files, st.alloc_failures, st.erase_total, st.erase_max
+    };
+    res_APDU[res_APDU_size++] = TAG_FLASH_STATS;
+    res_APDU[res_APDU_size++] = sizeof(stats);
+    for (int i = 0; i < sizeof(stats) / sizeof(uint32_t); i++) {
+        res_APDU[res_APDU_size++] = stats[i] >> 24;
+        res_APDU[res_APDU_size++] = stats[i] >> 16;
+        res_APDU[res_APDU_size++] = stats[i] >> 8;
+        res_APDU[res_APDU_size++] = stats[i];
+    }
     res_APDU[0] = res_APDU_size - 1;
     return 0;
 }
@@ -129,7 +143,6 @@ int cmd_write_config() {
     }
     file_t *ef = file_new(EF_DEV_CONF);
     flash_write_data_to_file(ef, apdu.data + 1, apdu.nc - 1);
-    low_flash_available();
     return SW_OK();
 }
 
@@ -137,20 +150,15 @@ int cmd_write_config() {
 #define INS_WRITE_CONFIG            0x1C
 
 static const cmd_t cmds[] = {
-    { INS_READ_CONFIG, cmd_read_config },
-    { INS_WRITE_CONFIG, cmd_write_config },
+    { INS_READ_CONFIG, cmd_read_config, 0, 0 },
+    { INS_WRITE_CONFIG, cmd_write_config, CMD_FLASH, 0 },
     { 0x00, 0x0 }
 };
+static cmd_table_t cmd_table = { .cmds = cmds };
 
 int man_process_apdu() {
     if (CLA(apdu) != 0x00) {
         return SW_CLA_NOT_SUPPORTED();
     }
-    for (const cmd_t *cmd = cmds; cmd->ins != 0x00; cmd++) {
-        if (cmd->ins == INS(apdu)) {
-            int r = cmd->cmd_handler();
-            return r;
-        }
-    }
-    return SW_INS_NOT_SUPPORTED();
+    return apdu_dispatch(&cmd_table);
 }
@@ -37,6 +37,7 @@
 #define TAG_REBOOT 0x0C
 #define TAG_NFC_SUPPORTED 0x0D
 #define TAG_NFC_ENABLED 0x0E
+#define TAG_FLASH_STATS 0x20
 
 #define CAP_OTP 0x01
 #define CAP_U2F 0x02
@@ -17,6 +17,7 @@
 
 #include "fido.h"
 #include "pico_keys.h"
+#include "telemetry.h"
 #include "apdu.h"
 #include "files.h"
 #include "random.h"
@@ -133,9 +134,6 @@ file_t *find_oath_cred(const uint8_t *name, size_t name_len) {
 }
 
 int cmd_put() {
-    if (validated == false) {
-        return SW_SECURITY_STATUS_NOT_SATISFIED();
-    }
     size_t key_len = 0, imf_len = 0, name_len = 0;
     uint8_t *key = NULL, *imf = NULL, *name = NULL;
     if (asn1_find_tag(apdu.data, apdu.nc, TAG_KEY, &key_len, &key) == false) {
@@ -183,9 +181,6 @@ int cmd_put() {
 int cmd_delete() {
     size_t tag_len = 0;
     uint8_t *tag_data = NULL;
-    if (validated == false) {
-        return SW_SECURITY_STATUS_NOT_SATISFIED();
-    }
     if (asn1_find_tag(apdu.data, apdu.nc, TAG_NAME, &tag_len, &tag_data) == true) {
         file_t *ef = find_oath_cred(tag_data, tag_len);
         if (ef) {
@@ -211,9 +206,6 @@ const mbedtls_md_info_t *get_oath_md_info(uint8_t alg) {
 }
 
 int cmd_set_code() {
-    if (validated == false) {
-        return SW_SECURITY_STATUS_NOT_SATISFIED();
-    }
     if (apdu.nc == 0) {
         delete_file(search_dynamic_file(EF_OATH_CODE));
         validated = true;
@@ -276,9 +268,6 @@ int cmd_reset() {
 int cmd_list() {
     size_t name_len = 0, key_len = 0;
     uint8_t *name = NULL, *key = NULL;
-    if (validated == false) {
-        return SW_SECURITY_STATUS_NOT_SATISFIED();
-    }
     for (int i = 0; i < MAX_OATH_CRED; i++) {
         file_t *ef = search_dynamic_file(EF_OATH_CRED + i);
         if (file_has_data(ef)) {
@@ -349,7 +338,9 @@ int calculate_oath(uint8_t truncate,
         return SW_INCORRECT_PARAMS();
     }
     uint8_t hmac[64];
+    TELEMETRY_PHASE_START(t);
     int r = mbedtls_md_hmac(md_info, key + 2, key_len - 2, chal, chal_len, hmac);
+    TELEMETRY_PHASE_END(TELEMETRY_PHASE_CRYPTO, t);
     size_t hmac_size = mbedtls_md_get_size(md_info);
     if (r != 0) {
         return CCID_EXEC_ERROR;
@@ -378,9 +369,6 @@ int cmd_calculate() {
     if (P2(apdu) != 0x0 && P2(apdu) != 0x1) {
         return SW_INCORRECT_P1P2();
     }
-    if (validated == false) {
-        return SW_SECURITY_STATUS_NOT_SATISFIED();
-    }
     if (asn1_find_tag(apdu.data, apdu.nc, TAG_CHALLENGE, &chal_len, &chal) == false) {
         return SW_INCORRECT_PARAMS();
     }
@@ -423,7 +411,10 @@ int cmd_calculate() {
                 24) | ((uint64_t) chal[5] << 16) | ((uint64_t) chal[6] << 8) | (uint64_t) chal[7];
         size_t ef_size = file_get_size(ef);
         v++;
-        uint8_t *tmp = (uint8_t *) calloc(1, ef_size);
+        uint8_t *tmp = (uint8_t *) arena_alloc(ef_size);
+        if (!tmp) {
+            return SW_EXEC_ERROR();
+        }
         memcpy(tmp, file_get_data(ef), ef_size);
         asn1_find_tag(tmp, ef_size, TAG_IMF, &chal_len, &chal);
         chal[0] = v >> 56;
@@ -436,7 +427,7 @@ int cmd_calculate() {
         chal[7] = v & 0xff;
         flash_write_data_to_file(ef, tmp, ef_size);
         low_flash_available();
-        free(tmp);
+        arena_free(tmp);
     }
     apdu.ne = res_APDU_size;
     return SW_OK();
@@ -448,9 +439,6 @@ int cmd_calculate_all() {
     if (P2(apdu) != 0x0 && P2(apdu) != 0x1) {
         return SW_INCORRECT_P1P2();
     }
-    if (validated == false) {
-        return SW_SECURITY_STATUS_NOT_SATISFIED();
-    }
     if (asn1_find_tag(apdu.data, apdu.nc, TAG_CHALLENGE, &chal_len, &chal) == false) {
         return SW_INCORRECT_PARAMS();
     }
@@ -625,33 +613,38 @@ int cmd_verify_hotp() {
 #define INS_SET_PIN         0xb4
 
 static const cmd_t cmds[] = {
-    { INS_PUT, cmd_put },
-    { INS_DELETE, cmd_delete },
-    { INS_SET_CODE, cmd_set_code },
-    { INS_RESET, cmd_reset },
-    { INS_LIST, cmd_list },
-    { INS_VALIDATE, cmd_validate },
-    { INS_CALCULATE, cmd_calculate },
-    { INS_CALC_ALL, cmd_calculate_all },
-    { INS_SEND_REMAINING, cmd_send_remaining },
-    { INS_SET_PIN, cmd_set_otp_pin },
-    { INS_CHANGE_PIN, cmd_change_otp_pin },
-    { INS_VERIFY_PIN, cmd_verify_otp_pin },
-    { INS_VERIFY_CODE, cmd_verify_hotp },
+    { INS_PUT, cmd_put, CMD_PIN | CMD_FLASH, 0 },
+    { INS_DELETE, cmd_delete, CMD_PIN | CMD_FLASH, 0 },
+    { INS_SET_CODE, cmd_set_code, CMD_PIN | CMD_FLASH, 0 },
+    { INS_RESET, cmd_reset, CMD_FLASH, 0 },
+    { INS_LIST, cmd_list, CMD_PIN, 0 },
+    { INS_VALIDATE, cmd_validate, 0, 0 },
+    { INS_CALCULATE, cmd_calculate, CMD_PIN | CMD_FLASH, 0 },
+    { INS_CALC_ALL, cmd_calculate_all, CMD_PIN | CMD_FLASH, 0 },
+    { INS_SEND_REMAINING, cmd_send_remaining, 0, 0 },
+    { INS_SET_PIN, cmd_set_otp_pin, CMD_FLASH, 0 },
+    { INS_CHANGE_PIN, cmd_change_otp_pin, CMD_FLASH, 0 },
+    { INS_VERIFY_PIN, cmd_verify_otp_pin, CMD_FLASH, 0 },
+    { INS_VERIFY_CODE, cmd_verify_hotp, CMD_FLASH, 0 },
     { 0x00, 0x0 }
 };
 
+// Handlers with CMD_PIN need the access code validated, if any
+static int oath_check(const cmd_t *cmd) {
+    if ((cmd->flags & CMD_PIN) && validated == false) {
+        return SW_SECURITY_STATUS_NOT_SATISFIED();
+    }
+    return 0;
+}
+
+static cmd_table_t cmd_table = { .cmds = cmds, .check = oath_check };
+
 int oath_process_apdu() {
     if (CLA(apdu) != 0x00) {
         return SW_CLA_NOT_SUPPORTED();
     }
     if (cap_supported(CAP_OATH)) {
-        for (const cmd_t *cmd = cmds; cmd->ins != 0x00; cmd++) {
-            if (cmd->ins == INS(apdu)) {
-                int r = cmd->cmd_handler();
-                return r;
-            }
-        }
+        return apdu_dispatch(&cmd_table);
     }
     return SW_INS_NOT_SUPPORTED();
 }
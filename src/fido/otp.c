@@ -109,6 +109,10 @@ static const size_t otp_config_size = sizeof(otp_config_t);
 uint16_t otp_status();
 
 int otp_process_apdu();
+#ifndef ENABLE_EMULATION
+void otp_precomp_invalidate();
+void otp_idle_task();
+#endif
 int otp_unload();
 
 #ifndef ENABLE_EMULATION
@@ -175,113 +179,122 @@ void init_otp() {
         }
         scanned = true;
         low_flash_available();
+#ifndef ENABLE_EMULATION
+        otp_precomp_invalidate();
+#endif
     }
 }
-extern int calculate_oath(uint8_t truncate,
-                          const uint8_t *key,
-                          size_t key_len,
-                          const uint8_t *chal,
-                          size_t chal_len);
+static const uint16_t crc_tab[256] = {
+    0x0000, 0x1189, 0x2312, 0x329B, 0x4624, 0x57AD, 0x6536, 0x74BF,
+    0x8C48, 0x9DC1, 0xAF5A, 0xBED3, 0xCA6C, 0xDBE5, 0xE97E, 0xF8F7,
+    0x1081, 0x0108, 0x3393, 0x221A, 0x56A5, 0x472C, 0x75B7, 0x643E,
+    0x9CC9, 0x8D40, 0xBFDB, 0xAE52, 0xDAED, 0xCB64, 0xF9FF, 0xE876,
+    0x2102, 0x308B, 0x0210, 0x1399, 0x6726, 0x76AF, 0x4434, 0x55BD,
+    0xAD4A, 0xBCC3, 0x8E58, 0x9FD1, 0xEB6E, 0xFAE7, 0xC87C, 0xD9F5,
+    0x3183, 0x200A, 0x1291, 0x0318, 0x77A7, 0x662E, 0x54B5, 0x453C,
+    0xBDCB, 0xAC42, 0x9ED9, 0x8F50, 0xFBEF, 0xEA66, 0xD8FD, 0xC974,
+    0x4204, 0x538D, 0x6116, 0x709F, 0x0420, 0x15A9, 0x2732, 0x36BB,
+    0xCE4C, 0xDFC5, 0xED5E, 0xFCD7, 0x8868, 0x99E1, 0xAB7A, 0xBAF3,
+    0x5285, 0x430C, 0x7197, 0x601E, 0x14A1, 0x0528, 0x37B3, 0x263A,
+    0xDECD, 0xCF44, 0xFDDF, 0xEC56, 0x98E9, 0x8960, 0xBBFB, 0xAA72,
+    0x6306, 0x728F, 0x4014, 0x519D, 0x2522, 0x34AB, 0x0630, 0x17B9,
+    0xEF4E, 0xFEC7, 0xCC5C, 0xDDD5, 0xA96A, 0xB8E3, 0x8A78, 0x9BF1,
+    0x7387, 0x620E, 0x5095, 0x411C, 0x35A3, 0x242A, 0x16B1, 0x0738,
+    0xFFCF, 0xEE46, 0xDCDD, 0xCD54, 0xB9EB, 0xA862, 0x9AF9, 0x8B70,
+    0x8408, 0x9581, 0xA71A, 0xB693, 0xC22C, 0xD3A5, 0xE13E, 0xF0B7,
+    0x0840, 0x19C9, 0x2B52, 0x3ADB, 0x4E64, 0x5FED, 0x6D76, 0x7CFF,
+    0x9489, 0x8500, 0xB79B, 0xA612, 0xD2AD, 0xC324, 0xF1BF, 0xE036,
+    0x18C1, 0x0948, 0x3BD3, 0x2A5A, 0x5EE5, 0x4F6C, 0x7DF7, 0x6C7E,
+    0xA50A, 0xB483, 0x8618, 0x9791, 0xE32E, 0xF2A7, 0xC03C, 0xD1B5,
+    0x2942, 0x38CB, 0x0A50, 0x1BD9, 0x6F66, 0x7EEF, 0x4C74, 0x5DFD,
+    0xB58B, 0xA402, 0x9699, 0x8710, 0xF3AF, 0xE226, 0xD0BD, 0xC134,
+    0x39C3, 0x284A, 0x1AD1, 0x0B58, 0x7FE7, 0x6E6E, 0x5CF5, 0x4D7C,
+    0xC60C, 0xD785, 0xE51E, 0xF497, 0x8028, 0x91A1, 0xA33A, 0xB2B3,
+    0x4A44, 0x5BCD, 0x6956, 0x78DF, 0x0C60, 0x1DE9, 0x2F72, 0x3EFB,
+    0xD68D, 0xC704, 0xF59F, 0xE416, 0x90A9, 0x8120, 0xB3BB, 0xA232,
+    0x5AC5, 0x4B4C, 0x79D7, 0x685E, 0x1CE1, 0x0D68, 0x3FF3, 0x2E7A,
+    0xE70E, 0xF687, 0xC41C, 0xD595, 0xA12A, 0xB0A3, 0x8238, 0x93B1,
+    0x6B46, 0x7ACF, 0x4854, 0x59DD, 0x2D62, 0x3CEB, 0x0E70, 0x1FF9,
+    0xF78F, 0xE606, 0xD49D, 0xC514, 0xB1AB, 0xA022, 0x92B9, 0x8330,
+    0x7BC7, 0x6A4E, 0x58D5, 0x495C, 0x3DE3, 0x2C6A, 0x1EF1, 0x0F78
+};
 
 uint16_t calculate_crc(const uint8_t *data, size_t data_len) {
     uint16_t crc = 0xFFFF;
     for (size_t idx = 0; idx < data_len; idx++) {
-        crc ^= data[idx];
-        for (uint8_t i = 0; i < 8; i++) {
-            uint16_t j = crc & 0x1;
-            crc >>= 1;
-            if (j == 1) {
-                crc ^= 0x8408;
-            }
-        }
+        crc = (crc >> 8) ^ crc_tab[(crc ^ data[idx]) & 0xff];
     }
-    return crc & 0xFFFF;
+    return crc;
 }
 
 #ifndef ENABLE_EMULATION
 static uint8_t session_counter[2] = { 0 };
-#endif
-int otp_button_pressed(uint8_t slot) {
-    init_otp();
-    if (!cap_supported(CAP_OTP)) {
-        return 3;
+
+typedef struct otp_precomp {
+    uint8_t out[44];
+    uint8_t out_len;
+    uint16_t counter;
+    uint64_t imf;
+    uint32_t ts;
+    uint8_t seq;
+    bool valid;
+} otp_precomp_t;
+
+// Next token of each slot, computed while idle and consumed on button press
+static otp_precomp_t otp_precomp[2] = { 0 };
+static volatile uint8_t otp_precomp_seq = 0;
+
+static uint64_t get_otp_imf(const otp_config_t *otp_config, const uint8_t *p) {
+    uint64_t imf = 0;
+    for (int i = 0; i < 8; i++) {
+        imf = (imf << 8) | *p++;
     }
-#ifndef ENABLE_EMULATION
+    if (imf == 0) {
+        imf = ((otp_config->uid[4] << 8) | otp_config->uid[5]) << 4;
+    }
+    return imf;
+}
+
+int otp_precompute(uint8_t slot) {
+    otp_precomp_t *pc = &otp_precomp[slot - 1];
+    uint8_t seq = otp_precomp_seq;
     file_t *ef = search_dynamic_file(slot == 1 ? EF_OTP_SLOT1 : EF_OTP_SLOT2);
     const uint8_t *data = file_get_data(ef);
-    otp_config_t *otp_config = (otp_config_t *) data;
-    if (file_has_data(ef) == false) {
+    const otp_config_t *otp_config = (const otp_config_t *) data;
+    pc->valid = false;
+    pc->out_len = 0;
+    if (!file_has_data(ef) || (otp_config->cfg_flags & CHAL_YUBICO && otp_config->tkt_flags & CHAL_RESP)) {
+        pc->seq = seq;
+        pc->valid = (seq == otp_precomp_seq);
         return 1;
     }
-    if (otp_config->cfg_flags & CHAL_YUBICO && otp_config->tkt_flags & CHAL_RESP) {
-        return 2;
-    }
     if (otp_config->tkt_flags & OATH_HOTP) {
-        uint8_t tmp_key[KEY_SIZE + 2];
-        tmp_key[0] = 0x01;
-        memcpy(tmp_key + 2, otp_config->aes_key, KEY_SIZE);
-        uint64_t imf = 0;
-        const uint8_t *p = data + otp_config_size;
-        imf |= (uint64_t) *p++ << 56;
-        imf |= (uint64_t) *p++ << 48;
-        imf |= (uint64_t) *p++ << 40;
-        imf |= (uint64_t) *p++ << 32;
-        imf |= *p++ << 24;
-        imf |= *p++ << 16;
-        imf |= *p++ << 8;
-        imf |= *p++;
-        if (imf == 0) {
-            imf = ((otp_config->uid[4] << 8) | otp_config->uid[5]) << 4;
-        }
+        uint64_t imf = get_otp_imf(otp_config, data + otp_config_size);
         uint8_t chal[8] =
         { imf >> 56, imf >> 48, imf >> 40, imf >> 32, imf >> 24, imf >> 16, imf >> 8, imf & 0xff };
-        res_APDU_size = 0;
-        int ret = calculate_oath(1, tmp_key, sizeof(tmp_key), chal, sizeof(chal));
-        if (ret == CCID_OK) {
-            uint32_t base = otp_config->cfg_flags & OATH_HOTP8 ? 1e8 : 1e6;
-            uint32_t number =
-                (res_APDU[2] << 24) | (res_APDU[3] << 16) | (res_APDU[4] << 8) | res_APDU[5];
-            number %= base;
-            char number_str[9];
-            if (otp_config->cfg_flags & OATH_HOTP8) {
-                sprintf(number_str, "%08lu", (long unsigned int) number);
-                add_keyboard_buffer((const uint8_t *) number_str, 8, true);
-            }
-            else {
-                sprintf(number_str, "%06lu", (long unsigned int) number);
-                add_keyboard_buffer((const uint8_t *) number_str, 6, true);
-            }
-            imf++;
-            uint8_t new_chal[8] =
-            { imf >> 56, imf >> 48, imf >> 40, imf >> 32, imf >> 24, imf >> 16, imf >> 8,
-              imf & 0xff };
-            uint8_t new_otp_config[otp_config_size + sizeof(new_chal)];
-            memcpy(new_otp_config, otp_config, otp_config_size);
-            memcpy(new_otp_config + otp_config_size, new_chal, sizeof(new_chal));
-            flash_write_data_to_file(ef, new_otp_config, sizeof(new_otp_config));
-            low_flash_available();
-        }
-        if (otp_config->tkt_flags & APPEND_CR) {
-            append_keyboard_buffer((const uint8_t *) "\r", 1);
+        uint8_t hmac[20];
+        if (mbedtls_md_hmac(mbedtls_md_info_from_type(MBEDTLS_MD_SHA1), otp_config->aes_key, KEY_SIZE, chal, sizeof(chal), hmac) != 0) {
+            return 2;
         }
-    }
-    else if (otp_config->cfg_flags & SHORT_TICKET || otp_config->cfg_flags & STATIC_TICKET) {
-        uint8_t fixed_size = FIXED_SIZE + UID_SIZE + KEY_SIZE;
-        if (otp_config->cfg_flags & SHORT_TICKET) { // Not clear which is the purpose of SHORT_TICKET
-            //fixed_size /= 2;
+        uint8_t offset = hmac[sizeof(hmac) - 1] & 0x0f;
+        uint32_t number = ((hmac[offset] & 0x7f) << 24) | (hmac[offset + 1] << 16) | (hmac[offset + 2] << 8) | hmac[offset + 3];
+        char number_str[9];
+        if (otp_config->cfg_flags & OATH_HOTP8) {
+            sprintf(number_str, "%08lu", (long unsigned int) (number % 100000000));
+            pc->out_len = 8;
         }
-        add_keyboard_buffer(otp_config->fixed_data, fixed_size, false);
-        if (otp_config->tkt_flags & APPEND_CR) {
-            append_keyboard_buffer((const uint8_t *) "\x28", 1);
+        else {
+            sprintf(number_str, "%06lu", (long unsigned int) (number % 1000000));
+            pc->out_len = 6;
         }
+        memcpy(pc->out, number_str, pc->out_len);
+        pc->imf = imf;
     }
-    else {
+    else if (!(otp_config->cfg_flags & SHORT_TICKET || otp_config->cfg_flags & STATIC_TICKET)) {
         uint8_t otpk[22], *po = otpk;
-        bool update_counter = false;
         uint16_t counter = (data[otp_config_size] << 8) | data[otp_config_size + 1], crc = 0;
-        uint32_t ts = board_millis() / 1000;
+        uint32_t ts = (board_millis() / 1000) >> 3;
         if (counter == 0) {
-            update_counter = true;
             counter = 1;
         }
         memcpy(po, otp_config->fixed_data, 6);
@@ -290,7 +303,6 @@ int otp_button_pressed(uint8_t slot) {
         po += UID_SIZE;
         *po++ = counter & 0xff;
         *po++ = counter >> 8;
-        ts >>= 3;
         *po++ = ts & 0xff;
         *po++ = ts >> 8;
         *po++ = ts >> 16;
@@ -305,9 +317,89 @@ int otp_button_pressed(uint8_t slot) {
         mbedtls_aes_setkey_enc(&ctx, otp_config->aes_key, 128);
         mbedtls_aes_crypt_ecb(&ctx, MBEDTLS_AES_ENCRYPT, otpk + 6, otpk + 6);
         mbedtls_aes_free(&ctx);
-        uint8_t otp_out[44];
-        encode_modhex(otpk, sizeof(otpk), otp_out);
-        add_keyboard_buffer((const uint8_t *) otp_out, sizeof(otp_out), true);
+        encode_modhex(otpk, sizeof(otpk), pc->out);
+        pc->out_len = sizeof(pc->out);
+        pc->counter = counter;
+        pc->ts = ts;
+    }
+    pc->seq = seq;
+    pc->valid = (seq == otp_precomp_seq);
+    return 0;
+}
+
+void otp_precomp_invalidate() {
+    otp_precomp_seq++;
+    otp_precomp[0].valid = otp_precomp[1].valid = false;
+}
+
+void otp_idle_task() {
+    if (scanned == false || !cap_supported(CAP_OTP)) {
+        return;
+    }
+    for (uint8_t slot = 1; slot <= 2; slot++) {
+        otp_precomp_t *pc = &otp_precomp[slot - 1];
+        if (pc->valid == false || pc->seq != otp_precomp_seq) {
+            otp_precompute(slot);
+        }
+        else if (pc->out_len == sizeof(pc->out) && pc->ts != (board_millis() / 1000) >> 3) {
+            otp_precompute(slot); // Refresh the timestamp of Yubico OTP
+        }
+    }
+}
+#endif
+
+int otp_button_pressed(uint8_t slot) {
+    init_otp();
+    if (!cap_supported(CAP_OTP)) {
+        return 3;
+    }
+#ifndef ENABLE_EMULATION
+    file_t *ef = search_dynamic_file(slot == 1 ? EF_OTP_SLOT1 : EF_OTP_SLOT2);
+    const uint8_t *data = file_get_data(ef);
+    otp_config_t *otp_config = (otp_config_t *) data;
+    if (file_has_data(ef) == false) {
+        return 1;
+    }
+    if (otp_config->cfg_flags & CHAL_YUBICO && otp_config->tkt_flags & CHAL_RESP) {
+        return 2;
+    }
+    otp_precomp_t *pc = &otp_precomp[slot - 1];
+    if (pc->valid == false || pc->seq != otp_precomp_seq) {
+        otp_precompute(slot);
+    }
+    if (otp_config->tkt_flags & OATH_HOTP) {
+        if (pc->out_len == 0) { // HMAC failed while precomputing, type nothing
+            pc->valid = false;
+            return 4;
+        }
+        add_keyboard_buffer(pc->out, pc->out_len, true);
+        uint64_t imf = pc->imf + 1;
+        uint8_t new_chal[8] =
+        { imf >> 56, imf >> 48, imf >> 40, imf >> 32, imf >> 24, imf >> 16, imf >> 8,
+          imf & 0xff };
+        uint8_t new_otp_config[otp_config_size + sizeof(new_chal)];
+        memcpy(new_otp_config, otp_config, otp_config_size);
+        memcpy(new_otp_config + otp_config_size, new_chal, sizeof(new_chal));
+        flash_write_data_to_file(ef, new_otp_config, sizeof(new_otp_config));
+        low_flash_available();
+        if (otp_config->tkt_flags & APPEND_CR) {
+            append_keyboard_buffer((const uint8_t *) "\r", 1);
+        }
+    }
+    else if (otp_config->cfg_flags & SHORT_TICKET || otp_config->cfg_flags & STATIC_TICKET) {
+        uint8_t fixed_size = FIXED_SIZE + UID_SIZE + KEY_SIZE;
+        if (otp_config->cfg_flags & SHORT_TICKET) { // Not clear which is the purpose of SHORT_TICKET
+            //fixed_size /= 2;
+        }
+        add_keyboard_buffer(otp_config->fixed_data, fixed_size, false);
+        if (otp_config->tkt_flags & APPEND_CR) {
+            append_keyboard_buffer((const uint8_t *) "\x28", 1);
+        }
+    }
+    else {
+        uint16_t counter = pc->counter;
+        bool update_counter = (data[otp_config_size] == 0 && data[otp_config_size + 1] == 0);
+        add_keyboard_buffer(pc->out, pc->out_len, true);
         if (otp_config->tkt_flags & APPEND_CR) {
             append_keyboard_buffer((const uint8_t *) "\r", 1);
         }
@@ -326,6 +418,7 @@ int otp_button_pressed(uint8_t slot) {
             low_flash_available();
         }
     }
+    pc->valid = false;
 #endif
     return 0;
 }
@@ -334,6 +427,7 @@ void __attribute__((constructor)) otp_ctor() {
     register_app(otp_select, otp_aid);
     button_pressed_cb = otp_button_pressed;
 #ifndef ENABLE_EMULATION
+    idle_task_cb = otp_idle_task;
     hid_set_report_cb = otp_hid_set_report_cb;
     hid_get_report_cb = otp_hid_get_report_cb;
 #endif
@@ -367,7 +461,7 @@ bool check_crc(const otp_config_t *data) {
     return crc == 0xF0B8;
 }
 
-int cmd_otp() {
+static int otp_exec() {
     uint8_t p1 = P1(apdu), p2 = P2(apdu);
     if (p2 != 0x00) {
         return SW_INCORRECT_P1P2();
@@ -495,24 +589,32 @@ int cmd_otp() {
     return SW_OK();
 }
 
+int cmd_otp() {
+    int ret = otp_exec();
+#ifndef ENABLE_EMULATION
+    // Only once the slots are written: a token precomputed meanwhile from the old data is dropped
+    uint8_t p1 = P1(apdu);
+    if (p1 == 0x01 || p1 == 0x03 || p1 == 0x04 || p1 == 0x05 || p1 == 0x06) {
+        otp_precomp_invalidate();
+    }
+#endif
+    return ret;
+}
+
 #define INS_OTP             0x01
 
 static const cmd_t cmds[] = {
-    { INS_OTP, cmd_otp },
+    { INS_OTP, cmd_otp, CMD_FLASH, 0 },
     { 0x00, 0x0 }
 };
+static cmd_table_t cmd_table = { .cmds = cmds };
 
 int otp_process_apdu() {
     if (CLA(apdu) != 0x00) {
         return SW_CLA_NOT_SUPPORTED();
     }
     if (cap_supported(CAP_OTP)) {
-        for (const cmd_t *cmd = cmds; cmd->ins != 0x00; cmd++) {
-            if (cmd->ins == INS(apdu)) {
-                int r = cmd->cmd_handler();
-                return r;
-            }
-        }
+        return apdu_dispatch(&cmd_table);
     }
     return SW_INS_NOT_SUPPORTED();
 }
@@ -0,0 +1,210 @@
+/*
+ * This file is part of the Pico FIDO distribution (https://github.com/polhenarejos/pico-fido).
+ * Copyright (c) 2022 Pol Henarejos.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, version 3.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Conformance and benchmark of the crypto backend. It is built with PICO_KEYS_CRYPTO_REFERENCE,
+ * so mbedTLS keeps its own block functions, and every backend function is checked against them
+ * on known answers and random states and blocks, then both are timed.
+ *
+ * Usage: crypto_bench [-n rounds]. It returns non zero if any check fails.
+ */
+
+#include <stdio.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#endif
+
+#include "mbedtls/sha256.h"
+#include "mbedtls/sha512.h"
+#include "crypto_backend.h"
+
+static uint64_t bench_cycles() {
+#if defined(__x86_64__) || defined(__i386__)
+    return __rdtsc();
+#else
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+#endif
+}
+
+static uint64_t prng_state = 0x9E3779B97F4A7C15ULL;
+
+static uint64_t prng() {
+    prng_state ^= prng_state << 13;
+    prng_state ^= prng_state >> 7;
+    prng_state ^= prng_state << 17;
+    return prng_state;
+}
+
+static void prng_fill(uint8_t *buf, size_t len) {
+    for (size_t i = 0; i < len; i++) {
+        buf[i] = (uint8_t) prng();
+    }
+}
+
+static int failures = 0;
+
+static void check(const char *name, bool ok) {
+    if (!ok) {
+        fprintf(stderr, "FAIL %s\n", name);
+        failures++;
+    }
+}
+
+/* Reference block functions, reached through the public contexts */
+static void ref_sha256_blocks(uint32_t state[8], const uint8_t *data, size_t blocks) {
+    mbedtls_sha256_context ctx;
+    mbedtls_sha256_init(&ctx);
+    memcpy(ctx.MBEDTLS_PRIVATE(state), state, 32);
+    for (; blocks > 0; blocks--, data += 64) {
+        mbedtls_internal_sha256_process(&ctx, data);
+    }
+    memcpy(state, ctx.MBEDTLS_PRIVATE(state), 32);
+    mbedtls_sha256_free(&ctx);
+}
+
+static void ref_sha512_blocks(uint64_t state[8], const uint8_t *data, size_t blocks) {
+    mbedtls_sha512_context ctx;
+    mbedtls_sha512_init(&ctx);
+    memcpy(ctx.MBEDTLS_PRIVATE(state), state, 64);
+    for (; blocks > 0; blocks--, data += 128) {
+        mbedtls_internal_sha512_process(&ctx, data);
+    }
+    memcpy(state, ctx.MBEDTLS_PRIVATE(state), 64);
+    mbedtls_sha512_free(&ctx);
+}
+
+static void conformance(int rounds) {
+    // FIPS 180-2 "abc", as a single padded block
+    static const uint32_t iv256[8] = {
+        0x6A09E667, 0xBB67AE85, 0x3C6EF372, 0xA54FF53A,
+        0x510E527F, 0x9B05688C, 0x1F83D9AB, 0x5BE0CD19
+    };
+    static const uint32_t abc256[8] = {
+        0xBA7816BF, 0x8F01CFEA, 0x414140DE, 0x5DAE2223,
+        0xB00361A3, 0x96177A9C, 0xB410FF61, 0xF20015AD
+    };
+    static const uint64_t iv512[8] = {
+        0x6A09E667F3BCC908ULL, 0xBB67AE8584CAA73BULL, 0x3C6EF372FE94F82BULL, 0xA54FF53A5F1D36F1ULL,
+        0x510E527FADE682D1ULL, 0x9B05688C2B3E6C1FULL, 0x1F83D9ABFB41BD6BULL, 0x5BE0CD19137E2179ULL
+    };
+    static const uint64_t abc512[8] = {
+        0xDDAF35A193617ABAULL, 0xCC417349AE204131ULL, 0x12E6FA4E89A97EA2ULL, 0x0A9EEEE64B55D39AULL,
+        0x2192992A274FC1A8ULL, 0x36BA3C23A3FEEBBDULL, 0x454D4423643CE80EULL, 0x2A9AC94FA54CA49FULL
+    };
+    uint8_t block[128] = { 'a', 'b', 'c', 0x80 };
+    uint32_t s256[8];
+    memcpy(s256, iv256, sizeof(s256));
+    block[63] = 24;
+    crypto_sha256_blocks(s256, block, 1);
+    check("sha256 abc", memcmp(s256, abc256, sizeof(s256)) == 0);
+    uint64_t s512[8];
+    memcpy(s512, iv512, sizeof(s512));
+    block[63] = 0;
+    block[127] = 24;
+    crypto_sha512_blocks(s512, block, 1);
+    check("sha512 abc", memcmp(s512, abc512, sizeof(s512)) == 0);
+
+    uint8_t data[128 * 4];
+    for (int r = 0; r < rounds; r++) {
+        size_t blocks = 1 + prng() % 4;
+        uint32_t a256[8], b256[8];
+        uint64_t a512[8], b512[8];
+        prng_fill(data, sizeof(data));
+        prng_fill((uint8_t *) a256, sizeof(a256));
+        prng_fill((uint8_t *) a512, sizeof(a512));
+        memcpy(b256, a256, sizeof(a256));
+        memcpy(b512, a512, sizeof(a512));
+        crypto_sha256_blocks(a256, data, blocks);
+        ref_sha256_blocks(b256, data, blocks);
+        check("sha256 random", memcmp(a256, b256, sizeof(a256)) == 0);
+        crypto_sha512_blocks(a512, data, blocks);
+        ref_sha512_blocks(b512, data, blocks);
+        check("sha512 random", memcmp(a512, b512, sizeof(a512)) == 0);
+    }
+}
+
+typedef void (*blocks_fn)(void *state, const uint8_t *data, size_t blocks);
+
+static void backend_sha256(void *state, const uint8_t *data, size_t blocks) {
+    crypto_sha256_blocks((uint32_t *) state, data, blocks);
+}
+
+static void reference_sha256(void *state, const uint8_t *data, size_t blocks) {
+    ref_sha256_blocks((uint32_t *) state, data, blocks);
+}
+
+static void backend_sha512(void *state, const uint8_t *data, size_t blocks) {
+    crypto_sha512_blocks((uint64_t *) state, data, blocks);
+}
+
+static void reference_sha512(void *state, const uint8_t *data, size_t blocks) {
+    ref_sha512_blocks((uint64_t *) state, data, blocks);
+}
+
+static void bench(const char *name, blocks_fn backend, blocks_fn reference, size_t block_size) {
+#if defined(__x86_64__) || defined(__i386__)
+    const char *unit = "cycles";
+#else
+    const char *unit = "ns";
+#endif
+    static uint8_t data[128 * 64];
+    uint64_t state[8] = { 0 };
+    size_t blocks = sizeof(data) / block_size;
+    uint64_t best[2] = { UINT64_MAX, UINT64_MAX };
+    prng_fill(data, sizeof(data));
+    for (int r = 0; r < 200; r++) {
+        uint64_t start = bench_cycles();
+        backend(state, data, blocks);
+        uint64_t mid = bench_cycles();
+        reference(state, data, blocks);
+        uint64_t end = bench_cycles();
+        best[0] = mid - start < best[0] ? mid - start : best[0];
+        best[1] = end - mid < best[1] ? end - mid : best[1];
+    }
+    // The block functions are always the in-tree ones, whatever backend the build selected
+    printf("%-8s %-8s %10.1f %s/block\n", name, "pico", (double) best[0] / blocks, unit);
+    printf("%-8s %-8s %10.1f %s/block\n", name, "mbedtls", (double) best[1] / blocks, unit);
+}
+
+int main(int argc, char **argv) {
+    int rounds = 10000, opt;
+    while ((opt = getopt(argc, argv, "n:")) != -1) {
+        if (opt == 'n') {
+            rounds = atoi(optarg);
+        }
+        else {
+            fprintf(stderr, "Usage: %s [-n rounds]\n", argv[0]);
+            return 1;
+        }
+    }
+    conformance(rounds);
+    bench("sha256", backend_sha256, reference_sha256, 64);
+    bench("sha512", backend_sha512, reference_sha512, 128);
+    if (failures > 0) {
+        fprintf(stderr, "%d checks failed\n", failures);
+        return 1;
+    }
+    printf("All checks passed\n");
+    return 0;
+}
@@ -23,10 +23,12 @@ import socket
 from typing import Set
 
 import logging
+import os
 import sys
 
 HOST = '127.0.0.1'
 PORT = 35962
+SOCKET_PATH = os.environ.get('PICO_KEYS_EMUL_SOCKET')
 
 # Don't typecheck this file on Windows
 assert sys.platform != "win32"  # nosec
@@ -37,7 +39,7 @@ class EmulationCtapHidConnection(CtapHidConnection):
     def __init__(self, descriptor):
         self.descriptor = descriptor
         self.handle = descriptor.path
-        self.handle.connect((HOST, PORT))
+        self.handle.connect(SOCKET_PATH if SOCKET_PATH else (HOST, PORT))
 
     def write_packet(self, packet):
         if (self.handle.send(len(packet).to_bytes(2, 'big')) != 2):
@@ -66,7 +68,7 @@ def open_connection(descriptor):
 def get_descriptor(_):
     HOST = 'localhost'    # The remote host
     PORT = 35962              # The same port as used by the server
-    s = socket.socket(socket.AF_INET, socket.SOCK_STREAM)
+    s = socket.socket(socket.AF_UNIX if SOCKET_PATH else socket.AF_INET, socket.SOCK_STREAM)
     return HidDescriptor(s, 0x00, 0x00, 64, 64, "Pico-Fido", "AAAAAA")
 
 def list_descriptors():
@@ -0,0 +1,380 @@
+/*
+ * This file is part of the Pico FIDO distribution (https://github.com/polhenarejos/pico-fido).
+ * Copyright (c) 2022 Pol Henarejos.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, version 3.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * In-process harness. It links the whole firmware against the emulated flash and RNG and
+ * feeds requests straight into the dispatchers, without USB nor sockets.
+ *
+ * An input is a sequence of records: | target (1) | len (2, big endian) | payload (len) |
+ *  - HARNESS_CTAP:    payload is the CTAP2 command byte followed by its CBOR parameters.
+ *  - HARNESS_APDU:    payload is a command APDU, processed by the selected applet.
+ *  - HARNESS_CTAPHID: payload is a sequence of 64 bytes HID reports.
+ *  - HARNESS_EXPECT:  payload is the status expected from the previous CTAP or APDU record, 1 or
+ *                     2 bytes big endian. A mismatch fails the run, except under libFuzzer.
+ *
+ * Built with ENABLE_HARNESS_FUZZER it is a libFuzzer target. Otherwise it runs the records
+ * of the given files -n times, restoring the flash before each run, and reports cycles and
+ * allocations per command. Without files it runs stdin once, which suits AFL.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#endif
+
+#include "pico_keys.h"
+#include "apdu.h"
+#include "usb.h"
+#include "ctap_hid.h"
+#include "crypto_utils.h"
+
+#define HARNESS_CTAP        0x00
+#define HARNESS_APDU        0x01
+#define HARNESS_CTAPHID     0x02
+#define HARNESS_EXPECT      0x03
+
+#define HARNESS_FLASH_SIZE  (8 * 1024 * 1024) // Same as the emulated flash
+#define HARNESS_MAX_STATS   64
+
+extern uint8_t *map;
+extern const uintptr_t start_asset_pool;
+extern void low_flash_init();
+extern void do_flash();
+extern void random_init();
+extern void init_fido();
+extern int driver_init_hid();
+extern int cbor_process(uint8_t last_cmd, const uint8_t *data, size_t len);
+extern int cbor_parse(uint8_t cmd, const uint8_t *data, size_t len);
+extern void tud_hid_report_complete_cb(uint8_t instance, uint8_t const *report, uint16_t len);
+extern const uint8_t *complete_report;
+extern uint16_t complete_len;
+extern uint16_t send_buffer_size[ITF_TOTAL];
+extern bool last_write_result[ITF_TOTAL];
+
+typedef struct harness_stat {
+    uint8_t target;
+    uint8_t code;
+    uint32_t count;
+    uint64_t total;
+    uint64_t min;
+    uint64_t max;
+    uint64_t allocs;
+    uint64_t alloc_bytes;
+} harness_stat_t;
+
+static harness_stat_t stats[HARNESS_MAX_STATS];
+static int num_stats = 0;
+static uint8_t *flash_snapshot = NULL;
+static size_t flash_snapshot_size = 0;
+static uint8_t cbor_buf[CTAP_MAX_PACKET_SIZE];
+
+#ifdef HARNESS_COUNT_ALLOCS
+static uint64_t alloc_count = 0, alloc_bytes = 0;
+
+extern void *__real_malloc(size_t size);
+extern void *__real_calloc(size_t nmemb, size_t size);
+extern void *__real_realloc(void *ptr, size_t size);
+
+void *__wrap_malloc(size_t size) {
+    alloc_count++;
+    alloc_bytes += size;
+    return __real_malloc(size);
+}
+
+void *__wrap_calloc(size_t nmemb, size_t size) {
+    alloc_count++;
+    alloc_bytes += nmemb * size;
+    return __real_calloc(nmemb, size);
+}
+
+void *__wrap_realloc(void *ptr, size_t size) {
+    alloc_count++;
+    alloc_bytes += size;
+    return __real_realloc(ptr, size);
+}
+#else
+static const uint64_t alloc_count = 0, alloc_bytes = 0;
+#endif
+
+static uint64_t harness_cycles() {
+#if defined(__x86_64__) || defined(__i386__)
+    return __rdtsc();
+#else
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+#endif
+}
+
+static void harness_init() {
+    char path[] = "/tmp/pico_fido_harness_XXXXXX";
+    bool temp_flash = getenv("PICO_KEYS_FLASH_FILE") == NULL;
+    if (temp_flash) {
+        int fd = mkstemp(path);
+        if (fd < 0) {
+            perror("mkstemp");
+            exit(1);
+        }
+        close(fd);
+        setenv("PICO_KEYS_FLASH_FILE", path, 1);
+    }
+    random_init();
+    low_flash_init();
+    if (temp_flash) {
+        unlink(path);
+    }
+    driver_init_hid();
+    init_fido();
+    do_flash();
+    // From the asset banks, below the journal, up to the end of flash
+    flash_snapshot_size = HARNESS_FLASH_SIZE - start_asset_pool;
+    flash_snapshot = (uint8_t *) malloc(flash_snapshot_size);
+    memcpy(flash_snapshot, map + start_asset_pool, flash_snapshot_size);
+}
+
+static void harness_reset() {
+    memcpy(map + start_asset_pool, flash_snapshot, flash_snapshot_size);
+    if (current_app && current_app->unload) {
+        current_app->unload();
+    }
+    current_app = NULL;
+    init_fido();
+    do_flash();
+}
+
+static void harness_run_apdu(const uint8_t *data, uint16_t len) {
+#ifdef USB_ITF_CCID
+    uint8_t itf = ITF_CCID;
+    uint16_t max_len = USB_CCID_BUFFER_SIZE;
+#else
+    uint8_t itf = ITF_HID;
+    uint16_t max_len = USB_BUFFER_SIZE;
+#endif
+    if (len < 4 || len > max_len) {
+        return;
+    }
+    // Applets may work in place, so the request is copied to the transport buffer like the drivers do
+    memcpy(usb_get_rx(itf), data, len);
+    if (apdu_process(itf, usb_get_rx(itf), len) > 0) {
+        process_apdu();
+    }
+    apdu_finish();
+    apdu_next();
+    arena_reset();
+}
+
+static void harness_run_ctap(const uint8_t *data, uint16_t len) {
+    if (len < 1 || len > sizeof(cbor_buf)) {
+        return;
+    }
+    // As CTAPHID_CBOR delivers it, the CTAP command byte stays in front of its parameters
+    memcpy(cbor_buf, data, len);
+    driver_init_hid();
+    cbor_process(CTAPHID_CBOR, cbor_buf, len);
+    apdu.sw = cbor_parse(CTAPHID_CBOR, cbor_buf, len);
+}
+
+static void harness_run_ctaphid(const uint8_t *data, uint16_t len) {
+    for (uint16_t off = 0; off + 64 <= len; off += 64) {
+        memcpy(usb_get_rx(ITF_HID), data + off, 64);
+        driver_process_usb_packet_emul(ITF_HID, 64);
+        // Responses longer than a report are drained as the USB stack would do
+        for (int r = 0; send_buffer_size[ITF_HID] > 0 && r < CTAP_MAX_PACKET_SIZE / 59 + 1; r++) {
+            last_write_result[ITF_HID] = true;
+            tud_hid_report_complete_cb(ITF_HID, complete_report, complete_len);
+        }
+        send_buffer_size[ITF_HID] = 0;
+    }
+}
+
+static harness_stat_t *harness_stat(uint8_t target, uint8_t code) {
+    for (int i = 0; i < num_stats; i++) {
+        if (stats[i].target == target && stats[i].code == code) {
+            return &stats[i];
+        }
+    }
+    if (num_stats < HARNESS_MAX_STATS) {
+        harness_stat_t *st = &stats[num_stats++];
+        memset(st, 0, sizeof(harness_stat_t));
+        st->target = target;
+        st->code = code;
+        st->min = UINT64_MAX;
+        return st;
+    }
+    return NULL;
+}
+
+// Returns the number of HARNESS_EXPECT records that did not match
+static int harness_input(const uint8_t *data, size_t size, bool measure) {
+    int failures = 0;
+    uint16_t last_sw = 0;
+    while (size >= 3) {
+        uint8_t target = data[0];
+        uint16_t len = (data[1] << 8) | data[2];
+        data += 3;
+        size -= 3;
+        if (len > size) {
+            len = size;
+        }
+        if (target == HARNESS_EXPECT) {
+            uint16_t sw = len == 1 ? data[0] : len == 2 ? (data[0] << 8) | data[1] : 0xFFFF;
+            if (sw != last_sw) {
+                fprintf(stderr, "Expected status %04X, got %04X\n", sw, last_sw);
+                failures++;
+            }
+            data += len;
+            size -= len;
+            continue;
+        }
+        uint8_t code = 0;
+        if (target == HARNESS_CTAP && len > 0) {
+            code = data[0];
+        }
+        else if (target == HARNESS_APDU && len > 1) {
+            code = data[1];
+        }
+        else if (target == HARNESS_CTAPHID && len > 4) {
+            code = data[4];
+        }
+        uint64_t allocs = alloc_count, bytes = alloc_bytes, start = harness_cycles();
+        if (target == HARNESS_CTAP) {
+            harness_run_ctap(data, len);
+            last_sw = apdu.sw;
+        }
+        else if (target == HARNESS_APDU) {
+            harness_run_apdu(data, len);
+            last_sw = apdu.sw;
+        }
+        else if (target == HARNESS_CTAPHID) {
+            harness_run_ctaphid(data, len);
+        }
+        uint64_t elapsed = harness_cycles() - start;
+        harness_stat_t *st = measure ? harness_stat(target, code) : NULL;
+        if (st) {
+            st->count++;
+            st->total += elapsed;
+            st->min = MIN(st->min, elapsed);
+            st->max = MAX(st->max, elapsed);
+            st->allocs += alloc_count - allocs;
+            st->alloc_bytes += alloc_bytes - bytes;
+        }
+        do_flash();
+        ecdsa_precompute_task(); // As the main loop does while idle
+        data += len;
+        size -= len;
+    }
+    return failures;
+}
+
+#ifdef HARNESS_LIBFUZZER
+
+int LLVMFuzzerInitialize(int *argc, char ***argv) {
+    if (freopen("/dev/null", "w", stdout) == NULL) {
+        perror("freopen");
+    }
+    harness_init();
+    return 0;
+}
+
+int LLVMFuzzerTestOneInput(const uint8_t *data, size_t size) {
+    harness_reset();
+    harness_input(data, size, false);
+    return 0;
+}
+
+#else
+
+static uint8_t *harness_load(FILE *f, uint8_t *buf, size_t *size) {
+    uint8_t chunk[4096];
+    size_t r;
+    while ((r = fread(chunk, 1, sizeof(chunk), f)) > 0) {
+        buf = (uint8_t *) realloc(buf, *size + r);
+        memcpy(buf + *size, chunk, r);
+        *size += r;
+    }
+    return buf;
+}
+
+int main(int argc, char **argv) {
+    int iterations = 1, opt;
+    bool verbose = false;
+    while ((opt = getopt(argc, argv, "n:v")) != -1) {
+        if (opt == 'n') {
+            iterations = atoi(optarg);
+        }
+        else if (opt == 'v') {
+            verbose = true;
+        }
+        else {
+            fprintf(stderr, "Usage: %s [-n iterations] [-v] [file ...]\n", argv[0]);
+            return 1;
+        }
+    }
+    if (!verbose && freopen("/dev/null", "w", stdout) == NULL) {
+        perror("freopen");
+    }
+    harness_init();
+
+    uint8_t *input = NULL;
+    size_t size = 0;
+    int failures = 0;
+    if (optind == argc) {
+        input = harness_load(stdin, input, &size);
+        failures = harness_input(input, size, false);
+        free(input);
+        return failures > 0 ? 1 : 0;
+    }
+    for (int i = optind; i < argc; i++) {
+        FILE *f = fopen(argv[i], "rb");
+        if (!f) {
+            perror(argv[i]);
+            return 1;
+        }
+        input = harness_load(f, input, &size);
+        fclose(f);
+    }
+    for (int i = 0; i < iterations; i++) {
+        harness_reset();
+        failures += harness_input(input, size, true);
+    }
+    free(input);
+
+    const char *targets[] = { "CTAP", "APDU", "CTAPHID" };
+#if defined(__x86_64__) || defined(__i386__)
+    const char *unit = "cycles";
+#else
+    const char *unit = "ns";
+#endif
+    fprintf(stderr, "%-12s %8s %12s %12s %12s %8s %10s (%s)\n", "Command", "Count", "Avg", "Min", "Max",
+            "Allocs", "Bytes", unit);
+    for (int i = 0; i < num_stats; i++) {
+        const harness_stat_t *st = &stats[i];
+        fprintf(stderr, "%-7s 0x%02X %8u %12llu %12llu %12llu %8llu %10llu\n",
+                st->target < sizeof(targets) / sizeof(targets[0]) ? targets[st->target] : "?",
+                st->code, st->count,
+                (unsigned long long) (st->total / st->count), (unsigned long long) st->min,
+                (unsigned long long) st->max, (unsigned long long) (st->allocs / st->count),
+                (unsigned long long) (st->alloc_bytes / st->count));
+    }
+    return failures > 0 ? 1 : 0;
+}
+
+#endif
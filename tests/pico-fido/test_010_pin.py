@@ -19,11 +19,13 @@
 
 
 import os
+import time
 import pytest
 from fido2.ctap import CtapError
 from fido2.client import ClientPin
 from fido2.webauthn import UserVerificationRequirement
 from fido2.utils import hmac_sha256
+from fido2.ctap2 import CredentialManagement
 
 from utils import *
 
@@ -259,3 +261,57 @@ def test_pin_attempts(device, client_pin):
 
     res = client_pin.get_pin_retries()
     assert res[0] == (8)
+
+def MCWithToken(device, token, rp=Ellipsis):
+    cdh = os.urandom(32)
+    return device.MC(client_data_hash=cdh, rp=rp, pin_uv_param=hmac_sha256(token, cdh)[:32], pin_uv_protocol=2)
+
+def MetadataWithToken(device, client_pin, token):
+    return CredentialManagement(device.client()._backend.ctap2, client_pin.protocol, token).get_metadata()
+
+def test_token_sessions_permissions(device, client_pin):
+    device.reset()
+    pin = "TestPin"
+    client_pin.set_pin(pin)
+
+    mc_token = client_pin.get_pin_token(pin, permissions=ClientPin.PERMISSION.MAKE_CREDENTIAL)
+    cm_token = client_pin.get_pin_token(pin, permissions=ClientPin.PERMISSION.CREDENTIAL_MGMT)
+
+    # Each session keeps its own permissions
+    with pytest.raises(CtapError) as e:
+        MCWithToken(device, cm_token)
+    assert e.value.code == CtapError.ERR.PIN_AUTH_INVALID
+    with pytest.raises(CtapError) as e:
+        MetadataWithToken(device, client_pin, mc_token)
+    assert e.value.code == CtapError.ERR.PIN_AUTH_INVALID
+
+    # The second token did not revoke the first one
+    MCWithToken(device, mc_token)
+    MetadataWithToken(device, client_pin, cm_token)
+
+def test_token_sessions_rp_binding(device, client_pin):
+    device.reset()
+    pin = "TestPin"
+    client_pin.set_pin(pin)
+
+    token = client_pin.get_pin_token(pin, permissions=ClientPin.PERMISSION.MAKE_CREDENTIAL, permissions_rpid="example.com")
+    with pytest.raises(CtapError) as e:
+        MCWithToken(device, token, rp={"id": "other.com", "name": "Other RP"})
+    assert e.value.code == CtapError.ERR.PIN_AUTH_INVALID
+    MCWithToken(device, token, rp={"id": "example.com", "name": "Example RP"})
+
+def test_token_sessions_initial_usage_limit(device, client_pin):
+    device.reset()
+    pin = "TestPin"
+    client_pin.set_pin(pin)
+
+    used = client_pin.get_pin_token(pin, permissions=ClientPin.PERMISSION.CREDENTIAL_MGMT)
+    unused = client_pin.get_pin_token(pin, permissions=ClientPin.PERMISSION.CREDENTIAL_MGMT)
+    MetadataWithToken(device, client_pin, used)
+
+    # A token that is not used within 30 seconds of being issued expires
+    time.sleep(31)
+    MetadataWithToken(device, client_pin, used)
+    with pytest.raises(CtapError) as e:
+        MetadataWithToken(device, client_pin, unused)
+    assert e.value.code == CtapError.ERR.PIN_AUTH_INVALID
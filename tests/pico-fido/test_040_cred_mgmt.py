@@ -125,6 +125,24 @@ def test_get_metadata_ok(MC_RK_Res, device):
     assert metadata[CredentialManagement.RESULT.EXISTING_CRED_COUNT] == 2
     assert metadata[CredentialManagement.RESULT.MAX_REMAINING_COUNT] >= 48
 
+def test_get_info_remaining(MC_RK_Res, device):
+    info = device.client()._backend.ctap2.get_info()
+    metadata = CredMgmt(device).get_metadata()
+    assert info.remaining_disc_creds == metadata[CredentialManagement.RESULT.MAX_REMAINING_COUNT]
+    assert info.remaining_disc_creds > 0
+
+def test_remaining_follows_creds(MC_RK_Res, device):
+    remaining = device.client()._backend.ctap2.get_info().remaining_disc_creds
+    rp = {"id": "example_rem.com", "name": "John Doe"}
+    reg = device.doMC(rp=rp, rk=True)['res'].attestation_object
+    after = device.client()._backend.ctap2.get_info().remaining_disc_creds
+    assert after < remaining
+
+    credMgmt = CredMgmt(device)
+    cred = {"id": reg.auth_data.credential_data.credential_id, "type": "public-key"}
+    credMgmt.delete_cred(cred)
+    assert device.client()._backend.ctap2.get_info().remaining_disc_creds > after
+
 def test_enumerate_rps(MC_RK_Res, device):
     res = CredMgmt(device).enumerate_rps()
     assert len(res) == 2
@@ -0,0 +1,168 @@
+"""
+/*
+ * This file is part of the Pico Fido distribution (https://github.com/polhenarejos/pico-fido).
+ * Copyright (c) 2022 Pol Henarejos.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, version 3.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+"""
+
+
+
+import pytest
+import struct
+from fido2 import cbor
+from fido2.ctap import CtapError
+from fido2.hid import CTAPHID
+from fido2.ctap2 import CredentialManagement
+from fido2.ctap2.pin import PinProtocolV2, ClientPin
+from utils import generate_random_user
+
+PIN = "12345678"
+VENDOR_CRED_IMPORT = 0x08
+CRED_IMPORT = 0x01
+CRED_IMPORT_MAX_SIZE = 2048
+
+@pytest.fixture(scope = 'function')
+def client_pin_set(device, client_pin):
+    device.reset()
+    client_pin.set_pin(PIN)
+
+def Export(device, rps):
+    """ Creates the RKs given per RP, exports them as a batch and deletes them. """
+    for rp_id, n in rps:
+        for i in range(n):
+            device.doMC(rp={"id": rp_id, "name": "John Doe"}, rk=True, user=generate_random_user())
+
+    credMgmt = CredMgmt(device)
+    batch = b''
+    for rp in credMgmt.enumerate_rps():
+        rp_id_hash = rp[CredentialManagement.RESULT.RP_ID_HASH]
+        for cred in credMgmt.enumerate_creds(rp_id_hash):
+            cred_id = cred[CredentialManagement.RESULT.CREDENTIAL_ID]["id"]
+            batch += rp_id_hash + struct.pack(">H", len(cred_id)) + cred_id
+            credMgmt.delete_cred({"id": cred_id, "type": "public-key"})
+    assert credMgmt.get_metadata()[CredentialManagement.RESULT.EXISTING_CRED_COUNT] == 0
+    return batch
+
+@pytest.fixture(scope = 'function')
+def exported(device, client_pin_set):
+    return Export(device, (("example_imp1.com", 2), ("example_imp2.com", 1)))
+
+def Split(batch, size):
+    """ Cuts a batch in batches of up to size bytes, as the tool does. """
+    batches, i = [b''], 0
+    while (i < len(batch)):
+        l = 32 + 2 + struct.unpack(">H", batch[i + 32:i + 34])[0]
+        if (batches[-1] and len(batches[-1]) + l > size):
+            batches.append(b'')
+        batches[-1] += batch[i:i + l]
+        i += l
+    return batches
+
+def PinToken(device):
+    return ClientPin(device.client()._backend.ctap2).get_pin_token(PIN, permissions=ClientPin.PERMISSION.MAKE_CREDENTIAL | ClientPin.PERMISSION.CREDENTIAL_MGMT)
+
+def CredMgmt(device):
+    return CredentialManagement(device.client()._backend.ctap2, PinProtocolV2(), PinToken(device))
+
+def Import(device, batch, token=None):
+    protocol = PinProtocolV2()
+    token = token or PinToken(device)
+    params = {1: batch}
+    msg = b"\xff" * 32 + struct.pack(">BBB", 0x80 | (CTAPHID.VENDOR_FIRST + 1), VENDOR_CRED_IMPORT, CRED_IMPORT) + cbor.encode(params)
+    req = {1: CRED_IMPORT, 2: params, 3: protocol.VERSION, 4: protocol.authenticate(token, msg)}
+    resp = device.dev.call(CTAPHID.VENDOR_FIRST + 1, struct.pack(">B", VENDOR_CRED_IMPORT) + cbor.encode(req))
+    if resp[0] != 0x00:
+        raise CtapError(resp[0])
+    return cbor.decode(resp[1:])
+
+def Existing(device):
+    return CredMgmt(device).get_metadata()[CredentialManagement.RESULT.EXISTING_CRED_COUNT]
+
+def test_import(device, exported):
+    res = Import(device, exported)
+    assert res[1] == 3
+    assert res[2] == device.client()._backend.ctap2.get_info().remaining_disc_creds
+
+    credMgmt = CredMgmt(device)
+    rps = credMgmt.enumerate_rps()
+    assert len(rps) == 2
+    for rp in rps:
+        creds = credMgmt.enumerate_creds(rp[CredentialManagement.RESULT.RP_ID_HASH])
+        assert len(creds) == (2 if rp[3]["id"] == "example_imp1.com" else 1)
+
+    device.doGA(rp_id="example_imp1.com")
+    device.doGA(rp_id="example_imp2.com")
+
+def test_import_again_replaces(device, exported):
+    Import(device, exported)
+    Import(device, exported)
+    assert Existing(device) == 3
+
+def test_import_wrong_pinauth(device, exported):
+    token = bytearray(PinToken(device))
+    token[0] = (token[0] + 1) % 256
+    with pytest.raises(CtapError) as e:
+        Import(device, exported, token=bytes(token))
+    assert e.value.code == CtapError.ERR.PIN_AUTH_INVALID
+    assert Existing(device) == 0
+
+def test_import_tampered(device, exported):
+    batch = bytearray(exported)
+    batch[-1] ^= 0x01
+    with pytest.raises(CtapError) as e:
+        Import(device, bytes(batch))
+    assert e.value.code == CtapError.ERR.INVALID_CREDENTIAL
+    assert Existing(device) == 0
+
+def test_import_truncated(device, exported):
+    with pytest.raises(CtapError) as e:
+        Import(device, exported[:-1])
+    assert e.value.code == CtapError.ERR.INVALID_LENGTH
+    assert Existing(device) == 0
+
+def test_import_same_user_twice(device, exported):
+    l = struct.unpack(">H", exported[32:34])[0]
+    first = exported[:34 + l]
+    with pytest.raises(CtapError) as e:
+        Import(device, first + first)
+    assert e.value.code == CtapError.ERR.INVALID_PARAMETER
+    assert Existing(device) == 0
+
+def test_import_config_message(device, exported):
+    # A token signature over the authenticatorConfig message of the same subcommand is refused
+    protocol = PinProtocolV2()
+    token = PinToken(device)
+    params = {1: exported}
+    msg = b"\xff" * 32 + b"\x0d" + struct.pack("<b", CRED_IMPORT) + cbor.encode(params)
+    req = {1: CRED_IMPORT, 2: params, 3: protocol.VERSION, 4: protocol.authenticate(token, msg)}
+    resp = device.dev.call(CTAPHID.VENDOR_FIRST + 1, struct.pack(">B", VENDOR_CRED_IMPORT) + cbor.encode(req))
+    assert resp[0] == CtapError.ERR.PIN_AUTH_INVALID
+    assert Existing(device) == 0
+
+def test_import_many(device, client_pin_set):
+    # Enough credentials for several journal-sized batches
+    batch = Export(device, (("example_imp1.com", 30), ("example_imp2.com", 10)))
+    batches = Split(batch, CRED_IMPORT_MAX_SIZE)
+    assert len(batches) > 2
+    # Two batches together are over the limit, or they would have been one
+    with pytest.raises(CtapError) as e:
+        Import(device, batches[0] + batches[1])
+    assert e.value.code == CtapError.ERR.REQUEST_TOO_LARGE
+    assert Existing(device) == 0
+
+    assert sum(Import(device, b)[1] for b in batches) == 40
+    assert Existing(device) == 40
+    device.doGA(rp_id="example_imp1.com")
+    device.doGA(rp_id="example_imp2.com")
@@ -0,0 +1,194 @@
+"""
+/*
+ * This file is part of the Pico Fido distribution (https://github.com/polhenarejos/pico-fido).
+ * Copyright (c) 2022 Pol Henarejos.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, version 3.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+"""
+
+
+
+import os
+import pytest
+import struct
+from fido2 import cbor
+from fido2.ctap import CtapError
+from fido2.hid import CTAPHID
+from fido2.ctap2 import Config, CredentialManagement
+from fido2.ctap2.pin import PinProtocolV2, ClientPin
+from cryptography.hazmat.primitives import hashes
+from cryptography.hazmat.primitives.asymmetric import ec
+from cryptography.hazmat.primitives.kdf.hkdf import HKDF
+from cryptography.hazmat.primitives.ciphers.aead import ChaCha20Poly1305
+from cryptography.hazmat.primitives.serialization import Encoding, PublicFormat
+from utils import generate_random_user
+
+PIN = "12345678"
+VENDOR_BACKUP = 0x01
+VENDOR_MSE = 0x02
+VENDOR_UNLOCK = 0x03
+KEY_AGREEMENT = 0x01
+BACKUP_READ = 0x03
+RESTORE_WRITE = 0x04
+RESTORE_STATUS = 0x05
+CONFIG_AUT_ENABLE = 0x03e43f56b34285e2
+CONFIG_AUT_DISABLE = 0x1831a40f04a25ed9
+CONFIG_VENDOR_PROTOTYPE = 0x7f
+RP_ID = "example_bk.com"
+
+def VendorRaw(device, cmd, req):
+    resp = device.dev.call(CTAPHID.VENDOR_FIRST + 1, struct.pack(">B", cmd) + req)
+    if resp[0] != 0x00:
+        raise CtapError(resp[0])
+    return cbor.decode(resp[1:]) if len(resp) > 1 else {}
+
+def Vendor(device, cmd, sub_cmd, params=None):
+    req = {1: sub_cmd}
+    if params is not None:
+        req[2] = params
+    return VendorRaw(device, cmd, cbor.encode(req))
+
+def Mse(device, secret):
+    """ Agrees a key with the device and returns secret encrypted with it. """
+    sk = ec.generate_private_key(ec.SECP256R1())
+    pn = sk.public_key().public_numbers()
+    pb = sk.public_key().public_bytes(Encoding.X962, PublicFormat.UncompressedPoint)
+    cose = {1: 2, 3: -25, -1: 1, -2: pn.x.to_bytes(32, 'big'), -3: pn.y.to_bytes(32, 'big')}
+    peer = Vendor(device, VENDOR_MSE, KEY_AGREEMENT, {2: cose})[1]
+    pk = ec.EllipticCurvePublicNumbers(int.from_bytes(peer[-2], 'big'), int.from_bytes(peer[-3], 'big'), ec.SECP256R1()).public_key()
+    kdf_out = HKDF(algorithm=hashes.SHA256(), length=12+32, salt=None, info=pb).derive(sk.exchange(ec.ECDH(), pk))
+    return ChaCha20Poly1305(kdf_out[12:]).encrypt(kdf_out[:12], secret, pb)
+
+def PinToken(device, permissions):
+    return ClientPin(device.client()._backend.ctap2).get_pin_token(PIN, permissions=permissions)
+
+def DeviceConfig(device):
+    return Config(device.client()._backend.ctap2, PinProtocolV2(), PinToken(device, ClientPin.PERMISSION.AUTHENTICATOR_CFG))
+
+def Existing(device):
+    credMgmt = CredentialManagement(device.client()._backend.ctap2, PinProtocolV2(), PinToken(device, ClientPin.PERMISSION.CREDENTIAL_MGMT))
+    return credMgmt.get_metadata()[CredentialManagement.RESULT.EXISTING_CRED_COUNT]
+
+def Retries(device):
+    return ClientPin(device.client()._backend.ctap2).get_pin_retries()[0]
+
+def Counter(device):
+    return device.GA(rp_id=RP_ID)['res'].auth_data.counter
+
+def Backup(device):
+    chunks, n = [], 1
+    while (len(chunks) < n):
+        res = Vendor(device, VENDOR_BACKUP, BACKUP_READ, {1: struct.pack('>I', len(chunks))})
+        chunks.append(res[1])
+        n = res[2]
+    return chunks
+
+def Restore(device, chunks):
+    """ Sends the chunks in order and returns the index asked for after the last one. """
+    nxt = 0
+    for c in chunks:
+        nxt = Vendor(device, VENDOR_BACKUP, RESTORE_WRITE, {1: c})[1]
+    return nxt
+
+def Status(device):
+    return Vendor(device, VENDOR_BACKUP, RESTORE_STATUS)
+
+@pytest.fixture(scope = 'function')
+def unlocked(device, client_pin):
+    """ Device with a PIN, two RKs and the device key protected and unlocked. """
+    device.reset()
+    client_pin.set_pin(PIN)
+    for i in range(2):
+        device.doMC(rp={"id": RP_ID, "name": "John Doe"}, rk=True, user=generate_random_user())
+    skey = os.urandom(32)
+    DeviceConfig(device)._call(CONFIG_VENDOR_PROTOTYPE, {1: CONFIG_AUT_ENABLE, 2: Mse(device, skey)})
+    Vendor(device, VENDOR_UNLOCK, 0x01, {1: Mse(device, skey)})
+    yield
+    DeviceConfig(device)._call(CONFIG_VENDOR_PROTOTYPE, {1: CONFIG_AUT_DISABLE})
+
+def test_mse_indefinite_key(device):
+    pn = ec.generate_private_key(ec.SECP256R1()).public_key().public_numbers()
+    x, y = pn.x.to_bytes(32, 'big'), pn.y.to_bytes(32, 'big')
+    # -2 is sent as a chunked byte string, which canonical CBOR does not allow
+    cose = b"\xa5\x01\x02\x03\x38\x18\x20\x01" + b"\x21\x5f\x50" + x[:16] + b"\x50" + x[16:] + b"\xff" + b"\x22\x58\x20" + y
+    req = b"\xa2\x01" + struct.pack(">B", KEY_AGREEMENT) + b"\x02\xa1\x02" + cose
+    with pytest.raises(CtapError) as e:
+        VendorRaw(device, VENDOR_MSE, req)
+    assert e.value.code == CtapError.ERR.INVALID_CBOR
+
+def test_mse_definite_key(device):
+    pn = ec.generate_private_key(ec.SECP256R1()).public_key().public_numbers()
+    cose = {1: 2, 3: -25, -1: 1, -2: pn.x.to_bytes(32, 'big'), -3: pn.y.to_bytes(32, 'big')}
+    res = VendorRaw(device, VENDOR_MSE, cbor.encode({1: KEY_AGREEMENT, 2: {2: cose}}))
+    assert len(res[1][-2]) == 32 and len(res[1][-3]) == 32
+
+def test_restore_round_trip(device, unlocked):
+    chunks = Backup(device)
+    assert len(chunks) >= 2
+    device.doMC(rp={"id": RP_ID, "name": "John Doe"}, rk=True, user=generate_random_user())
+    assert Existing(device) == 3
+
+    # The first pass only verifies the stream
+    assert Restore(device, chunks) == 0
+    assert Status(device)[4] == False
+    assert Existing(device) == 3
+
+    assert Restore(device, chunks) == len(chunks)
+    assert Status(device)[4] == True
+    assert Existing(device) == 2
+    device.doGA(rp_id=RP_ID)
+
+def test_restore_keeps_pin_retries(device, unlocked):
+    chunks = Backup(device)
+    retries = Retries(device)
+    with pytest.raises(CtapError) as e:
+        ClientPin(device.client()._backend.ctap2).get_pin_token("87654321")
+    assert e.value.code == CtapError.ERR.PIN_INVALID
+    assert Restore(device, chunks) == 0
+    assert Restore(device, chunks) == len(chunks)
+    assert Retries(device) == retries - 1
+
+def test_restore_keeps_counter(device, unlocked):
+    chunks = Backup(device)
+    counter = max(Counter(device), Counter(device))
+    assert Restore(device, chunks) == 0
+    assert Restore(device, chunks) == len(chunks)
+    assert Counter(device) > counter
+
+def test_restore_tampered_chunk(device, unlocked):
+    chunks = Backup(device)
+    device.doMC(rp={"id": RP_ID, "name": "John Doe"}, rk=True, user=generate_random_user())
+    tampered = bytearray(chunks[1])
+    tampered[20] ^= 0x01
+    with pytest.raises(CtapError) as e:
+        Restore(device, [chunks[0], bytes(tampered)] + chunks[2:])
+    assert e.value.code == CtapError.ERR.INTEGRITY_FAILURE
+    assert Existing(device) == 3
+
+    # The genuine chunks complete the verification, which applies nothing
+    assert Restore(device, chunks[1:]) == 0
+    assert Status(device)[4] == False
+    assert Existing(device) == 3
+
+def test_restore_truncated(device, unlocked):
+    chunks = Backup(device)
+    device.doMC(rp={"id": RP_ID, "name": "John Doe"}, rk=True, user=generate_random_user())
+    assert Restore(device, chunks[:-1]) == len(chunks) - 1
+    assert Status(device)[4] == False
+    assert Existing(device) == 3
+
+    # The manifest again restarts the verification, not the apply pass
+    assert Restore(device, chunks[:1]) == 1
+    assert Status(device)[4] == False
+    assert Existing(device) == 3
@@ -26,13 +26,14 @@ from binascii import hexlify
 from threading import Event
 from typing import Mapping, Any, Optional, Callable
 import struct
+import hashlib
 import urllib.request
 import json
 from enum import IntEnum, unique
 
 try:
     from fido2.ctap2.config import Config
-    from fido2.ctap2 import Ctap2, ClientPin, PinProtocolV2
+    from fido2.ctap2 import Ctap2, ClientPin, PinProtocolV2, CredentialManagement
     from fido2.hid import CtapHidDevice, CTAPHID
     from fido2.utils import bytes2int, int2bytes
     from fido2 import cbor
@@ -190,6 +191,10 @@ class Vendor:
         VENDOR_MSE       = 0x02
         VENDOR_UNLOCK    = 0x03
         VENDOR_EA        = 0x04
+        VENDOR_KNOWN_APPS = 0x05
+        VENDOR_TELEMETRY = 0x06
+        VENDOR_FLASH_STATS = 0x07
+        VENDOR_CRED_IMPORT = 0x08
 
     @unique
     class PARAM(IntEnum):
@@ -199,9 +204,24 @@ class Vendor:
     class SUBCMD(IntEnum):
         ENABLE              = 0x01
         DISABLE             = 0x02
+        BACKUP_READ         = 0x03
+        RESTORE_WRITE       = 0x04
+        RESTORE_STATUS      = 0x05
         KEY_AGREEMENT       = 0x01
         EA_CSR              = 0x01
         EA_UPLOAD           = 0x02
+        KA_GET              = 0x01
+        KA_SET              = 0x02
+        TELEMETRY_DUMP      = 0x01
+        TELEMETRY_RESET     = 0x02
+        FLASH_STATS         = 0x01
+        CRED_IMPORT         = 0x01
+
+    class KA_FLAG(IntEnum):
+        SIGN_COUNT          = 0x01
+        SIGN_COUNT_VALUE    = 0x02
+        SELF_ATT            = 0x04
+        SELF_ATT_VALUE      = 0x08
 
     class RESP(IntEnum):
         PARAM       = 0x01
@@ -230,10 +250,10 @@ class Vendor:
         else:
             params = None
         if self.pin_uv:
+            # Signed under the vendor HID command, not authenticatorConfig's 0x0d
             msg = (
                 b"\xff" * 32
-                + b"\x0d"
-                + struct.pack("<b", sub_cmd)
+                + struct.pack(">BBB", 0x80 | (CTAPHID.VENDOR_FIRST + 1), cmd, sub_cmd)
                 + (cbor.encode(params) if params else b"")
             )
             pin_uv_protocol = self.pin_uv.protocol.VERSION
@@ -252,17 +272,22 @@ class Vendor:
             print('ERROR: platform not supported')
             sys.exit(-1)
         from words import words
+        self.unlock_device()
         ret = self._call(
             Vendor.CMD.VENDOR_BACKUP,
             Vendor.SUBCMD.ENABLE,
         )
         data = ret[Vendor.RESP.PARAM]
+        chunks = self._backup_chunks()
+        body = data + struct.pack('>I', len(chunks))
+        for chunk in chunks:
+            body += struct.pack('>H', len(chunk)) + chunk
         d = int.from_bytes(skey.get_secure_key(), 'big')
         with open(filename, 'wb') as fp:
-            fp.write(b'\x01')
-            fp.write(data)
+            fp.write(b'\x02')
+            fp.write(body)
             pk = ec.derive_private_key(d, ec.SECP256R1())
-            signature = pk.sign(data, ec.ECDSA(hashes.SHA256()))
+            signature = pk.sign(body, ec.ECDSA(hashes.SHA256()))
             fp.write(signature)
         print('Remember the following words in this order:')
         for c in range(24):
@@ -289,20 +314,80 @@ class Vendor:
 
         pk = ec.derive_private_key(d, ec.SECP256R1())
         pb = pk.public_key()
+        chunks = []
         with open(filename, 'rb') as fp:
             format = fp.read(1)[0]
             if (format == 0x1):
                 data = fp.read(60)
                 signature = fp.read()
-            pb.verify(signature, data, ec.ECDSA(hashes.SHA256()))
+                pb.verify(signature, data, ec.ECDSA(hashes.SHA256()))
+            elif (format == 0x2):
+                body = fp.read()
+                data, n, off = body[:60], struct.unpack('>I', body[60:64])[0], 64
+                for _ in range(n):
+                    size = struct.unpack('>H', body[off:off + 2])[0]
+                    chunks.append(body[off + 2:off + 2 + size])
+                    off += 2 + size
+                pb.verify(body[off:], body[:off], ec.ECDSA(hashes.SHA256()))
+            else:
+                print('ERROR: unknown backup format')
+                sys.exit(-1)
         skey.set_secure_key(pk)
-        return self._call(
+        ret = self._call(
             Vendor.CMD.VENDOR_BACKUP,
             Vendor.SUBCMD.DISABLE,
             {
                 Vendor.PARAM.PARAM: data
             },
         )
+        if (chunks):
+            self.unlock_device()
+            self._restore_chunks(chunks)
+        return ret
+
+    def _backup_chunks(self):
+        chunks, n, i = [], 1, 0
+        while (i < n):
+            ret = self._call(
+                Vendor.CMD.VENDOR_BACKUP,
+                Vendor.SUBCMD.BACKUP_READ,
+                {
+                    Vendor.PARAM.PARAM: struct.pack('>I', i)
+                },
+            )
+            chunks.append(ret[Vendor.RESP.PARAM])
+            n = ret[2]
+            i += 1
+        # All chunks must belong to the same snapshot of the device
+        if (any(c[:8] != chunks[0][:8] for c in chunks)):
+            print('ERROR: the device changed while it was backed up. Please, try again.')
+            sys.exit(-1)
+        return chunks
+
+    def _restore_chunks(self, chunks):
+        status = self._call(
+            Vendor.CMD.VENDOR_BACKUP,
+            Vendor.SUBCMD.RESTORE_STATUS,
+        )
+        # An interrupted restore of the same backup is resumed where it was left
+        resume = status[3] == chunks[0][:8] and 0 < status[1] < len(chunks)
+        i = status[1] if resume else 0
+        apply = status.get(4, False) if resume else False
+        # The device verifies the whole backup first and asks for it again to apply it
+        while (i < len(chunks)):
+            print(f'{"Restoring" if apply else "Verifying"} chunk {i + 1} of {len(chunks)}...', end='\r')
+            ret = self._call(
+                Vendor.CMD.VENDOR_BACKUP,
+                Vendor.SUBCMD.RESTORE_WRITE,
+                {
+                    Vendor.PARAM.PARAM: chunks[i]
+                },
+            )
+            i = ret[Vendor.RESP.PARAM]
+            if (i == 0):
+                print('')
+                apply = True
+        print('')
 
     def mse(self):
         sk = ec.generate_private_key(ec.SECP256R1())
@@ -393,6 +478,105 @@ class Vendor:
             }
         )
 
+    def _known_apps_get(self):
+        data, size = b'', 1
+        while (len(data) < size):
+            ret = self._call(
+                Vendor.CMD.VENDOR_KNOWN_APPS,
+                Vendor.SUBCMD.KA_GET,
+                {
+                    Vendor.PARAM.PARAM: struct.pack('>H', len(data))
+                },
+            )
+            data += ret[Vendor.RESP.PARAM]
+            size = ret[2]
+            if (not ret[Vendor.RESP.PARAM]):
+                break
+        apps = []
+        while (len(data) > 33):
+            end = data.index(b'\x00', 33)
+            apps.append((data[:32], data[32], data[33:end].decode()))
+            data = data[end+1:]
+        return apps
+
+    def _known_apps_set(self, apps):
+        data = b''.join([rp_id_hash + bytes([flags]) + label.encode() + b'\x00' for rp_id_hash, flags, label in apps])
+        self._call(
+            Vendor.CMD.VENDOR_KNOWN_APPS,
+            Vendor.SUBCMD.KA_SET,
+            {
+                Vendor.PARAM.PARAM: data
+            }
+        )
+
+    def known_apps_list(self):
+        return self._known_apps_get()
+
+    def known_apps_add(self, rp_id, sign_count=None, self_attestation=None):
+        rp_id_hash = hashlib.sha256(rp_id.encode()).digest()
+        flags = 0
+        if (sign_count is not None):
+            flags |= Vendor.KA_FLAG.SIGN_COUNT | (Vendor.KA_FLAG.SIGN_COUNT_VALUE if sign_count else 0)
+        if (self_attestation is not None):
+            flags |= Vendor.KA_FLAG.SELF_ATT | (Vendor.KA_FLAG.SELF_ATT_VALUE if self_attestation else 0)
+        apps = [a for a in self._known_apps_get() if a[0] != rp_id_hash]
+        apps.append((rp_id_hash, flags, rp_id))
+        self._known_apps_set(apps)
+
+    def known_apps_remove(self, rp_id):
+        rp_id_hash = hashlib.sha256(rp_id.encode()).digest()
+        self._known_apps_set([a for a in self._known_apps_get() if a[0] != rp_id_hash])
+
+    def telemetry_dump(self):
+        return self._call(
+            Vendor.CMD.VENDOR_TELEMETRY,
+            Vendor.SUBCMD.TELEMETRY_DUMP,
+        )
+
+    def telemetry_reset(self):
+        self._call(
+            Vendor.CMD.VENDOR_TELEMETRY,
+            Vendor.SUBCMD.TELEMETRY_RESET,
+        )
+
+    def flash_stats(self):
+        return self._call(
+            Vendor.CMD.VENDOR_FLASH_STATS,
+            Vendor.SUBCMD.FLASH_STATS,
+        )
+
+    def creds_export(self):
+        cm = CredentialManagement(self.ctap, self.pin_uv.protocol, self.pin_uv.token)
+        data = b''
+        for rp in cm.enumerate_rps():
+            rp_id_hash = rp[CredentialManagement.RESULT.RP_ID_HASH]
+            for cred in cm.enumerate_creds(rp_id_hash):
+                cred_id = cred[CredentialManagement.RESULT.CREDENTIAL_ID]['id']
+                data += rp_id_hash + struct.pack('>H', len(cred_id)) + cred_id
+        return data
+
+    # Largest batch the device takes in one flash transaction (CRED_IMPORT_MAX_SIZE)
+    def creds_import(self, data, batch_size=2048):
+        imported, remaining, i = 0, None, 0
+        while (i < len(data)):
+            batch = b''
+            while (i < len(data)):
+                l = 32 + 2 + struct.unpack('>H', data[i + 32:i + 34])[0]
+                if (batch and len(batch) + l > batch_size):
+                    break
+                batch += data[i:i + l]
+                i += l
+            ret = self._call(
+                Vendor.CMD.VENDOR_CRED_IMPORT,
+                Vendor.SUBCMD.CRED_IMPORT,
+                {
+                    Vendor.PARAM.PARAM: batch
+                },
+            )
+            imported += ret[1]
+            remaining = ret[2]
+        return imported, remaining
+
 def parse_args():
     parser = argparse.ArgumentParser()
     subparser = parser.add_subparsers(title="commands", dest="command")
@@ -406,7 +590,23 @@ def parse_args():
 
     parser_attestation = subparser.add_parser('attestation', help='Manages Enterprise Attestation')
     parser_attestation.add_argument('subcommand', choices=['csr'])
-    parser_attestation.add_argument('--filename', help='Uploads the certificate filename to the device as enterprise attestation certificate. If not provided, it will generate an enterprise attestation certificate automatically.')
+    parser_attestation.add_argument('--filename', help='Uploads the certificate filename to the device as enterprise attestation certificate. A PEM file may carry the whole chain, leaf first. If not provided, it will generate an enterprise attestation certificate automatically.')
+
+    parser_knownapps = subparser.add_parser('knownapps', help='Manages the user list of known apps.')
+    parser_knownapps.add_argument('subcommand', choices=['list', 'add', 'remove'])
+    parser_knownapps.add_argument('rp_id', nargs='?', help='Relying party ID (e.g. example.com).')
+    parser_knownapps.add_argument('--sign-count', choices=['on', 'off'], help='Forces the use of signature counter.')
+    parser_knownapps.add_argument('--self-attestation', choices=['on', 'off'], help='Forces the use of self attestation.')
+
+    parser_telemetry = subparser.add_parser('telemetry', help='Dumps per-command telemetry (firmware built with ENABLE_TELEMETRY).')
+    parser_telemetry.add_argument('subcommand', choices=['dump', 'reset'])
+
+    parser_flash = subparser.add_parser('flash', help='Shows flash capacity and wear statistics.')
+    parser_flash.add_argument('--sectors', action='store_true', help='Also prints the erase counter of every sector.')
+
+    parser_creds = subparser.add_parser('creds', help='Exports or imports resident credentials in bulk.')
+    parser_creds.add_argument('subcommand', choices=['export', 'import'])
+    parser_creds.add_argument('filename', help='File with the sealed credentials. They are only valid for devices that share the device key.')
 
     args = parser.parse_args()
     return args
@@ -431,15 +631,70 @@ def attestation(vdr, args):
             csr = x509.load_der_x509_csr(vdr.csr())
             data = urllib.parse.urlencode({'csr': csr.public_bytes(Encoding.PEM)}).encode()
             j = get_pki_data('csr', data=data)
-            cert = x509.load_pem_x509_certificate(j['x509'].encode())
+            chain = x509.load_pem_x509_certificates(j['x509'].encode())
         else:
             with open(args.filename, 'rb') as f:
                 dataf = f.read()
                 try:
-                    cert = x509.load_der_x509_certificate(dataf)
+                    chain = [x509.load_der_x509_certificate(dataf)]
                 except ValueError:
-                    cert = x509.load_pem_x509_certificate(dataf)
-        vdr.upload_ea(cert.public_bytes(Encoding.DER))
+                    chain = x509.load_pem_x509_certificates(dataf)
+        # The leaf goes first, followed by the intermediates, if any
+        vdr.upload_ea(b''.join(cert.public_bytes(Encoding.DER) for cert in chain))
+
+def knownapps(vdr, args):
+    if (args.subcommand == 'list'):
+        for rp_id_hash, flags, label in vdr.known_apps_list():
+            print(f'{label}: {hexlify(rp_id_hash).decode()} (flags {flags:02x})')
+    elif (args.rp_id is None):
+        print('ERROR: rp_id is required')
+    elif (args.subcommand == 'add'):
+        vdr.known_apps_add(args.rp_id,
+                           sign_count=None if args.sign_count is None else args.sign_count == 'on',
+                           self_attestation=None if args.self_attestation is None else args.self_attestation == 'on')
+    elif (args.subcommand == 'remove'):
+        vdr.known_apps_remove(args.rp_id)
+
+def telemetry(vdr, args):
+    if (args.subcommand == 'dump'):
+        types = {1: 'APDU', 2: 'CTAP', 3: 'CTAPHID'}
+        t = vdr.telemetry_dump()
+        print(f'{"Command":<14} {"Count":>7} {"Avg us":>9} {"Max us":>9} {"Parse":>9} {"Crypto":>9} {"Flash":>9} {"Transport":>9} {"Heap":>7}')
+        for c in t[1]:
+            name = f'{types.get(c[1], c[1])} {c[2]:02X}'
+            count = max(c[3], 1)
+            phases = [p // count for p in c[6]]
+            avg = c[8] // count
+            print(f'{name:<14} {c[3]:>7} {avg:>9} {c[4]:>9} {phases[0]:>9} {phases[1]:>9} {phases[2]:>9} {phases[3]:>9} {c[7]:>7}')
+            print(f'{"":<14} latency histogram (<256us, x2 per bin): {c[5]}')
+        print('')
+        print(f'Flash cache: reads {t[2][0]} hits / {t[2][1]} misses, writes {t[2][2]} hits / {t[2][3]} misses')
+        print(f'Peak heap per command: {t[3]} bytes')
+        if (4 in t):
+            print(f'Request arena: {t[4][1]} of {t[4][0]} bytes at most, {t[4][2]} heap fallbacks')
+    elif (args.subcommand == 'reset'):
+        vdr.telemetry_reset()
+
+def flash(vdr, args):
+    s = vdr.flash_stats()
+    print(f'Data pool:   {s[1]} bytes')
+    print(f'Used:        {s[2]} bytes in {s[6]} files ({s[2] * 100 // max(s[1], 1)}%)')
+    print(f'Free:        {s[3]} bytes ({s[4]} fragmented, largest free extent {s[5]} bytes)')
+    print(f'Alloc fails: {s[7]}')
+    print(f'Erases:      {s[8]} total, {s[9]} in the most worn slot')
+    if (args.sectors):
+        for i in range(0, len(s[11]), 16):
+            print(f'{i * s[10]:>5}: {" ".join(f"{c:>5}" for c in s[11][i:i + 16])}')
+
+def creds(vdr, args):
+    if (args.subcommand == 'export'):
+        data = vdr.creds_export()
+        with open(args.filename, 'wb') as f:
+            f.write(data)
+    elif (args.subcommand == 'import'):
+        with open(args.filename, 'rb') as f:
+            imported, remaining = vdr.creds_import(f.read())
+        print(f'Imported {imported} credentials, room for {remaining} more')
 
 def main(args):
     print('Pico Fido Tool v1.6')
@@ -451,7 +706,7 @@ def main(args):
     dev = next(CtapHidDevice.list_devices(), None)
     ctap = Ctap2Vendor(dev)
     client_pin = ClientPin(ctap)
-    token = client_pin.get_pin_token(args.pin, permissions=ClientPin.PERMISSION.AUTHENTICATOR_CFG)
+    token = client_pin.get_pin_token(args.pin, permissions=ClientPin.PERMISSION.AUTHENTICATOR_CFG | ClientPin.PERMISSION.CREDENTIAL_MGMT)
     vdr = Vendor(ctap, pin_uv_protocol=PinProtocolV2(), pin_uv_token=token)
 
     if (args.command == 'secure'):
@@ -460,6 +715,14 @@ def main(args):
         backup(vdr, args)
     elif (args.command == 'attestation'):
         attestation(vdr, args)
+    elif (args.command == 'knownapps'):
+        knownapps(vdr, args)
+    elif (args.command == 'telemetry'):
+        telemetry(vdr, args)
+    elif (args.command == 'flash'):
+        flash(vdr, args)
+    elif (args.command == 'creds'):
+        creds(vdr, args)
 
 def run():
     args = parse_args()